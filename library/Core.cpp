@@ -45,12 +45,17 @@ using namespace std;
 #include "PluginManager.h"
 #include "ModuleFactory.h"
 #include "modules/EventManager.h"
+#include "modules/ItemIndex.h"
+#include "modules/IdIndex.h"
+#include "modules/DataStore.h"
 #include "modules/Gui.h"
 #include "modules/World.h"
 #include "modules/Graphic.h"
 #include "modules/Windows.h"
 #include "RemoteServer.h"
 #include "LuaTools.h"
+#include "Profiler.h"
+#include "ScriptIndex.h"
 
 #include "MiscUtils.h"
 
@@ -126,61 +131,7 @@ struct Core::Private
 
 void Core::cheap_tokenise(string const& input, vector<string> &output)
 {
-    string *cur = NULL;
-    size_t i = 0;
-
-    // Check the first non-space character
-    while (i < input.size() && isspace(input[i])) i++;
-
-    // Special verbatim argument mode?
-    if (i < input.size() && input[i] == ':')
-    {
-        // Read the command
-        std::string cmd;
-        i++;
-        while (i < input.size() && !isspace(input[i]))
-            cmd.push_back(input[i++]);
-        if (!cmd.empty())
-            output.push_back(cmd);
-
-        // Find the argument
-        while (i < input.size() && isspace(input[i])) i++;
-
-        if (i < input.size())
-            output.push_back(input.substr(i));
-
-        return;
-    }
-
-    // Otherwise, parse in the regular quoted mode
-    for (; i < input.size(); i++)
-    {
-        unsigned char c = input[i];
-        if (isspace(c)) {
-            cur = NULL;
-        } else {
-            if (!cur) {
-                output.push_back("");
-                cur = &output.back();
-            }
-
-            if (c == '"') {
-                for (i++; i < input.size(); i++) {
-                    c = input[i];
-                    if (c == '"')
-                        break;
-                    else if (c == '\\') {
-                        if (++i < input.size())
-                            cur->push_back(input[i]);
-                    }
-                    else
-                        cur->push_back(c);
-                }
-            } else {
-                cur->push_back(c);
-            }
-        }
-    }
+    split_command_line(input, output);
 }
 
 struct IODATA
@@ -231,53 +182,6 @@ struct sortable
     };
 };
 
-static std::string getScriptHelp(std::string path, std::string helpprefix)
-{
-    ifstream script(path.c_str());
-
-    if (script.good())
-    {
-        std::string help;
-        if (getline(script, help) &&
-            help.substr(0,helpprefix.length()) == helpprefix)
-            return help.substr(helpprefix.length());
-    }
-
-    return "No help available.";
-}
-
-static void listScripts(PluginManager *plug_mgr, std::map<string,string> &pset, std::string path, bool all, std::string prefix = "")
-{
-    std::vector<string> files;
-    getdir(path, files);
-
-    for (size_t i = 0; i < files.size(); i++)
-    {
-        if (hasEnding(files[i], ".lua"))
-        {
-            std::string help = getScriptHelp(path + files[i], "-- ");
-
-            pset[prefix + files[i].substr(0, files[i].size()-4)] = help;
-        }
-        else if (plug_mgr->eval_ruby && hasEnding(files[i], ".rb"))
-        {
-            std::string help = getScriptHelp(path + files[i], "# ");
-
-            pset[prefix + files[i].substr(0, files[i].size()-3)] = help;
-        }
-        else if (all && !files[i].empty() && files[i][0] != '.')
-        {
-            listScripts(plug_mgr, pset, path+files[i]+"/", all, prefix+files[i]+"/");
-        }
-    }
-}
-
-static bool fileExists(std::string path)
-{
-    ifstream script(path.c_str());
-    return script.good();
-}
-
 namespace {
     struct ScriptArgs {
         const string *pcmd;
@@ -365,7 +269,7 @@ static bool try_autocomplete(color_ostream &con, const std::string &first, std::
     bool all = (first.find('/') != std::string::npos);
 
     std::map<string, string> scripts;
-    listScripts(plug_mgr, scripts, Core::getInstance().getHackPath() + "scripts/", all);
+    ScriptIndex::list(scripts, all, plug_mgr->eval_ruby != NULL);
     for (auto iter = scripts.begin(); iter != scripts.end(); ++iter)
         if (iter->first.substr(0, first.size()) == first)
             possible.push_back(iter->first);
@@ -415,6 +319,8 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                           "  fpause                - Force DF to pause.\n"
                           "  die                   - Force DF to close immediately\n"
                           "  keybinding            - Modify bindings of commands to keys\n"
+                          "  profile               - Measure the frame time used by plugins\n"
+                          "  tasks [budget USEC]   - List sliced plugin tasks, or set their frame budget\n"
                           "Plugin management (useful for developers):\n"
                           "  plug [PLUGIN|v]       - List plugin state and description.\n"
                           "  load PLUGIN|all       - Load a plugin by name or load all possible plugins.\n"
@@ -443,16 +349,9 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                         return CR_OK;
                     }
                 }
-                auto filename = getHackPath() + "scripts/" + parts[0];
-                if (fileExists(filename + ".lua"))
-                {
-                    string help = getScriptHelp(filename + ".lua", "-- ");
-                    con.print("%s: %s\n", parts[0].c_str(), help.c_str());
-                    return CR_OK;
-                }
-                if (plug_mgr->eval_ruby && fileExists(filename + ".rb"))
+                string help;
+                if (ScriptIndex::getHelp(parts[0], plug_mgr->eval_ruby != NULL, &help))
                 {
-                    string help = getScriptHelp(filename + ".rb", "# ");
                     con.print("%s: %s\n", parts[0].c_str(), help.c_str());
                     return CR_OK;
                 }
@@ -579,6 +478,8 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                 "  fpause                - Force DF to pause.\n"
                 "  die                   - Force DF to close immediately\n"
                 "  keybinding            - Modify bindings of commands to keys\n"
+                "  profile [report]      - Measure the frame time used by plugins and events.\n"
+                "  tasks [budget USEC]   - List sliced plugin tasks, or set their frame budget.\n"
                 "  script FILENAME       - Run the commands specified in a file.\n"
                 "  plug [PLUGIN|v]       - List plugin state and detailed description.\n"
                 "  load PLUGIN|all       - Load a plugin by name or load all possible plugins.\n"
@@ -607,7 +508,7 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                     con.reset_color();
                 }
                 std::map<string, string> scripts;
-                listScripts(plug_mgr, scripts, getHackPath() + "scripts/", all);
+                ScriptIndex::list(scripts, all, plug_mgr->eval_ruby != NULL);
                 if (!scripts.empty())
                 {
                     con.print("\nscripts:\n");
@@ -693,6 +594,32 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
         {
             _exit(666);
         }
+        else if(first == "profile")
+        {
+            return Profiler::runCommand(con, parts);
+        }
+        else if(first == "tasks")
+        {
+            CoreSuspender suspend;
+            if (parts.size() == 2 && parts[0] == "budget")
+            {
+                int usec = atoi(parts[1].c_str());
+                if (usec <= 0)
+                {
+                    con.printerr("Invalid budget: %s\n", parts[1].c_str());
+                    return CR_WRONG_USAGE;
+                }
+                plug_mgr->setFrameBudget(usec);
+            }
+            else if (!parts.empty())
+            {
+                con << "Usage:" << endl
+                    << "  tasks               - list sliced plugin tasks" << endl
+                    << "  tasks budget USEC   - set the per-frame time budget" << endl;
+                return CR_WRONG_USAGE;
+            }
+            plug_mgr->listTasks(con);
+        }
         else if(first == "script")
         {
             if(parts.size() == 1)
@@ -711,12 +638,12 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
             command_result res = plug_mgr->InvokeCommand(con, first, parts);
             if(res == CR_NOT_IMPLEMENTED)
             {
-                auto filename = getHackPath() + "scripts/" + first;
+                auto type = ScriptIndex::find(first, plug_mgr->eval_ruby != NULL);
                 std::string completed;
 
-                if (fileExists(filename + ".lua"))
+                if (type == ScriptIndex::LUA)
                     res = runLuaScript(con, first, parts);
-                else if (plug_mgr->eval_ruby && fileExists(filename + ".rb"))
+                else if (type == ScriptIndex::RUBY)
                     res = runRubyScript(con, plug_mgr, first, parts);
                 else if (try_autocomplete(con, first, completed))
                     return CR_NOT_IMPLEMENTED;// runCommand(con, completed, parts);
@@ -1280,28 +1207,60 @@ int Core::Update()
 extern bool buildings_do_onupdate;
 void buildings_onStateChange(color_ostream &out, state_change_event event);
 void buildings_onUpdate(color_ostream &out);
+void buildings_onFrame();
 
 static int buildings_timer = 0;
 
 void Core::onUpdate(color_ostream &out)
 {
-    EventManager::manageEvents(out);
+    static Profiler::Probe *frame_probe = Profiler::getProbe("core/frame");
+    static Profiler::Probe *events_probe = Profiler::getProbe("core/EventManager");
+    static Profiler::Probe *buildings_probe = Profiler::getProbe("core/buildings");
+    static Profiler::Probe *plugins_probe = Profiler::getProbe("core/plugins");
+    static Profiler::Probe *lua_probe = Profiler::getProbe("core/lua-timers");
+
+    // the plugin task budget is counted from here
+    uint64_t frame_start = Profiler::now();
+    Profiler::Scope frame_scope(frame_probe);
+
+    // item and building indexes are refreshed by the first query of the frame
+    ItemIndex::onUpdate();
+    buildings_onFrame();
+
+    {
+        Profiler::Scope scope(events_probe);
+        EventManager::manageEvents(out);
+    }
 
     // convert building reagents
     if (buildings_do_onupdate && (++buildings_timer & 1))
+    {
+        Profiler::Scope scope(buildings_probe);
         buildings_onUpdate(out);
+    }
 
-    // notify all the plugins that a game tick is finished
-    plug_mgr->OnUpdate(out);
+    // notify all the plugins that a game tick is finished, then run
+    // plugin tasks with what is left of the frame budget
+    {
+        Profiler::Scope scope(plugins_probe);
+        plug_mgr->OnUpdate(out, frame_start);
+    }
 
     // process timers in lua
-    Lua::Core::onUpdate(out);
+    {
+        Profiler::Scope scope(lua_probe);
+        Lua::Core::onUpdate(out);
+    }
 }
 
 void Core::onStateChange(color_ostream &out, state_change_event event)
 {
     EventManager::onStateChange(out, event);
 
+    ItemIndex::onStateChange(out, event);
+    IdIndex::onStateChange(out, event);
+    DataStore::onStateChange(out, event);
+
     buildings_onStateChange(out, event);
 
     plug_mgr->OnStateChange(out, event);
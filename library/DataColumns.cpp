@@ -0,0 +1,462 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#include "Internal.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+using namespace std;
+
+#include "DataColumns.h"
+#include "DataIdentity.h"
+#include "MiscUtils.h"
+
+#include "df/global_objects.h"
+
+using namespace DFHack;
+
+/*
+ * FieldPath
+ */
+
+void FieldPath::clear()
+{
+    kind = INVALID;
+    derefs.clear();
+    offset = 0;
+    field = NULL;
+    bits = NULL;
+    bit = -1;
+    bit_size = 0;
+}
+
+static const struct_field_info *find_struct_field(struct_identity *type, const char *name)
+{
+    for (; type; type = type->getParent())
+    {
+        auto fields = type->getFields();
+        if (!fields)
+            continue;
+
+        for (; fields->mode != struct_field_info::END; ++fields)
+        {
+            if (fields->name && strcmp(fields->name, name) == 0)
+                return fields;
+        }
+    }
+
+    return NULL;
+}
+
+static int find_bitfield_bit(bitfield_identity *type, const char *name)
+{
+    auto bits = type->getBits();
+    for (int i = 0; i < type->getNumBits(); i++)
+    {
+        if (bits[i].name && strcmp(bits[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static FieldPath::Kind number_kind(type_identity *type)
+{
+    if (type->type() == IDTYPE_ENUM)
+        type = ((enum_identity*)type)->getBaseType();
+    if (!type)
+        return FieldPath::OTHER;
+
+    if (type->type() == IDTYPE_BITFIELD)
+    {
+        switch (type->byte_size())
+        {
+        case 1: return FieldPath::UINT8;
+        case 2: return FieldPath::UINT16;
+        case 4: return FieldPath::UINT32;
+        case 8: return FieldPath::UINT64;
+        default: return FieldPath::OTHER;
+        }
+    }
+
+    if (type->type() != IDTYPE_PRIMITIVE)
+        return FieldPath::OTHER;
+
+    static const struct {
+        const char *name;
+        FieldPath::Kind kind;
+    } names[] = {
+        { "char", FieldPath::INT8 },
+        { "int8_t", FieldPath::INT8 },
+        { "uint8_t", FieldPath::UINT8 },
+        { "int16_t", FieldPath::INT16 },
+        { "uint16_t", FieldPath::UINT16 },
+        { "int32_t", FieldPath::INT32 },
+        { "uint32_t", FieldPath::UINT32 },
+        { "int64_t", FieldPath::INT64 },
+        { "uint64_t", FieldPath::UINT64 },
+        { "float", FieldPath::FLOAT },
+        { "double", FieldPath::DOUBLE },
+        { "bool", FieldPath::BOOL },
+    };
+
+    std::string name = type->getFullName();
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+    {
+        if (name == names[i].name)
+            return names[i].kind;
+    }
+
+    return FieldPath::OTHER;
+}
+
+bool FieldPath::resolve(type_identity *type, const std::string &path, std::string *error)
+{
+    clear();
+
+    std::vector<std::string> tokens;
+    split_string(&tokens, path, ".");
+
+    type_identity *cur = type;
+
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        const std::string &name = tokens[i];
+
+        if (bits)
+        {
+            *error = "cannot index bit " + tokens[i-1] + " in " + path;
+            return false;
+        }
+
+        // Step into the field found last
+        if (field)
+        {
+            switch (field->mode)
+            {
+            case struct_field_info::POINTER:
+                derefs.push_back(offset);
+                offset = 0;
+                // fallthrough
+            case struct_field_info::PRIMITIVE:
+            case struct_field_info::SUBSTRUCT:
+                cur = field->type;
+                break;
+
+            default:
+                *error = "cannot index field " + tokens[i-1] + " in " + path;
+                return false;
+            }
+
+            field = NULL;
+        }
+
+        if (cur && cur->type() == IDTYPE_BITFIELD)
+        {
+            bits = (bitfield_identity*)cur;
+            bit = find_bitfield_bit(bits, name.c_str());
+            if (bit < 0)
+            {
+                *error = "bit " + name + " not found in " + cur->getFullName();
+                return false;
+            }
+            bit_size = std::max(1, bits->getBits()[bit].size);
+            continue;
+        }
+
+        if (!cur || (cur->type() != IDTYPE_STRUCT && cur->type() != IDTYPE_CLASS))
+        {
+            *error = "cannot resolve " + name + " in " + path;
+            return false;
+        }
+
+        field = find_struct_field((struct_identity*)cur, name.c_str());
+        if (!field)
+        {
+            *error = "field " + name + " not found in " + cur->getFullName();
+            return false;
+        }
+        if (field->mode == struct_field_info::OBJ_METHOD ||
+            field->mode == struct_field_info::CLASS_METHOD)
+        {
+            *error = path + " is a method";
+            return false;
+        }
+
+        offset += field->offset;
+    }
+
+    if (bits)
+        kind = BIT;
+    else if (!field)
+    {
+        *error = "empty field path";
+        return false;
+    }
+    else if (field->mode == struct_field_info::PRIMITIVE ||
+             field->mode == struct_field_info::SUBSTRUCT)
+        kind = number_kind(field->type);
+    else
+        kind = OTHER;
+
+    return true;
+}
+
+bool FieldPath::readInt(void *obj, int64_t *out) const
+{
+    uint8_t *ptr = locate(obj);
+    if (!ptr)
+        return false;
+
+    switch (kind)
+    {
+    case INT8: *out = *(int8_t*)ptr; return true;
+    case UINT8: *out = *(uint8_t*)ptr; return true;
+    case INT16: *out = *(int16_t*)ptr; return true;
+    case UINT16: *out = *(uint16_t*)ptr; return true;
+    case INT32: *out = *(int32_t*)ptr; return true;
+    case UINT32: *out = *(uint32_t*)ptr; return true;
+    case INT64: *out = *(int64_t*)ptr; return true;
+    case UINT64: *out = int64_t(*(uint64_t*)ptr); return true;
+    case FLOAT: *out = int64_t(*(float*)ptr); return true;
+    case DOUBLE: *out = int64_t(*(double*)ptr); return true;
+    case BOOL: *out = *(bool*)ptr ? 1 : 0; return true;
+    case BIT: *out = getBitfieldField(ptr, bit, bit_size); return true;
+    default: return false;
+    }
+}
+
+bool FieldPath::readFloat(void *obj, double *out) const
+{
+    if (kind == FLOAT || kind == DOUBLE)
+    {
+        uint8_t *ptr = locate(obj);
+        if (!ptr)
+            return false;
+        *out = (kind == FLOAT) ? *(float*)ptr : *(double*)ptr;
+        return true;
+    }
+
+    int64_t val;
+    if (!readInt(obj, &val))
+        return false;
+    *out = double(val);
+    return true;
+}
+
+/*
+ * DataColumns
+ */
+
+namespace {
+    struct VectorInfo {
+        FieldPath path;                 // from the global object
+        void **global;                  // address of the global pointer
+        type_identity *item;
+    };
+}
+
+static std::map<std::pair<type_identity*, std::string>, FieldPath> path_cache;
+static std::map<std::string, VectorInfo> vector_cache;
+
+const FieldPath *DataColumns::getFieldPath(type_identity *type, const std::string &path,
+                                           std::string *error)
+{
+    CHECK_NULL_POINTER(type);
+
+    auto key = std::make_pair(type, path);
+    auto it = path_cache.find(key);
+    if (it != path_cache.end())
+        return &it->second;
+
+    FieldPath fp;
+    if (!fp.resolve(type, path, error))
+        return NULL;
+
+    return &(path_cache[key] = fp);
+}
+
+static bool resolve_vector(VectorInfo *info, const std::string &path, std::string *error)
+{
+    size_t dot = path.find('.');
+    std::string global = path.substr(0, dot);
+
+    auto gfield = find_struct_field(&df::global::_identity, global.c_str());
+    if (!gfield)
+    {
+        *error = "global " + global + " not found";
+        return false;
+    }
+
+    info->global = (void**)gfield->offset;
+
+    if (dot == std::string::npos)
+    {
+        *error = path + " is not a vector";
+        return false;
+    }
+
+    if (!info->path.resolve(gfield->type, path.substr(dot+1), error))
+        return false;
+
+    auto field = info->path.getField();
+    if (!field)
+    {
+        *error = path + " is not a vector";
+        return false;
+    }
+
+    switch (field->mode)
+    {
+    case struct_field_info::STL_VECTOR_PTR:
+        info->item = field->type;
+        break;
+
+    case struct_field_info::CONTAINER:
+        if (field->type->type() == IDTYPE_STL_PTR_VECTOR)
+        {
+            info->item = ((container_identity*)field->type)->getItemType();
+            break;
+        }
+        // fallthrough
+
+    default:
+        *error = path + " is not a vector of pointers";
+        return false;
+    }
+
+    if (!info->item)
+    {
+        *error = path + " holds objects of unknown type";
+        return false;
+    }
+
+    return true;
+}
+
+bool DataColumns::findVector(std::vector<void*> **vec, type_identity **item,
+                             const std::string &path, std::string *error)
+{
+    CHECK_NULL_POINTER(vec);
+    CHECK_NULL_POINTER(item);
+
+    auto it = vector_cache.find(path);
+    if (it == vector_cache.end())
+    {
+        VectorInfo info;
+        if (!resolve_vector(&info, path, error))
+            return false;
+        it = vector_cache.insert(std::make_pair(path, info)).first;
+    }
+
+    const VectorInfo &info = it->second;
+    void *base = *info.global;
+    uint8_t *ptr = base ? info.path.locate(base) : NULL;
+    if (!ptr)
+    {
+        *error = "address of " + path + " not known";
+        return false;
+    }
+
+    *vec = (std::vector<void*>*)ptr;
+    *item = info.item;
+    return true;
+}
+
+bool DataColumns::fetch(std::vector<Column> *out, size_t *total,
+                        const std::string &vector_path,
+                        const std::vector<std::string> &fields,
+                        std::string *error, size_t first, size_t count)
+{
+    CHECK_NULL_POINTER(out);
+    CHECK_NULL_POINTER(total);
+
+    std::vector<void*> *vec;
+    type_identity *item;
+    if (!findVector(&vec, &item, vector_path, error))
+        return false;
+
+    std::vector<const FieldPath*> paths(fields.size());
+    for (size_t j = 0; j < fields.size(); j++)
+    {
+        paths[j] = getFieldPath(item, fields[j], error);
+        if (!paths[j])
+            return false;
+        if (!paths[j]->isNumber())
+        {
+            *error = fields[j] + " is not a number";
+            return false;
+        }
+    }
+
+    *total = vec->size();
+    first = std::min(first, vec->size());
+    count = std::min(count, vec->size() - first);
+
+    out->resize(fields.size());
+    for (size_t j = 0; j < fields.size(); j++)
+    {
+        Column &col = (*out)[j];
+        const FieldPath *fp = paths[j];
+
+        col.path = fields[j];
+        col.is_float = fp->isFloat();
+        col.ints.clear();
+        col.floats.clear();
+        col.null_rows.clear();
+
+        // One column at a time keeps the reads of a row type-stable
+        if (col.is_float)
+        {
+            col.floats.resize(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                void *obj = (*vec)[first + i];
+                if (!obj || !fp->readFloat(obj, &col.floats[i]))
+                {
+                    col.floats[i] = 0;
+                    col.null_rows.push_back(int32_t(i));
+                }
+            }
+        }
+        else
+        {
+            col.ints.resize(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                void *obj = (*vec)[first + i];
+                if (!obj || !fp->readInt(obj, &col.ints[i]))
+                {
+                    col.ints[i] = 0;
+                    col.null_rows.push_back(int32_t(i));
+                }
+            }
+        }
+    }
+
+    return true;
+}
@@ -39,6 +39,10 @@ distribution.
 
 #include "MiscUtils.h"
 
+#ifndef LINUX_BUILD
+#include <windows.h>
+#endif
+
 using namespace DFHack;
 
 
@@ -227,8 +231,118 @@ virtual_identity::~virtual_identity()
 /* Vtable name to identity lookup. */
 static std::map<std::string, virtual_identity*> name_lookup;
 
-/* Vtable pointer to identity lookup. */
-std::map<void*, virtual_identity*> virtual_identity::known;
+/*
+ * Vtable pointer to identity lookup.
+ *
+ * This is hit by every virtual_cast, so it is read without locking:
+ * an open addressing table that writers, holding known_mutex, fill in
+ * slot by slot, storing the identity before the key. When it gets half
+ * full, a copy of twice the size is built and published by swapping the
+ * pointer. Replaced tables are never freed, as another thread may still
+ * be probing them; since they double in size, that is bounded by the
+ * size of the live one.
+ */
+
+struct VTableSlot
+{
+    void *volatile vtable;
+    virtual_identity *volatile identity;
+};
+
+struct VTableIndex
+{
+    size_t mask;
+    size_t count;
+    VTableSlot slots[1];
+};
+
+static VTableIndex *volatile vtable_index = NULL;
+static std::vector<VTableIndex*> retired_vtable_indexes;
+
+static inline void memory_barrier()
+{
+#ifdef LINUX_BUILD
+    __sync_synchronize();
+#else
+    MemoryBarrier();
+#endif
+}
+
+static inline size_t hash_vtable(void *vtable)
+{
+    // Vtables are word aligned and packed close together
+    size_t v = size_t(vtable) >> 2;
+    return v ^ (v >> 11);
+}
+
+static bool lookup_vtable(void *vtable, virtual_identity **out)
+{
+    VTableIndex *index = vtable_index;
+    if (!index)
+        return false;
+
+    // x86 does not reorder loads, so a key that is seen has its identity
+    for (size_t i = hash_vtable(vtable) & index->mask;; i = (i+1) & index->mask)
+    {
+        void *key = index->slots[i].vtable;
+        if (key == vtable)
+        {
+            *out = index->slots[i].identity;
+            return true;
+        }
+        if (!key)
+            return false;
+    }
+}
+
+static void put_vtable(VTableIndex *index, void *vtable, virtual_identity *id)
+{
+    size_t i = hash_vtable(vtable) & index->mask;
+    for (; index->slots[i].vtable; i = (i+1) & index->mask)
+    {
+        if (index->slots[i].vtable == vtable)
+        {
+            index->slots[i].identity = id;
+            return;
+        }
+    }
+
+    index->slots[i].identity = id;
+    memory_barrier();
+    index->slots[i].vtable = vtable;
+    index->count++;
+}
+
+// Called with known_mutex held, or from Init before any other thread runs.
+static void add_vtable(void *vtable, virtual_identity *id)
+{
+    VTableIndex *index = vtable_index;
+    if (index && (index->count+1)*2 <= index->mask+1)
+    {
+        put_vtable(index, vtable, id);
+        return;
+    }
+
+    size_t capacity = 256;
+    while (index && (index->count+1)*2 > capacity)
+        capacity *= 2;
+
+    size_t bytes = sizeof(VTableIndex) + (capacity-1)*sizeof(VTableSlot);
+    VTableIndex *grown = (VTableIndex*)calloc(1, bytes);
+    grown->mask = capacity-1;
+
+    if (index)
+    {
+        for (size_t i = 0; i <= index->mask; i++)
+            if (index->slots[i].vtable)
+                put_vtable(grown, index->slots[i].vtable, index->slots[i].identity);
+        retired_vtable_indexes.push_back(index);
+    }
+    put_vtable(grown, vtable, id);
+
+    memory_barrier();
+    vtable_index = grown;
+}
 
 void virtual_identity::doInit(Core *core)
 {
@@ -239,7 +353,7 @@ void virtual_identity::doInit(Core *core)
 
     vtable_ptr = core->vinfo->getVTable(vtname);
     if (vtable_ptr)
-        known[vtable_ptr] = this;
+        add_vtable(vtable_ptr, this);
 }
 
 virtual_identity *virtual_identity::find(const std::string &name)
@@ -258,16 +372,16 @@ virtual_identity *virtual_identity::get(virtual_ptr instance_ptr)
 
 virtual_identity *virtual_identity::find(void *vtable)
 {
-    // Actually, a reader/writer lock would be sufficient,
-    // since the table is only written once per class.
-    tthread::lock_guard<tthread::mutex> lock(*known_mutex);
+    virtual_identity *id;
+    if (lookup_vtable(vtable, &id))
+        return id;
 
-    std::map<void*, virtual_identity*>::iterator it = known.find(vtable);
+    tthread::lock_guard<tthread::mutex> lock(*known_mutex);
 
-    if (it != known.end())
-        return it->second;
+    // Another thread may have added it in the meantime
+    if (lookup_vtable(vtable, &id))
+        return id;
 
-    // If using a reader/writer lock, re-grab as write here, and recheck
     Core &core = Core::getInstance();
     std::string name = core.p->doReadClassName(vtable);
 
@@ -289,7 +403,7 @@ virtual_identity *virtual_identity::find(void *vtable)
                       << std::hex << pv << std::dec << "'/>" << std::endl;
         }
 
-        known[vtable] = p;
+        add_vtable(vtable, p);
         p->vtable_ptr = vtable;
         return p;
     }
@@ -297,7 +411,7 @@ virtual_identity *virtual_identity::find(void *vtable)
     std::cerr << "UNKNOWN CLASS '" << name << "': vtable = 0x"
               << std::hex << unsigned(vtable) << std::dec << std::endl;
 
-    known[vtable] = NULL;
+    add_vtable(vtable, NULL);
     return NULL;
 }
 
@@ -50,7 +50,9 @@ distribution.
 #include "modules/MapCache.h"
 #include "modules/Burrows.h"
 #include "modules/Buildings.h"
+#include "modules/IdIndex.h"
 #include "modules/Constructions.h"
+#include "modules/DataStore.h"
 
 #include "LuaWrapper.h"
 #include "LuaTools.h"
@@ -1159,6 +1161,7 @@ static const luaL_Reg dfhack_job_funcs[] = {
 /***** Units module *****/
 
 static const LuaWrapper::FunctionReg dfhack_units_module[] = {
+    WRAPN(find, IdIndex::findUnit),
     WRAPM(Units, getGeneralRef),
     WRAPM(Units, getSpecificRef),
     WRAPM(Units, getContainer),
@@ -1252,6 +1255,7 @@ static df::proj_itemst *items_makeProjectile(df::item *item)
 }
 
 static const LuaWrapper::FunctionReg dfhack_items_module[] = {
+    WRAPN(find, IdIndex::findItem),
     WRAPM(Items, getGeneralRef),
     WRAPM(Items, getSpecificRef),
     WRAPM(Items, getOwner),
@@ -1432,6 +1436,7 @@ static bool buildings_containsTile(df::building *bld, int x, int y, bool room) {
 }
 
 static const LuaWrapper::FunctionReg dfhack_buildings_module[] = {
+    WRAPN(find, IdIndex::findBuilding),
     WRAPM(Buildings, getGeneralRef),
     WRAPM(Buildings, getSpecificRef),
     WRAPM(Buildings, setOwner),
@@ -1539,6 +1544,110 @@ static const luaL_Reg dfhack_constructions_funcs[] = {
     { NULL, NULL }
 };
 
+/***** DataStore module *****/
+
+static const LuaWrapper::FunctionReg dfhack_datastore_module[] = {
+    WRAPM(DataStore, isLoaded),
+    WRAPM(DataStore, has),
+    { NULL, NULL }
+};
+
+static int datastore_get(lua_State *L)
+{
+    std::string key = luaL_checkstring(L, 1);
+    std::string value;
+
+    if (DataStore::get(key, &value))
+        lua_pushlstring(L, value.data(), value.size());
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+static int datastore_set(lua_State *L)
+{
+    std::string key = luaL_checkstring(L, 1);
+    size_t size;
+    const char *data = luaL_checklstring(L, 2, &size);
+    if (key.empty())
+        luaL_argerror(L, 1, "empty key");
+
+    lua_pushboolean(L, DataStore::set(key, std::string(data, size)));
+    return 1;
+}
+
+static int datastore_delete(lua_State *L)
+{
+    std::string key = luaL_checkstring(L, 1);
+
+    lua_pushboolean(L, DataStore::erase(key));
+    return 1;
+}
+
+static int datastore_list(lua_State *L)
+{
+    std::string prefix = luaL_optstring(L, 1, "");
+
+    std::vector<std::string> keys;
+    DataStore::list(&keys, prefix);
+    Lua::PushVector(L, keys);
+    return 1;
+}
+
+static int datastore_update(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    // Nothing is written unless every entry checks out
+    DataStore::Transaction tx;
+    lua_pushnil(L);
+    while (lua_next(L, 1))
+    {
+        if (lua_type(L, -2) != LUA_TSTRING || lua_rawlen(L, -2) == 0)
+            luaL_error(L, "data store keys must be non-empty strings");
+
+        std::string key = lua_tostring(L, -2);
+        if (lua_type(L, -1) == LUA_TSTRING)
+        {
+            size_t size;
+            const char *data = lua_tolstring(L, -1, &size);
+            tx.set(key, std::string(data, size));
+        }
+        else if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1))
+            tx.erase(key);
+        else
+            luaL_error(L, "value for '%s' must be a string, or false to delete", key.c_str());
+
+        lua_pop(L, 1);
+    }
+
+    lua_pushboolean(L, tx.commit());
+    return 1;
+}
+
+static int datastore_getStats(lua_State *L)
+{
+    DataStore::Stats stats;
+    DataStore::getStats(&stats);
+
+    lua_createtable(L, 0, 4);
+    Lua::SetField(L, int(stats.keys), -1, "keys");
+    Lua::SetField(L, int(stats.bytes), -1, "bytes");
+    Lua::SetField(L, int(stats.file_bytes), -1, "file_bytes");
+    Lua::SetField(L, int(stats.commits), -1, "commits");
+    return 1;
+}
+
+static const luaL_Reg dfhack_datastore_funcs[] = {
+    { "get", datastore_get },
+    { "set", datastore_set },
+    { "delete", datastore_delete },
+    { "list", datastore_list },
+    { "update", datastore_update },
+    { "getStats", datastore_getStats },
+    { NULL, NULL }
+};
+
 /***** Screen module *****/
 
 static const LuaWrapper::FunctionReg dfhack_screen_module[] = {
@@ -2033,6 +2142,7 @@ void OpenDFHackApi(lua_State *state)
     OpenModule(state, "burrows", dfhack_burrows_module, dfhack_burrows_funcs);
     OpenModule(state, "buildings", dfhack_buildings_module, dfhack_buildings_funcs);
     OpenModule(state, "constructions", dfhack_constructions_module);
+    OpenModule(state, "datastore", dfhack_datastore_module, dfhack_datastore_funcs);
     OpenModule(state, "screen", dfhack_screen_module, dfhack_screen_funcs);
     OpenModule(state, "internal", dfhack_internal_module, dfhack_internal_funcs);
 }
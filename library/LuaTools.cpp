@@ -27,11 +27,20 @@ distribution.
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <fstream>
+#include <iterator>
+
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "MemAccess.h"
 #include "Core.h"
 #include "VersionInfo.h"
 #include "tinythread.h"
+#include "TimingWheel.h"
+#include "Profiler.h"
+#include "ScriptIndex.h"
 // must be last due to MS stupidity
 #include "DataDefs.h"
 #include "DataIdentity.h"
@@ -1672,10 +1681,42 @@ lua_State *DFHack::Lua::Open(color_ostream &out, lua_State *state)
     return state;
 }
 
+/*
+ * Timers
+ *
+ * Callbacks live in a registry table indexed by timer id, while the
+ * timing wheels only hold the ids, so that arming and cancelling a
+ * timer are O(1) no matter how many are pending.
+ */
+
+struct TimeoutEntry
+{
+    int id;
+    int site;
+    TimeoutEntry(int id = -1, int site = -1) : id(id), site(site) {}
+};
+
+struct TimeoutRef
+{
+    TimingWheelHandle handle;
+    bool ticks;
+};
+
+struct TimeoutSite
+{
+    std::string name;
+    size_t scheduled, fired, cancelled, active;
+    uint64_t time, max_time; // microseconds spent in the callbacks
+};
+
 static int next_timeout_id = 0;
 static int frame_idx = 0;
-static std::multimap<int,int> frame_timers;
-static std::multimap<int,int> tick_timers;
+static TimingWheel<TimeoutEntry> frame_timers;
+static TimingWheel<TimeoutEntry> tick_timers;
+static std::unordered_map<int,TimeoutRef> timeout_refs;
+
+static std::vector<TimeoutSite> timeout_sites;
+static std::map<std::string,int> timeout_site_index;
 
 int DFHACK_TIMEOUTS_TOKEN = 0;
 
@@ -1683,6 +1724,39 @@ static const char *const timeout_modes[] = {
     "frames", "ticks", "days", "months", "years", NULL
 };
 
+// Finds the accounting slot for the code that called dfhack.timeout
+static int find_timeout_site(lua_State *L)
+{
+    lua_Debug ar;
+    std::string name = "?";
+    if (lua_getstack(L, 1, &ar) && lua_getinfo(L, "Sl", &ar))
+        name = stl_sprintf("%s:%d", ar.short_src, ar.currentline);
+
+    auto it = timeout_site_index.find(name);
+    if (it != timeout_site_index.end())
+        return it->second;
+
+    TimeoutSite site;
+    site.name = name;
+    site.scheduled = site.fired = site.cancelled = site.active = 0;
+    site.time = site.max_time = 0;
+
+    int idx = int(timeout_sites.size());
+    timeout_sites.push_back(site);
+    timeout_site_index[name] = idx;
+    return idx;
+}
+
+static void drop_timeout(const TimeoutEntry &entry, bool cancelled)
+{
+    timeout_refs.erase(entry.id);
+
+    TimeoutSite &site = timeout_sites[entry.site];
+    site.active--;
+    if (cancelled)
+        site.cancelled++;
+}
+
 int dfhack_timeout(lua_State *L)
 {
     using df::global::world;
@@ -1722,10 +1796,25 @@ int dfhack_timeout(lua_State *L)
 
     // Queue the timeout
     int id = next_timeout_id++;
+    TimeoutEntry entry(id, find_timeout_site(L));
+    TimeoutRef ref;
+    ref.ticks = (mode != 0);
+
     if (mode)
-        tick_timers.insert(std::pair<int,int>(world->frame_counter+delta, id));
+    {
+        // An idle wheel may lag behind the game; catch up in one step
+        if (tick_timers.empty())
+            tick_timers.advance(world->frame_counter);
+        ref.handle = tick_timers.schedule(world->frame_counter+delta, entry);
+    }
     else
-        frame_timers.insert(std::pair<int,int>(frame_idx+delta, id));
+        ref.handle = frame_timers.schedule(frame_idx+delta, entry);
+
+    timeout_refs[id] = ref;
+
+    TimeoutSite &site = timeout_sites[entry.site];
+    site.scheduled++;
+    site.active++;
 
     lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
     lua_swap(L);
@@ -1735,6 +1824,28 @@ int dfhack_timeout(lua_State *L)
     return 1;
 }
 
+static bool cancel_timeout(lua_State *L, int table, int id)
+{
+    auto it = timeout_refs.find(id);
+    if (it == timeout_refs.end())
+        return false;
+
+    auto &timers = it->second.ticks ? tick_timers : frame_timers;
+    TimeoutEntry *entry = timers.get(it->second.handle);
+    if (entry)
+    {
+        TimeoutEntry copy = *entry;
+        timers.cancel(it->second.handle);
+        drop_timeout(copy, true);
+    }
+    else
+        timeout_refs.erase(it);
+
+    lua_pushnil(L);
+    lua_rawseti(L, table, id);
+    return true;
+}
+
 int dfhack_timeout_active(lua_State *L)
 {
     int id = luaL_optint(L, 1, -1);
@@ -1753,25 +1864,84 @@ int dfhack_timeout_active(lua_State *L)
     lua_rawgeti(L, 3, id);
     if (set_cb && !lua_isnil(L, -1))
     {
-        lua_pushvalue(L, 2);
-        lua_rawseti(L, 3, id);
+        if (lua_isnil(L, 2))
+            cancel_timeout(L, 3, id);
+        else
+        {
+            lua_pushvalue(L, 2);
+            lua_rawseti(L, 3, id);
+        }
     }
     return 1;
 }
 
-static void cancel_timers(std::multimap<int,int> &timers)
+int dfhack_timeout_cancel(lua_State *L)
 {
-    using Lua::Core::State;
+    int id = luaL_optint(L, 1, -1);
+    if (id < 0)
+    {
+        lua_pushboolean(L, false);
+        return 1;
+    }
 
-    Lua::StackUnwinder frame(State);
-    lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
+    lua_pushboolean(L, cancel_timeout(L, lua_gettop(L), id));
+    return 1;
+}
+
+int dfhack_timeout_stats(lua_State *L)
+{
+    bool reset = lua_toboolean(L, 1);
+
+    lua_createtable(L, timeout_sites.size(), 0);
 
-    for (auto it = timers.begin(); it != timers.end(); ++it)
+    for (size_t i = 0; i < timeout_sites.size(); i++)
     {
-        lua_pushnil(State);
-        lua_rawseti(State, frame[1], it->second);
+        TimeoutSite &site = timeout_sites[i];
+
+        lua_createtable(L, 0, 7);
+        Lua::SetField(L, site.name, -1, "site");
+        Lua::SetField(L, int(site.scheduled), -1, "scheduled");
+        Lua::SetField(L, int(site.fired), -1, "fired");
+        Lua::SetField(L, int(site.cancelled), -1, "cancelled");
+        Lua::SetField(L, int(site.active), -1, "active");
+        Lua::SetField(L, site.time / 1000.0, -1, "ms");
+        Lua::SetField(L, site.max_time / 1000.0, -1, "max_ms");
+        lua_rawseti(L, -2, i+1);
+
+        if (reset)
+        {
+            site.scheduled = site.fired = site.cancelled = 0;
+            site.time = site.max_time = 0;
+        }
     }
 
+    return 1;
+}
+
+struct TimeoutCanceller
+{
+    lua_State *L;
+    int table;
+
+    bool operator() (const TimeoutEntry &entry) const
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, table, entry.id);
+        drop_timeout(entry, true);
+        return true;
+    }
+};
+
+static void cancel_timers(TimingWheel<TimeoutEntry> &timers)
+{
+    using Lua::Core::State;
+
+    Lua::StackUnwinder frame(State);
+    lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
+
+    TimeoutCanceller canceller = { State, frame[1] };
+    timers.cancelIf(canceller);
     timers.clear();
 }
 
@@ -1793,23 +1963,34 @@ void DFHack::Lua::Core::onStateChange(color_ostream &out, int code) {
 }
 
 static void run_timers(color_ostream &out, lua_State *L,
-                       std::multimap<int,int> &timers, int table, int bound)
+                       TimingWheel<TimeoutEntry> &timers, int table, int bound)
 {
-    while (!timers.empty() && timers.begin()->first <= bound)
+    timers.advance(bound);
+
+    TimeoutEntry entry;
+    while (timers.popReady(&entry))
     {
-        int id = timers.begin()->second;
-        timers.erase(timers.begin());
+        drop_timeout(entry, false);
 
-        lua_rawgeti(L, table, id);
+        lua_rawgeti(L, table, entry.id);
 
         if (lua_isnil(L, -1))
             lua_pop(L, 1);
         else
         {
             lua_pushnil(L);
-            lua_rawseti(L, table, id);
+            lua_rawseti(L, table, entry.id);
 
+            uint64_t start = Profiler::now();
             Lua::SafeCall(out, L, 0, 0);
+            uint64_t elapsed = Profiler::now() - start;
+
+            // The callback may have added sites, so look it up again
+            TimeoutSite &site = timeout_sites[entry.site];
+            site.fired++;
+            site.time += elapsed;
+            if (elapsed > site.max_time)
+                site.max_time = elapsed;
         }
     }
 }
@@ -1821,6 +2002,9 @@ void DFHack::Lua::Core::onUpdate(color_ostream &out)
     if (frame_timers.empty() && tick_timers.empty())
         return;
 
+    static Profiler::Probe *probe = Profiler::getProbe("lua/timers");
+    Profiler::Scope scope(probe);
+
     Lua::StackUnwinder frame(State);
     lua_rawgetp(State, LUA_REGISTRYINDEX, &DFHACK_TIMEOUTS_TOKEN);
 
@@ -1830,6 +2014,219 @@ void DFHack::Lua::Core::onUpdate(color_ostream &out)
         run_timers(out, State, tick_timers, frame[1], world->frame_counter);
 }
 
+/*
+ * Compiled script cache
+ *
+ * Scripts run in the core context are parsed once per version of the file:
+ * the bytecode is kept by path together with the file mtime and size, and
+ * loaded again from memory while those stay the same.
+ */
+
+struct ScriptChunk
+{
+    time_t mtime;
+    off_t size;
+    uint64_t parse_time;    // microseconds
+    std::string bytecode;
+};
+
+static std::map<std::string, ScriptChunk> script_chunks;
+static size_t script_hits = 0, script_misses = 0;
+static uint64_t script_parse_time = 0, script_saved_time = 0;
+
+static int append_chunk(lua_State *L, const void *p, size_t sz, void *data)
+{
+    ((std::string*)data)->append((const char*)p, sz);
+    return 0;
+}
+
+static bool read_script(const std::string &path, std::string *text)
+{
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file.good())
+        return false;
+
+    text->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    // Same as luaL_loadfilex: skip a UTF-8 BOM, and comment out a '#' line
+    if (text->compare(0, 3, "\xEF\xBB\xBF") == 0)
+        text->erase(0, 3);
+    if (!text->empty() && (*text)[0] == '#')
+        text->insert(0, "--");
+
+    return true;
+}
+
+// Pushes the chunk like loadfile(path, 't'), or nil and a message.
+static int load_script_chunk(lua_State *L, const std::string &path)
+{
+    std::string chunkname = "@" + path;
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot open %s", path.c_str());
+        return 2;
+    }
+
+    auto it = script_chunks.find(path);
+    if (it != script_chunks.end())
+    {
+        ScriptChunk &chunk = it->second;
+
+        if (chunk.mtime == st.st_mtime && chunk.size == st.st_size &&
+            luaL_loadbufferx(L, chunk.bytecode.data(), chunk.bytecode.size(),
+                             chunkname.c_str(), "b") == LUA_OK)
+        {
+            script_hits++;
+            script_saved_time += chunk.parse_time;
+            return 1;
+        }
+
+        script_chunks.erase(it);
+    }
+
+    std::string text;
+    if (!read_script(path, &text))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot read %s", path.c_str());
+        return 2;
+    }
+
+    uint64_t start = Profiler::now();
+    if (luaL_loadbufferx(L, text.data(), text.size(), chunkname.c_str(), "t") != LUA_OK)
+    {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    ScriptChunk &chunk = script_chunks[path];
+    chunk.mtime = st.st_mtime;
+    chunk.size = st.st_size;
+    chunk.parse_time = Profiler::now() - start;
+    chunk.bytecode.clear();
+    lua_dump(L, append_chunk, &chunk.bytecode);
+
+    script_misses++;
+    script_parse_time += chunk.parse_time;
+    return 1;
+}
+
+// dfhack.internal.loadScript(path[,env]) -> function or nil,error
+static int internal_loadScript(lua_State *L)
+{
+    std::string path = luaL_checkstring(L, 1);
+    bool has_env = !lua_isnone(L, 2);
+
+    int rv = load_script_chunk(L, path);
+
+    if (rv == 1 && has_env)
+    {
+        lua_pushvalue(L, 2);
+        if (!lua_setupvalue(L, -2, 1))
+            lua_pop(L, 1);
+    }
+
+    return rv;
+}
+
+// dfhack.internal.precompileScripts() -> compiled,failed
+static int internal_precompileScripts(lua_State *L)
+{
+    std::map<std::string, std::string> scripts;
+    ScriptIndex::list(scripts, true, false);
+
+    int compiled = 0;
+    lua_newtable(L);
+
+    for (auto it = scripts.begin(); it != scripts.end(); ++it)
+    {
+        std::string path;
+        if (ScriptIndex::find(it->first, false, &path) != ScriptIndex::LUA)
+            continue;
+
+        if (load_script_chunk(L, path) == 1)
+        {
+            compiled++;
+            lua_pop(L, 1);
+        }
+        else
+        {
+            lua_setfield(L, -3, it->first.c_str());
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pushinteger(L, compiled);
+    lua_insert(L, -2);
+    return 2;
+}
+
+// dfhack.internal.getScriptCacheStats([reset]) -> table
+static int internal_getScriptCacheStats(lua_State *L)
+{
+    bool reset = lua_toboolean(L, 1);
+
+    size_t bytes = 0;
+    for (auto it = script_chunks.begin(); it != script_chunks.end(); ++it)
+        bytes += it->second.bytecode.size();
+
+    lua_createtable(L, 0, 6);
+    Lua::SetField(L, int(script_chunks.size()), -1, "scripts");
+    Lua::SetField(L, int(bytes), -1, "bytes");
+    Lua::SetField(L, int(script_hits), -1, "hits");
+    Lua::SetField(L, int(script_misses), -1, "misses");
+    Lua::SetField(L, script_parse_time / 1000.0, -1, "parse_ms");
+    Lua::SetField(L, script_saved_time / 1000.0, -1, "saved_ms");
+
+    if (reset)
+    {
+        script_hits = script_misses = 0;
+        script_parse_time = script_saved_time = 0;
+    }
+
+    return 1;
+}
+
+static int internal_clearScriptCache(lua_State *L)
+{
+    script_chunks.clear();
+    return 0;
+}
+
+// dfhack.internal.getScriptIndexStats() -> table
+static int internal_getScriptIndexStats(lua_State *L)
+{
+    ScriptIndex::Stats stats;
+    ScriptIndex::getStats(&stats);
+
+    lua_createtable(L, 0, 4);
+    Lua::SetField(L, int(stats.scripts), -1, "scripts");
+    Lua::SetField(L, int(stats.dirs), -1, "dirs");
+    Lua::SetField(L, int(stats.rescans), -1, "rescans");
+    Lua::SetField(L, int(stats.help_reads), -1, "help_reads");
+    return 1;
+}
+
+static int internal_rescanScripts(lua_State *L)
+{
+    ScriptIndex::invalidate();
+    return 0;
+}
+
+static const luaL_Reg dfhack_core_internal_funcs[] = {
+    { "loadScript", internal_loadScript },
+    { "precompileScripts", internal_precompileScripts },
+    { "getScriptCacheStats", internal_getScriptCacheStats },
+    { "clearScriptCache", internal_clearScriptCache },
+    { "getScriptIndexStats", internal_getScriptIndexStats },
+    { "rescanScripts", internal_rescanScripts },
+    { NULL, NULL }
+};
+
 void DFHack::Lua::Core::Init(color_ostream &out)
 {
     if (State)
@@ -1856,6 +2253,14 @@ static void Lua::Core::InitCoreContext()
     lua_setfield(State, -2, "timeout");
     lua_pushcfunction(State, dfhack_timeout_active);
     lua_setfield(State, -2, "timeout_active");
+    lua_pushcfunction(State, dfhack_timeout_cancel);
+    lua_setfield(State, -2, "timeout_cancel");
+    lua_pushcfunction(State, dfhack_timeout_stats);
+    lua_setfield(State, -2, "timeout_stats");
+
+    lua_getfield(State, -1, "internal");
+    luaL_setfuncs(State, dfhack_core_internal_funcs, 0);
+    lua_pop(State, 1);
 
     lua_pop(State, 1);
 }
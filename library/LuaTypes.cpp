@@ -39,6 +39,7 @@ distribution.
 #include "LuaWrapper.h"
 #include "LuaTools.h"
 #include "DataFuncs.h"
+#include "DataColumns.h"
 
 #include "MiscUtils.h"
 
@@ -1030,6 +1031,103 @@ static int meta_global_newindex(lua_State *state)
     return 0;
 }
 
+static void read_field_path(lua_State *state, const FieldPath *fp, void *obj)
+{
+    uint8_t *ptr = fp->locate(obj);
+
+    if (!ptr)
+        lua_pushnil(state);
+    else if (fp->getBitfield())
+        read_bitfield(state, ptr, fp->getBitfield(), fp->getBit());
+    else
+        read_field(state, fp->getField(), ptr);
+}
+
+/**
+ * Function: df.fetch(vector, {path...}[, first[, count]])
+ *
+ * Reads the given fields from every object in a vector of pointers,
+ * returning one array per path. The vector may also be given as a path
+ * from df.global, e.g. 'world.units.active'. Element i of the vector
+ * ends up at index i-first+1 of each array; NULL objects and NULL
+ * pointers met along a path read as nil.
+ */
+int LuaWrapper::fetch_fields(lua_State *state)
+{
+    int argc = lua_gettop(state);
+    if (argc < 2 || argc > 4 || !lua_istable(state, 2))
+        luaL_error(state, "Usage: df.fetch(vector, {path,...}[, first[, count]])");
+
+    std::vector<void*> *pvec;
+    type_identity *item;
+    std::string error;
+
+    if (lua_type(state, 1) == LUA_TSTRING)
+    {
+        if (!DataColumns::findVector(&pvec, &item, lua_tostring(state, 1), &error))
+            luaL_error(state, "%s in df.fetch()", error.c_str());
+    }
+    else
+    {
+        auto id = get_object_identity(state, 1, "df.fetch()", false, true);
+        if (id->type() != IDTYPE_STL_PTR_VECTOR)
+            luaL_error(state, "Vector of pointers expected in df.fetch()");
+
+        item = ((container_identity*)id)->getItemType();
+        lua_getfield(state, -1, "_field_identity");
+        if (lua_touserdata(state, -1))
+            item = (type_identity*)lua_touserdata(state, -1);
+        lua_pop(state, 2);
+
+        if (!item)
+            luaL_error(state, "Vector of unknown objects in df.fetch()");
+
+        pvec = (std::vector<void*>*)get_object_ref(state, 1);
+    }
+
+    auto &vec = *pvec;
+
+    int first = luaL_optint(state, 3, 0);
+    int count = luaL_optint(state, 4, int(vec.size()));
+    first = std::max(0, std::min(first, int(vec.size())));
+    count = std::max(0, std::min(count, int(vec.size()) - first));
+
+    int npaths = lua_rawlen(state, 2);
+    std::vector<const FieldPath*> paths(npaths);
+    for (int j = 0; j < npaths; j++)
+    {
+        lua_rawgeti(state, 2, j+1);
+        const char *str = lua_tostring(state, -1);
+        if (!str)
+            luaL_error(state, "Field path %d is not a string", j+1);
+        paths[j] = DataColumns::getFieldPath(item, str, &error);
+        if (!paths[j])
+            luaL_error(state, "Invalid field path '%s': %s", str, error.c_str());
+        lua_pop(state, 1);
+    }
+
+    luaL_checkstack(state, npaths + LUA_MINSTACK, "too many field paths");
+
+    int base = lua_gettop(state) + 1;
+    for (int j = 0; j < npaths; j++)
+        lua_createtable(state, count, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        void *obj = vec[first + i];
+        if (!obj)
+            continue;
+
+        for (int j = 0; j < npaths; j++)
+        {
+            read_field_path(state, paths[j], obj);
+            lua_rawseti(state, base + j, i+1);
+        }
+    }
+
+    return npaths;
+}
+
 /**
  * Wrapper for c++ methods and functions.
  */
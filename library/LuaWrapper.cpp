@@ -1624,6 +1624,10 @@ static int DoAttach(lua_State *state)
         lua_getfield(state, LUA_REGISTRYINDEX, DFHACK_CAST_NAME);
         lua_setfield(state, -2, "reinterpret_cast");
 
+        lua_rawgetp(state, LUA_REGISTRYINDEX, &DFHACK_TYPETABLE_TOKEN);
+        lua_pushcclosure(state, fetch_fields, 1);
+        lua_setfield(state, -2, "fetch");
+
         lua_pushlightuserdata(state, NULL);
         lua_setfield(state, -2, "NULL");
         lua_pushlightuserdata(state, NULL);
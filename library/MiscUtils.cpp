@@ -95,6 +95,65 @@ bool split_string(std::vector<std::string> *out,
     return out->size() > 1;
 }
 
+void split_command_line(const std::string &input, std::vector<std::string> &output)
+{
+    std::string *cur = NULL;
+    size_t i = 0;
+
+    // Check the first non-space character
+    while (i < input.size() && isspace(input[i])) i++;
+
+    // Special verbatim argument mode?
+    if (i < input.size() && input[i] == ':')
+    {
+        // Read the command
+        std::string cmd;
+        i++;
+        while (i < input.size() && !isspace(input[i]))
+            cmd.push_back(input[i++]);
+        if (!cmd.empty())
+            output.push_back(cmd);
+
+        // Find the argument
+        while (i < input.size() && isspace(input[i])) i++;
+
+        if (i < input.size())
+            output.push_back(input.substr(i));
+
+        return;
+    }
+
+    // Otherwise, parse in the regular quoted mode
+    for (; i < input.size(); i++)
+    {
+        unsigned char c = input[i];
+        if (isspace(c)) {
+            cur = NULL;
+        } else {
+            if (!cur) {
+                output.push_back("");
+                cur = &output.back();
+            }
+
+            if (c == '"') {
+                for (i++; i < input.size(); i++) {
+                    c = input[i];
+                    if (c == '"')
+                        break;
+                    else if (c == '\\') {
+                        if (++i < input.size())
+                            cur->push_back(input[i]);
+                    }
+                    else
+                        cur->push_back(c);
+                }
+            } else {
+                cur->push_back(c);
+            }
+        }
+    }
+}
+
 std::string join_strings(const std::string &separator, const std::vector<std::string> &items)
 {
     std::stringstream ss;
@@ -33,6 +33,7 @@ distribution.
 
 #include "DataDefs.h"
 #include "MiscUtils.h"
+#include "Profiler.h"
 
 #include "LuaWrapper.h"
 #include "LuaTools.h"
@@ -42,6 +43,7 @@ using namespace DFHack;
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 using namespace std;
 
 #include "tinythread.h"
@@ -173,6 +175,7 @@ Plugin::Plugin(Core * core, const std::string & filepath, const std::string & _f
     plugin_onstatechange = 0;
     plugin_rpcconnect = 0;
     state = PS_UNLOADED;
+    update_probe = NULL;
     access = new RefLock();
 }
 
@@ -259,6 +262,7 @@ bool Plugin::load(color_ostream &con)
     else
     {
         con.printerr("Plugin %s has failed to initialize properly.\n", filename.c_str());
+        parent->removeTasks(this);
         reset_lua();
         ClosePlugin(plugin_lib);
         state = PS_BROKEN;
@@ -296,6 +300,7 @@ bool Plugin::unload(color_ostream &con)
         // cleanup...
         reset_lua();
         parent->unregisterCommands(this);
+        parent->removeTasks(this);
         commands.clear();
         if(cr == CR_OK)
         {
@@ -412,6 +417,9 @@ command_result Plugin::on_update(color_ostream &out)
     access->lock_add();
     if(state == PS_LOADED && plugin_onupdate)
     {
+        if (!update_probe && Profiler::isEnabled())
+            update_probe = Profiler::getProbe("plugin/" + name);
+        Profiler::Scope scope(update_probe);
         cr = plugin_onupdate(out);
         Lua::Core::Reset(out, "plugin_onupdate");
     }
@@ -601,10 +609,36 @@ void Plugin::push_function(lua_State *state, LuaFunction *fn)
     lua_pushcclosure(state, lua_fun_wrapper, 4);
 }
 
+struct PluginManager::Task
+{
+    Plugin *owner;
+    std::string name;
+    task_function fn;       // NULL once removed
+    int period;
+    bool busy;              // in the middle of a pass
+    uint32_t pass_start;    // frame_count when the last pass began
+    uint32_t passes;
+    uint32_t slices;
+    uint32_t frames;        // frames spanned by the last finished pass
+    Profiler::Probe *probe;
+};
+
+// Every slice gets at least this many microseconds, however little is left.
+static const uint32_t MIN_SLICE_TIME = 50;
+
+bool TaskBudget::expired() const
+{
+    return Profiler::now() >= deadline;
+}
+
 PluginManager::PluginManager(Core * core)
 {
     cmdlist_mutex = new mutex();
     eval_ruby = NULL;
+    task_cursor = 0;
+    tasks_running = false;
+    frame_budget = 2000;
+    frame_count = 0;
 }
 
 PluginManager::~PluginManager()
@@ -614,6 +648,11 @@ PluginManager::~PluginManager()
         delete all_plugins[i];
     }
     all_plugins.clear();
+    for(size_t i = 0; i < tasks.size(); i++)
+    {
+        delete tasks[i];
+    }
+    tasks.clear();
     delete cmdlist_mutex;
 }
 
@@ -673,12 +712,196 @@ bool PluginManager::CanInvokeHotkey(const std::string &command, df::viewscreen *
     return plugin ? plugin->can_invoke_hotkey(command, top) : true;
 }
 
-void PluginManager::OnUpdate(color_ostream &out)
+void PluginManager::OnUpdate(color_ostream &out, uint64_t frame_start)
 {
     for(size_t i = 0; i < all_plugins.size(); i++)
     {
         all_plugins[i]->on_update(out);
     }
+
+    frame_count++;
+    if (!tasks.empty())
+        runTasks(out, frame_start);
+}
+
+bool PluginManager::addTask(Plugin *owner, const std::string &name, task_function fn, int period)
+{
+    if (!owner || !fn)
+        return false;
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (tasks[i]->fn && tasks[i]->owner == owner && tasks[i]->name == name)
+            return false;
+    }
+
+    Task *task = new Task();
+    task->owner = owner;
+    task->name = name;
+    task->fn = fn;
+    task->period = std::max(period, 1);
+    task->busy = false;
+    // Due on the next frame
+    task->pass_start = frame_count - task->period;
+    task->passes = task->slices = task->frames = 0;
+    task->probe = NULL;
+    tasks.push_back(task);
+    return true;
+}
+
+bool PluginManager::removeTask(Plugin *owner, const std::string &name)
+{
+    bool found = false;
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (tasks[i]->fn && tasks[i]->owner == owner && tasks[i]->name == name)
+        {
+            tasks[i]->fn = NULL;
+            found = true;
+        }
+    }
+    if (!tasks_running)
+        compactTasks();
+    return found;
+}
+
+void PluginManager::removeTasks(Plugin *owner)
+{
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (tasks[i]->owner == owner)
+            tasks[i]->fn = NULL;
+    }
+    if (!tasks_running)
+        compactTasks();
+}
+
+void PluginManager::compactTasks()
+{
+    size_t out_idx = 0;
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (!tasks[i]->fn)
+        {
+            delete tasks[i];
+            continue;
+        }
+        if (i == task_cursor)
+            task_cursor = out_idx;
+        tasks[out_idx++] = tasks[i];
+    }
+    tasks.resize(out_idx);
+    if (task_cursor >= tasks.size())
+        task_cursor = 0;
+}
+
+bool PluginManager::runSlice(color_ostream &out, Task *task, uint64_t deadline)
+{
+    Plugin *plugin = task->owner;
+    bool done = true;
+
+    plugin->access->lock_add();
+    if (plugin->state == Plugin::PS_LOADED && task->fn)
+    {
+        if (!task->probe && Profiler::isEnabled())
+            task->probe = Profiler::getProbe("task/" + plugin->name + "/" + task->name);
+        Profiler::Scope scope(task->probe);
+
+        TaskBudget budget(deadline);
+        done = task->fn(out, budget);
+        Lua::Core::Reset(out, "plugin task");
+    }
+    plugin->access->lock_sub();
+
+    task->slices++;
+    return done;
+}
+
+void PluginManager::runTasks(color_ostream &out, uint64_t frame_start)
+{
+    // Start a new pass of every idle task that is due
+    size_t busy = 0;
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        Task *task = tasks[i];
+        if (!task->busy && frame_count - task->pass_start >= uint32_t(task->period))
+        {
+            task->busy = true;
+            task->pass_start = frame_count;
+        }
+        if (task->busy)
+            busy++;
+    }
+
+    if (busy == 0)
+        return;
+
+    tasks_running = true;
+
+    uint64_t frame_deadline = frame_start + frame_budget;
+    bool first = true;
+
+    /*
+     * Hand out slices round-robin, splitting whatever is left of the
+     * frame budget evenly among the busy tasks. The first slice of a
+     * frame always runs, so every task makes progress even when the
+     * regular hooks have already used up the budget.
+     */
+    for (size_t visited = 0; busy > 0; visited++)
+    {
+        uint64_t now = Profiler::now();
+        if (now >= frame_deadline && !first)
+            break;
+
+        if (task_cursor >= tasks.size())
+            task_cursor = 0;
+        Task *task = tasks[task_cursor];
+        task_cursor++;
+
+        if (!task->busy)
+        {
+            // A whole lap without a busy task means they were all removed
+            if (visited > tasks.size())
+                break;
+            continue;
+        }
+        visited = 0;
+
+        uint64_t left = (frame_deadline > now) ? frame_deadline - now : 0;
+        uint64_t slice = std::max(left / busy, uint64_t(MIN_SLICE_TIME));
+        first = false;
+
+        if (runSlice(out, task, now + slice))
+        {
+            task->busy = false;
+            task->passes++;
+            task->frames = frame_count - task->pass_start + 1;
+            busy--;
+        }
+    }
+
+    tasks_running = false;
+    compactTasks();
+}
+
+void PluginManager::listTasks(color_ostream &out)
+{
+    out.print("Frame budget: %u us\n", frame_budget);
+    if (tasks.empty())
+    {
+        out.print("No tasks.\n");
+        return;
+    }
+
+    out.print("%-20s %-20s %7s %5s %8s %9s %11s\n",
+              "plugin", "task", "period", "busy", "passes", "slices", "pass frames");
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        Task *task = tasks[i];
+        out.print("%-20s %-20s %7d %5s %8u %9u %11u\n",
+                  task->owner->name.c_str(), task->name.c_str(), task->period,
+                  task->busy ? "yes" : "no", task->passes, task->slices, task->frames);
+    }
 }
 
 void PluginManager::OnStateChange(color_ostream &out, state_change_event event)
@@ -0,0 +1,343 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#include "Internal.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+#include "Profiler.h"
+#include "ColorText.h"
+#include "MiscUtils.h"
+
+#include "tinythread.h"
+
+#ifdef LINUX_BUILD
+#include <time.h>
+#ifdef _DARWIN
+#include <mach/mach_time.h>
+#endif
+#else
+#include <windows.h>
+#endif
+
+using namespace DFHack;
+using namespace DFHack::Profiler;
+using namespace tthread;
+
+static inline void memory_barrier()
+{
+#ifdef LINUX_BUILD
+    __sync_synchronize();
+#else
+    MemoryBarrier();
+#endif
+}
+
+// Never goes back when the wall clock is adjusted
+uint64_t Profiler::now()
+{
+#if defined(_DARWIN)
+    static mach_timebase_info_data_t timebase;
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+    uint64_t ticks = mach_absolute_time();
+    return ((ticks / timebase.denom) * timebase.numer +
+            (ticks % timebase.denom) * timebase.numer / timebase.denom) / 1000;
+#elif defined(LINUX_BUILD)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+    static LARGE_INTEGER freq;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER cnt;
+    QueryPerformanceCounter(&cnt);
+    return uint64_t(cnt.QuadPart / freq.QuadPart) * 1000000 +
+           uint64_t(cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#endif
+}
+
+/*
+ * Probe
+ */
+
+Probe::Probe(const std::string &name) : name(name), count(0)
+{
+    memset(ring, 0, sizeof(ring));
+}
+
+void Probe::record(uint64_t start, uint32_t duration)
+{
+    // Single writer: fill the slot first, then publish it by bumping the count.
+    uint32_t cur = count;
+    Sample &slot = ring[cur % RING_SIZE];
+    slot.start = start;
+    slot.duration = duration;
+    memory_barrier();
+    count = cur + 1;
+}
+
+uint32_t Probe::snapshot(std::vector<Sample> *out) const
+{
+    uint32_t cur = count;
+    memory_barrier();
+
+    uint32_t num = (cur > RING_SIZE) ? RING_SIZE : cur;
+    out->clear();
+    out->reserve(num);
+    for (uint32_t i = cur - num; i != cur; i++)
+        out->push_back(ring[i % RING_SIZE]);
+
+    return cur;
+}
+
+void Probe::reset()
+{
+    count = 0;
+}
+
+/*
+ * Registry
+ */
+
+static volatile bool profiling_enabled = false;
+// Constructed when the library loads, before any thread can ask for a probe
+static mutex probe_mutex;
+static std::map<std::string, Probe*> probe_map;
+
+bool Profiler::isEnabled()
+{
+    return profiling_enabled;
+}
+
+void Profiler::setEnabled(bool enable)
+{
+    profiling_enabled = enable;
+}
+
+Probe *Profiler::getProbe(const std::string &name)
+{
+    lock_guard<mutex> lock(probe_mutex);
+
+    Probe *&probe = probe_map[name];
+    if (!probe)
+        probe = new Probe(name);
+    return probe;
+}
+
+void Profiler::reset()
+{
+    lock_guard<mutex> lock(probe_mutex);
+
+    for (auto it = probe_map.begin(); it != probe_map.end(); ++it)
+        it->second->reset();
+}
+
+static void compute_stats(Stats *stats, const std::vector<Sample> &samples, uint32_t calls)
+{
+    stats->calls = calls;
+    stats->samples = samples.size();
+    stats->p50 = stats->p99 = stats->max = 0;
+    stats->mean = 0;
+
+    if (samples.empty())
+        return;
+
+    std::vector<uint32_t> durations(samples.size());
+    uint64_t total = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        durations[i] = samples[i].duration;
+        total += samples[i].duration;
+    }
+
+    stats->mean = double(total) / durations.size();
+    stats->max = *std::max_element(durations.begin(), durations.end());
+
+    size_t i50 = (durations.size()-1) / 2;
+    size_t i99 = (durations.size()-1) * 99 / 100;
+    std::nth_element(durations.begin(), durations.begin()+i50, durations.end());
+    stats->p50 = durations[i50];
+    std::nth_element(durations.begin(), durations.begin()+i99, durations.end());
+    stats->p99 = durations[i99];
+}
+
+void Profiler::getStats(std::vector<Stats> *out)
+{
+    std::vector<Probe*> probes;
+    {
+        lock_guard<mutex> lock(probe_mutex);
+        for (auto it = probe_map.begin(); it != probe_map.end(); ++it)
+            probes.push_back(it->second);
+    }
+
+    out->clear();
+    std::vector<Sample> samples;
+    for (size_t i = 0; i < probes.size(); i++)
+    {
+        uint32_t calls = probes[i]->snapshot(&samples);
+        if (calls == 0)
+            continue;
+
+        Stats stats;
+        stats.name = probes[i]->getName();
+        compute_stats(&stats, samples, calls);
+        out->push_back(stats);
+    }
+}
+
+static std::string json_escape(const std::string &str)
+{
+    std::string rv;
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+        if (c == '"' || c == '\\')
+            rv.push_back('\\');
+        if (uint8_t(c) < 32)
+            continue;
+        rv.push_back(c);
+    }
+    return rv;
+}
+
+bool Profiler::writeChromeTrace(const std::string &path, std::string *error)
+{
+    std::ofstream file(path.c_str());
+    if (!file.good())
+    {
+        if (error)
+            *error = "could not open " + path;
+        return false;
+    }
+
+    std::vector<Probe*> probes;
+    {
+        lock_guard<mutex> lock(probe_mutex);
+        for (auto it = probe_map.begin(); it != probe_map.end(); ++it)
+            probes.push_back(it->second);
+    }
+
+    file << "{\"traceEvents\":[\n";
+
+    bool first = true;
+    std::vector<Sample> samples;
+    for (size_t i = 0; i < probes.size(); i++)
+    {
+        probes[i]->snapshot(&samples);
+
+        // The part before the first '/' is used as the category
+        std::string name = json_escape(probes[i]->getName());
+        std::string cat = name.substr(0, name.find('/'));
+
+        for (size_t j = 0; j < samples.size(); j++)
+        {
+            if (!first)
+                file << ",\n";
+            first = false;
+            file << "{\"name\":\"" << name << "\",\"cat\":\"" << cat
+                 << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << samples[j].start
+                 << ",\"dur\":" << samples[j].duration << "}";
+        }
+    }
+
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return file.good();
+}
+
+static bool compare_p99(const Stats &a, const Stats &b)
+{
+    return a.p99 > b.p99;
+}
+
+command_result Profiler::runCommand(color_ostream &out, std::vector<std::string> &parameters)
+{
+    std::string cmd = parameters.empty() ? "report" : parameters[0];
+
+    if (cmd == "enable" || cmd == "on")
+    {
+        setEnabled(true);
+        out.print("Profiling enabled.\n");
+    }
+    else if (cmd == "disable" || cmd == "off")
+    {
+        setEnabled(false);
+        out.print("Profiling disabled.\n");
+    }
+    else if (cmd == "reset")
+    {
+        reset();
+        out.print("Profiling data cleared.\n");
+    }
+    else if (cmd == "report")
+    {
+        std::vector<Stats> stats;
+        getStats(&stats);
+        std::sort(stats.begin(), stats.end(), compare_p99);
+
+        if (!isEnabled())
+            out.print("Profiling is disabled; use 'profile enable' to collect data.\n");
+        if (stats.empty())
+        {
+            out.print("No samples.\n");
+            return CR_OK;
+        }
+
+        out.print("%-40s %10s %8s %8s %8s %9s\n", "probe", "calls", "p50us", "p99us", "maxus", "meanus");
+        for (size_t i = 0; i < stats.size(); i++)
+        {
+            out.print("%-40s %10u %8u %8u %8u %9.1f\n",
+                      stats[i].name.c_str(), stats[i].calls,
+                      stats[i].p50, stats[i].p99, stats[i].max, stats[i].mean);
+        }
+        out.print("Percentiles cover the last %u calls of each probe.\n", Probe::RING_SIZE);
+    }
+    else if (cmd == "trace" && parameters.size() == 2)
+    {
+        std::string error;
+        if (!writeChromeTrace(parameters[1], &error))
+        {
+            out.printerr("Could not write trace: %s\n", error.c_str());
+            return CR_FAILURE;
+        }
+        out.print("Trace written to %s\n", parameters[1].c_str());
+    }
+    else
+    {
+        out.print("Usage:\n"
+                  "  profile enable|disable  - Start or stop collecting frame timings.\n"
+                  "  profile [report]        - Show p50/p99/max per plugin and event handler.\n"
+                  "  profile reset           - Clear the collected samples.\n"
+                  "  profile trace FILE      - Dump the samples as a Chrome trace JSON file.\n");
+        return CR_WRONG_USAGE;
+    }
+
+    return CR_OK;
+}
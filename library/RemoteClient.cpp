@@ -55,6 +55,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <memory>
 
+#include <google/protobuf/io/coded_stream.h>
+
 using namespace DFHack;
 
 #include "tinythread.h"
@@ -91,8 +93,10 @@ RemoteClient::RemoteClient(color_ostream *default_output)
     : p_default_output(default_output)
 {
     active = false;
+    protocol_version = 0;
     socket = new CActiveSocket();
     suspend_ready = false;
+    runcmdlist_bound = false;
 
     if (!p_default_output)
     {
@@ -165,7 +169,7 @@ bool RemoteClient::connect(int port)
 
     RPCHandshakeHeader header;
     memcpy(header.magic, RPCHandshakeHeader::REQUEST_MAGIC, sizeof(header.magic));
-    header.version = 1;
+    header.version = RPCHandshakeHeader::CURRENT_VERSION;
 
     if (socket->Send((uint8*)&header, sizeof(header)) != sizeof(header))
     {
@@ -182,13 +186,15 @@ bool RemoteClient::connect(int port)
     }
 
     if (memcmp(header.magic, RPCHandshakeHeader::RESPONSE_MAGIC, sizeof(header.magic)) ||
-        header.version != 1)
+        header.version < 1 || header.version > RPCHandshakeHeader::CURRENT_VERSION)
     {
         default_output().printerr("Invalid handshake response.\n");
         socket->Close();
         return active = false;
     }
 
+    protocol_version = header.version;
+
     bind_call.name = "BindMethod";
     bind_call.p_client = this;
     bind_call.id = 0;
@@ -197,6 +203,8 @@ bool RemoteClient::connect(int port)
     runcmd_call.p_client = this;
     runcmd_call.id = 1;
 
+    runcmdlist_bound = false;
+
     return true;
 }
 
@@ -258,6 +266,107 @@ command_result RemoteClient::run_command(color_ostream &out, const std::string &
     return runcmd_call(out);
 }
 
+command_result RemoteClient::run_command_list(std::vector<RemoteCommand> &commands)
+{
+    if (commands.empty())
+        return CR_OK;
+
+    if (!active || !socket->IsSocketValid())
+    {
+        default_output().printerr("In RunCommandList: client connection not valid.\n");
+        for (size_t i = 0; i < commands.size(); i++)
+            commands[i].result = CR_LINK_FAILURE;
+        return CR_LINK_FAILURE;
+    }
+
+    if (!runcmdlist_bound)
+    {
+        runcmdlist_bound = true;
+
+        // Older servers don't have it; that is not worth a message
+        buffered_color_ostream discard;
+        runcmdlist_call.bind(discard, this, "RunCommandList");
+    }
+
+    if (runcmdlist_call.isValid())
+    {
+        runcmdlist_call.reset();
+
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            auto cmd = runcmdlist_call.in()->add_commands();
+            cmd->set_command(commands[i].command);
+            for (size_t j = 0; j < commands[i].arguments.size(); j++)
+                cmd->add_arguments(commands[i].arguments[j]);
+        }
+
+        command_result rv = runcmdlist_call(default_output());
+        if (rv != CR_OK)
+        {
+            // None of the results came back
+            for (size_t i = 0; i < commands.size(); i++)
+                commands[i].result = rv;
+            return rv;
+        }
+
+        auto reply = runcmdlist_call.out();
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            if (int(i) >= reply->results_size())
+            {
+                commands[i].result = CR_LINK_FAILURE;
+                continue;
+            }
+
+            auto result = reply->mutable_results(i);
+            commands[i].result = command_result(result->result());
+
+            if (result->has_output())
+            {
+                color_ostream_proxy text_decoder(commands[i].out ? *commands[i].out : default_output());
+                text_decoder.decode(result->mutable_output());
+            }
+        }
+
+        return CR_OK;
+    }
+
+    // Send everything first, then collect the replies in the same order
+    std::vector<dfproto::CoreRunCommandRequest> requests(commands.size());
+    size_t sent = 0;
+
+    for (; sent < commands.size(); sent++)
+    {
+        requests[sent].set_command(commands[sent].command);
+        for (size_t j = 0; j < commands[sent].arguments.size(); j++)
+            requests[sent].add_arguments(commands[sent].arguments[j]);
+
+        color_ostream &out = commands[sent].out ? *commands[sent].out : default_output();
+        if (runcmd_call.send(out, &requests[sent]) != CR_OK)
+            break;
+    }
+
+    command_result status = CR_OK;
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (i >= sent)
+        {
+            commands[i].result = CR_LINK_FAILURE;
+            status = CR_LINK_FAILURE;
+            continue;
+        }
+
+        color_ostream &out = commands[i].out ? *commands[i].out : default_output();
+        commands[i].result = runcmd_call.receive(out);
+
+        if (commands[i].result == CR_LINK_FAILURE)
+            status = CR_LINK_FAILURE;
+    }
+
+    return status;
+}
+
 int RemoteClient::suspend_game()
 {
     if (!active)
@@ -344,8 +453,26 @@ bool sendRemoteMessage(CSimpleSocket *socket, int16_t id, const MessageLite *msg
     return (got == fullsz);
 }
 
+static bool sendControlHeader(CSimpleSocket *socket, int16_t id, int32_t value)
+{
+    RPCMessageHeader header;
+    header.id = id;
+    header.size = value;
+    return socket->Send((uint8_t*)&header, sizeof(header)) == sizeof(header);
+}
+
 command_result RemoteFunctionBase::execute(color_ostream &out,
-                                           const message_type *input, message_type *output)
+                                           const message_type *input, message_type *output,
+                                           part_function on_part, void *data)
+{
+    command_result res = send(out, input);
+    if (res != CR_OK)
+        return res;
+
+    return receive(out, output, on_part, data);
+}
+
+command_result RemoteFunctionBase::send(color_ostream &out, const message_type *input)
 {
     if (!isValid())
     {
@@ -377,9 +504,22 @@ command_result RemoteFunctionBase::execute(color_ostream &out,
         return CR_LINK_FAILURE;
     }
 
+    return CR_OK;
+}
+
+command_result RemoteFunctionBase::receive(color_ostream &out, message_type *output,
+                                           part_function on_part, void *data)
+{
+    if (!isValid())
+        return CR_NOT_IMPLEMENTED;
+
     color_ostream_proxy text_decoder(out);
     CoreTextNotification text_data;
 
+    std::auto_ptr<message_type> part;
+    int parts_received = 0;
+    bool cancelled = false;
+
     output->Clear();
 
     for (;;) {
@@ -415,7 +555,10 @@ command_result RemoteFunctionBase::execute(color_ostream &out,
 
         switch (header.id) {
         case RPC_REPLY_RESULT:
-            if (!output->ParseFromArray(buf, header.size))
+        {
+            // Merge, so that parts received without a handler are kept
+            google::protobuf::io::CodedInputStream input(buf, header.size);
+            if (!output->MergeFromCodedStream(&input))
             {
                 out.printerr("In call to %s::%s: error parsing received result.\n",
                              this->proto.c_str(), this->name.c_str());
@@ -425,6 +568,50 @@ command_result RemoteFunctionBase::execute(color_ostream &out,
 
             delete[] buf;
             return CR_OK;
+        }
+
+        case RPC_REPLY_PART:
+        {
+            bool ok;
+            if (on_part)
+            {
+                if (!part.get())
+                    part.reset(make_out());
+                part->Clear();
+                ok = part->ParseFromArray(buf, header.size);
+                if (ok && !cancelled && !on_part(data, part.get()))
+                {
+                    cancelled = true;
+                    if (!sendControlHeader(p_client->socket, RPC_REQUEST_CANCEL, 0))
+                        ok = false;
+                }
+            }
+            else
+            {
+                google::protobuf::io::CodedInputStream input(buf, header.size);
+                ok = output->MergePartialFromCodedStream(&input);
+            }
+
+            if (!ok)
+            {
+                out.printerr("In call to %s::%s: error parsing received part.\n",
+                             this->proto.c_str(), this->name.c_str());
+                delete[] buf;
+                return CR_LINK_FAILURE;
+            }
+
+            // Let the server send more once half of the window is consumed
+            parts_received++;
+            if (parts_received % (RPCMessageHeader::STREAM_WINDOW/2) == 0 &&
+                !sendControlHeader(p_client->socket, RPC_REQUEST_ACK, parts_received))
+            {
+                out.printerr("In call to %s::%s: I/O error in send.\n",
+                             this->proto.c_str(), this->name.c_str());
+                delete[] buf;
+                return CR_LINK_FAILURE;
+            }
+            break;
+        }
 
         case RPC_REPLY_TEXT:
             text_data.Clear();
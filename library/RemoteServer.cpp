@@ -51,6 +51,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "PassiveSocket.h"
 #include "PluginManager.h"
 #include "MiscUtils.h"
+#include "Profiler.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -58,6 +59,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <memory>
 
+#ifdef LINUX_BUILD
+#include <sys/select.h>
+#endif
+
 using namespace DFHack;
 
 #include "tinythread.h"
@@ -71,6 +76,104 @@ bool readFullBuffer(CSimpleSocket *socket, void *buf, int size);
 bool sendRemoteMessage(CSimpleSocket *socket, int16_t id,
                         const ::google::protobuf::MessageLite *msg, bool size_ready);
 
+/*
+ * Batches of suspended calls
+ */
+
+namespace {
+    struct BatchJob {
+        ServerFunctionBase *fn;
+        color_ostream *out;
+        command_result result;
+        bool done;
+    };
+}
+
+// One suspension window is kept short enough not to stall the game
+static const uint64_t MAX_BATCH_TIME = 20000; // microseconds
+
+static tthread::mutex batch_mutex;
+static tthread::condition_variable batch_cond;
+static std::deque<BatchJob*> batch_queue;
+static bool batch_running = false;
+
+static void run_batch_window()
+{
+    static Profiler::Probe *probe = Profiler::getProbe("rpc/batch");
+
+    CoreSuspender suspend;
+    Profiler::Scope scope(probe);
+    uint64_t start = Profiler::now();
+
+    batch_mutex.lock();
+
+    while (!batch_queue.empty())
+    {
+        BatchJob *job = batch_queue.front();
+        batch_queue.pop_front();
+
+        batch_mutex.unlock();
+        job->result = job->fn->execute(*job->out);
+        batch_mutex.lock();
+
+        job->done = true;
+        batch_cond.notify_all();
+
+        // Always at least one job, so the queue keeps moving
+        if (Profiler::now() - start >= MAX_BATCH_TIME)
+            break;
+    }
+
+    batch_mutex.unlock();
+}
+
+static void run_batch(std::vector<BatchJob> &jobs)
+{
+    if (jobs.empty())
+        return;
+
+    batch_mutex.lock();
+
+    for (size_t i = 0; i < jobs.size(); i++)
+        batch_queue.push_back(&jobs[i]);
+
+    for (;;)
+    {
+        bool all_done = true;
+        for (size_t i = 0; i < jobs.size(); i++)
+            all_done = all_done && jobs[i].done;
+        if (all_done)
+            break;
+
+        if (batch_running)
+        {
+            batch_cond.wait(batch_mutex);
+            continue;
+        }
+
+        // Nobody is executing the queue: do it for everybody
+        batch_running = true;
+        batch_mutex.unlock();
+
+        run_batch_window();
+
+        batch_mutex.lock();
+        batch_running = false;
+        batch_cond.notify_all();
+    }
+
+    batch_mutex.unlock();
+}
+
+struct ServerConnection::Call {
+    ServerFunctionBase *fn;
+    bool ready;
+    int in_size, out_size;
+    command_result res;
+    // Text of batched calls, sent just before their reply
+    buffered_color_ostream *text;
+};
+
 
 RPCService::RPCService()
 {
@@ -108,10 +211,95 @@ void RPCService::finalize(ServerConnection *owner, std::vector<ServerFunctionBas
     }
 }
 
+ServerConnection *ServerFunctionBase::connection()
+{
+    return owner->owner;
+}
+
+bool ServerStreamBase::write(const message_type *part)
+{
+    if (cancelled || connection->in_error)
+        return false;
+
+    // Old clients can only take a single reply, so build it up here
+    if (connection->protocol_version < 2)
+    {
+        reply->CheckTypeAndMergeFrom(*part);
+        parts++;
+        return true;
+    }
+
+    int size = part->ByteSize();
+    if (size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+    {
+        connection->stream.printerr("In RPC server: reply part too large: %d.\n", size);
+        cancelled = true;
+        return false;
+    }
+
+    if (!waitForWindow())
+        return false;
+
+    // Keep text output in order with the parts
+    connection->stream.flush();
+    if (connection->in_error)
+        return false;
+
+    if (!sendRemoteMessage(connection->socket, RPC_REPLY_PART, part, true))
+    {
+        connection->in_error = true;
+        Core::printerr("In RPC server: I/O error in send reply part.\n");
+        return false;
+    }
+
+    parts++;
+    return true;
+}
+
+bool ServerStreamBase::waitForWindow()
+{
+    while (parts - acked >= RPCMessageHeader::STREAM_WINDOW)
+    {
+        RPCMessageHeader header;
+
+        if (!readFullBuffer(connection->socket, &header, sizeof(header)))
+        {
+            connection->in_error = true;
+            Core::printerr("In RPC server: I/O error in receive acknowledgement.\n");
+            return false;
+        }
+
+        switch ((DFHack::DFHackReplyCode)header.id)
+        {
+        case RPC_REQUEST_ACK:
+            if (header.size > acked)
+                acked = header.size;
+            break;
+
+        case RPC_REQUEST_CANCEL:
+            cancelled = true;
+            return false;
+
+        case RPC_REQUEST_QUIT:
+            connection->queueRequest(header);
+            cancelled = true;
+            return false;
+
+        default:
+            // The next call of a pipelining client
+            if (!connection->queueRequest(header))
+                return false;
+        }
+    }
+
+    return true;
+}
+
 ServerConnection::ServerConnection(CActiveSocket *socket)
     : socket(socket), stream(this)
 {
     in_error = false;
+    protocol_version = 1;
 
     core_service = new CoreService();
     core_service->finalize(this, &functions);
@@ -167,18 +355,23 @@ ServerFunctionBase *ServerConnection::findFunction(color_ostream &out, const std
 
 void ServerConnection::connection_ostream::flush_proxy()
 {
-    if (owner->in_error)
-    {
-        buffer.clear();
-        return;
-    }
+    if (!owner->in_error)
+        owner->sendText(buffer);
 
-    if (buffer.empty())
-        return;
+    buffer.clear();
+}
+
+bool ServerConnection::sendText(const std::list<buffered_color_ostream::fragment_type> &fragments)
+{
+    if (in_error)
+        return false;
+
+    if (fragments.empty())
+        return true;
 
     CoreTextNotification msg;
 
-    for (auto it = buffer.begin(); it != buffer.end(); ++it)
+    for (auto it = fragments.begin(); it != fragments.end(); ++it)
     {
         auto frag = msg.add_fragments();
         frag->set_text(it->second);
@@ -186,13 +379,235 @@ void ServerConnection::connection_ostream::flush_proxy()
             frag->set_color(CoreTextFragment::Color(it->first));
     }
 
-    buffer.clear();
-
-    if (!sendRemoteMessage(owner->socket, RPC_REPLY_TEXT, &msg, false))
+    if (!sendRemoteMessage(socket, RPC_REPLY_TEXT, &msg, false))
     {
-        owner->in_error = true;
+        in_error = true;
         Core::printerr("Error writing text into client socket.\n");
+        return false;
     }
+
+    return true;
+}
+
+bool ServerConnection::readRequest()
+{
+    RPCMessageHeader header;
+
+    if (!readFullBuffer(socket, &header, sizeof(header)))
+    {
+        in_error = true;
+        Core::printerr("In RPC server: I/O error in receive header.\n");
+        return false;
+    }
+
+    return queueRequest(header);
+}
+
+bool ServerConnection::queueRequest(const RPCMessageHeader &header)
+{
+    switch ((DFHack::DFHackReplyCode)header.id)
+    {
+    case RPC_REQUEST_ACK:
+    case RPC_REQUEST_CANCEL:
+        // Flow control left over from a stream that has already ended
+        return true;
+
+    case RPC_REQUEST_QUIT:
+        backlog.push_back(Request());
+        backlog.back().header = header;
+        backlog.back().header.size = 0;
+        return true;
+
+    default:
+        break;
+    }
+
+    if (header.size < 0 || header.size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+    {
+        in_error = true;
+        Core::printerr("In RPC server: invalid received size %d.\n", header.size);
+        return false;
+    }
+
+    if (backlog.size() >= MAX_PIPELINE)
+    {
+        in_error = true;
+        Core::printerr("In RPC server: too many calls in flight.\n");
+        return false;
+    }
+
+    backlog.push_back(Request());
+    Request &req = backlog.back();
+    req.header = header;
+    req.data.resize(header.size);
+
+    if (header.size > 0 && !readFullBuffer(socket, &req.data[0], header.size))
+    {
+        in_error = true;
+        Core::printerr("In RPC server: I/O error in receive %d bytes of data.\n", header.size);
+        return false;
+    }
+
+    return true;
+}
+
+bool ServerConnection::hasPendingInput()
+{
+    // CSimpleSocket::Select() also reports a writable socket
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(socket->GetSocketDescriptor(), &set);
+
+    timeval timeout;
+    timeout.tv_sec = timeout.tv_usec = 0;
+
+    // The first argument is ignored on windows
+    int nfds = (int)socket->GetSocketDescriptor() + 1;
+    return select(nfds, &set, NULL, NULL, &timeout) > 0;
+}
+
+void ServerConnection::takeCalls(std::vector<Call> &calls)
+{
+    while (!backlog.empty())
+    {
+        Request &req = backlog.front();
+        if ((DFHack::DFHackReplyCode)req.header.id == RPC_REQUEST_QUIT)
+            break;
+
+        ServerFunctionBase *fn = vector_get(functions, req.header.id);
+        bool batched = fn && !(fn->flags & SF_DONT_SUSPEND);
+
+        // A run of distinct suspended functions, or a single other call;
+        // each function only has one set of input and output buffers.
+        if (!calls.empty())
+        {
+            if (!batched)
+                break;
+
+            bool seen = false;
+            for (size_t i = 0; i < calls.size(); i++)
+                seen = seen || calls[i].fn == fn;
+            if (seen)
+                break;
+        }
+
+        Call call;
+        call.fn = fn;
+        call.ready = false;
+        call.in_size = req.header.size;
+        call.out_size = 0;
+        call.res = CR_FAILURE;
+        call.text = batched ? new buffered_color_ostream() : NULL;
+
+        color_ostream &out = call.text ? *(color_ostream*)call.text : stream;
+
+        if (!fn)
+            out.printerr("RPC call of invalid id %d\n", req.header.id);
+        else if (!fn->in()->ParseFromArray(req.data.empty() ? NULL : &req.data[0], req.header.size))
+            out.printerr("In call to %s: could not decode input args.\n", fn->name);
+        else
+            call.ready = true;
+
+        backlog.pop_front();
+        calls.push_back(call);
+
+        if (!batched)
+            break;
+    }
+}
+
+void ServerConnection::executeCalls(std::vector<Call> &calls)
+{
+    std::vector<BatchJob> jobs;
+    jobs.reserve(calls.size());
+
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        Call &call = calls[i];
+        if (!call.ready)
+            continue;
+
+        if (!call.text)
+        {
+            call.res = call.fn->execute(stream);
+            continue;
+        }
+
+        BatchJob job;
+        job.fn = call.fn;
+        job.out = call.text;
+        job.result = CR_FAILURE;
+        job.done = false;
+        jobs.push_back(job);
+    }
+
+    // A client that suspended the core through CoreSuspend already
+    // has it, and must not wait for some other thread to get it.
+    if (!jobs.empty() && Core::getInstance().isSuspended())
+    {
+        for (size_t i = 0; i < jobs.size(); i++)
+            jobs[i].result = jobs[i].fn->execute(*jobs[i].out);
+    }
+    else
+        run_batch(jobs);
+
+    for (size_t i = 0, j = 0; i < calls.size(); i++)
+    {
+        if (calls[i].ready && calls[i].text)
+            calls[i].res = jobs[j++].result;
+    }
+}
+
+bool ServerConnection::sendReply(color_ostream &out, Call &call)
+{
+    ServerFunctionBase *fn = call.fn;
+    MessageLite *reply = (call.ready ? fn->out() : NULL);
+    command_result res = call.res;
+
+    // Send reply
+    call.out_size = (reply ? reply->ByteSize() : 0);
+
+    if (call.out_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+    {
+        stream.printerr("In call to %s: reply too large: %d.\n",
+                            (fn ? fn->name : "UNKNOWN"), call.out_size);
+        res = CR_LINK_FAILURE;
+    }
+
+    // Flush all text output
+    if (call.text)
+    {
+        call.text->flush();
+        sendText(call.text->fragments());
+    }
+
+    stream.flush();
+
+    if (in_error)
+        return false;
+
+    if (res == CR_OK && reply)
+    {
+        if (!sendRemoteMessage(socket, RPC_REPLY_RESULT, reply, true))
+        {
+            out.printerr("In RPC server: I/O error in send result.\n");
+            return false;
+        }
+    }
+    else
+    {
+        RPCMessageHeader header;
+        header.id = RPC_REPLY_FAIL;
+        header.size = res;
+
+        if (socket->Send((uint8_t*)&header, sizeof(header)) != sizeof(header))
+        {
+            out.printerr("In RPC server: I/O error in send failure code.\n");
+            return false;
+        }
+    }
+
+    return true;
 }
 
 void ServerConnection::threadFn(void *arg)
@@ -226,8 +641,12 @@ void ServerConnection::threadFn()
             return;
         }
 
+        protocol_version = header.version;
+        if (protocol_version > RPCHandshakeHeader::CURRENT_VERSION)
+            protocol_version = RPCHandshakeHeader::CURRENT_VERSION;
+
         memcpy(header.magic, RPCHandshakeHeader::RESPONSE_MAGIC, sizeof(header.magic));
-        header.version = 1;
+        header.version = protocol_version;
 
         if (socket->Send((uint8*)&header, sizeof(header)) != sizeof(header))
         {
@@ -240,114 +659,55 @@ void ServerConnection::threadFn()
 
     std::cerr << "Client connection established." << endl;
 
-    while (!in_error) {
-        // Read the message
-        RPCMessageHeader header;
-
-        if (!readFullBuffer(socket, &header, sizeof(header)))
+    while (!in_error)
+    {
+        // Wait for a call, then take whatever else has arrived already.
+        // Stray ACK and CANCEL headers are expected here: the client acks
+        // every few parts of a streamed reply, and those still in flight
+        // when the stream ends are read and dropped without queuing a call.
+        while (!in_error && backlog.empty())
         {
-            out.printerr("In RPC server: I/O error in receive header.\n");
-            break;
+            if (!readRequest())
+                break;
         }
 
-        if ((DFHack::DFHackReplyCode)header.id == RPC_REQUEST_QUIT)
+        if (in_error || backlog.empty())
             break;
 
-        if (header.size < 0 || header.size > RPCMessageHeader::MAX_MESSAGE_SIZE)
-        {
-            out.printerr("In RPC server: invalid received size %d.\n", header.size);
-            break;
-        }
+        while (!in_error && backlog.size() < MAX_PIPELINE && hasPendingInput())
+            readRequest();
 
-        std::auto_ptr<uint8_t> buf(new uint8_t[header.size]);
-
-        if (!readFullBuffer(socket, buf.get(), header.size))
-        {
-            out.printerr("In RPC server: I/O error in receive %d bytes of data.\n", header.size);
+        if (in_error)
             break;
-        }
-
-        //out.print("Handling %d:%d\n", header.id, header.size);
-
-        // Find and call the function
-        int in_size = header.size;
-
-        ServerFunctionBase *fn = vector_get(functions, header.id);
-        MessageLite *reply = NULL;
-        command_result res = CR_FAILURE;
-
-        if (!fn)
-        {
-            stream.printerr("RPC call of invalid id %d\n", header.id);
-        }
-        else
-        {
-            if (!fn->in()->ParseFromArray(buf.get(), header.size))
-            {
-                stream.printerr("In call to %s: could not decode input args.\n", fn->name);
-            }
-            else
-            {
-                buf.reset();
-
-                reply = fn->out();
-
-                if (fn->flags & SF_DONT_SUSPEND)
-                {
-                    res = fn->execute(stream);
-                }
-                else
-                {
-                    CoreSuspender suspend;
-                    res = fn->execute(stream);
-                }
-            }
-        }
 
-        // Flush all text output
-        if (in_error)
+        if ((DFHack::DFHackReplyCode)backlog.front().header.id == RPC_REQUEST_QUIT)
             break;
 
-        //out.print("Answer %d:%d\n", res, reply);
+        std::vector<Call> calls;
+        takeCalls(calls);
 
-        // Send reply
-        int out_size = (reply ? reply->ByteSize() : 0);
+        executeCalls(calls);
 
-        if (out_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        // Replies go out in the order the calls came in
+        for (size_t i = 0; i < calls.size(); i++)
         {
-            stream.printerr("In call to %s: reply too large: %d.\n",
-                                (fn ? fn->name : "UNKNOWN"), out_size);
-            res = CR_LINK_FAILURE;
+            if (!in_error && !sendReply(out, calls[i]))
+                in_error = true;
         }
 
-        stream.flush();
-
-        if (res == CR_OK && reply)
-        {
-            if (!sendRemoteMessage(socket, RPC_REPLY_RESULT, reply, true))
-            {
-                out.printerr("In RPC server: I/O error in send result.\n");
-                break;
-            }
-        }
-        else
+        // Cleanup
+        for (size_t i = 0; i < calls.size(); i++)
         {
-            header.id = RPC_REPLY_FAIL;
-            header.size = res;
+            Call &call = calls[i];
+
+            delete call.text;
 
-            if (socket->Send((uint8_t*)&header, sizeof(header)) != sizeof(header))
+            if (call.fn)
             {
-                out.printerr("In RPC server: I/O error in send failure code.\n");
-                break;
+                call.fn->reset((call.fn->flags & SF_CALLED_ONCE) ||
+                               (call.out_size > 128*1024 || call.in_size > 32*1024));
             }
         }
-
-        // Cleanup
-        if (fn)
-        {
-            fn->reset((fn->flags & SF_CALLED_ONCE) ||
-                      (out_size > 128*1024 || in_size > 32*1024));
-        }
     }
 
     std::cerr << "Shutting down client connection." << endl;
@@ -49,6 +49,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "PluginManager.h"
 #include "MiscUtils.h"
 #include "VersionInfo.h"
+#include "Profiler.h"
+#include "DataColumns.h"
 
 #include "modules/Materials.h"
 #include "modules/Translation.h"
@@ -83,6 +85,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 
 #include <memory>
+#include <algorithm>
 
 using namespace DFHack;
 using namespace df::enums;
@@ -645,6 +648,75 @@ static command_result SetUnitLabors(color_ostream &stream, const SetUnitLaborsIn
     return CR_OK;
 }
 
+static command_result GetProfileStats(color_ostream &stream,
+                                      const EmptyMessage *, GetProfileStatsOut *out)
+{
+    std::vector<Profiler::Stats> stats;
+    Profiler::getStats(&stats);
+
+    out->set_enabled(Profiler::isEnabled());
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        auto item = out->add_probe();
+        item->set_name(stats[i].name);
+        item->set_calls(stats[i].calls);
+        item->set_p50_us(stats[i].p50);
+        item->set_p99_us(stats[i].p99);
+        item->set_max_us(stats[i].max);
+        item->set_mean_us(stats[i].mean);
+    }
+
+    return CR_OK;
+}
+
+static command_result FetchColumns(color_ostream &stream,
+                                   const FetchColumnsIn *in, FetchColumnsOut *out)
+{
+    std::vector<std::string> fields(in->field().begin(), in->field().end());
+    size_t first = in->has_first() ? std::max(0, in->first()) : 0;
+    size_t count = in->has_count() ? std::max(0, in->count()) : size_t(-1);
+
+    std::vector<DataColumns::Column> columns;
+    size_t total;
+    std::string error;
+
+    if (!DataColumns::fetch(&columns, &total, in->vector(), fields, &error, first, count))
+    {
+        stream.printerr("%s\n", error.c_str());
+        return CR_FAILURE;
+    }
+
+    first = std::min(first, total);
+    out->set_total(total);
+    out->set_first(first);
+    out->set_count(std::min(count, total - first));
+
+    for (size_t i = 0; i < columns.size(); i++)
+    {
+        auto &col = columns[i];
+        auto item = out->add_column();
+        item->set_field(col.path);
+
+        if (col.is_float)
+        {
+            item->mutable_float_value()->Reserve(col.floats.size());
+            for (size_t j = 0; j < col.floats.size(); j++)
+                item->add_float_value(col.floats[j]);
+        }
+        else
+        {
+            item->mutable_int_value()->Reserve(col.ints.size());
+            for (size_t j = 0; j < col.ints.size(); j++)
+                item->add_int_value(col.ints[j]);
+        }
+
+        for (size_t j = 0; j < col.null_rows.size(); j++)
+            item->add_null_row(col.null_rows[j]);
+    }
+
+    return CR_OK;
+}
+
 CoreService::CoreService() {
     suspend_depth = 0;
 
@@ -655,6 +727,7 @@ CoreService::CoreService() {
     // Add others here:
     addMethod("CoreSuspend", &CoreService::CoreSuspend, SF_DONT_SUSPEND);
     addMethod("CoreResume", &CoreService::CoreResume, SF_DONT_SUSPEND);
+    addMethod("RunCommandList", &CoreService::RunCommandList, SF_DONT_SUSPEND);
 
     // Functions:
     addFunction("GetVersion", GetVersion, SF_DONT_SUSPEND);
@@ -670,6 +743,9 @@ CoreService::CoreService() {
     addFunction("ListSquads", ListSquads);
 
     addFunction("SetUnitLabors", SetUnitLabors);
+
+    addFunction("GetProfileStats", GetProfileStats, SF_DONT_SUSPEND);
+    addFunction("FetchColumns", FetchColumns);
 }
 
 CoreService::~CoreService()
@@ -714,6 +790,42 @@ command_result CoreService::RunCommand(color_ostream &stream,
     return Core::getInstance().runCommand(stream, cmd, args);
 }
 
+command_result CoreService::RunCommandList(color_ostream &stream,
+                                           const dfproto::CoreRunCommandListRequest *in,
+                                           dfproto::CoreRunCommandListReply *out)
+{
+    for (int i = 0; i < in->commands_size(); i++)
+    {
+        auto &cmd = in->commands(i);
+        std::vector<std::string> args;
+        for (int j = 0; j < cmd.arguments_size(); j++)
+            args.push_back(cmd.arguments(j));
+
+        // Each command's output is returned with its result, not streamed
+        buffered_color_ostream text;
+        command_result rv = Core::getInstance().runCommand(text, cmd.command(), args);
+        text.flush();
+
+        auto result = out->add_results();
+        result->set_result(rv);
+
+        auto &fragments = text.fragments();
+        if (fragments.empty())
+            continue;
+
+        auto output = result->mutable_output();
+        for (auto it = fragments.begin(); it != fragments.end(); ++it)
+        {
+            auto frag = output->add_fragments();
+            frag->set_text(it->second);
+            if (it->first >= 0)
+                frag->set_color(CoreTextFragment::Color(it->first));
+        }
+    }
+
+    return CR_OK;
+}
+
 command_result CoreService::CoreSuspend(color_ostream &stream, const EmptyMessage*, IntMessage *cnt)
 {
     Core::getInstance().Suspend();
@@ -0,0 +1,342 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#include "Internal.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <ctime>
+using namespace std;
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ScriptIndex.h"
+#include "Core.h"
+#include "Error.h"
+#include "MiscUtils.h"
+#include "Types.h"
+#include "Profiler.h"
+#include "tinythread.h"
+
+using namespace DFHack;
+
+/*
+ * The index keeps the names relative to the scripts directory, e.g.
+ * 'devel/find-offsets', and the directories as prefixes like 'devel/'.
+ */
+
+static const uint64_t CHECK_INTERVAL = 1000000; // microseconds
+
+static const char *const extensions[] = { "", ".lua", ".rb" };
+static const char *const help_prefixes[] = { "", "-- ", "# " };
+
+struct HelpCache
+{
+    bool valid;
+    time_t mtime;
+    off_t size;
+    uint64_t checked;
+    std::string text;
+
+    HelpCache() : valid(false), mtime(0), size(0), checked(0) {}
+};
+
+struct ScriptInfo
+{
+    bool present[3];
+    HelpCache help[3];
+
+    ScriptInfo() { present[0] = present[1] = present[2] = false; }
+};
+
+struct DirInfo
+{
+    time_t mtime;
+    bool settled;   // mtime is older than the listing
+
+    DirInfo() : mtime(0), settled(false) {}
+};
+
+static tthread::mutex index_mutex;
+
+static bool loaded = false;
+static bool forced = false;
+static std::string root;
+static uint64_t last_check = 0;
+
+static std::map<std::string, ScriptInfo> scripts;
+static std::map<std::string, DirInfo> dirs;
+
+static size_t rescans = 0, help_reads = 0;
+
+static bool has_prefix(const std::string &name, const std::string &prefix)
+{
+    return name.compare(0, prefix.size(), prefix) == 0;
+}
+
+static bool in_dir(const std::string &name, const std::string &prefix)
+{
+    return has_prefix(name, prefix) && name.find('/', prefix.size()) == std::string::npos;
+}
+
+static void remove_dir(const std::string &prefix)
+{
+    auto it = scripts.lower_bound(prefix);
+    while (it != scripts.end() && has_prefix(it->first, prefix))
+        scripts.erase(it++);
+
+    auto dit = dirs.lower_bound(prefix);
+    while (dit != dirs.end() && has_prefix(dit->first, prefix))
+        dirs.erase(dit++);
+}
+
+// Lists one directory again, and any subdirectories not seen before.
+static void scan_dir(const std::string &prefix)
+{
+    std::string path = root + prefix;
+    std::vector<std::string> files;
+    struct stat st;
+
+    // Take the mtime before listing, so that a change during it is seen next time
+    if (stat(path.c_str(), &st) != 0 || getdir(path, files) != 0)
+    {
+        if (prefix.empty())
+        {
+            scripts.clear();
+            dirs.clear();
+            dirs[prefix] = DirInfo();
+        }
+        else
+            remove_dir(prefix);
+        return;
+    }
+
+    DirInfo &dir = dirs[prefix];
+    dir.mtime = st.st_mtime;
+    dir.settled = (st.st_mtime < time(NULL));
+
+    std::map<std::string, int> found;
+    std::vector<std::string> subdirs;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const std::string &file = files[i];
+
+        if (hasEnding(file, ".lua"))
+            found[prefix + file.substr(0, file.size()-4)] |= (1 << ScriptIndex::LUA);
+        else if (hasEnding(file, ".rb"))
+            found[prefix + file.substr(0, file.size()-3)] |= (1 << ScriptIndex::RUBY);
+        else if (!file.empty() && file[0] != '.')
+        {
+            if (stat((path + file).c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR)
+                subdirs.push_back(prefix + file + "/");
+        }
+    }
+
+    // Drop the scripts of this directory that are gone, keeping help caches of the rest
+    auto it = scripts.lower_bound(prefix);
+    while (it != scripts.end() && has_prefix(it->first, prefix))
+    {
+        if (in_dir(it->first, prefix) && !found.count(it->first))
+            scripts.erase(it++);
+        else
+            ++it;
+    }
+
+    for (auto fit = found.begin(); fit != found.end(); ++fit)
+    {
+        ScriptInfo &info = scripts[fit->first];
+        for (int type = ScriptIndex::LUA; type <= ScriptIndex::RUBY; type++)
+            info.present[type] = (fit->second & (1 << type)) != 0;
+    }
+
+    for (size_t i = 0; i < subdirs.size(); i++)
+    {
+        if (!dirs.count(subdirs[i]))
+            scan_dir(subdirs[i]);
+    }
+}
+
+static void refresh()
+{
+    uint64_t now = Profiler::now();
+    std::string path = Core::getInstance().getHackPath() + "scripts/";
+
+    if (!loaded || path != root)
+    {
+        scripts.clear();
+        dirs.clear();
+        root = path;
+        loaded = true;
+        forced = false;
+        last_check = now;
+        scan_dir("");
+        return;
+    }
+
+    if (!forced && now - last_check < CHECK_INTERVAL)
+        return;
+
+    forced = false;
+    last_check = now;
+
+    std::vector<std::string> changed;
+
+    for (auto it = dirs.begin(); it != dirs.end(); ++it)
+    {
+        struct stat st;
+        if (stat((root + it->first).c_str(), &st) != 0 ||
+            st.st_mtime != it->second.mtime || !it->second.settled)
+            changed.push_back(it->first);
+    }
+
+    // A parent is listed before its children, and may remove them
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        if (!dirs.count(changed[i]))
+            continue;
+
+        scan_dir(changed[i]);
+        rescans++;
+    }
+}
+
+static ScriptIndex::Type find_type(const std::string &name, bool with_ruby)
+{
+    auto it = scripts.find(name);
+    if (it == scripts.end())
+        return ScriptIndex::NONE;
+
+    if (it->second.present[ScriptIndex::LUA])
+        return ScriptIndex::LUA;
+    if (with_ruby && it->second.present[ScriptIndex::RUBY])
+        return ScriptIndex::RUBY;
+    return ScriptIndex::NONE;
+}
+
+static const std::string &get_help(const std::string &name, ScriptInfo &info, ScriptIndex::Type type)
+{
+    static const std::string no_help = "No help available.";
+
+    HelpCache &cache = info.help[type];
+    uint64_t now = Profiler::now();
+
+    if (cache.valid && now - cache.checked < CHECK_INTERVAL)
+        return cache.text;
+
+    cache.checked = now;
+
+    std::string path = root + name + extensions[type];
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        cache.valid = false;
+        return no_help;
+    }
+
+    if (cache.valid && cache.mtime == st.st_mtime && cache.size == st.st_size)
+        return cache.text;
+
+    cache.valid = true;
+    cache.mtime = st.st_mtime;
+    cache.size = st.st_size;
+    cache.text = no_help;
+    help_reads++;
+
+    std::string prefix = help_prefixes[type];
+    std::ifstream script(path.c_str());
+    std::string help;
+    if (script.good() && getline(script, help) &&
+        help.substr(0, prefix.length()) == prefix)
+        cache.text = help.substr(prefix.length());
+
+    return cache.text;
+}
+
+ScriptIndex::Type ScriptIndex::find(const std::string &name, bool with_ruby, std::string *path)
+{
+    tthread::lock_guard<tthread::mutex> lock(index_mutex);
+    refresh();
+
+    Type type = find_type(name, with_ruby);
+    if (path && type != NONE)
+        *path = root + name + extensions[type];
+    return type;
+}
+
+bool ScriptIndex::getHelp(const std::string &name, bool with_ruby, std::string *help)
+{
+    tthread::lock_guard<tthread::mutex> lock(index_mutex);
+    refresh();
+
+    Type type = find_type(name, with_ruby);
+    if (type == NONE)
+        return false;
+
+    *help = get_help(name, scripts[name], type);
+    return true;
+}
+
+void ScriptIndex::list(std::map<std::string, std::string> &pset, bool all, bool with_ruby)
+{
+    tthread::lock_guard<tthread::mutex> lock(index_mutex);
+    refresh();
+
+    for (auto it = scripts.begin(); it != scripts.end(); ++it)
+    {
+        if (!all && it->first.find('/') != std::string::npos)
+            continue;
+
+        Type type = find_type(it->first, with_ruby);
+        if (type != NONE)
+            pset[it->first] = get_help(it->first, it->second, type);
+    }
+}
+
+void ScriptIndex::invalidate()
+{
+    tthread::lock_guard<tthread::mutex> lock(index_mutex);
+    forced = true;
+
+    for (auto it = scripts.begin(); it != scripts.end(); ++it)
+        for (int type = LUA; type <= RUBY; type++)
+            it->second.help[type].checked = 0;
+}
+
+void ScriptIndex::getStats(Stats *out)
+{
+    CHECK_NULL_POINTER(out);
+
+    tthread::lock_guard<tthread::mutex> lock(index_mutex);
+    refresh();
+
+    out->scripts = scripts.size();
+    out->dirs = dirs.size();
+    out->rescans = rescans;
+    out->help_reads = help_reads;
+}
@@ -0,0 +1,270 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#include "Internal.h"
+
+#include <vector>
+
+#include "WorkerPool.h"
+
+#include "tinythread.h"
+
+using namespace DFHack;
+using namespace DFHack::WorkerPool;
+using namespace tthread;
+
+static const unsigned MAX_DEFAULT_WORKERS = 8;
+
+static unsigned worker_count = 0;
+
+unsigned WorkerPool::getWorkerCount()
+{
+    if (!worker_count)
+    {
+        unsigned cores = thread::hardware_concurrency();
+        if (cores < 1)
+            cores = 1;
+        if (cores > MAX_DEFAULT_WORKERS)
+            cores = MAX_DEFAULT_WORKERS;
+        worker_count = cores;
+    }
+    return worker_count;
+}
+
+void WorkerPool::setWorkerCount(unsigned count)
+{
+    worker_count = count;
+}
+
+namespace {
+    // The indices a worker still has to do: [begin, end)
+    struct Range
+    {
+        mutex lock;
+        size_t begin, end;
+    };
+
+    struct Job
+    {
+        body_function body;
+        void *data;
+        unsigned workers;
+        Range *ranges;
+    };
+
+}
+
+static bool take_own(Range &range, size_t *index)
+{
+    lock_guard<mutex> lock(range.lock);
+    if (range.begin >= range.end)
+        return false;
+    *index = range.begin++;
+    return true;
+}
+
+static bool steal(Job *job, unsigned self, size_t *index)
+{
+    for (;;)
+    {
+        // Pick the victim with the most work left
+        unsigned victim = self;
+        size_t best = 0;
+        for (unsigned i = 0; i < job->workers; i++)
+        {
+            if (i == self)
+                continue;
+            Range &range = job->ranges[i];
+            lock_guard<mutex> lock(range.lock);
+            if (range.end - range.begin > best)
+            {
+                best = range.end - range.begin;
+                victim = i;
+            }
+        }
+
+        if (victim == self)
+            return false;
+
+        size_t begin, end;
+        {
+            Range &range = job->ranges[victim];
+            lock_guard<mutex> lock(range.lock);
+            size_t left = range.end - range.begin;
+            if (left == 0)
+                continue;   // drained in the meantime; look again
+            end = range.end;
+            begin = end - (left+1)/2;
+            range.end = begin;
+        }
+
+        *index = begin;
+        Range &own = job->ranges[self];
+        lock_guard<mutex> lock(own.lock);
+        own.begin = begin+1;
+        own.end = end;
+        return true;
+    }
+}
+
+static void work(Job *job, unsigned self)
+{
+    size_t index;
+    for (;;)
+    {
+        if (!take_own(job->ranges[self], &index) && !steal(job, self, &index))
+            break;
+        job->body(job->data, index, self);
+    }
+}
+
+/*
+ * Pool threads
+ *
+ * The threads are started on the first parallel run and then wait for
+ * the next job. The state is never freed, so that threads still blocked
+ * on it at exit don't touch destroyed objects.
+ */
+
+namespace {
+    struct Pool
+    {
+        // Held for the duration of a parallel run
+        mutex run_lock;
+
+        mutex lock;
+        condition_variable wake, done;
+        Job *job;
+        unsigned generation;
+        unsigned busy;
+        std::vector<thread*> threads;
+
+        Pool() : job(NULL), generation(0), busy(0) {}
+    };
+
+    struct ThreadArg
+    {
+        Pool *pool;
+        unsigned index;
+        unsigned generation;
+    };
+}
+
+static Pool *pool = new Pool();
+
+static void worker_main(void *arg)
+{
+    ThreadArg *targ = (ThreadArg*)arg;
+    Pool *pool = targ->pool;
+    unsigned index = targ->index;
+    unsigned seen = targ->generation;
+    delete targ;
+
+    for (;;)
+    {
+        Job *job;
+        {
+            lock_guard<mutex> lock(pool->lock);
+            while (pool->generation == seen)
+                pool->wake.wait(pool->lock);
+            seen = pool->generation;
+            job = pool->job;
+        }
+
+        // Threads beyond the current worker count sit this one out
+        if (index < job->workers)
+            work(job, index);
+
+        lock_guard<mutex> lock(pool->lock);
+        if (--pool->busy == 0)
+            pool->done.notify_all();
+    }
+}
+
+// Starts threads until there are count-1 of them; needs pool->lock.
+static void grow_pool(unsigned count)
+{
+    while (pool->threads.size() + 1 < count)
+    {
+        ThreadArg *arg = new ThreadArg();
+        arg->pool = pool;
+        arg->index = unsigned(pool->threads.size()) + 1;
+        arg->generation = pool->generation;
+
+        // Never joined or deleted; see above
+        pool->threads.push_back(new thread(worker_main, arg));
+    }
+}
+
+void WorkerPool::run(size_t count, body_function body, void *data)
+{
+    if (count == 0)
+        return;
+
+    unsigned workers = getWorkerCount();
+    if (workers > count)
+        workers = unsigned(count);
+
+    // One parallel run at a time; a nested or concurrent call, e.g. from
+    // another RPC thread, just does its work on the calling thread.
+    if (workers <= 1 || !pool->run_lock.try_lock())
+    {
+        for (size_t i = 0; i < count; i++)
+            body(data, i, 0);
+        return;
+    }
+
+    Job job;
+    job.body = body;
+    job.data = data;
+    job.workers = workers;
+    job.ranges = new Range[workers];
+
+    for (unsigned i = 0; i < workers; i++)
+    {
+        job.ranges[i].begin = count * i / workers;
+        job.ranges[i].end = count * (i+1) / workers;
+    }
+
+    {
+        lock_guard<mutex> lock(pool->lock);
+        grow_pool(workers);
+        pool->job = &job;
+        pool->busy = unsigned(pool->threads.size());
+        pool->generation++;
+        pool->wake.notify_all();
+    }
+
+    work(&job, 0);
+
+    {
+        lock_guard<mutex> lock(pool->lock);
+        while (pool->busy > 0)
+            pool->done.wait(pool->lock);
+        pool->job = NULL;
+    }
+
+    delete[] job.ranges;
+    pool->run_lock.unlock();
+}
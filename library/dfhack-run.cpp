@@ -43,30 +43,506 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <fstream>
 #include <istream>
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 #include "RemoteClient.h"
+#include "MiscUtils.h"
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 
 #include <memory>
 
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
+
 using namespace DFHack;
 using namespace dfproto;
 using std::cout;
 
+/*
+ * Persistent mode
+ *
+ * Keeps one connection to DFHack and runs command lines as they come, in
+ * batches: every line that has arrived by the time the previous batch is
+ * done goes into a single RunCommandList call.
+ */
+
+static const size_t MAX_BATCH = 64;
+static const size_t MAX_LINE = 65536;
+
+class Session
+{
+    color_ostream &out;
+    RemoteClient *client;
+
+public:
+    Session(color_ostream &out) : out(out), client(NULL) {}
+    ~Session() { delete client; }
+
+    bool connect()
+    {
+        if (client)
+            return true;
+
+        client = new RemoteClient(&out);
+        if (client->connect())
+            return true;
+
+        delete client;
+        client = NULL;
+        return false;
+    }
+
+    // Runs the commands; after a connection failure the next call reconnects.
+    void run(std::vector<RemoteCommand> &commands)
+    {
+        if (!connect())
+        {
+            for (size_t i = 0; i < commands.size(); i++)
+                commands[i].result = CR_LINK_FAILURE;
+            return;
+        }
+
+        // Commands that may have run already are not retried.
+        if (client->run_command_list(commands) == CR_LINK_FAILURE)
+        {
+            delete client;
+            client = NULL;
+        }
+    }
+};
+
+static bool parse_line(const std::string &line, RemoteCommand *cmd)
+{
+    std::vector<std::string> words;
+    split_command_line(line, words);
+
+    if (words.empty() || words[0].empty() || words[0][0] == '#')
+        return false;
+
+    cmd->command = words[0];
+    cmd->arguments.assign(words.begin()+1, words.end());
+    return true;
+}
+
+#ifndef _WIN32
+
+struct LineReader
+{
+    int fd;
+    bool eof;
+    std::string buf;
+
+    LineReader(int fd = -1) : fd(fd), eof(false) {}
+
+    bool ready(int timeout)
+    {
+        pollfd pfd = { fd, POLLIN, 0 };
+        return poll(&pfd, 1, timeout) > 0;
+    }
+
+    // Reads what is available, waiting for it first if block is set.
+    void fill(bool block)
+    {
+        if (eof || (!block && !ready(0)))
+            return;
+
+        char tmp[4096];
+        ssize_t cnt;
+        do {
+            cnt = read(fd, tmp, sizeof(tmp));
+        } while (cnt < 0 && errno == EINTR);
+
+        if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (cnt <= 0)
+            eof = true;
+        else
+            buf.append(tmp, cnt);
+    }
+
+    bool hasLine() { return buf.find('\n') != std::string::npos || (eof && !buf.empty()); }
+
+    bool getLine(std::string *line)
+    {
+        size_t pos = buf.find('\n');
+        if (pos == std::string::npos)
+        {
+            if (!eof || buf.empty())
+                return false;
+            pos = buf.size();
+        }
+
+        line->assign(buf, 0, pos);
+        buf.erase(0, pos+1);
+
+        if (!line->empty() && (*line)[line->size()-1] == '\r')
+            line->erase(line->size()-1);
+        return true;
+    }
+};
+
+static int run_stdin(color_ostream &out)
+{
+    Session session(out);
+    if (!session.connect())
+        return 2;
+
+    LineReader in(0);
+    int status = 0;
+
+    for (;;)
+    {
+        while (!in.hasLine() && !in.eof)
+            in.fill(true);
+
+        // Take in whatever else has arrived meanwhile
+        while (!in.eof && in.buf.size() < MAX_LINE * 4 && in.ready(0))
+            in.fill(false);
+
+        std::vector<RemoteCommand> batch;
+        std::string line;
+        while (batch.size() < MAX_BATCH && in.getLine(&line))
+        {
+            RemoteCommand cmd;
+            if (parse_line(line, &cmd))
+                batch.push_back(cmd);
+        }
+
+        if (batch.empty())
+        {
+            if (in.eof && !in.hasLine())
+                break;
+            continue;
+        }
+
+        session.run(batch);
+        out.flush();
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            if (batch[i].result == CR_NOT_IMPLEMENTED)
+                out.printerr("%s is not a recognized command.\n", batch[i].command.c_str());
+
+            if (batch[i].result == CR_LINK_FAILURE)
+                status = 2;
+            else if (batch[i].result != CR_OK && status == 0)
+                status = 1;
+        }
+    }
+
+    return status;
+}
+
+static volatile sig_atomic_t quit_signal = 0;
+
+static void on_quit_signal(int)
+{
+    quit_signal = 1;
+}
+
+// Replies pile up to this size before a client's lines are left waiting
+static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+struct Peer
+{
+    int fd;
+    LineReader in;
+    std::string out;
+    bool broken;
+
+    // Lines are only taken while the client keeps reading the replies
+    bool accepting() { return !broken && out.size() < MAX_PENDING_OUTPUT; }
+    bool finished() { return broken || (in.eof && !in.hasLine() && out.empty()); }
+
+    // Writes what the socket takes without blocking.
+    void flush()
+    {
+        while (!broken && !out.empty())
+        {
+            ssize_t cnt = write(fd, out.data(), out.size());
+            if (cnt < 0 && errno == EINTR)
+                continue;
+            if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (cnt <= 0)
+                broken = true;
+            else
+                out.erase(0, cnt);
+        }
+    }
+};
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/*
+ * Every connection sends command lines and gets back, for each of them,
+ * the output followed by a line '## <result>' with the numeric
+ * command_result (0 is success). A batch takes one line from each
+ * connection in turn, so every client's lines run in the order they
+ * were sent and no client can crowd out the others.
+ */
+static int run_listen(color_ostream &out, const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        out.printerr("Socket path too long: %s\n", path);
+        return 2;
+    }
+
+    // Replace a socket left behind by an earlier run, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (listener < 0 ||
+        bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 16) != 0)
+    {
+        out.printerr("Could not listen on %s: %s\n", path, strerror(errno));
+        if (listener >= 0)
+            close(listener);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_quit_signal);
+    signal(SIGTERM, on_quit_signal);
+
+    Session session(out);
+    session.connect();
+
+    std::vector<Peer> peers;
+    size_t first_peer = 0;
+
+    while (!quit_signal)
+    {
+        // Don't wait if lines are left over from a full batch
+        int timeout = -1;
+        std::vector<pollfd> fds(1 + peers.size());
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < peers.size(); i++)
+        {
+            Peer &peer = peers[i];
+            fds[i+1].fd = peer.fd;
+            fds[i+1].events = 0;
+            if (!peer.in.eof && peer.accepting() && peer.in.buf.size() < MAX_LINE)
+                fds[i+1].events |= POLLIN;
+            if (!peer.out.empty())
+                fds[i+1].events |= POLLOUT;
+            if (peer.accepting() && peer.in.hasLine())
+                timeout = 0;
+        }
+
+        if (poll(&fds[0], fds.size(), timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            out.printerr("poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (size_t i = 0; i < peers.size(); i++)
+        {
+            Peer &peer = peers[i];
+            short revents = fds[i+1].revents;
+            if ((revents & (POLLIN | POLLHUP | POLLERR)) && (fds[i+1].events & POLLIN))
+                peer.in.fill(true);
+            if (revents & POLLOUT)
+                peer.flush();
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0 && set_nonblocking(fd))
+            {
+                Peer peer;
+                peer.fd = fd;
+                peer.in.fd = fd;
+                peer.broken = false;
+                peers.push_back(peer);
+            }
+            else if (fd >= 0)
+                close(fd);
+        }
+
+        // One batch over all connections, a line from each in turn
+        std::vector<RemoteCommand> batch;
+        std::vector<size_t> owners;
+        std::vector<buffered_color_ostream*> outputs;
+
+        for (bool progress = true; progress && batch.size() < MAX_BATCH; )
+        {
+            progress = false;
+            for (size_t k = 0; k < peers.size() && batch.size() < MAX_BATCH; k++)
+            {
+                size_t i = (first_peer + k) % peers.size();
+                if (!peers[i].accepting())
+                    continue;
+
+                // Skip comments and blank lines until a command turns up
+                std::string line;
+                RemoteCommand cmd;
+                bool found = false;
+                while (!found && peers[i].in.getLine(&line))
+                    found = parse_line(line, &cmd);
+                if (!found)
+                    continue;
+
+                outputs.push_back(new buffered_color_ostream());
+                cmd.out = outputs.back();
+                batch.push_back(cmd);
+                owners.push_back(i);
+                progress = true;
+            }
+        }
+
+        // The next batch starts with the connection after this one's first
+        if (!peers.empty())
+            first_peer = (first_peer + 1) % peers.size();
+
+        if (!batch.empty())
+            session.run(batch);
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            outputs[i]->flush();
+
+            Peer &peer = peers[owners[i]];
+            size_t start = peer.out.size();
+
+            auto &fragments = outputs[i]->fragments();
+            for (auto it = fragments.begin(); it != fragments.end(); ++it)
+                peer.out += it->second;
+            if (peer.out.size() > start && peer.out[peer.out.size()-1] != '\n')
+                peer.out += '\n';
+            peer.out += stl_sprintf("## %d\n", int(batch[i].result));
+
+            delete outputs[i];
+        }
+
+        for (size_t i = 0; i < peers.size(); i++)
+            peers[i].flush();
+
+        // Drop finished and broken connections, and ones sending junk
+        for (size_t i = peers.size(); i-- > 0; )
+        {
+            Peer &peer = peers[i];
+            bool overlong = peer.in.buf.size() >= MAX_LINE &&
+                            peer.in.buf.find('\n') == std::string::npos;
+            if (peer.finished() || overlong)
+            {
+                close(peer.fd);
+                peers.erase(peers.begin() + i);
+                if (first_peer > i)
+                    first_peer--;
+            }
+        }
+        if (first_peer >= peers.size())
+            first_peer = 0;
+    }
+
+    for (size_t i = 0; i < peers.size(); i++)
+        close(peers[i].fd);
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+#else
+
+static int run_stdin(color_ostream &out)
+{
+    Session session(out);
+    if (!session.connect())
+        return 2;
+
+    int status = 0;
+    std::string line;
+
+    while (std::getline(std::cin, line))
+    {
+        std::vector<RemoteCommand> batch(1);
+        if (!parse_line(line, &batch[0]))
+            continue;
+
+        session.run(batch);
+        out.flush();
+
+        if (batch[0].result == CR_NOT_IMPLEMENTED)
+            out.printerr("%s is not a recognized command.\n", batch[0].command.c_str());
+
+        if (batch[0].result == CR_LINK_FAILURE)
+            status = 2;
+        else if (batch[0].result != CR_OK && status == 0)
+            status = 1;
+    }
+
+    return status;
+}
+
+#endif
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: dfhack-run <command> [args...]\n"
+        "       dfhack-run --stdin\n"
+#ifndef _WIN32
+        "       dfhack-run --listen <socket path>\n"
+#endif
+    );
+}
+
 int main (int argc, char *argv[])
 {
     color_ostream_wrapper out(cout);
 
     if (argc <= 1)
     {
-        fprintf(stderr, "Usage: dfhack-run <command> [args...]\n");
+        usage();
         return 2;
     }
 
+    if (strcmp(argv[1], "--stdin") == 0)
+        return run_stdin(out);
+
+#ifndef _WIN32
+    if (strcmp(argv[1], "--listen") == 0)
+    {
+        if (argc != 3)
+        {
+            usage();
+            return 2;
+        }
+        return run_listen(out, argv[2]);
+    }
+#endif
+
     // Connect to DFHack
     RemoteClient client(&out);
     if (!client.connect())
@@ -0,0 +1,132 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Export.h"
+#include "DataDefs.h"
+
+namespace DFHack
+{
+    /**
+     * A chain of field names like 'pos.x', 'job.current_job.id' or
+     * 'flags1.dead', resolved once against the struct_identity field
+     * metadata into pointer offsets, so that the field can be found
+     * in any number of objects of that type without name lookups.
+     */
+    class DFHACK_EXPORT FieldPath
+    {
+    public:
+        enum Kind {
+            INVALID,
+            INT8, UINT8, INT16, UINT16, INT32, UINT32, INT64, UINT64,
+            FLOAT, DOUBLE, BOOL,
+            BIT,        // a bit or bit group of a bitfield
+            OTHER       // not a number: only readable from lua
+        };
+
+        FieldPath() { clear(); }
+
+        /// Resolves the path against the type; on failure returns false
+        /// and describes the problem in *error.
+        bool resolve(type_identity *type, const std::string &path, std::string *error);
+        void clear();
+
+        Kind getKind() const { return kind; }
+        bool isNumber() const { return kind != INVALID && kind != OTHER; }
+        bool isFloat() const { return kind == FLOAT || kind == DOUBLE; }
+
+        const struct_field_info *getField() const { return field; }
+        bitfield_identity *getBitfield() const { return bits; }
+        int getBit() const { return bit; }
+
+        /// Address of the final field (or of the bitfield holding the bit),
+        /// or NULL if a pointer along the path is NULL.
+        uint8_t *locate(void *obj) const
+        {
+            uint8_t *ptr = (uint8_t*)obj;
+            for (size_t i = 0; i < derefs.size(); i++)
+            {
+                ptr = *(uint8_t**)(ptr + derefs[i]);
+                if (!ptr)
+                    return NULL;
+            }
+            return ptr + offset;
+        }
+
+        /// Reads a number; false if not a number or a pointer was NULL.
+        bool readInt(void *obj, int64_t *out) const;
+        bool readFloat(void *obj, double *out) const;
+
+    private:
+        Kind kind;
+        std::vector<size_t> derefs;     // offsets of the pointers to follow
+        size_t offset;                  // of the final field, after them
+        const struct_field_info *field;
+        bitfield_identity *bits;
+        int bit, bit_size;
+    };
+
+    /**
+     * Columnar export of fields from a vector of objects reachable
+     * from df.global, e.g. 'world.units.active'.
+     *
+     * Paths are resolved on first use and cached. Everything here must
+     * be called with the core suspended.
+     */
+    namespace DataColumns
+    {
+        struct Column
+        {
+            std::string path;
+            bool is_float;
+            std::vector<int64_t> ints;      // if !is_float
+            std::vector<double> floats;     // if is_float
+            std::vector<int32_t> null_rows; // rows read as 0 due to NULL pointers
+        };
+
+        /// Finds a vector of pointers through df.global, and its item type.
+        DFHACK_EXPORT bool findVector(std::vector<void*> **vec, type_identity **item,
+                                      const std::string &path, std::string *error);
+
+        /// Resolves a path against the type, cached.
+        DFHACK_EXPORT const FieldPath *getFieldPath(type_identity *type, const std::string &path,
+                                                    std::string *error);
+
+        /**
+         * Reads the fields of rows [first, first+count) of the vector into
+         * one column each; every field must be a number. *total receives
+         * the length of the vector.
+         */
+        DFHACK_EXPORT bool fetch(std::vector<Column> *out, size_t *total,
+                                 const std::string &vector_path,
+                                 const std::vector<std::string> &fields,
+                                 std::string *error,
+                                 size_t first = 0, size_t count = size_t(-1));
+    }
+}
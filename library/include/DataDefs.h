@@ -297,8 +297,6 @@ namespace DFHack
     class MemoryPatcher;
 
     class DFHACK_EXPORT virtual_identity : public struct_identity {
-        static std::map<void*, virtual_identity*> known;
-
         const char *original_name;
 
         void *vtable_ptr;
@@ -154,6 +154,11 @@ namespace DFHack { namespace LuaWrapper {
 
     void push_adhoc_pointer(lua_State *state, void *ptr, type_identity *target);
 
+    /**
+     * Implementation of df.fetch(); needs DFHACK_TYPETABLE as upvalue 1.
+     */
+    int fetch_fields(lua_State *state);
+
     /**
      * Verify that the object is a DF ref with UPVAL_METATABLE.
      * If everything ok, extract the address.
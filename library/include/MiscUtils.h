@@ -314,6 +314,8 @@ inline bool static_add_to_map(CT *pmap, typename CT::key_type key, typename CT::
 DFHACK_EXPORT bool split_string(std::vector<std::string> *out,
                                 const std::string &str, const std::string &separator,
                                 bool squash_empty = false);
+// Splits a console command line into words, like Core::runCommand does.
+DFHACK_EXPORT void split_command_line(const std::string &input, std::vector<std::string> &output);
 DFHACK_EXPORT std::string join_strings(const std::string &separator, const std::vector<std::string> &items);
 
 DFHACK_EXPORT std::string toUpper(const std::string &str);
@@ -56,6 +56,9 @@ namespace DFHack
     namespace Lua {
         class Notification;
     }
+    namespace Profiler {
+        class Probe;
+    }
 
     // anon type, pretty much
     struct DFLibrary;
@@ -119,6 +122,31 @@ namespace DFHack
         command_hotkey_guard guard;
         std::string usage;
     };
+
+    /*
+     * Long-running plugin work can be split into slices that the plugin
+     * manager runs from the simulation thread, sharing a per-frame time
+     * budget. A task function does some work, checks budget.expired()
+     * every now and then, and returns as soon as it is: the function
+     * keeps its own cursor, and is called again with a fresh budget on
+     * a later frame. It returns true once the current pass is finished;
+     * the task is then idle until 'period' frames after the pass started.
+     */
+    class DFHACK_EXPORT TaskBudget
+    {
+    public:
+        TaskBudget(uint64_t deadline) : deadline(deadline) {}
+
+        // True once the slice should save its place and return.
+        bool expired() const;
+        uint64_t getDeadline() const { return deadline; }
+
+    private:
+        uint64_t deadline;
+    };
+
+    typedef bool (*task_function)(color_ostream &out, TaskBudget &budget);
+
     class Plugin
     {
         struct RefLock;
@@ -174,6 +202,7 @@ namespace DFHack
         DFLibrary * plugin_lib;
         PluginManager * parent;
         plugin_state state;
+        Profiler::Probe * update_probe;
 
         struct LuaCommand;
         std::map<std::string, LuaCommand*> lua_commands;
@@ -206,10 +235,15 @@ namespace DFHack
         PluginManager(Core * core);
         ~PluginManager();
         void init(Core* core);
-        void OnUpdate(color_ostream &out);
+        void OnUpdate(color_ostream &out, uint64_t frame_start);
         void OnStateChange(color_ostream &out, state_change_event event);
         void registerCommands( Plugin * p );
         void unregisterCommands( Plugin * p );
+        struct Task;
+        void removeTasks( Plugin * p );
+        void compactTasks();
+        bool runSlice(color_ostream &out, Task *task, uint64_t deadline);
+        void runTasks(color_ostream &out, uint64_t frame_start);
     // PUBLIC METHODS
     public:
         Plugin *getPluginByName (const std::string & name);
@@ -227,12 +261,27 @@ namespace DFHack
             return all_plugins.size();
         }
         command_result (*eval_ruby)(color_ostream &, const char*);
+
+        /// Registers a sliced task; must be called with the core suspended,
+        /// e.g. from plugin_init. Tasks are removed when their plugin unloads.
+        bool addTask(Plugin *owner, const std::string &name, task_function fn, int period = 1);
+        bool removeTask(Plugin *owner, const std::string &name);
+        /// Time in microseconds that DFHack may spend per frame before
+        /// the remaining tasks are deferred to the next one.
+        uint32_t getFrameBudget() { return frame_budget; }
+        void setFrameBudget(uint32_t usec) { frame_budget = usec; }
+        void listTasks(color_ostream &out);
     // DATA
     private:
         tthread::mutex * cmdlist_mutex;
         std::map <std::string, Plugin *> belongs;
         std::vector <Plugin *> all_plugins;
         std::string plugin_path;
+        std::vector <Task *> tasks;
+        size_t task_cursor;
+        bool tasks_running;
+        uint32_t frame_budget;
+        uint32_t frame_count;
     };
 
     namespace Gui
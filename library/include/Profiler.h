@@ -0,0 +1,122 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#include "Pragma.h"
+#include "Export.h"
+#include "RemoteClient.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace DFHack
+{
+    class color_ostream;
+
+    /*
+     * Frame-time instrumentation for the per-frame hooks run by the core.
+     *
+     * Every probe owns a fixed-size ring buffer of the most recent samples.
+     * Samples are only ever recorded from the simulation thread, so writing
+     * is lock-free; readers on other threads (the console, RPC) copy the
+     * ring without stopping the writer, and may at worst see one slot that
+     * is being overwritten at the time.
+     */
+    namespace Profiler
+    {
+        struct Sample
+        {
+            uint64_t start;     // microseconds, see Profiler::now()
+            uint32_t duration;  // microseconds
+        };
+
+        class DFHACK_EXPORT Probe
+        {
+        public:
+            static const unsigned RING_SIZE = 1024;
+
+            Probe(const std::string &name);
+
+            const std::string &getName() const { return name; }
+
+            void record(uint64_t start, uint32_t duration);
+
+            // Copies the buffered samples, oldest first; returns the total
+            // number of samples ever recorded.
+            uint32_t snapshot(std::vector<Sample> *out) const;
+
+            void reset();
+
+        private:
+            std::string name;
+            volatile uint32_t count;   // word-sized, so readers never see it torn
+            Sample ring[RING_SIZE];
+        };
+
+        struct Stats
+        {
+            std::string name;
+            uint32_t calls;     // since the last reset
+            size_t samples;     // number of samples the percentiles are based on
+            uint32_t p50, p99, max;
+            double mean;
+        };
+
+        // Monotonic time in microseconds.
+        DFHACK_EXPORT uint64_t now();
+
+        DFHACK_EXPORT bool isEnabled();
+        DFHACK_EXPORT void setEnabled(bool enable);
+
+        // Finds or creates the named probe. Probes are never destroyed,
+        // so the pointer may be cached by the caller.
+        DFHACK_EXPORT Probe *getProbe(const std::string &name);
+
+        DFHACK_EXPORT void reset();
+        DFHACK_EXPORT void getStats(std::vector<Stats> *out);
+
+        // Writes the buffered samples in the Chrome trace event format
+        // (load in chrome://tracing).
+        DFHACK_EXPORT bool writeChromeTrace(const std::string &path, std::string *error = NULL);
+
+        // Implements the 'profile' console command.
+        DFHACK_EXPORT command_result runCommand(color_ostream &out, std::vector<std::string> &parameters);
+
+        /*
+         * Times the enclosing block into a probe, if profiling is enabled.
+         */
+        class Scope
+        {
+            Probe *probe;
+            uint64_t start;
+        public:
+            Scope(Probe *probe_) : probe(isEnabled() ? probe_ : NULL), start(0) {
+                if (probe) start = now();
+            }
+            ~Scope() {
+                if (probe) probe->record(start, uint32_t(now() - start));
+            }
+        };
+    }
+}
@@ -54,7 +54,10 @@ namespace  DFHack
         RPC_REPLY_RESULT = -1,
         RPC_REPLY_FAIL = -2,
         RPC_REPLY_TEXT = -3,
-        RPC_REQUEST_QUIT = -4
+        RPC_REQUEST_QUIT = -4,
+        RPC_REPLY_PART = -5,
+        RPC_REQUEST_ACK = -6,
+        RPC_REQUEST_CANCEL = -7
     };
 
     struct RPCHandshakeHeader {
@@ -63,10 +66,15 @@ namespace  DFHack
 
         static const char REQUEST_MAGIC[9];
         static const char RESPONSE_MAGIC[9];
+
+        // Highest protocol version implemented on this side
+        static const int CURRENT_VERSION = 2;
     };
 
     struct RPCMessageHeader {
         static const int MAX_MESSAGE_SIZE = 8*1048576;
+        // Number of streamed parts the server may send ahead of the acknowledgements
+        static const int STREAM_WINDOW = 16;
 
         int16_t id;
         int32_t size;
@@ -78,7 +86,8 @@ namespace  DFHack
      *
      *   Client initiates connection by sending the handshake
      *   request header. The server responds with the response
-     *   magic. Currently both versions must be 1.
+     *   magic, and the lower of the two protocol versions. Version
+     *   2 adds streamed replies; otherwise both versions are the same.
      *
      * 2. Interaction
      *
@@ -102,6 +111,26 @@ namespace  DFHack
      *   of the function if it succeeded, or RPC_REPLY_FAIL with the
      *   error code if it did not.
      *
+     *   Functions that stream their reply (version 2 and up) also
+     *   send any number of RPC_REPLY_PART messages before the result,
+     *   each holding a serialized part of the output; the client may
+     *   handle them one by one, or merge them into one message. The
+     *   client acknowledges the parts it has consumed by sending an
+     *   RPC_REQUEST_ACK header with the total count in the size field,
+     *   and the server stops to wait for one whenever it gets
+     *   STREAM_WINDOW parts ahead. An RPC_REQUEST_CANCEL header asks
+     *   the server to stop streaming; the rest of the reply still
+     *   follows as usual, and stray acknowledgements received between
+     *   calls are ignored. Version 1 clients get all parts merged into
+     *   the final result instead.
+     *
+     *   The client does not have to wait for a reply before sending
+     *   the next call. The server reads ahead up to 64 pending calls,
+     *   executes them in order, and replies in the same order; calls
+     *   that need the core suspended may be executed together in one
+     *   suspension. Pipelining clients must keep reading replies while
+     *   they send, or both sides may block on full socket buffers.
+     *
      * 3. Disconnect
      *
      *   The client terminates the connection by sending an
@@ -149,6 +178,9 @@ namespace  DFHack
 
     class DFHACK_EXPORT RemoteFunctionBase : public RPCFunctionBase {
     public:
+        // Receives the parts of a streamed reply; return false to cancel the rest.
+        typedef bool (*part_function)(void *data, message_type *part);
+
         bool bind(RemoteClient *client, const std::string &name,
                   const std::string &proto = std::string());
         bool bind(color_ostream &out,
@@ -165,7 +197,17 @@ namespace  DFHack
         {}
 
         inline color_ostream &default_ostream();
-        command_result execute(color_ostream &out, const message_type *input, message_type *output);
+        command_result execute(color_ostream &out, const message_type *input, message_type *output,
+                               part_function on_part = NULL, void *data = NULL);
+        // The two halves of execute(), for pipelined calls
+        command_result send(color_ostream &out, const message_type *input);
+        command_result receive(color_ostream &out, message_type *output,
+                               part_function on_part = NULL, void *data = NULL);
+
+        template<class Out, class F>
+        static bool call_part_function(void *data, message_type *part) {
+            return (*(F*)data)(static_cast<Out*>(part));
+        }
 
         std::string name, proto;
         RemoteClient *p_client;
@@ -196,6 +238,34 @@ namespace  DFHack
         command_result operator() (color_ostream &stream, const In *input, Out *output) {
             return RemoteFunctionBase::execute(stream, input, output);
         }
+
+        // Calls fn(part) for every part of a streamed reply as soon as it
+        // arrives, instead of merging them; the final result goes to out().
+        template<class F>
+        command_result stream(color_ostream &stream, const In *input, F &fn) {
+            return RemoteFunctionBase::execute(stream, input, out(), &call_part_function<Out,F>, &fn);
+        }
+        template<class F>
+        command_result stream(const In *input, F &fn) {
+            return p_client ? stream(default_ostream(), input, fn) : CR_NOT_IMPLEMENTED;
+        }
+
+        // Pipelining: any number of calls, to any functions, may be sent
+        // before reading the replies. Replies come back in the order the
+        // calls were sent, so receive() must be called in the same order,
+        // once per send(). The input is serialized by send() itself.
+        command_result send(color_ostream &stream, const In *input) {
+            return RemoteFunctionBase::send(stream, input);
+        }
+        command_result send(const In *input) {
+            return p_client ? send(default_ostream(), input) : CR_NOT_IMPLEMENTED;
+        }
+        command_result receive(color_ostream &stream, Out *output) {
+            return RemoteFunctionBase::receive(stream, output);
+        }
+        command_result receive(Out *output) {
+            return p_client ? receive(default_ostream(), output) : CR_NOT_IMPLEMENTED;
+        }
     };
 
     template<typename In>
@@ -220,6 +290,30 @@ namespace  DFHack
         command_result operator() (color_ostream &stream, const In *input) {
             return RemoteFunctionBase::execute(stream, input, out());
         }
+
+        command_result send(color_ostream &stream, const In *input) {
+            return RemoteFunctionBase::send(stream, input);
+        }
+        command_result send(const In *input) {
+            return p_client ? send(default_ostream(), input) : CR_NOT_IMPLEMENTED;
+        }
+        command_result receive(color_ostream &stream) {
+            return RemoteFunctionBase::receive(stream, out());
+        }
+        command_result receive() {
+            return p_client ? receive(default_ostream()) : CR_NOT_IMPLEMENTED;
+        }
+    };
+
+    // One command of RemoteClient::run_command_list
+    struct RemoteCommand
+    {
+        std::string command;
+        std::vector<std::string> arguments;
+        color_ostream *out;         // gets the output; NULL for the default output
+        command_result result;
+
+        RemoteCommand() : out(NULL), result(CR_NOT_IMPLEMENTED) {}
     };
 
     class DFHACK_EXPORT RemoteClient
@@ -235,6 +329,9 @@ namespace  DFHack
 
         static int GetDefaultPort();
 
+        // Protocol version agreed on with the server.
+        int getProtocolVersion() { return protocol_version; }
+
         color_ostream &default_output() { return *p_default_output; };
 
         bool connect(int port = -1);
@@ -246,6 +343,11 @@ namespace  DFHack
         command_result run_command(color_ostream &out, const std::string &cmd,
                                    const std::vector<std::string> &args);
 
+        // Runs the commands in order with one round trip, and sets their
+        // results; returns CR_OK unless the connection failed. Servers
+        // without RunCommandList get pipelined RunCommand calls instead.
+        command_result run_command_list(std::vector<RemoteCommand> &commands);
+
         // For executing multiple calls in rapid succession.
         // Best used via RemoteSuspender.
         int suspend_game();
@@ -253,12 +355,17 @@ namespace  DFHack
 
     private:
         bool active, delete_output;
+        int protocol_version;
         CActiveSocket *socket;
         color_ostream *p_default_output;
 
         RemoteFunction<dfproto::CoreBindRequest,dfproto::CoreBindReply> bind_call;
         RemoteFunction<dfproto::CoreRunCommandRequest> runcmd_call;
 
+        bool runcmdlist_bound;
+        RemoteFunction<dfproto::CoreRunCommandListRequest,
+                       dfproto::CoreRunCommandListReply> runcmdlist_call;
+
         bool suspend_ready;
         RemoteFunction<EmptyMessage, IntMessage> suspend_call, resume_call;
     };
@@ -28,6 +28,8 @@ distribution.
 #include "RemoteClient.h"
 #include "Core.h"
 
+#include <deque>
+
 class CPassiveSocket;
 class CActiveSocket;
 class CSimpleSocket;
@@ -46,7 +48,11 @@ namespace  DFHack
         SF_CALLED_ONCE = 1,
         // Don't automatically suspend the core around the call.
         // The function is supposed to manage locking itself.
-        SF_DONT_SUSPEND = 2
+        // Such calls never wait for the batches described below.
+        SF_DONT_SUSPEND = 2,
+        // The reply is sent in parts through a ServerStream.
+        // Always implies SF_DONT_SUSPEND.
+        SF_STREAM = 4
     };
 
     class DFHACK_EXPORT ServerFunctionBase : public RPCFunctionBase {
@@ -67,6 +73,8 @@ namespace  DFHack
         {}
         virtual ~ServerFunctionBase() {}
 
+        ServerConnection *connection();
+
         RPCService *owner;
         int16_t id;
     };
@@ -106,6 +114,72 @@ namespace  DFHack
         function_type fptr;
     };
 
+    /*
+     * The sending end of a streamed reply.
+     *
+     * Each write() goes out as a separate RPC_REPLY_PART message, so
+     * the reply is never held in memory as a whole and the client can
+     * use the first parts while the rest are still being produced.
+     * write() blocks while the client is STREAM_WINDOW parts behind,
+     * so stream handlers are never run with the core suspended; they
+     * should hold a CoreSuspender only while gathering each part.
+     */
+    class DFHACK_EXPORT ServerStreamBase {
+    public:
+        typedef RPCFunctionBase::message_type message_type;
+
+        // Returns false once the client cancelled the call or the
+        // connection failed; the handler should just return then.
+        bool write(const message_type *part);
+
+        bool isCancelled() { return cancelled; }
+        int getPartCount() { return parts; }
+
+    protected:
+        ServerStreamBase(ServerConnection *connection, message_type *reply)
+            : connection(connection), reply(reply), parts(0), acked(0), cancelled(false)
+        {}
+
+    private:
+        bool waitForWindow();
+
+        ServerConnection *connection;
+        message_type *reply;
+        int parts, acked;
+        bool cancelled;
+    };
+
+    template<typename Out>
+    class ServerStream : public ServerStreamBase {
+    public:
+        ServerStream(ServerConnection *connection, Out *reply)
+            : ServerStreamBase(connection, reply) {}
+
+        bool write(const Out &part) { return ServerStreamBase::write(&part); }
+    };
+
+    template<typename In, typename Out>
+    class StreamServerFunction : public ServerFunctionBase {
+    public:
+        typedef command_result (*function_type)(color_ostream &out, const In *input, ServerStream<Out> *output);
+
+        In *in() { return static_cast<In*>(RPCFunctionBase::in()); }
+        Out *out() { return static_cast<Out*>(RPCFunctionBase::out()); }
+
+        StreamServerFunction(RPCService *owner, const char *name, int flags, function_type fptr)
+            : ServerFunctionBase(&In::default_instance(), &Out::default_instance(), owner, name,
+                                 flags | SF_STREAM | SF_DONT_SUSPEND),
+              fptr(fptr) {}
+
+        virtual command_result execute(color_ostream &stream) {
+            ServerStream<Out> output(connection(), out());
+            return fptr(stream, in(), &output);
+        }
+
+    private:
+        function_type fptr;
+    };
+
     template<typename Svc, typename In, typename Out>
     class ServerMethod : public ServerFunctionBase {
     public:
@@ -147,6 +221,7 @@ namespace  DFHack
 
     class DFHACK_EXPORT RPCService {
         friend class ServerConnection;
+        friend class ServerFunctionBase;
         friend class Plugin;
 
         std::vector<ServerFunctionBase*> functions;
@@ -183,6 +258,18 @@ namespace  DFHack
             functions.push_back(new VoidServerFunction<In>(this, name, flags, fptr));
         }
 
+        // Registers a function that sends its reply in parts. Clients that
+        // predate streaming receive all the parts merged into one result.
+        template<typename In, typename Out>
+        void addStreamFunction(
+            const char *name,
+            command_result (*fptr)(color_ostream &out, const In *input, ServerStream<Out> *output),
+            int flags = 0
+        ) {
+            assert(!owner);
+            functions.push_back(new StreamServerFunction<In,Out>(this, name, flags, fptr));
+        }
+
     protected:
         ServerConnection *connection() { return owner; }
 
@@ -207,7 +294,24 @@ namespace  DFHack
         }
     };
 
+    /*
+     * Each connection is served by its own thread, and reads ahead
+     * whatever calls a pipelining client has already sent. A run of
+     * calls that need the core suspended is not executed by suspending
+     * once per call: the calls of all connections go into one queue,
+     * and one of the waiting threads suspends the core and executes
+     * the whole queue in that window, up to a time limit per frame.
+     * Replies are always sent in the order the calls were received.
+     */
     class ServerConnection {
+        friend class ServerStreamBase;
+
+        struct Request {
+            RPCMessageHeader header;
+            std::vector<uint8_t> data;
+        };
+        struct Call;
+
         class connection_ostream : public buffered_color_ostream {
             ServerConnection *owner;
 
@@ -219,11 +323,25 @@ namespace  DFHack
         };
 
         bool in_error;
+        int protocol_version;
         CActiveSocket *socket;
         connection_ostream stream;
 
         std::vector<ServerFunctionBase*> functions;
 
+        // Received, but not yet executed
+        std::deque<Request> backlog;
+        static const size_t MAX_PIPELINE = 64;
+
+        bool readRequest();
+        bool queueRequest(const RPCMessageHeader &header);
+        bool hasPendingInput();
+
+        void takeCalls(std::vector<Call> &calls);
+        void executeCalls(std::vector<Call> &calls);
+        bool sendReply(color_ostream &out, Call &call);
+        bool sendText(const std::list<buffered_color_ostream::fragment_type> &fragments);
+
         CoreService *core_service;
         std::map<std::string, RPCService*> plugin_services;
 
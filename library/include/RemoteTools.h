@@ -140,6 +140,9 @@ namespace DFHack
                                   dfproto::CoreBindReply *out);
         command_result RunCommand(color_ostream &stream,
                                   const dfproto::CoreRunCommandRequest *in);
+        command_result RunCommandList(color_ostream &stream,
+                                      const dfproto::CoreRunCommandListRequest *in,
+                                      dfproto::CoreRunCommandListReply *out);
 
         // For batching
         command_result CoreSuspend(color_ostream &stream, const EmptyMessage*, IntMessage *cnt);
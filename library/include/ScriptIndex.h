@@ -0,0 +1,75 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#pragma once
+
+#include <string>
+#include <map>
+
+#include "Export.h"
+
+namespace DFHack
+{
+    /**
+     * In-memory index of hack/scripts: which names resolve to a lua or
+     * ruby script, and the help line of each.
+     *
+     * The tree is listed once on first use. After that, the directories
+     * are stat()ed at most once per second, and only the ones whose mtime
+     * changed are listed again; help lines are reread only when the file
+     * mtime or size changes. Safe to call from any thread.
+     */
+    namespace ScriptIndex
+    {
+        enum Type
+        {
+            NONE,
+            LUA,
+            RUBY
+        };
+
+        struct Stats
+        {
+            size_t scripts, dirs;
+            size_t rescans;     // directory listings since the first
+            size_t help_reads;  // files opened to read a help line
+        };
+
+        /// The kind of script a command name refers to, preferring lua.
+        /// Ruby scripts are skipped unless with_ruby is set.
+        DFHACK_EXPORT Type find(const std::string &name, bool with_ruby, std::string *path = NULL);
+
+        /// The first line of the script, without its comment prefix.
+        DFHACK_EXPORT bool getHelp(const std::string &name, bool with_ruby, std::string *help);
+
+        /// Adds name -> help to pset for every script; subdirectories are
+        /// only included with all set.
+        DFHACK_EXPORT void list(std::map<std::string, std::string> &pset, bool all, bool with_ruby);
+
+        /// Rechecks everything on the next call, regardless of the interval.
+        DFHACK_EXPORT void invalidate();
+        DFHACK_EXPORT void getStats(Stats *out);
+    }
+}
@@ -0,0 +1,349 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#include "Pragma.h"
+#include "Export.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace DFHack
+{
+    // Identifies one entry of a TimingWheel; goes stale once the entry fires or is cancelled.
+    struct TimingWheelHandle
+    {
+        int32_t index;
+        uint32_t serial;
+
+        TimingWheelHandle() : index(-1), serial(0) {}
+        TimingWheelHandle(int32_t index, uint32_t serial) : index(index), serial(serial) {}
+
+        bool isValid() const { return index >= 0; }
+        bool operator== (const TimingWheelHandle &other) const {
+            return index == other.index && serial == other.serial;
+        }
+        bool operator!= (const TimingWheelHandle &other) const { return !(*this == other); }
+    };
+
+    /*
+     * Hierarchical timing wheel over a 32-bit time counter.
+     *
+     * Four levels of 256 slots each; an entry lives in the level of the
+     * highest byte in which its due time differs from the current time,
+     * and is cascaded down one level whenever the current time crosses
+     * into its slot. Scheduling and cancelling are O(1); advancing costs
+     * O(1) per elapsed time unit plus the entries that become due, and
+     * empty stretches of the wheel are skipped over entirely.
+     *
+     * Due entries are moved to a ready queue by advance() and handed out
+     * one by one by popReady(), so callbacks are free to schedule or
+     * cancel other entries (including ones already in the ready queue).
+     * Recurring entries are re-armed by popReady() before it returns.
+     */
+    template<class T>
+    class TimingWheel
+    {
+    public:
+        typedef TimingWheelHandle Handle;
+
+        explicit TimingWheel(uint32_t now = 0) : current(now), wheel_count(0), live_count(0), free_head(-1)
+        {
+            for (int i = 0; i < NUM_LISTS; i++)
+                lists[i].head = lists[i].tail = -1;
+            for (int i = 0; i < LEVELS; i++)
+                level_count[i] = 0;
+        }
+
+        uint32_t now() const { return current; }
+
+        // Number of live entries, including the ones waiting in the ready queue.
+        size_t size() const { return live_count; }
+        bool empty() const { return live_count == 0; }
+
+        // Drops every entry and restarts the wheel at the given time.
+        void clear(uint32_t now = 0)
+        {
+            for (size_t i = 0; i < nodes.size(); i++)
+            {
+                if (nodes[i].list >= 0)
+                    release((int32_t)i);
+            }
+            current = now;
+        }
+
+        // Arms an entry due at the absolute time 'when'; entries due at
+        // or before now() go straight to the ready queue. A non-zero
+        // period makes the entry recur until it is cancelled.
+        Handle schedule(uint32_t when, const T &value, uint32_t period = 0)
+        {
+            int32_t idx = allocate();
+            Node &node = nodes[idx];
+            node.value = value;
+            node.when = when;
+            node.period = period;
+            place(idx);
+            return Handle(idx, node.serial);
+        }
+
+        bool isScheduled(const Handle &handle) const
+        {
+            return handle.index >= 0 && size_t(handle.index) < nodes.size() &&
+                   nodes[handle.index].serial == handle.serial &&
+                   nodes[handle.index].list >= 0;
+        }
+
+        // Returns the payload of a live entry, or NULL.
+        T *get(const Handle &handle)
+        {
+            return isScheduled(handle) ? &nodes[handle.index].value : NULL;
+        }
+
+        bool cancel(const Handle &handle)
+        {
+            if (!isScheduled(handle))
+                return false;
+            release(handle.index);
+            return true;
+        }
+
+        // Cancels every entry whose payload satisfies the predicate.
+        template<class Pred>
+        size_t cancelIf(Pred pred)
+        {
+            size_t count = 0;
+            for (size_t i = 0; i < nodes.size(); i++)
+            {
+                if (nodes[i].list >= 0 && pred(nodes[i].value))
+                {
+                    release((int32_t)i);
+                    count++;
+                }
+            }
+            return count;
+        }
+
+        // Moves the current time forward, queueing everything due at or before 'to'.
+        void advance(uint32_t to)
+        {
+            while (current < to)
+            {
+                if (wheel_count == 0)
+                {
+                    current = to;
+                    break;
+                }
+
+                // Jump to the last time unit before the next boundary that
+                // has work to do; all the slots in between are empty.
+                uint32_t skip_mask = 0;
+                for (int level = 0; level < LEVELS-1 && level_count[level] == 0; level++)
+                    skip_mask = (skip_mask << BITS) | SLOT_MASK;
+
+                uint32_t next = current | skip_mask;
+                if (next > current)
+                {
+                    current = (next < to) ? next : to;
+                    continue;
+                }
+
+                tick();
+            }
+        }
+
+        // Pops the next due entry; returns false when nothing is due.
+        bool popReady(T *value, Handle *handle = NULL)
+        {
+            List &ready = lists[READY_LIST];
+            int32_t idx = ready.head;
+            if (idx < 0)
+                return false;
+
+            Node &node = nodes[idx];
+            *value = node.value;
+            if (handle)
+                *handle = Handle(idx, node.serial);
+
+            if (node.period > 0)
+            {
+                // Recurring: keep the cadence, but never fire twice for one advance.
+                unlink(idx);
+                uint32_t when = node.when + node.period;
+                node.when = (when > current) ? when : current + node.period;
+                place(idx);
+            }
+            else
+                release(idx);
+
+            return true;
+        }
+
+    private:
+        static const int BITS = 8;
+        static const int SLOTS = 1 << BITS;
+        static const uint32_t SLOT_MASK = SLOTS - 1;
+        static const int LEVELS = 4;
+        static const int READY_LIST = LEVELS * SLOTS;
+        static const int NUM_LISTS = READY_LIST + 1;
+
+        struct Node
+        {
+            T value;
+            uint32_t when;
+            uint32_t period;
+            uint32_t serial;
+            int32_t list;       // owning list, or -1 if free
+            int32_t prev, next; // intrusive links; next doubles as the free list
+        };
+
+        struct List
+        {
+            int32_t head, tail;
+        };
+
+        uint32_t current;
+        size_t wheel_count;
+        size_t live_count;
+        size_t level_count[LEVELS];
+        int32_t free_head;
+        std::vector<Node> nodes;
+        List lists[NUM_LISTS];
+
+        int32_t allocate()
+        {
+            int32_t idx = free_head;
+            if (idx >= 0)
+                free_head = nodes[idx].next;
+            else
+            {
+                idx = (int32_t)nodes.size();
+                nodes.push_back(Node());
+                nodes[idx].serial = 0;
+            }
+            nodes[idx].list = -1;
+            live_count++;
+            return idx;
+        }
+
+        void release(int32_t idx)
+        {
+            unlink(idx);
+            Node &node = nodes[idx];
+            node.value = T();
+            node.serial++;
+            node.list = -1;
+            node.next = free_head;
+            free_head = idx;
+            live_count--;
+        }
+
+        void link(int32_t idx, int32_t list_id)
+        {
+            Node &node = nodes[idx];
+            List &list = lists[list_id];
+            node.list = list_id;
+            node.next = -1;
+            node.prev = list.tail;
+            if (list.tail >= 0)
+                nodes[list.tail].next = idx;
+            else
+                list.head = idx;
+            list.tail = idx;
+
+            if (list_id != READY_LIST)
+            {
+                wheel_count++;
+                level_count[list_id / SLOTS]++;
+            }
+        }
+
+        void unlink(int32_t idx)
+        {
+            Node &node = nodes[idx];
+            if (node.list < 0)
+                return;
+            List &list = lists[node.list];
+            if (node.prev >= 0)
+                nodes[node.prev].next = node.next;
+            else
+                list.head = node.next;
+            if (node.next >= 0)
+                nodes[node.next].prev = node.prev;
+            else
+                list.tail = node.prev;
+
+            if (node.list != READY_LIST)
+            {
+                wheel_count--;
+                level_count[node.list / SLOTS]--;
+            }
+            node.list = -1;
+        }
+
+        void place(int32_t idx)
+        {
+            uint32_t when = nodes[idx].when;
+            if (when <= current)
+            {
+                link(idx, READY_LIST);
+                return;
+            }
+
+            // Level of the highest byte in which the due time differs from now
+            uint32_t diff = when ^ current;
+            int level = 0;
+            while (level < LEVELS-1 && (diff >> (BITS*(level+1))) != 0)
+                level++;
+
+            link(idx, level*SLOTS + ((when >> (BITS*level)) & SLOT_MASK));
+        }
+
+        void cascade(int level, uint32_t slot)
+        {
+            List &list = lists[level*SLOTS + slot];
+            int32_t idx = list.head;
+            while (idx >= 0)
+            {
+                int32_t next = nodes[idx].next;
+                unlink(idx);
+                place(idx);
+                idx = next;
+            }
+        }
+
+        void tick()
+        {
+            current++;
+
+            // Crossing a boundary at some level pulls its slot down, highest level first
+            int top = 0;
+            while (top < LEVELS-1 && (current & ((1u << (BITS*(top+1))) - 1)) == 0)
+                top++;
+            for (int level = top; level > 0; level--)
+                cascade(level, (current >> (BITS*level)) & SLOT_MASK);
+
+            cascade(0, current & SLOT_MASK);
+        }
+    };
+}
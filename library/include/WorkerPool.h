@@ -0,0 +1,91 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#include "Pragma.h"
+#include "Export.h"
+#include <stddef.h>
+#include <vector>
+
+namespace DFHack
+{
+    /*
+     * Fork-join loops for CPU-bound work, such as scanning the map while
+     * the core is suspended.
+     *
+     * The index range is split evenly between the workers; a worker that
+     * runs out of work steals the back half of the largest range that is
+     * left, so uneven items (open sky next to dense rock) still keep all
+     * threads busy. The calling thread takes part as worker 0, and run()
+     * returns once every index has been processed.
+     *
+     * The other workers are threads that are started on first use and then
+     * kept waiting for the next call, so a small run costs a wakeup rather
+     * than thread creation. Only one run uses them at a time; a call made
+     * while another is in progress (including from inside a body) is done
+     * on the calling thread alone.
+     *
+     * The body must not throw, print to a console or touch shared mutable
+     * state; collect results per worker and merge them afterwards.
+     */
+    namespace WorkerPool
+    {
+        typedef void (*body_function)(void *data, size_t index, unsigned worker);
+
+        // Number of worker indices run() may hand out.
+        DFHACK_EXPORT unsigned getWorkerCount();
+        // 0 restores the default: the number of cores, up to 8.
+        DFHACK_EXPORT void setWorkerCount(unsigned count);
+
+        DFHACK_EXPORT void run(size_t count, body_function body, void *data);
+
+        template<class F>
+        void call_body(void *data, size_t index, unsigned worker)
+        {
+            (*(F*)data)(index, worker);
+        }
+
+        // Calls fn(index, worker) for each index in [0, count).
+        template<class F>
+        void run(size_t count, F &fn)
+        {
+            run(count, &call_body<F>, &fn);
+        }
+
+        /*
+         * One accumulator per worker, to be merged once run() returns.
+         */
+        template<class T>
+        class PerWorker
+        {
+            std::vector<T> items;
+        public:
+            PerWorker() : items(getWorkerCount()) {}
+            explicit PerWorker(const T &init) : items(getWorkerCount(), init) {}
+
+            T &operator[] (unsigned worker) { return items[worker]; }
+            size_t size() const { return items.size(); }
+        };
+    }
+}
@@ -0,0 +1,166 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#pragma once
+#include "Export.h"
+#include "Core.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * \defgroup grp_datastore Per-save key-value storage
+ * @ingroup grp_modules
+ */
+
+namespace DFHack
+{
+    /**
+     * Binary values keyed by strings, stored with the save in a file of
+     * their own next to the game files, for tools that keep more data
+     * than fits well in World::*PersistentData.
+     *
+     * Keys are kept sorted, so that a whole subtree like "workflow/" can
+     * be listed at once. Changes are grouped into transactions, and each
+     * committed transaction is appended to the file as one record: the
+     * cost of writing scales with what changed, not with what is stored.
+     * The file is rewritten in full only on load, when most of it turns
+     * out to be superseded.
+     *
+     * Records carry the game time of their commit. When a save is loaded,
+     * the ones newer than the save are skipped, i.e. the store goes back
+     * in time along with the world when the game is quit without saving;
+     * a marker appended to the file keeps them from coming back later.
+     *
+     * Everything here must be called with the core suspended, and only
+     * works while a world is loaded.
+     *
+     * \ingroup grp_datastore
+     */
+    namespace DataStore
+    {
+        DFHACK_EXPORT bool isLoaded();
+
+        DFHACK_EXPORT bool get(const std::string &key, std::string *value);
+        DFHACK_EXPORT bool has(const std::string &key);
+        /// Keys equal to the prefix or starting with prefix+"/", sorted;
+        /// an empty prefix lists everything.
+        DFHACK_EXPORT void list(std::vector<std::string> *keys, const std::string &prefix);
+
+        /// Single-change transactions.
+        DFHACK_EXPORT bool set(const std::string &key, const std::string &value);
+        DFHACK_EXPORT bool erase(const std::string &key);
+
+        /**
+         * A batch of changes that become visible and are written out
+         * together by commit(). Changes not committed by the time the
+         * object is destroyed are dropped.
+         */
+        class DFHACK_EXPORT Transaction
+        {
+        public:
+            Transaction() {}
+            ~Transaction() {}
+
+            void set(const std::string &key, const std::string &value);
+            void erase(const std::string &key);
+
+            /// Reads through the pending changes.
+            bool get(const std::string &key, std::string *value) const;
+
+            size_t size() const { return changes.size(); }
+            bool empty() const { return changes.empty(); }
+
+            bool commit();
+            void rollback() { changes.clear(); }
+
+        private:
+            Transaction(const Transaction&);
+            Transaction &operator= (const Transaction&);
+
+            // Either an erase or a set to value
+            struct Change
+            {
+                bool erase;
+                std::string value;
+            };
+            std::map<std::string, Change> changes;
+        };
+
+        struct Stats
+        {
+            size_t keys;
+            size_t bytes;       // keys and values in memory
+            size_t file_bytes;  // size of the file, including superseded and skipped records
+            size_t commits;     // records appended since the world was loaded
+        };
+
+        DFHACK_EXPORT void getStats(Stats *out);
+
+        /**
+         * Compact encoding for values: integers as variable length,
+         * signed ones zigzag-encoded, so small numbers take one byte.
+         */
+        class DFHACK_EXPORT BlobWriter
+        {
+        public:
+            explicit BlobWriter(std::string *out) : out(out) {}
+
+            void writeUInt(uint64_t val);
+            void writeInt(int64_t val) { writeUInt((uint64_t(val) << 1) ^ uint64_t(val >> 63)); }
+            void writeBool(bool val) { out->push_back(val ? 1 : 0); }
+            void writeDouble(double val);
+            void writeString(const std::string &val);
+
+        private:
+            std::string *out;
+        };
+
+        /// Reads what BlobWriter wrote; once a read fails, all further ones do.
+        class DFHACK_EXPORT BlobReader
+        {
+        public:
+            BlobReader(const std::string &data) : data(data), pos(0), failed(false) {}
+
+            bool readUInt(uint64_t *val);
+            bool readInt(int64_t *val);
+            bool readBool(bool *val);
+            bool readDouble(double *val);
+            bool readString(std::string *val);
+
+            bool atEnd() const { return pos >= data.size(); }
+            bool hasFailed() const { return failed; }
+
+        private:
+            const std::string &data;
+            size_t pos;
+            bool failed;
+        };
+
+        void onStateChange(color_ostream &out, state_change_event event);
+    }
+}
@@ -7,6 +7,7 @@
 #include "ColorText.h"
 #include "PluginManager.h"
 #include "Console.h"
+#include "TimingWheel.h"
 
 namespace DFHack {
     namespace EventManager {
@@ -25,17 +26,33 @@ namespace DFHack {
             };
         }
 
+        /*
+         * How an event is detected. SCAN rebuilds a full picture of the relevant
+         * world state on every check and diffs it against the previous one.
+         * INCREMENTAL keeps per-ID records with generation counters and only does
+         * real work for the objects that changed since the last check. Both
+         * report the same events; handlers may pick either per event type.
+         **/
+        namespace Backend {
+            enum Backend {
+                SCAN,
+                INCREMENTAL,
+                BACKEND_MAX
+            };
+        }
+
         struct EventHandler {
             void (*eventHandler)(color_ostream&, void*); //called when the event happens
             int32_t freq;
+            Backend::Backend backend;
 
-            EventHandler(void (*eventHandlerIn)(color_ostream&, void*), int32_t freqIn): eventHandler(eventHandlerIn), freq(freqIn) {
+            EventHandler(void (*eventHandlerIn)(color_ostream&, void*), int32_t freqIn, Backend::Backend backendIn = Backend::SCAN): eventHandler(eventHandlerIn), freq(freqIn), backend(backendIn) {
             }
 
-            bool operator==(EventHandler& handle) const {
+            bool operator==(const EventHandler& handle) const {
                 return eventHandler == handle.eventHandler && freq == handle.freq;
             }
-            bool operator!=(EventHandler& handle) const {
+            bool operator!=(const EventHandler& handle) const {
                 return !( *this == handle);
             }
         };
@@ -48,8 +65,13 @@ namespace DFHack {
             }
         };
         
+        //stays valid until a one-shot timer fires or the timer is cancelled
+        typedef TimingWheelHandle TickHandle;
+
         DFHACK_EXPORT void registerListener(EventType::EventType e, EventHandler handler, Plugin* plugin);
-        DFHACK_EXPORT void registerTick(EventHandler handler, int32_t when, Plugin* plugin, bool absolute=false);
+        DFHACK_EXPORT TickHandle registerTick(EventHandler handler, int32_t when, Plugin* plugin, bool absolute=false);
+        DFHACK_EXPORT TickHandle registerRecurringTick(EventHandler handler, int32_t period, Plugin* plugin);
+        DFHACK_EXPORT bool cancelTick(TickHandle handle);
         DFHACK_EXPORT void unregister(EventType::EventType e, EventHandler handler, Plugin* plugin);
         DFHACK_EXPORT void unregisterAll(Plugin* plugin);
         void manageEvents(color_ostream& out);
@@ -0,0 +1,89 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#include "Export.h"
+#include "Core.h"
+#include "DataDefs.h"
+
+namespace df
+{
+    struct unit;
+    struct item;
+    struct building;
+}
+
+/**
+ * \defgroup grp_idindex Hashed lookup of units, items and buildings by id
+ * @ingroup grp_modules
+ */
+
+namespace DFHack
+{
+    /**
+     * Open-addressing hash tables from id to position in world->units.all,
+     * world->items.all and world->buildings.all, for code that looks up
+     * objects by id in a loop.
+     *
+     * The tables are not told about changes to the vectors. Every hit is
+     * checked against the vector, and a stale or missing entry falls back
+     * to the usual binary search and is patched with its result. A table
+     * is rebuilt when the vector outgrows it, or once too many entries
+     * were found stale, e.g. after objects were removed from the middle.
+     *
+     * Like df::unit::find() and the like, this must be called with the
+     * core suspended.
+     *
+     * \ingroup grp_idindex
+     */
+    namespace IdIndex
+    {
+        enum Kind
+        {
+            UNITS,
+            ITEMS,
+            BUILDINGS,
+            KIND_COUNT
+        };
+
+        struct Stats
+        {
+            size_t capacity, entries;
+            size_t hits, misses;    // misses fell back to a binary search
+            size_t rebuilds;
+        };
+
+        /// Position of the object in its world vector, or -1.
+        DFHACK_EXPORT int32_t findIndex(Kind kind, int32_t id);
+
+        DFHACK_EXPORT df::unit *findUnit(int32_t id);
+        DFHACK_EXPORT df::item *findItem(int32_t id);
+        DFHACK_EXPORT df::building *findBuilding(int32_t id);
+
+        DFHACK_EXPORT void getStats(Kind kind, Stats *out);
+        DFHACK_EXPORT void clear();
+
+        void onStateChange(color_ostream &out, state_change_event event);
+    }
+}
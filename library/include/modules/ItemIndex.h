@@ -0,0 +1,109 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#include "Export.h"
+#include "Core.h"
+#include "DataDefs.h"
+#include "df/item_type.h"
+#include "df/coord.h"
+
+#include <vector>
+
+namespace df
+{
+    struct item;
+    struct building;
+}
+
+/**
+ * \defgroup grp_itemindex Secondary indexes over the items in play
+ * @ingroup grp_modules
+ */
+
+namespace DFHack
+{
+    /**
+     * Secondary indexes over world->items.other[IN_PLAY], so that tools can
+     * look at the items of one type, one stockpile or one part of the map
+     * instead of sweeping every item in the game.
+     *
+     * The indexes are brought up to date on the first query of each frame.
+     * That compares the IN_PLAY vector with its copy from the last update:
+     * only created and destroyed items are added or dropped, and only the
+     * items whose flags, position or reference count differ get their
+     * container, stockpile and map cell looked up again. Changes made by
+     * the caller earlier in the same frame need update(true) to be seen.
+     *
+     * Everything here must be called with the core suspended. The find
+     * functions append to the output vector.
+     *
+     * \ingroup grp_itemindex
+     */
+    namespace ItemIndex
+    {
+        // Item flags with a list of their own
+        enum FlagList
+        {
+            MELT,       // designated for melting
+            DUMP,       // designated for dumping
+            FORBID,
+            FLAG_LIST_COUNT
+        };
+
+        struct Stats
+        {
+            size_t items;
+            size_t updates, full_diffs;
+            size_t changed;     // items reindexed by the last update
+            uint64_t last_time; // microseconds spent in the last update
+        };
+
+        /// Brings the indexes up to date, unless already done this frame.
+        DFHACK_EXPORT void update(bool force = false);
+        DFHACK_EXPORT void clear();
+        DFHACK_EXPORT void getStats(Stats *out);
+
+        /// Items of a type; subtype -1 matches any subtype.
+        DFHACK_EXPORT void findByType(std::vector<df::item*> *out,
+                                      df::item_type type, int16_t subtype = -1);
+        /// Items of a type and actual material; subtype -1 matches any subtype.
+        DFHACK_EXPORT void findByMaterial(std::vector<df::item*> *out,
+                                          df::item_type type, int16_t subtype,
+                                          int16_t mat_type, int32_t mat_index);
+        DFHACK_EXPORT void findFlagged(std::vector<df::item*> *out, FlagList list);
+
+        /// Items lying on the ground in a stockpile; with_contents also adds
+        /// everything inside them, recursively.
+        DFHACK_EXPORT void findInStockpile(std::vector<df::item*> *out,
+                                           df::building *stockpile, bool with_contents = false);
+        /// Items directly inside a container.
+        DFHACK_EXPORT void findInContainer(std::vector<df::item*> *out, df::item *container);
+        /// Items lying on the ground within the inclusive box.
+        DFHACK_EXPORT void findInBox(std::vector<df::item*> *out, df::coord min, df::coord max);
+
+        void onUpdate();
+        void onStateChange(color_ostream &out, state_change_event event);
+    }
+}
@@ -49,6 +49,65 @@ class DFHACK_EXPORT MapCache;
 
 class Block;
 
+/*
+ * Tiles changed since the last Write(), one bit per tile. Bit y of
+ * rows[x] stands for tile (x,y), so that a row of bits matches a row of
+ * the [x][y] block arrays, and Write() can copy runs of changed tiles.
+ */
+struct TileDirtyMask
+{
+    uint16_t rows[16];
+    uint16_t any_rows; // bit x is set if rows[x] is not 0
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+    bool empty() const { return any_rows == 0; }
+    void set(df::coord2d p) {
+        rows[p.x&15] |= uint16_t(1 << (p.y&15));
+        any_rows |= uint16_t(1 << (p.x&15));
+    }
+};
+
+/*
+ * The previous contents of the tiles that Block::Write() overwrote while
+ * the journal was attached to a MapCache, in the order they were written.
+ * undo() puts them back straight into the game's map blocks, newest
+ * first, so it still works after the cache is gone. Only the data that
+ * Write() copies is recorded; e.g. constructions and items are not.
+ */
+class DFHACK_EXPORT UndoJournal
+{
+public:
+    enum Field
+    {
+        DESIGNATION,
+        OCCUPANCY,
+        TEMPERATURE, // temperature_1 in the low half, temperature_2 in the high one
+        TILETYPE
+    };
+
+    struct Entry
+    {
+        df::coord pos;
+        uint8_t field;
+        uint32_t value;
+    };
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    void clear() { entries.clear(); }
+
+    /// Restores the recorded tiles and clears the journal; returns the
+    /// number of tiles restored. Caches that hold the changed blocks
+    /// are out of date afterwards. Needs the core suspended.
+    size_t undo();
+
+    // Safe to call from several Block::Write() at once
+    void append(const std::vector<Entry> &batch);
+
+private:
+    std::vector<Entry> entries;
+};
+
 class BlockInfo
 {
     Block *mblock;
@@ -179,7 +238,8 @@ public:
     bool setTemp1At(df::coord2d p, uint16_t temp)
     {
         if(!valid) return false;
-        dirty_temperatures = true;
+        dirty_temperatures.set(p);
+        if (!queued) queue();
         index_tile<uint16_t&>(temp1,p) = temp;
         return true;
     }
@@ -191,7 +251,8 @@ public:
     bool setTemp2At(df::coord2d p, uint16_t temp)
     {
         if(!valid) return false;
-        dirty_temperatures = true;
+        dirty_temperatures.set(p);
+        if (!queued) queue();
         index_tile<uint16_t&>(temp2,p) = temp;
         return true;
     }
@@ -203,7 +264,8 @@ public:
     bool setDesignationAt(df::coord2d p, df::tile_designation des)
     {
         if(!valid) return false;
-        dirty_designations = true;
+        dirty_designations.set(p);
+        if (!queued) queue();
         //printf("setting block %d/%d/%d , %d %d\n",x,y,z, p.x, p.y);
         index_tile<df::tile_designation&>(designation,p) = des;
         if(des.bits.dig && block)
@@ -218,7 +280,8 @@ public:
     bool setOccupancyAt(df::coord2d p, df::tile_occupancy des)
     {
         if(!valid) return false;
-        dirty_occupancies = true;
+        dirty_occupancies.set(p);
+        if (!queued) queue();
         index_tile<df::tile_occupancy&>(occupancy,p) = des;
         return true;
     }
@@ -234,7 +297,12 @@ public:
         return block ? block->flags : t_blockflags();
     }
 
+    // Copies the changed tiles back into the game
     bool Write();
+    bool isDirty() {
+        return dirty_tiles || !dirty_designations.empty() ||
+               !dirty_temperatures.empty() || !dirty_occupancies.empty();
+    }
 
     df::coord2d biomeRegionAt(df::coord2d p);
     int16_t GeoIndexAt(df::coord2d p);
@@ -261,10 +329,13 @@ private:
     int biomeIndexAt(df::coord2d p);
 
     bool valid;
-    bool dirty_designations:1;
-    bool dirty_tiles:1;
-    bool dirty_temperatures:1;
-    bool dirty_occupancies:1;
+    bool dirty_tiles;
+    bool queued;    // in the parent's list of blocks for WriteAll
+    void queue();
+
+    TileDirtyMask dirty_designations;
+    TileDirtyMask dirty_temperatures;
+    TileDirtyMask dirty_occupancies;
 
     DFCoord bcoord;
 
@@ -323,21 +394,44 @@ private:
     t_temperatures temp2;
 };
 
+/*
+ * How a MapCache keeps its blocks. The sparse store is a std::map that is
+ * filled in on demand, which is cheap to set up for edits touching a few
+ * blocks. The dense store is a flat index over the whole map, sized from
+ * Maps::getSize, with the blocks carved out of pooled chunks; use it for
+ * tools that walk large parts of the map.
+ */
+enum BlockStorage
+{
+    SPARSE_BLOCKS,
+    DENSE_BLOCKS
+};
+
 class DFHACK_EXPORT MapCache
 {
     public:
-    MapCache();
-    ~MapCache()
-    {
-        trash();
-    }
+    MapCache(BlockStorage storage = SPARSE_BLOCKS);
+    ~MapCache();
     bool isValid ()
     {
         return valid;
     }
+    BlockStorage getStorage() { return storage; }
 
     /// get the map block at a *block* coord. Block coord = tile coord / 16
-    Block *BlockAt(DFCoord blockcoord);
+    Block *BlockAt(DFCoord blockcoord)
+    {
+        if (dense_index &&
+            unsigned(blockcoord.x) < x_bmax &&
+            unsigned(blockcoord.y) < y_bmax &&
+            unsigned(blockcoord.z) < z_max)
+        {
+            Block *b = dense_index[(blockcoord.z*y_bmax + blockcoord.y)*x_bmax + blockcoord.x];
+            if (b)
+                return b;
+        }
+        return loadBlock(blockcoord);
+    }
     /// get the map block at a tile coord.
     Block *BlockAtTile(DFCoord coord) {
         return BlockAt(df::coord(coord.x>>4,coord.y>>4,coord.z));
@@ -482,25 +576,46 @@ class DFHACK_EXPORT MapCache
         return b ? b->removeItemOnGround(item) : false;
     }
 
-    bool WriteAll()
+    /*
+     * Calls fn(block, worker) for every valid block in the given inclusive
+     * range of block coordinates, spread over the WorkerPool threads.
+     * Blocks already in the cache are passed as they are; any other block
+     * is only loaded for the duration of the call, so the callback has to
+     * Write() it to keep changes. The callback must not use the cache or
+     * other blocks, and should collect its results in per-worker
+     * accumulators (see WorkerPool::PerWorker). Needs the core suspended.
+     */
+    typedef void (*block_function)(void *data, Block *block, unsigned worker);
+    void parallelForEachBlock(block_function fn, void *data, DFCoord bmin, DFCoord bmax);
+    void parallelForEachBlock(block_function fn, void *data)
     {
-        std::map<DFCoord, Block *>::iterator p;
-        for(p = blocks.begin(); p != blocks.end(); p++)
-        {
-            p->second->Write();
-        }
-        return true;
+        parallelForEachBlock(fn, data, DFCoord(0,0,0), DFCoord(x_bmax-1, y_bmax-1, z_max-1));
     }
-    void trash()
+
+    template<class F>
+    static void call_block_function(void *data, Block *block, unsigned worker)
     {
-        std::map<DFCoord, Block *>::iterator p;
-        for(p = blocks.begin(); p != blocks.end(); p++)
-        {
-            delete p->second;
-        }
-        blocks.clear();
+        (*(F*)data)(block, worker);
+    }
+    template<class F>
+    void parallelForEachBlock(F &fn, DFCoord bmin, DFCoord bmax)
+    {
+        parallelForEachBlock(&call_block_function<F>, &fn, bmin, bmax);
+    }
+    template<class F>
+    void parallelForEachBlock(F &fn)
+    {
+        parallelForEachBlock(&call_block_function<F>, &fn);
     }
 
+    /// Writes the blocks changed since the last call.
+    bool WriteAll();
+    void trash();
+
+    /// While a journal is set, Write() records the tiles it overwrites in it.
+    void setJournal(UndoJournal *journal) { this->journal = journal; }
+    UndoJournal *getJournal() { return journal; }
+
     uint32_t maxBlockX() { return x_bmax; }
     uint32_t maxBlockY() { return y_bmax; }
     uint32_t maxTileX() { return x_tmax; }
@@ -523,7 +638,23 @@ private:
     std::vector<int> default_stone;
     std::vector< std::vector <int16_t> > layer_mats;
     std::map<df::coord2d, df::world_region_details*> region_details;
-    std::map<DFCoord, Block *> blocks;
+
+    BlockStorage storage;
+    std::map<DFCoord, Block *> blocks;  // sparse storage
+    Block **dense_index;                // dense storage, x fastest, then y, then z
+    std::vector<void*> block_chunks;    // pooled memory for dense blocks
+    size_t chunk_used;
+    std::vector<Block*> block_list;     // every block loaded so far
+    std::vector<Block*> dirty_blocks;   // blocks changed since WriteAll
+    bool scanning;                      // inside parallelForEachBlock
+    bool unlisted_writes;               // blocks were changed during a scan
+    UndoJournal *journal;
+
+    Block *loadBlock(DFCoord blockcoord);
+    Block *findLoaded(DFCoord blockcoord);
+
+    struct BlockScan;
+    static void scanBlock(void *data, size_t index, unsigned worker);
 };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,293 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#include "Export.h"
+#include "DataDefs.h"
+#include "WorkerPool.h"
+#include "modules/Maps.h"
+#include "TileTypes.h"
+#include "df/unit_flags1.h"
+#include "df/unit_flags2.h"
+#include "df/unit_flags3.h"
+#include "df/cie_add_tag_mask1.h"
+#include "df/cie_add_tag_mask2.h"
+#include "df/item_flags.h"
+#include "df/item_type.h"
+#include "df/profession.h"
+
+#include <vector>
+
+/**
+ * \defgroup grp_snapshot Read-only copies of the game state
+ * @ingroup grp_modules
+ */
+
+namespace DFHack
+{
+    /**
+     * A compact, self-contained copy of the map blocks, units and items,
+     * for tools that only read the game state but take a long time to
+     * analyze or serialize it.
+     *
+     * capture() must be called with the core suspended, and does little
+     * more than copy arrays; everything after that can run once the
+     * CoreSuspender is released, while the game keeps going:
+     *
+     *     Snapshot snap;
+     *     {
+     *         CoreSuspender suspend;
+     *         snap.capture(Snapshot::MAP);
+     *     }
+     *     snap.parallelForEachBlock(scan);
+     *
+     * Nothing in a snapshot points back into game memory. Raws (material
+     * and creature definitions) are not copied, as they do not change
+     * while a world is loaded.
+     *
+     * \ingroup grp_snapshot
+     */
+    class DFHACK_EXPORT Snapshot
+    {
+    public:
+        /// Bumped whenever the layout of the copied data changes.
+        static const uint32_t FORMAT_VERSION = 1;
+
+        enum Part
+        {
+            MAP = 1,
+            UNITS = 2,
+            ITEMS = 4,
+            ALL = MAP | UNITS | ITEMS
+        };
+
+        struct PlantData
+        {
+            df::coord pos;
+            int16_t material;
+            bool is_shrub;
+        };
+
+        struct VeinData
+        {
+            int16_t inorganic_mat;
+            uint16_t tile_bitmask[16];
+
+            bool getassignment(df::coord2d p) const {
+                return (tile_bitmask[p.y&15] >> (p.x&15)) & 1;
+            }
+        };
+
+        struct ConstructionData
+        {
+            df::coord pos;
+            int16_t mat_type;
+            int32_t mat_index;
+            df::tiletype original_tile;
+        };
+
+        struct UnitData
+        {
+            int32_t id;
+            int16_t race;
+            int16_t caste;
+            int8_t sex;
+            int32_t civ_id;
+            int32_t hist_figure_id;
+            df::profession profession;
+            df::coord pos;
+            df::unit_flags1 flags1;
+            df::unit_flags2 flags2;
+            df::unit_flags3 flags3;
+            int32_t birth_year;
+            int32_t curse_year;
+            int32_t death_id;
+            df::cie_add_tag_mask1 curse_add_tags1;
+            df::cie_add_tag_mask2 curse_add_tags2;
+        };
+
+        struct ItemData
+        {
+            int32_t id;
+            df::item_type type;
+            int16_t subtype;
+            int16_t mat_type;
+            int32_t mat_index;
+            int16_t quality;
+            int32_t stack_size;
+            df::coord pos;
+            df::item_flags flags;
+        };
+
+        /**
+         * One map block, with the same read accessors as MapExtras::Block.
+         * Materials are those of the tile as it is now, i.e. a vein under
+         * a construction is not looked through.
+         */
+        class DFHACK_EXPORT Block
+        {
+        public:
+            df::coord getCoord() const { return pos; }
+            df::coord2d getRegionPos() const { return region_pos; }
+
+            df::tiletype tiletypeAt(df::coord2d p) const {
+                return tiletype[p.x&15][p.y&15];
+            }
+            df::tile_designation DesignationAt(df::coord2d p) const {
+                return designation[p.x&15][p.y&15];
+            }
+            df::tile_occupancy OccupancyAt(df::coord2d p) const {
+                return occupancy[p.x&15][p.y&15];
+            }
+
+            int16_t layerMaterialAt(df::coord2d p) const;
+            int16_t veinMaterialAt(df::coord2d p) const;
+
+            // The origin field of the returned features is always NULL.
+            bool GetGlobalFeature(t_feature *out) const;
+            bool GetLocalFeature(t_feature *out) const;
+
+            size_t getPlantCount() const { return plant_count; }
+            const PlantData &getPlant(size_t i) const;
+
+        private:
+            friend class Snapshot;
+
+            const Snapshot *owner;
+            df::coord pos;
+            df::coord2d region_pos;
+            biome_indices40d region_offset;
+            t_feature global_feature;
+            t_feature local_feature;
+            tiletypes40d tiletype;
+            designations40d designation;
+            occupancies40d occupancy;
+            // Ranges in the flat per-snapshot vectors
+            uint32_t vein_begin, vein_count;
+            uint32_t plant_begin, plant_count;
+        };
+
+        Snapshot();
+        ~Snapshot();
+
+        /// Copies the requested parts; the core must be suspended. Parts
+        /// that are unavailable (e.g. no map loaded) are left empty.
+        void capture(unsigned parts = ALL);
+        void clear();
+
+        unsigned getParts() const { return parts; }
+        /// Increases by one with every capture in the process.
+        uint32_t getSerial() const { return serial; }
+        uint32_t getYear() const { return year; }
+        uint32_t getTick() const { return tick; }
+        /// How long the game was held up by capture(), in microseconds.
+        uint64_t getCaptureTime() const { return capture_time; }
+        size_t getMemoryUsage() const;
+
+        /*
+         * Map
+         */
+
+        bool hasMap() const { return !blocks.empty(); }
+        /// Size of the map in blocks.
+        void getSize(uint32_t &x, uint32_t &y, uint32_t &z) const {
+            x = x_bmax; y = y_bmax; z = z_bmax;
+        }
+        df::coord getRegionOrigin() const { return region_origin; }
+
+        const Block *getBlock(int32_t x, int32_t y, int32_t z) const
+        {
+            if (x < 0 || y < 0 || z < 0 ||
+                uint32_t(x) >= x_bmax || uint32_t(y) >= y_bmax || uint32_t(z) >= z_bmax)
+                return NULL;
+            int32_t idx = block_index[(z*y_bmax + y)*x_bmax + x];
+            return idx >= 0 ? &blocks[idx] : NULL;
+        }
+        const Block *getBlockAbs(df::coord pos) const {
+            return getBlock(pos.x >> 4, pos.y >> 4, pos.z);
+        }
+        const std::vector<Block> &getBlocks() const { return blocks; }
+
+        const std::vector<ConstructionData> &getConstructions() const { return constructions; }
+
+        typedef void (*block_function)(void *data, const Block *block, unsigned worker);
+
+        // Calls fn on the existing blocks within the block coordinate box
+        // [bmin, bmax], spread over the WorkerPool.
+        void parallelForEachBlock(block_function fn, void *data, df::coord bmin, df::coord bmax) const;
+        void parallelForEachBlock(block_function fn, void *data) const;
+
+        template<class F>
+        static void call_block_function(void *data, const Block *block, unsigned worker)
+        {
+            (*(F*)data)(block, worker);
+        }
+
+        template<class F>
+        void parallelForEachBlock(F &fn) const
+        {
+            parallelForEachBlock(&call_block_function<F>, &fn);
+        }
+        template<class F>
+        void parallelForEachBlock(F &fn, df::coord bmin, df::coord bmax) const
+        {
+            parallelForEachBlock(&call_block_function<F>, &fn, bmin, bmax);
+        }
+
+        /*
+         * Units and items
+         */
+
+        const std::vector<UnitData> &getUnits() const { return units; }
+        const std::vector<ItemData> &getItems() const { return items; }
+
+    private:
+        Snapshot(const Snapshot&);
+        Snapshot &operator= (const Snapshot&);
+
+        void captureMap();
+        void captureUnits();
+        void captureItems();
+
+        struct BlockScan;
+        static void scanBlock(void *data, size_t index, unsigned worker);
+
+        unsigned parts;
+        uint32_t serial;
+        uint32_t year, tick;
+        uint64_t capture_time;
+
+        uint32_t x_bmax, y_bmax, z_bmax;
+        df::coord region_origin;
+        std::vector<int32_t> block_index;
+        std::vector<Block> blocks;
+        std::vector<VeinData> veins;
+        std::vector<PlantData> plants;
+        std::vector<ConstructionData> constructions;
+        std::vector< std::vector<int16_t> > layer_mats;
+
+        std::vector<UnitData> units;
+        std::vector<ItemData> items;
+    };
+}
@@ -343,7 +343,13 @@ function dfhack.run_script(name,...)
         env = {}
         setmetatable(env, { __index = base_env })
     end
-    local f,perr = loadfile(file, 't', env)
+    local f,perr
+    if internal.loadScript then
+        -- core context: reuse the compiled chunk while the file is unchanged
+        f,perr = internal.loadScript(file, env)
+    else
+        f,perr = loadfile(file, 't', env)
+    end
     if f == nil then
         error(perr)
     end
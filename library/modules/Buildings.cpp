@@ -27,6 +27,7 @@ distribution.
 
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <string>
@@ -90,6 +91,30 @@ struct CoordHash {
 
 static unordered_map<df::coord, int32_t, CoordHash> locationToBuilding;
 
+/*
+ * Spatial index: every building, civzones included, is listed in each
+ * map block its bounding box overlaps, in the order of buildings.all.
+ *
+ * It is checked against buildings.all on the first lookup of each frame,
+ * and rebuilt if a building was added, removed or resized. Changes made
+ * through this module mark it for checking again right away.
+ */
+struct BuildingBox {
+    int32_t x1, y1, x2, y2, z;
+
+    bool operator!= (const BuildingBox &b) const {
+        return x1 != b.x1 || y1 != b.y1 || x2 != b.x2 || y2 != b.y2 || z != b.z;
+    }
+};
+
+static uint32_t grid_x = 0, grid_y = 0, grid_z = 0;
+static vector<vector<df::building*> > grid_cells;
+static vector<size_t> grid_used;
+static vector<df::building*> grid_buildings;
+static vector<BuildingBox> grid_boxes;
+
+static uint32_t frame_serial = 1, grid_checked = 0;
+
 static uint8_t *getExtentTile(df::building_extents &extent, df::coord2d tile)
 {
     if (!extent.extents)
@@ -108,14 +133,130 @@ static uint8_t *getExtentTile(df::building_extents &extent, df::coord2d tile)
  */
 bool buildings_do_onupdate = false;
 
+static void clearGrid()
+{
+    grid_x = grid_y = grid_z = 0;
+    grid_cells.clear();
+    grid_used.clear();
+    grid_buildings.clear();
+    grid_boxes.clear();
+    grid_checked = 0;
+}
+
+static BuildingBox getBox(df::building *bld)
+{
+    BuildingBox box;
+    box.x1 = min(bld->x1, bld->x2);
+    box.y1 = min(bld->y1, bld->y2);
+    box.x2 = max(bld->x1, bld->x2);
+    box.y2 = max(bld->y1, bld->y2);
+    box.z = bld->z;
+    return box;
+}
+
+static void rebuildGrid()
+{
+    auto &all = world->buildings.all;
+
+    for (size_t i = 0; i < grid_used.size(); i++)
+        grid_cells[grid_used[i]].clear();
+    grid_used.clear();
+
+    grid_buildings = all;
+    grid_boxes.resize(all.size());
+
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        BuildingBox box = grid_boxes[i] = getBox(all[i]);
+
+        if (box.z < 0 || uint32_t(box.z) >= grid_z)
+            continue;
+
+        int x1 = std::max(box.x1 >> 4, 0), x2 = std::min<int>(box.x2 >> 4, grid_x-1);
+        int y1 = std::max(box.y1 >> 4, 0), y2 = std::min<int>(box.y2 >> 4, grid_y-1);
+
+        for (int y = y1; y <= y2; y++)
+        {
+            for (int x = x1; x <= x2; x++)
+            {
+                size_t idx = (size_t(box.z)*grid_y + y)*grid_x + x;
+                if (grid_cells[idx].empty())
+                    grid_used.push_back(idx);
+                grid_cells[idx].push_back(all[i]);
+            }
+        }
+    }
+}
+
+static void checkGrid()
+{
+    if (grid_checked == frame_serial)
+        return;
+    grid_checked = frame_serial;
+
+    uint32_t x = 0, y = 0, z = 0;
+    if (Maps::IsValid())
+        Maps::getSize(x, y, z);
+
+    if (x != grid_x || y != grid_y || z != grid_z)
+    {
+        clearGrid();
+        grid_checked = frame_serial;
+        grid_x = x; grid_y = y; grid_z = z;
+        grid_cells.resize(size_t(x) * y * z);
+        rebuildGrid();
+        return;
+    }
+
+    auto &all = world->buildings.all;
+
+    if (all.size() != grid_buildings.size() ||
+        (!all.empty() && memcmp(&all[0], &grid_buildings[0], all.size() * sizeof(df::building*)) != 0))
+    {
+        rebuildGrid();
+        return;
+    }
+
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        if (getBox(all[i]) != grid_boxes[i])
+        {
+            rebuildGrid();
+            return;
+        }
+    }
+}
+
+// The buildings whose bounding box may contain pos, or NULL
+static const vector<df::building*> *getGridCell(df::coord pos)
+{
+    checkGrid();
+
+    if (pos.x < 0 || pos.y < 0 || pos.z < 0)
+        return NULL;
+
+    uint32_t x = pos.x >> 4, y = pos.y >> 4;
+    if (x >= grid_x || y >= grid_y || uint32_t(pos.z) >= grid_z)
+        return NULL;
+
+    return &grid_cells[(size_t(pos.z)*grid_y + y)*grid_x + x];
+}
+
+void buildings_onFrame()
+{
+    frame_serial++;
+}
+
 void buildings_onStateChange(color_ostream &out, state_change_event event)
 {
     switch (event) {
     case SC_MAP_LOADED:
         buildings_do_onupdate = true;
+        clearGrid();
         break;
     case SC_MAP_UNLOADED:
         buildings_do_onupdate = false;
+        clearGrid();
         break;
     default:
         break;
@@ -263,8 +404,13 @@ df::building *Buildings::findAtTile(df::coord pos)
         }
     }
 
-    // The authentic method, i.e. how the game generally does this:
-    auto &vec = df::building::get_vector();
+    // The authentic method, i.e. how the game generally does this,
+    // limited to the buildings that overlap the map block:
+    auto pvec = getGridCell(pos);
+    if (!pvec)
+        return NULL;
+
+    auto &vec = *pvec;
     for (size_t i = 0; i < vec.size(); i++)
     {
         auto bld = vec[i];
@@ -294,8 +440,11 @@ bool Buildings::findCivzonesAt(std::vector<df::building_civzonest*> *pvec, df::c
 {
     pvec->clear();
 
-    auto &vec = world->buildings.other[buildings_other_id::ANY_ZONE];
+    auto cell = getGridCell(pos);
+    if (!cell)
+        return false;
 
+    auto &vec = *cell;
     for (size_t i = 0; i < vec.size(); i++)
     {
         auto bld = strict_virtual_cast<df::building_civzonest>(vec[i]);
@@ -847,6 +996,7 @@ static void linkBuilding(df::building *bld)
 
     world->buildings.all.push_back(bld);
     bld->categorize(true);
+    grid_checked = 0;
 
     if (bld->isSettingOccupancy())
         markBuildingTiles(bld, false);
@@ -1081,6 +1231,7 @@ bool Buildings::deconstruct(df::building *bld)
 
     bld->uncategorize();
     delete bld;
+    grid_checked = 0;
 
     if (world->selected_building == bld)
     {
@@ -0,0 +1,698 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#include "Internal.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstdio>
+using namespace std;
+
+#include "modules/DataStore.h"
+#include "modules/World.h"
+#include "Core.h"
+#include "Error.h"
+#include "MiscUtils.h"
+
+#include "DataDefs.h"
+#include "df/world.h"
+
+using namespace DFHack;
+using namespace DFHack::DataStore;
+using df::global::world;
+
+/*
+ * File format
+ *
+ * A header, then one record per committed transaction:
+ *
+ *   uint32 payload size, uint32 FNV-1a checksum of the payload (little endian)
+ *   payload: record type and game time, then for a transaction the change
+ *            count, and for each change an erase flag, the key and unless
+ *            erased the value, all written by BlobWriter.
+ *
+ * Records newer than the save being loaded come from a session that was
+ * quit without saving. They are skipped, and an abandon record stamped
+ * with the time of the save is appended: from then on it voids every
+ * earlier record stamped after it, whatever the game time of later loads.
+ *
+ * Reading stops at the first record that is cut short or does not match
+ * its checksum, so a write interrupted by a crash loses only that record.
+ * Files of the first version have no record type and only transactions.
+ */
+
+static const char file_magic[] = "DFHKVS2\n";
+static const char file_magic_v1[] = "DFHKVS1\n";
+static const size_t header_size = sizeof(file_magic)-1;
+static const size_t record_header_size = 8;
+
+static const uint64_t RECORD_TRANSACTION = 0;
+static const uint64_t RECORD_ABANDON = 1;
+
+namespace {
+    struct FileChange
+    {
+        bool erase;
+        std::string key, value;
+    };
+
+    struct FileRecord
+    {
+        uint64_t type;
+        uint64_t stamp;
+        std::vector<FileChange> changes;
+        // Replayed on this load; changes that later replayed records
+        // overwrite are dropped when the file is compacted.
+        bool applied;
+        std::vector<bool> superseded;
+    };
+}
+
+static bool loaded = false;
+static std::string file_path;
+static std::map<std::string, std::string> store;
+static Stats stats;
+
+// Game time when the world was loaded, i.e. of the save
+static bool have_save_time = false;
+static uint64_t save_time = 0;
+
+static uint32_t fnv1a(const char *data, size_t size)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= uint8_t(data[i]);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void put_uint32(std::string *out, uint32_t val)
+{
+    for (int i = 0; i < 4; i++)
+        out->push_back(char((val >> (8*i)) & 0xFF));
+}
+
+static uint32_t get_uint32(const char *p)
+{
+    return uint32_t(uint8_t(p[0])) | (uint32_t(uint8_t(p[1])) << 8) |
+           (uint32_t(uint8_t(p[2])) << 16) | (uint32_t(uint8_t(p[3])) << 24);
+}
+
+static uint64_t game_time()
+{
+    return uint64_t(World::ReadCurrentYear()) * 403200 + World::ReadCurrentTick();
+}
+
+static void apply_set(const std::string &key, const std::string &value)
+{
+    auto it = store.find(key);
+    if (it != store.end())
+    {
+        stats.bytes -= it->second.size();
+        it->second = value;
+    }
+    else
+    {
+        stats.bytes += key.size();
+        store[key] = value;
+    }
+    stats.bytes += value.size();
+}
+
+static void apply_erase(const std::string &key)
+{
+    auto it = store.find(key);
+    if (it == store.end())
+        return;
+    stats.bytes -= key.size() + it->second.size();
+    store.erase(it);
+}
+
+static void write_payload(std::string *payload, const FileRecord &rec, bool all_changes = true)
+{
+    BlobWriter out(payload);
+    out.writeUInt(rec.type);
+    out.writeUInt(rec.stamp);
+    if (rec.type != RECORD_TRANSACTION)
+        return;
+
+    size_t count = 0;
+    for (size_t i = 0; i < rec.changes.size(); i++)
+        count += (all_changes || !rec.superseded[i]);
+
+    out.writeUInt(count);
+    for (size_t i = 0; i < rec.changes.size(); i++)
+    {
+        if (!all_changes && rec.superseded[i])
+            continue;
+
+        const FileChange &change = rec.changes[i];
+        out.writeBool(change.erase);
+        out.writeString(change.key);
+        if (!change.erase)
+            out.writeString(change.value);
+    }
+}
+
+static bool parse_payload(const std::string &payload, bool v1, FileRecord *rec)
+{
+    BlobReader in(payload);
+    rec->type = RECORD_TRANSACTION;
+    rec->applied = false;
+    rec->changes.clear();
+
+    if (!v1 && !in.readUInt(&rec->type))
+        return false;
+    if (!in.readUInt(&rec->stamp))
+        return false;
+
+    if (rec->type == RECORD_ABANDON)
+        return true;
+
+    uint64_t count;
+    if (rec->type != RECORD_TRANSACTION || !in.readUInt(&count))
+        return false;
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        FileChange change;
+        if (!in.readBool(&change.erase) || !in.readString(&change.key))
+            return false;
+        if (!change.erase && !in.readString(&change.value))
+            return false;
+        rec->changes.push_back(change);
+    }
+
+    rec->superseded.assign(rec->changes.size(), false);
+    return true;
+}
+
+static void make_record(std::string *out, const std::string &payload)
+{
+    put_uint32(out, uint32_t(payload.size()));
+    put_uint32(out, fnv1a(payload.data(), payload.size()));
+    out->append(payload);
+}
+
+// Rewrites the file without the changes that later replayed records
+// overwrite. Everything else, including skipped records, is kept.
+static bool rewrite_file(const std::vector<FileRecord> &records)
+{
+    std::string data(file_magic, header_size);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const FileRecord &rec = records[i];
+        if (rec.applied && std::find(rec.superseded.begin(), rec.superseded.end(), false) == rec.superseded.end())
+            continue;
+
+        std::string payload;
+        write_payload(&payload, rec, !rec.applied);
+        make_record(&data, payload);
+    }
+
+    std::string tmp_path = file_path + ".tmp";
+    {
+        std::ofstream file(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file.write(data.data(), data.size()) || !file.flush())
+        {
+            Core::printerr("DataStore: could not write %s\n", tmp_path.c_str());
+            return false;
+        }
+    }
+
+    remove(file_path.c_str());
+    if (rename(tmp_path.c_str(), file_path.c_str()) != 0)
+    {
+        Core::printerr("DataStore: could not replace %s\n", file_path.c_str());
+        return false;
+    }
+
+    stats.file_bytes = data.size();
+    return true;
+}
+
+static bool append_record(const std::string &payload);
+
+static bool load()
+{
+    if (loaded)
+        return true;
+    if (!world || !Core::getInstance().isWorldLoaded())
+        return false;
+
+    std::string dir = world->cur_savegame.save_dir;
+    if (dir.empty())
+        return false;
+
+    file_path = "data/save/" + dir + "/dfhack-store.dat";
+    store.clear();
+    memset(&stats, 0, sizeof(stats));
+    loaded = true;
+
+    std::ifstream file(file_path.c_str(), std::ios::binary);
+    if (!file)
+        return true;
+
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+
+    bool v1 = data.size() >= header_size && memcmp(data.data(), file_magic_v1, header_size) == 0;
+    if (!v1 && (data.size() < header_size || memcmp(data.data(), file_magic, header_size) != 0))
+    {
+        Core::printerr("DataStore: %s is not a data store; ignoring it.\n", file_path.c_str());
+        return true;
+    }
+
+    std::vector<FileRecord> records;
+    size_t pos = header_size;
+    while (pos + record_header_size <= data.size())
+    {
+        size_t size = get_uint32(&data[pos]);
+        uint32_t checksum = get_uint32(&data[pos+4]);
+        if (size > data.size() - pos - record_header_size)
+            break;
+
+        const char *payload = &data[pos + record_header_size];
+        FileRecord rec;
+        if (fnv1a(payload, size) != checksum ||
+            !parse_payload(std::string(payload, size), v1, &rec))
+            break;
+
+        records.push_back(rec);
+        pos += record_header_size + size;
+    }
+
+    // Transactions voided by a later abandon record
+    std::vector<bool> voided(records.size(), false);
+    uint64_t void_after = ~uint64_t(0);
+    for (size_t i = records.size(); i-- > 0; )
+    {
+        if (records[i].type == RECORD_ABANDON)
+            void_after = std::min(void_after, records[i].stamp);
+        else
+            voided[i] = records[i].stamp > void_after;
+    }
+
+    // Replay what was committed up to the save, including on its own tick
+    uint64_t cutoff = have_save_time ? save_time : game_time();
+    bool abandon = false;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        FileRecord &rec = records[i];
+        if (rec.type != RECORD_TRANSACTION || voided[i])
+            continue;
+
+        if (rec.stamp > cutoff)
+        {
+            abandon = true;
+            continue;
+        }
+
+        rec.applied = true;
+        for (size_t j = 0; j < rec.changes.size(); j++)
+        {
+            if (rec.changes[j].erase)
+                apply_erase(rec.changes[j].key);
+            else
+                apply_set(rec.changes[j].key, rec.changes[j].value);
+        }
+    }
+
+    // Find the changes that a later replayed record overwrites
+    size_t superseded_bytes = 0;
+    std::set<std::string> seen;
+    for (size_t i = records.size(); i-- > 0; )
+    {
+        FileRecord &rec = records[i];
+        if (!rec.applied)
+            continue;
+
+        for (size_t j = 0; j < rec.changes.size(); j++)
+        {
+            if (seen.insert(rec.changes[j].key).second)
+                continue;
+            rec.superseded[j] = true;
+            superseded_bytes += rec.changes[j].key.size() + rec.changes[j].value.size();
+        }
+    }
+
+    stats.keys = store.size();
+    stats.file_bytes = data.size();
+
+    if (abandon)
+    {
+        FileRecord rec;
+        rec.type = RECORD_ABANDON;
+        rec.stamp = cutoff;
+        rec.applied = false;
+        records.push_back(rec);
+    }
+
+    // Compact a file that is mostly superseded, and one that has to be
+    // rewritten anyway: cut short, or in the old format
+    if (v1 || pos < data.size() || superseded_bytes > stats.bytes + 4096)
+        rewrite_file(records);
+    else if (abandon)
+    {
+        std::string payload;
+        write_payload(&payload, records.back());
+        append_record(payload);
+        stats.commits = 0;
+    }
+
+    return true;
+}
+
+static bool append_record(const std::string &payload)
+{
+    std::string data;
+    if (stats.file_bytes == 0)
+        data.assign(file_magic, header_size);
+    make_record(&data, payload);
+
+    std::ofstream file(file_path.c_str(), std::ios::binary | std::ios::app);
+    if (!file.write(data.data(), data.size()) || !file.flush())
+    {
+        Core::printerr("DataStore: could not write %s\n", file_path.c_str());
+        return false;
+    }
+
+    stats.file_bytes += data.size();
+    stats.commits++;
+    return true;
+}
+
+/*
+ * Queries
+ */
+
+bool DataStore::isLoaded()
+{
+    return load();
+}
+
+bool DataStore::get(const std::string &key, std::string *value)
+{
+    CHECK_NULL_POINTER(value);
+
+    if (!load())
+        return false;
+
+    auto it = store.find(key);
+    if (it == store.end())
+        return false;
+
+    *value = it->second;
+    return true;
+}
+
+bool DataStore::has(const std::string &key)
+{
+    return load() && store.count(key) > 0;
+}
+
+void DataStore::list(std::vector<std::string> *keys, const std::string &prefix)
+{
+    CHECK_NULL_POINTER(keys);
+
+    keys->clear();
+    if (!load())
+        return;
+
+    if (prefix.empty())
+    {
+        for (auto it = store.begin(); it != store.end(); ++it)
+            keys->push_back(it->first);
+        return;
+    }
+
+    if (store.count(prefix))
+        keys->push_back(prefix);
+
+    std::string bound = prefix;
+    if (bound[bound.size()-1] != '/')
+        bound += "/";
+
+    auto it = store.lower_bound(bound);
+    for (; it != store.end() && it->first.compare(0, bound.size(), bound) == 0; ++it)
+        keys->push_back(it->first);
+}
+
+void DataStore::getStats(Stats *out)
+{
+    CHECK_NULL_POINTER(out);
+
+    if (!load())
+    {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+
+    stats.keys = store.size();
+    *out = stats;
+}
+
+/*
+ * Changes
+ */
+
+bool DataStore::set(const std::string &key, const std::string &value)
+{
+    Transaction tx;
+    tx.set(key, value);
+    return tx.commit();
+}
+
+bool DataStore::erase(const std::string &key)
+{
+    if (!has(key))
+        return false;
+
+    Transaction tx;
+    tx.erase(key);
+    return tx.commit();
+}
+
+void Transaction::set(const std::string &key, const std::string &value)
+{
+    CHECK_INVALID_ARGUMENT(!key.empty());
+
+    Change &change = changes[key];
+    change.erase = false;
+    change.value = value;
+}
+
+void Transaction::erase(const std::string &key)
+{
+    CHECK_INVALID_ARGUMENT(!key.empty());
+
+    Change &change = changes[key];
+    change.erase = true;
+    change.value.clear();
+}
+
+bool Transaction::get(const std::string &key, std::string *value) const
+{
+    auto it = changes.find(key);
+    if (it == changes.end())
+        return DataStore::get(key, value);
+    if (it->second.erase)
+        return false;
+
+    *value = it->second.value;
+    return true;
+}
+
+bool Transaction::commit()
+{
+    if (changes.empty())
+        return true;
+    if (!load())
+        return false;
+
+    FileRecord rec;
+    rec.type = RECORD_TRANSACTION;
+    rec.stamp = game_time();
+    for (auto it = changes.begin(); it != changes.end(); ++it)
+    {
+        FileChange change;
+        change.erase = it->second.erase;
+        change.key = it->first;
+        change.value = it->second.value;
+        rec.changes.push_back(change);
+    }
+
+    std::string payload;
+    write_payload(&payload, rec);
+
+    // Nothing is applied unless the record made it to the file
+    if (!append_record(payload))
+        return false;
+
+    for (auto it = changes.begin(); it != changes.end(); ++it)
+    {
+        if (it->second.erase)
+            apply_erase(it->first);
+        else
+            apply_set(it->first, it->second.value);
+    }
+
+    changes.clear();
+    return true;
+}
+
+/*
+ * Blob encoding
+ */
+
+void BlobWriter::writeUInt(uint64_t val)
+{
+    while (val >= 0x80)
+    {
+        out->push_back(char((val & 0x7F) | 0x80));
+        val >>= 7;
+    }
+    out->push_back(char(val));
+}
+
+void BlobWriter::writeDouble(double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    for (int i = 0; i < 8; i++)
+        out->push_back(char((bits >> (8*i)) & 0xFF));
+}
+
+void BlobWriter::writeString(const std::string &val)
+{
+    writeUInt(val.size());
+    out->append(val);
+}
+
+bool BlobReader::readUInt(uint64_t *val)
+{
+    uint64_t result = 0;
+    for (int shift = 0; !failed && shift < 64; shift += 7)
+    {
+        if (pos >= data.size())
+            break;
+
+        uint8_t byte = uint8_t(data[pos++]);
+        result |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            *val = result;
+            return true;
+        }
+    }
+
+    failed = true;
+    return false;
+}
+
+bool BlobReader::readInt(int64_t *val)
+{
+    uint64_t raw;
+    if (!readUInt(&raw))
+        return false;
+    *val = int64_t(raw >> 1) ^ -int64_t(raw & 1);
+    return true;
+}
+
+bool BlobReader::readBool(bool *val)
+{
+    if (failed || pos >= data.size())
+    {
+        failed = true;
+        return false;
+    }
+    *val = (data[pos++] != 0);
+    return true;
+}
+
+bool BlobReader::readDouble(double *val)
+{
+    if (failed || data.size() - pos < 8)
+    {
+        failed = true;
+        return false;
+    }
+
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++)
+        bits |= uint64_t(uint8_t(data[pos+i])) << (8*i);
+    pos += 8;
+
+    memcpy(val, &bits, sizeof(bits));
+    return true;
+}
+
+bool BlobReader::readString(std::string *val)
+{
+    uint64_t size;
+    if (!readUInt(&size))
+        return false;
+    if (size > data.size() - pos)
+    {
+        failed = true;
+        return false;
+    }
+
+    val->assign(data, pos, size_t(size));
+    pos += size_t(size);
+    return true;
+}
+
+/*
+ * State
+ */
+
+void DataStore::onStateChange(color_ostream &out, state_change_event event)
+{
+    switch (event)
+    {
+    case SC_WORLD_LOADED:
+    case SC_WORLD_UNLOADED:
+        // Everything is on disk already; the next query loads the new world
+        loaded = false;
+        store.clear();
+        file_path.clear();
+
+        // The first query may come much later, so remember the save's time now
+        have_save_time = (event == SC_WORLD_LOADED && world);
+        save_time = have_save_time ? game_time() : 0;
+        break;
+    default:
+        break;
+    }
+}
@@ -3,20 +3,28 @@
 #include "modules/Buildings.h"
 #include "modules/Constructions.h"
 #include "modules/EventManager.h"
+#include "modules/IdIndex.h"
 #include "modules/Job.h"
 #include "modules/World.h"
 
 #include "df/building.h"
 #include "df/construction.h"
 #include "df/global_objects.h"
+#include "df/incident.h"
 #include "df/item.h"
 #include "df/job.h"
+#include "df/job_item.h"
 #include "df/job_list_link.h"
 #include "df/ui.h"
 #include "df/unit.h"
 #include "df/unit_syndrome.h"
 #include "df/world.h"
 
+#include "MiscUtils.h"
+#include "Profiler.h"
+
+#include <cstring>
+#include <functional>
 #include <map>
 #include <unordered_map>
 #include <unordered_set>
@@ -31,8 +39,18 @@ using namespace EventManager;
  *  consider a typedef instead of a struct for EventHandler
  **/
 
-//map<uint32_t, vector<DFHack::EventManager::EventHandler> > tickQueue;
-multimap<uint32_t, EventHandler> tickQueue;
+namespace {
+    struct TickEntry {
+        EventHandler handler;
+        Plugin* plugin;
+        TickEntry(): handler(NULL, 0), plugin(NULL) {}
+        TickEntry(EventHandler handler_in, Plugin* plugin_in): handler(handler_in), plugin(plugin_in) {}
+    };
+}
+
+//timer times are relative to tickOrigin, which is the game tick at world load
+static TimingWheel<TickEntry> tickQueue;
+static uint32_t tickOrigin = 0;
 
 //TODO: consider unordered_map of pairs, or unordered_map of unordered_set, or whatever
 multimap<Plugin*, EventHandler> handlers[EventType::EVENT_MAX];
@@ -44,9 +62,13 @@ void DFHack::EventManager::registerListener(EventType::EventType e, EventHandler
     handlers[e].insert(pair<Plugin*, EventHandler>(plugin, handler));
 }
 
-void DFHack::EventManager::registerTick(EventHandler handler, int32_t when, Plugin* plugin, bool absolute) {
-    uint32_t tick = DFHack::World::ReadCurrentYear()*ticksPerYear
+static uint32_t currentTick() {
+    return DFHack::World::ReadCurrentYear()*ticksPerYear
         + DFHack::World::ReadCurrentTick();
+}
+
+EventManager::TickHandle DFHack::EventManager::registerTick(EventHandler handler, int32_t when, Plugin* plugin, bool absolute) {
+    uint32_t tick = currentTick();
     if ( !Core::getInstance().isWorldLoaded() ) {
         tick = 0;
         if ( absolute ) {
@@ -56,13 +78,46 @@ void DFHack::EventManager::registerTick(EventHandler handler, int32_t when, Plug
     if ( absolute ) {
         tick = 0;
     }
-    
-    tickQueue.insert(pair<uint32_t, EventHandler>(tick+(uint32_t)when, handler));
-    handlers[EventType::TICK].insert(pair<Plugin*,EventHandler>(plugin,handler));
-    return;
+
+    //anything already in the past fires on the next check
+    int64_t due = (int64_t)tick + when - tickOrigin;
+    if ( due < (int64_t)tickQueue.now() )
+        due = tickQueue.now();
+    return tickQueue.schedule((uint32_t)due, TickEntry(handler, plugin));
+}
+
+EventManager::TickHandle DFHack::EventManager::registerRecurringTick(EventHandler handler, int32_t period, Plugin* plugin) {
+    if ( period < 1 )
+        period = 1;
+    uint32_t tick = Core::getInstance().isWorldLoaded() ? currentTick() : 0;
+    int64_t due = (int64_t)tick + period - tickOrigin;
+    if ( due < (int64_t)tickQueue.now() )
+        due = tickQueue.now();
+    return tickQueue.schedule((uint32_t)due, TickEntry(handler, plugin), period);
+}
+
+bool DFHack::EventManager::cancelTick(TickHandle handle) {
+    return tickQueue.cancel(handle);
+}
+
+namespace {
+    struct SameTickOwner {
+        Plugin* plugin;
+        const EventHandler* handler;
+        bool operator()(TickEntry& entry) const {
+            if ( entry.plugin != plugin )
+                return false;
+            return handler == NULL || entry.handler == *handler;
+        }
+    };
 }
 
 void DFHack::EventManager::unregister(EventType::EventType e, EventHandler handler, Plugin* plugin) {
+    if ( e == EventType::TICK ) {
+        SameTickOwner owner = { plugin, &handler };
+        tickQueue.cancelIf(owner);
+        return;
+    }
     for ( multimap<Plugin*, EventHandler>::iterator i = handlers[e].find(plugin); i != handlers[e].end(); i++ ) {
         if ( (*i).first != plugin )
             break;
@@ -75,28 +130,16 @@ void DFHack::EventManager::unregister(EventType::EventType e, EventHandler handl
     return;
 }
 
+//one profiler probe per (event type, plugin)
+static map<pair<int, Plugin*>, Profiler::Probe*> handlerProbes;
+
 void DFHack::EventManager::unregisterAll(Plugin* plugin) {
-    for ( auto i = handlers[EventType::TICK].find(plugin); i != handlers[EventType::TICK].end(); i++ ) {
-        if ( (*i).first != plugin )
-            break;
-        
-        //shenanigans to avoid concurrent modification
-        EventHandler getRidOf = (*i).second;
-        bool didSomething;
-        do {
-            didSomething = false;
-            for ( auto j = tickQueue.begin(); j != tickQueue.end(); j++ ) {
-                EventHandler candidate = (*j).second;
-                if ( getRidOf != candidate )
-                    continue;
-                tickQueue.erase(j);
-                didSomething = true;
-                break;
-            }
-        } while(didSomething);
-    }
+    SameTickOwner owner = { plugin, NULL };
+    tickQueue.cancelIf(owner);
     for ( size_t a = 0; a < (size_t)EventType::EVENT_MAX; a++ ) {
         handlers[a].erase(plugin);
+        //the plugin may be unloading, and its pointer reused by another one
+        handlerProbes.erase(make_pair((int)a, plugin));
     }
     return;
 }
@@ -110,6 +153,45 @@ static void manageBuildingEvent(color_ostream& out);
 static void manageConstructionEvent(color_ostream& out);
 static void manageSyndromeEvent(color_ostream& out);
 static void manageInvasionEvent(color_ostream& out);
+static void clearJobRecords();
+
+typedef vector<pair<Plugin*, EventHandler> > HandlerList;
+
+//the handlers for one event type that asked for the given backend
+static bool copyHandlers(EventType::EventType e, Backend::Backend backend, HandlerList& copy) {
+    copy.clear();
+    for ( auto i = handlers[e].begin(); i != handlers[e].end(); i++ ) {
+        if ( (*i).second.backend == backend )
+            copy.push_back(*i);
+    }
+    return !copy.empty();
+}
+
+static const char* eventTypeNames[EventType::EVENT_MAX] = {
+    "TICK",
+    "JOB_INITIATED",
+    "JOB_COMPLETED",
+    "UNIT_DEATH",
+    "ITEM_CREATED",
+    "BUILDING",
+    "CONSTRUCTION",
+    "SYNDROME",
+    "INVASION"
+};
+
+static void callHandler(color_ostream& out, EventType::EventType e, Plugin* plugin, EventHandler& handler, void* ptr) {
+    Profiler::Probe* probe = NULL;
+    if ( Profiler::isEnabled() ) {
+        Profiler::Probe*& cached = handlerProbes[make_pair((int)e, plugin)];
+        if ( cached == NULL ) {
+            string name = string("event/") + eventTypeNames[e] + "/" + (plugin ? plugin->getName() : "core");
+            cached = Profiler::getProbe(name);
+        }
+        probe = cached;
+    }
+    Profiler::Scope scope(probe);
+    handler.eventHandler(out, ptr);
+}
 
 //tick event
 static uint32_t lastTick = 0;
@@ -120,8 +202,20 @@ static int32_t lastJobId = -1;
 //job completed
 static unordered_map<int32_t, df::job*> prevJobs;
 
+namespace {
+    //incremental backend: a snapshot of each live job, recloned only when its fingerprint changes
+    struct JobRecord {
+        df::job* snapshot;
+        uint32_t generation;
+        uint64_t fingerprint;
+    };
+}
+static unordered_map<int32_t, JobRecord> jobRecords;
+static uint32_t jobGeneration;
+
 //unit death
 static unordered_set<int32_t> livingUnits;
+static int32_t nextIncident;
 
 //item creation
 static int32_t nextItem;
@@ -129,9 +223,12 @@ static int32_t nextItem;
 //building
 static int32_t nextBuilding;
 static unordered_set<int32_t> buildings;
+static int32_t incNextBuilding;
+static unordered_set<int32_t> incBuildings;
 
 //construction
 static unordered_set<df::construction*> constructions;
+static vector<df::construction*> incConstructions;
 static bool gameLoaded;
 
 //invasion
@@ -142,7 +239,7 @@ void DFHack::EventManager::onStateChange(color_ostream& out, state_change_event
     if ( !doOnce ) {
         //TODO: put this somewhere else
         doOnce = true;
-        EventHandler buildingHandler(Buildings::updateBuildings, 100);
+        EventHandler buildingHandler(Buildings::updateBuildings, 100, Backend::INCREMENTAL);
         DFHack::EventManager::registerListener(EventType::BUILDING, buildingHandler, NULL);
         //out.print("Registered listeners.\n %d", __LINE__);
     }
@@ -153,29 +250,30 @@ void DFHack::EventManager::onStateChange(color_ostream& out, state_change_event
             Job::deleteJobStruct((*i).second);
         }
         prevJobs.clear();
+        clearJobRecords();
         tickQueue.clear();
+        tickOrigin = 0;
         livingUnits.clear();
+        nextIncident = -1;
         nextItem = -1;
         nextBuilding = -1;
         buildings.clear();
+        incNextBuilding = -1;
+        incBuildings.clear();
         constructions.clear();
+        incConstructions.clear();
 
         Buildings::clearBuildings(out);
         gameLoaded = false;
         nextInvasion = -1;
     } else if ( event == DFHack::SC_WORLD_LOADED ) {
-        uint32_t tick = DFHack::World::ReadCurrentYear()*ticksPerYear
-            + DFHack::World::ReadCurrentTick();
-        multimap<uint32_t,EventHandler> newTickQueue;
-        for ( auto i = tickQueue.begin(); i != tickQueue.end(); i++ ) {
-            newTickQueue.insert(pair<uint32_t,EventHandler>(tick + (*i).first, (*i).second));
-        }
-        tickQueue.clear();
-
-        tickQueue.insert(newTickQueue.begin(), newTickQueue.end());
+        //timers registered before the load count from now: just move the origin
+        tickOrigin = currentTick() - tickQueue.now();
 
         nextItem = 0;
         nextBuilding = 0;
+        incNextBuilding = 0;
+        nextIncident = -1;
         lastTick = 0;
         nextInvasion = df::global::ui->invasions.next_id;
         gameLoaded = true;
@@ -186,8 +284,7 @@ void DFHack::EventManager::manageEvents(color_ostream& out) {
     if ( !gameLoaded ) {
         return;
     }
-    uint32_t tick = DFHack::World::ReadCurrentYear()*ticksPerYear
-        + DFHack::World::ReadCurrentTick();
+    uint32_t tick = currentTick();
     
     if ( tick <= lastTick )
         return;
@@ -242,16 +339,15 @@ void DFHack::EventManager::manageEvents(color_ostream& out) {
 }
 
 static void manageTickEvent(color_ostream& out) {
-    uint32_t tick = DFHack::World::ReadCurrentYear()*ticksPerYear
-        + DFHack::World::ReadCurrentTick();
-    while ( !tickQueue.empty() ) {
-        if ( tick < (*tickQueue.begin()).first )
-            break;
-        EventHandler handle = (*tickQueue.begin()).second;
-        tickQueue.erase(tickQueue.begin());
-        handle.eventHandler(out, (void*)tick);
+    uint32_t tick = currentTick();
+    if ( tick < tickOrigin )
+        return;
+    tickQueue.advance(tick - tickOrigin);
+
+    TickEntry entry;
+    while ( tickQueue.popReady(&entry) ) {
+        callHandler(out, EventType::TICK, entry.plugin, entry.handler, (void*)tick);
     }
-    
 }
 
 static void manageJobInitiatedEvent(color_ostream& out) {
@@ -274,19 +370,14 @@ static void manageJobInitiatedEvent(color_ostream& out) {
         if ( link->item->id <= lastJobId )
             continue;
         for ( auto i = copy.begin(); i != copy.end(); i++ ) {
-            (*i).second.eventHandler(out, (void*)link->item);
+            callHandler(out, EventType::JOB_INITIATED, (*i).first, (*i).second, (void*)link->item);
         }
     }
 
     lastJobId = *df::global::job_next_id - 1;
 }
 
-static void manageJobCompletedEvent(color_ostream& out) {
-    if ( handlers[EventType::JOB_COMPLETED].empty() ) {
-        return;
-    }
-    
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::JOB_COMPLETED].begin(), handlers[EventType::JOB_COMPLETED].end());
+static void scanJobCompleted(color_ostream& out, HandlerList& copy) {
     map<int32_t, df::job*> nowJobs;
     for ( df::job_list_link* link = &df::global::world->job_list; link != NULL; link = link->next ) {
         if ( link->item == NULL )
@@ -300,7 +391,7 @@ static void manageJobCompletedEvent(color_ostream& out) {
 
         //recently finished or cancelled job!
         for ( auto j = copy.begin(); j != copy.end(); j++ ) {
-            (*j).second.eventHandler(out, (void*)(*i).second);
+            callHandler(out, EventType::JOB_COMPLETED, (*j).first, (*j).second, (void*)(*i).second);
         }
     }
 
@@ -312,27 +403,120 @@ static void manageJobCompletedEvent(color_ostream& out) {
     
     //create new jobs
     for ( auto j = nowJobs.begin(); j != nowJobs.end(); j++ ) {
-        /*map<int32_t, df::job*>::iterator i = prevJobs.find((*j).first);
-        if ( i != prevJobs.end() ) {
-            continue;
-        }*/
-
         df::job* newJob = Job::cloneJobStruct((*j).second, true);
         prevJobs[newJob->id] = newJob;
     }
+}
 
-    /*//get rid of old pointers to deallocated jobs
-    for ( size_t a = 0; a < toDelete.size(); a++ ) {
-        prevJobs.erase(a);
-    }*/
+static void clearJobRecords() {
+    for ( auto i = jobRecords.begin(); i != jobRecords.end(); i++ ) {
+        Job::deleteJobStruct((*i).second.snapshot);
+    }
+    jobRecords.clear();
 }
 
-static void manageUnitDeathEvent(color_ostream& out) {
-    if ( handlers[EventType::UNIT_DEATH].empty() ) {
+static inline void mixFingerprint(uint64_t& hash, uint64_t value) {
+    hash = (hash ^ value) * 1099511628211ULL;
+}
+
+//covers what cloneJobStruct copies and DF changes while a job is live, so that the
+//snapshot handed to JOB_COMPLETED handlers matches a clone taken on the last check:
+//the repeat and suspend flags, material, item subtype and category, figure, reaction,
+//position, the general refs (by object, e.g. a new worker ref) and the job items (by
+//object and remaining quantity). completion_timer, the other flags, items and specific
+//refs are not tracked, as cloneJobStruct resets them in the snapshots of both backends.
+static uint64_t jobFingerprint(df::job* job) {
+    uint64_t hash = 14695981039346656037ULL;
+    mixFingerprint(hash, job->flags.bits.repeat);
+    mixFingerprint(hash, job->flags.bits.suspend);
+    mixFingerprint(hash, uint16_t(job->mat_type));
+    mixFingerprint(hash, uint32_t(job->mat_index));
+    mixFingerprint(hash, uint16_t(job->item_subtype));
+    mixFingerprint(hash, job->item_category.whole);
+    mixFingerprint(hash, job->material_category.whole);
+    mixFingerprint(hash, uint32_t(job->hist_figure_id));
+    mixFingerprint(hash, std::hash<string>()(job->reaction_name));
+    mixFingerprint(hash, (uint64_t(uint16_t(job->pos.x)) << 32) | (uint32_t(uint16_t(job->pos.y)) << 16) | uint16_t(job->pos.z));
+    mixFingerprint(hash, job->general_refs.size());
+    for ( size_t a = 0; a < job->general_refs.size(); a++ ) {
+        mixFingerprint(hash, uintptr_t(job->general_refs[a]));
+    }
+    mixFingerprint(hash, job->job_items.size());
+    for ( size_t a = 0; a < job->job_items.size(); a++ ) {
+        mixFingerprint(hash, uintptr_t(job->job_items[a]));
+        mixFingerprint(hash, uint32_t(job->job_items[a]->quantity));
+    }
+    return hash;
+}
+
+static void snapshotJob(JobRecord& record, df::job* job, uint64_t fingerprint) {
+    record.snapshot = Job::cloneJobStruct(job, true);
+    record.fingerprint = fingerprint;
+}
+
+static void incrementalJobCompleted(color_ostream& out, HandlerList& copy) {
+    //stamp every live job with the current generation; only new or altered jobs get cloned
+    jobGeneration++;
+    size_t liveJobs = 0;
+    for ( df::job_list_link* link = df::global::world->job_list.next; link != NULL; link = link->next ) {
+        df::job* job = link->item;
+        if ( job == NULL )
+            continue;
+        liveJobs++;
+        auto i = jobRecords.find(job->id);
+        uint64_t fingerprint = jobFingerprint(job);
+        if ( i == jobRecords.end() ) {
+            JobRecord& record = jobRecords[job->id];
+            snapshotJob(record, job, fingerprint);
+            record.generation = jobGeneration;
+            continue;
+        }
+        JobRecord& record = (*i).second;
+        record.generation = jobGeneration;
+        if ( record.fingerprint != fingerprint ) {
+            Job::deleteJobStruct(record.snapshot);
+            snapshotJob(record, job, fingerprint);
+        }
+    }
+
+    //every record was stamped: nothing finished since the last check
+    if ( liveJobs == jobRecords.size() )
         return;
+
+    for ( auto i = jobRecords.begin(); i != jobRecords.end(); ) {
+        if ( (*i).second.generation == jobGeneration ) {
+            i++;
+            continue;
+        }
+        //recently finished or cancelled job!
+        df::job* snapshot = (*i).second.snapshot;
+        for ( auto j = copy.begin(); j != copy.end(); j++ ) {
+            callHandler(out, EventType::JOB_COMPLETED, (*j).first, (*j).second, (void*)snapshot);
+        }
+        Job::deleteJobStruct(snapshot);
+        i = jobRecords.erase(i);
     }
-    
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::UNIT_DEATH].begin(), handlers[EventType::UNIT_DEATH].end());
+}
+
+static void manageJobCompletedEvent(color_ostream& out) {
+    HandlerList copy;
+    if ( copyHandlers(EventType::JOB_COMPLETED, Backend::SCAN, copy) ) {
+        scanJobCompleted(out, copy);
+    } else if ( !prevJobs.empty() ) {
+        //nobody is listening anymore: don't keep the clones alive
+        for ( auto i = prevJobs.begin(); i != prevJobs.end(); i++ ) {
+            Job::deleteJobStruct((*i).second);
+        }
+        prevJobs.clear();
+    }
+
+    if ( copyHandlers(EventType::JOB_COMPLETED, Backend::INCREMENTAL, copy) )
+        incrementalJobCompleted(out, copy);
+    else if ( !jobRecords.empty() )
+        clearJobRecords();
+}
+
+static void scanUnitDeath(color_ostream& out, HandlerList& copy) {
     for ( size_t a = 0; a < df::global::world->units.active.size(); a++ ) {
         df::unit* unit = df::global::world->units.active[a];
         if ( unit->counters.death_id == -1 ) {
@@ -344,12 +528,45 @@ static void manageUnitDeathEvent(color_ostream& out) {
             continue;
 
         for ( auto i = copy.begin(); i != copy.end(); i++ ) {
-            (*i).second.eventHandler(out, (void*)unit->id);
+            callHandler(out, EventType::UNIT_DEATH, (*i).first, (*i).second, (void*)unit->id);
         }
         livingUnits.erase(unit->id);
     }
 }
 
+static void incrementalUnitDeath(color_ostream& out, HandlerList& copy) {
+    //every death files an incident, and the victim's death_id points back at it
+    vector<df::incident*>& incidents = df::global::world->incidents.all;
+    if ( nextIncident == -1 ) {
+        nextIncident = incidents.empty() ? 0 : incidents.back()->id + 1;
+        return;
+    }
+    if ( incidents.empty() || incidents.back()->id < nextIncident )
+        return;
+
+    int32_t index = binsearch_index(incidents, &df::incident::id, nextIncident, false);
+    for ( size_t a = index; a < incidents.size(); a++ ) {
+        df::incident* incident = incidents[a];
+        df::unit* unit = IdIndex::findUnit(incident->victim);
+        if ( unit == NULL || unit->counters.death_id != incident->id )
+            continue;
+        for ( auto i = copy.begin(); i != copy.end(); i++ ) {
+            callHandler(out, EventType::UNIT_DEATH, (*i).first, (*i).second, (void*)unit->id);
+        }
+    }
+    nextIncident = incidents.back()->id + 1;
+}
+
+static void manageUnitDeathEvent(color_ostream& out) {
+    HandlerList copy;
+    if ( copyHandlers(EventType::UNIT_DEATH, Backend::SCAN, copy) )
+        scanUnitDeath(out, copy);
+    if ( copyHandlers(EventType::UNIT_DEATH, Backend::INCREMENTAL, copy) )
+        incrementalUnitDeath(out, copy);
+    else
+        nextIncident = -1;
+}
+
 static void manageItemCreationEvent(color_ostream& out) {
     if ( handlers[EventType::ITEM_CREATED].empty() ) {
         return;
@@ -376,24 +593,16 @@ static void manageItemCreationEvent(color_ostream& out) {
         if ( item->flags.bits.spider_web )
             continue;
         for ( auto i = copy.begin(); i != copy.end(); i++ ) {
-            (*i).second.eventHandler(out, (void*)item->id);
+            callHandler(out, EventType::ITEM_CREATED, (*i).first, (*i).second, (void*)item->id);
         }
     }
     nextItem = *df::global::item_next_id;
 }
 
-static void manageBuildingEvent(color_ostream& out) {
-    /*
-     * TODO: could be faster
-     * consider looking at jobs: building creation / destruction
-     **/
-    if ( handlers[EventType::BUILDING].empty() )
-        return;
-    
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::BUILDING].begin(), handlers[EventType::BUILDING].end());
+static void scanBuilding(color_ostream& out, HandlerList& copy) {
     //first alert people about new buildings
     for ( int32_t a = nextBuilding; a < *df::global::building_next_id; a++ ) {
-        int32_t index = df::building::binsearch_index(df::global::world->buildings.all, a);
+        int32_t index = IdIndex::findIndex(IdIndex::BUILDINGS, a);
         if ( index == -1 ) {
             //out.print("%s, line %d: Couldn't find new building with id %d.\n", __FILE__, __LINE__, a);
             //the tricky thing is that when the game first starts, it's ok to skip buildings, but otherwise, if you skip buildings, something is probably wrong. TODO: make this smarter
@@ -402,7 +611,7 @@ static void manageBuildingEvent(color_ostream& out) {
         buildings.insert(a);
         for ( auto b = copy.begin(); b != copy.end(); b++ ) {
             EventHandler bob = (*b).second;
-            bob.eventHandler(out, (void*)a);
+            callHandler(out, EventType::BUILDING, (*b).first, bob, (void*)a);
         }
     }
     nextBuilding = *df::global::building_next_id;
@@ -411,14 +620,14 @@ static void manageBuildingEvent(color_ostream& out) {
     unordered_set<int32_t> toDelete;
     for ( auto a = buildings.begin(); a != buildings.end(); a++ ) {
         int32_t id = *a;
-        int32_t index = df::building::binsearch_index(df::global::world->buildings.all,id);
+        int32_t index = IdIndex::findIndex(IdIndex::BUILDINGS, id);
         if ( index != -1 )
             continue;
         toDelete.insert(id);
 
         for ( auto b = copy.begin(); b != copy.end(); b++ ) {
             EventHandler bob = (*b).second;
-            bob.eventHandler(out, (void*)id);
+            callHandler(out, EventType::BUILDING, (*b).first, bob, (void*)id);
         }
     }
 
@@ -430,20 +639,59 @@ static void manageBuildingEvent(color_ostream& out) {
     //out.print("Sent building event.\n %d", __LINE__);
 }
 
-static void manageConstructionEvent(color_ostream& out) {
-    if ( handlers[EventType::CONSTRUCTION].empty() )
+static void incrementalBuilding(color_ostream& out, HandlerList& copy) {
+    vector<df::building*>& all = df::global::world->buildings.all;
+
+    //ids are handed out in order, so new buildings are everything past the last id we saw
+    if ( incNextBuilding < *df::global::building_next_id ) {
+        int32_t index = df::building::binsearch_index(all, incNextBuilding, false);
+        for ( size_t a = index; a < all.size(); a++ ) {
+            int32_t id = all[a]->id;
+            if ( !incBuildings.insert(id).second )
+                continue;
+            for ( auto b = copy.begin(); b != copy.end(); b++ ) {
+                callHandler(out, EventType::BUILDING, (*b).first, (*b).second, (void*)id);
+            }
+        }
+        incNextBuilding = *df::global::building_next_id;
+    }
+
+    //every known building is still there unless the counts disagree
+    if ( all.size() == incBuildings.size() )
         return;
 
+    vector<int32_t> toDelete;
+    for ( auto a = incBuildings.begin(); a != incBuildings.end(); a++ ) {
+        if ( IdIndex::findIndex(IdIndex::BUILDINGS, *a) == -1 )
+            toDelete.push_back(*a);
+    }
+    for ( size_t a = 0; a < toDelete.size(); a++ ) {
+        int32_t id = toDelete[a];
+        incBuildings.erase(id);
+        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
+            callHandler(out, EventType::BUILDING, (*b).first, (*b).second, (void*)id);
+        }
+    }
+}
+
+static void manageBuildingEvent(color_ostream& out) {
+    HandlerList copy;
+    if ( copyHandlers(EventType::BUILDING, Backend::SCAN, copy) )
+        scanBuilding(out, copy);
+    if ( copyHandlers(EventType::BUILDING, Backend::INCREMENTAL, copy) )
+        incrementalBuilding(out, copy);
+}
+
+static void scanConstruction(color_ostream& out, HandlerList& copy) {
     unordered_set<df::construction*> constructionsNow(df::global::world->constructions.begin(), df::global::world->constructions.end());
     
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::CONSTRUCTION].begin(), handlers[EventType::CONSTRUCTION].end());
     for ( auto a = constructions.begin(); a != constructions.end(); a++ ) {
         df::construction* construction = *a;
         if ( constructionsNow.find(construction) != constructionsNow.end() )
             continue;
         for ( auto b = copy.begin(); b != copy.end(); b++ ) {
             EventHandler handle = (*b).second;
-            handle.eventHandler(out, (void*)construction);
+            callHandler(out, EventType::CONSTRUCTION, (*b).first, handle, (void*)construction);
         }
     }
 
@@ -453,7 +701,7 @@ static void manageConstructionEvent(color_ostream& out) {
             continue;
         for ( auto b = copy.begin(); b != copy.end(); b++ ) {
             EventHandler handle = (*b).second;
-            handle.eventHandler(out, (void*)construction);
+            callHandler(out, EventType::CONSTRUCTION, (*b).first, handle, (void*)construction);
         }
     }
     
@@ -461,6 +709,47 @@ static void manageConstructionEvent(color_ostream& out) {
     constructions.insert(constructionsNow.begin(), constructionsNow.end());
 }
 
+static void incrementalConstruction(color_ostream& out, HandlerList& copy) {
+    vector<df::construction*>& now = df::global::world->constructions;
+
+    //the common case is an untouched vector, which a memcmp settles without hashing anything
+    if ( now.size() == incConstructions.size() &&
+         (now.empty() || memcmp(&now[0], &incConstructions[0], now.size()*sizeof(df::construction*)) == 0) )
+        return;
+
+    //skip the shared prefix; only the tail can contain changes
+    size_t common = 0;
+    while ( common < now.size() && common < incConstructions.size() && now[common] == incConstructions[common] )
+        common++;
+
+    unordered_set<df::construction*> before(incConstructions.begin()+common, incConstructions.end());
+    unordered_set<df::construction*> after(now.begin()+common, now.end());
+    for ( auto a = before.begin(); a != before.end(); a++ ) {
+        if ( after.find(*a) != after.end() )
+            continue;
+        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
+            callHandler(out, EventType::CONSTRUCTION, (*b).first, (*b).second, (void*)*a);
+        }
+    }
+    for ( auto a = after.begin(); a != after.end(); a++ ) {
+        if ( before.find(*a) != before.end() )
+            continue;
+        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
+            callHandler(out, EventType::CONSTRUCTION, (*b).first, (*b).second, (void*)*a);
+        }
+    }
+
+    incConstructions.assign(now.begin(), now.end());
+}
+
+static void manageConstructionEvent(color_ostream& out) {
+    HandlerList copy;
+    if ( copyHandlers(EventType::CONSTRUCTION, Backend::SCAN, copy) )
+        scanConstruction(out, copy);
+    if ( copyHandlers(EventType::CONSTRUCTION, Backend::INCREMENTAL, copy) )
+        incrementalConstruction(out, copy);
+}
+
 static void manageSyndromeEvent(color_ostream& out) {
     if ( handlers[EventType::SYNDROME].empty() )
         return;
@@ -479,7 +768,7 @@ static void manageSyndromeEvent(color_ostream& out) {
             SyndromeData data(unit->id, b);
             for ( auto c = copy.begin(); c != copy.end(); c++ ) {
                 EventHandler handle = (*c).second;
-                handle.eventHandler(out, (void*)&data);
+                callHandler(out, EventType::SYNDROME, (*c).first, handle, (void*)&data);
             }
         }
     }
@@ -497,7 +786,7 @@ static void manageInvasionEvent(color_ostream& out) {
 
     for ( auto a = copy.begin(); a != copy.end(); a++ ) {
         EventHandler handle = (*a).second;
-        handle.eventHandler(out, (void*)nextInvasion);
+        callHandler(out, EventType::INVASION, (*a).first, handle, (void*)nextInvasion);
     }
 }
 
@@ -0,0 +1,225 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+
+#include "Internal.h"
+
+#include <vector>
+#include <cstring>
+using namespace std;
+
+#include "modules/IdIndex.h"
+#include "MiscUtils.h"
+
+#include "DataDefs.h"
+#include "df/world.h"
+#include "df/unit.h"
+#include "df/item.h"
+#include "df/building.h"
+
+using namespace DFHack;
+using namespace DFHack::IdIndex;
+using df::global::world;
+
+namespace {
+    struct Table
+    {
+        struct Entry
+        {
+            int32_t id;     // -1 if the slot is free
+            int32_t index;  // -1 if not in the vector any more
+        };
+
+        std::vector<Entry> entries;
+        size_t count;
+        size_t stale;       // stale entries found since the last rebuild
+        Stats stats;
+
+        Table() : count(0), stale(0) { memset(&stats, 0, sizeof(stats)); }
+
+        static size_t hash(int32_t id)
+        {
+            // Ids are mostly sequential; the multiply spreads them out
+            return size_t(uint32_t(id) * 2654435761U);
+        }
+
+        template<class T>
+        void rebuild(const std::vector<T*> &vec);
+
+        template<class T>
+        int32_t find(const std::vector<T*> &vec, int32_t id);
+
+        void clear()
+        {
+            entries.clear();
+            count = stale = 0;
+        }
+    };
+}
+
+template<class T>
+void Table::rebuild(const std::vector<T*> &vec)
+{
+    // Room for the vector to double before the next rebuild
+    size_t capacity = 64;
+    while (capacity < vec.size() * 4)
+        capacity *= 2;
+
+    Entry empty = { -1, -1 };
+    entries.assign(capacity, empty);
+    count = stale = 0;
+    stats.rebuilds++;
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < vec.size(); i++)
+    {
+        int32_t id = vec[i]->id;
+        size_t pos = hash(id) & mask;
+        while (entries[pos].id >= 0 && entries[pos].id != id)
+            pos = (pos + 1) & mask;
+
+        if (entries[pos].id < 0)
+            count++;
+        entries[pos].id = id;
+        entries[pos].index = int32_t(i);
+    }
+}
+
+template<class T>
+int32_t Table::find(const std::vector<T*> &vec, int32_t id)
+{
+    if (id < 0 || vec.empty())
+        return -1;
+
+    // The probe loop below needs a non-empty, power of two sized table
+    if (entries.empty() || entries.size() < vec.size() * 2 || stale > vec.size() / 8 + 64)
+        rebuild(vec);
+
+    size_t mask = entries.size() - 1;
+    size_t pos = hash(id) & mask;
+
+    for (; entries[pos].id >= 0; pos = (pos + 1) & mask)
+    {
+        Entry &entry = entries[pos];
+        if (entry.id != id)
+            continue;
+
+        int32_t idx = entry.index;
+        if (idx >= 0 && size_t(idx) < vec.size() && vec[idx]->id == id)
+        {
+            stats.hits++;
+            return idx;
+        }
+
+        // Moved or removed: patch the entry
+        stats.misses++;
+        stale++;
+        entry.index = binsearch_index(vec, id);
+        return entry.index;
+    }
+
+    // Not seen yet; ids that don't exist are not remembered
+    stats.misses++;
+    int32_t idx = binsearch_index(vec, id);
+    if (idx >= 0)
+    {
+        if ((count + 1) * 2 > entries.size())
+            rebuild(vec);
+        else
+        {
+            entries[pos].id = id;
+            entries[pos].index = idx;
+            count++;
+        }
+    }
+    return idx;
+}
+
+static Table tables[KIND_COUNT];
+
+int32_t IdIndex::findIndex(Kind kind, int32_t id)
+{
+    if (!world)
+        return -1;
+
+    switch (kind)
+    {
+    case UNITS:
+        return tables[kind].find(world->units.all, id);
+    case ITEMS:
+        return tables[kind].find(world->items.all, id);
+    case BUILDINGS:
+        return tables[kind].find(world->buildings.all, id);
+    default:
+        return -1;
+    }
+}
+
+df::unit *IdIndex::findUnit(int32_t id)
+{
+    int32_t idx = findIndex(UNITS, id);
+    return idx >= 0 ? world->units.all[idx] : NULL;
+}
+
+df::item *IdIndex::findItem(int32_t id)
+{
+    int32_t idx = findIndex(ITEMS, id);
+    return idx >= 0 ? world->items.all[idx] : NULL;
+}
+
+df::building *IdIndex::findBuilding(int32_t id)
+{
+    int32_t idx = findIndex(BUILDINGS, id);
+    return idx >= 0 ? world->buildings.all[idx] : NULL;
+}
+
+void IdIndex::getStats(Kind kind, Stats *out)
+{
+    CHECK_NULL_POINTER(out);
+    CHECK_INVALID_ARGUMENT(kind >= 0 && kind < KIND_COUNT);
+
+    Table &table = tables[kind];
+    table.stats.capacity = table.entries.size();
+    table.stats.entries = table.count;
+    *out = table.stats;
+}
+
+void IdIndex::clear()
+{
+    for (int i = 0; i < KIND_COUNT; i++)
+        tables[i].clear();
+}
+
+void IdIndex::onStateChange(color_ostream &out, state_change_event event)
+{
+    switch (event)
+    {
+    case SC_WORLD_UNLOADED:
+    case SC_MAP_UNLOADED:
+        clear();
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,670 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#include "Internal.h"
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cstring>
+#include <limits>
+using namespace std;
+
+#include "modules/ItemIndex.h"
+#include "modules/Items.h"
+#include "modules/Buildings.h"
+#include "modules/Maps.h"
+#include "Profiler.h"
+
+#include "DataDefs.h"
+#include "df/world.h"
+#include "df/item.h"
+#include "df/building.h"
+#include "df/items_other_id.h"
+
+using namespace DFHack;
+using namespace DFHack::ItemIndex;
+using namespace df::enums;
+using df::global::world;
+
+namespace {
+    // Slots of the records, in no particular order
+    typedef std::vector<int32_t> Bucket;
+
+    struct Record
+    {
+        df::item *item;
+        int32_t id;
+        bool live;
+        uint32_t seen;      // serial of the last full diff that found it
+
+        // Never change during the life of an item
+        df::item_type type;
+        int16_t subtype;
+        int16_t mat_type;
+        int32_t mat_index;
+
+        // Compared on every update
+        uint32_t flags;
+        df::coord pos;
+        size_t ref_count;
+
+        // Looked up again whenever the above change
+        int32_t container;  // item id, or -1
+        int32_t stockpile;  // building id, or -1
+        int32_t cell;       // index in by_cell, or -1
+        uint8_t flag_lists; // bit mask of FlagList
+
+        // Positions in the buckets, for removal
+        int32_t type_pos, material_pos, container_pos, stockpile_pos, cell_pos;
+        int32_t melt_pos, dump_pos, forbid_pos;
+    };
+
+    struct MaterialKey
+    {
+        int16_t type;
+        int16_t mat_type;
+        int32_t mat_index;
+        int16_t subtype;
+
+        MaterialKey(int16_t type, int16_t mat_type, int32_t mat_index, int16_t subtype)
+            : type(type), mat_type(mat_type), mat_index(mat_index), subtype(subtype) {}
+
+        bool operator< (const MaterialKey &b) const
+        {
+            if (type != b.type) return type < b.type;
+            if (mat_type != b.mat_type) return mat_type < b.mat_type;
+            if (mat_index != b.mat_index) return mat_index < b.mat_index;
+            return subtype < b.subtype;
+        }
+    };
+
+    struct CoordHash {
+        size_t operator()(const df::coord pos) const {
+            return pos.x*65537 + pos.y*17 + pos.z;
+        }
+    };
+
+    struct StockpileShape
+    {
+        int32_t id;
+        int32_t x1, y1, x2, y2, z;
+        uint32_t extents_hash;
+
+        bool operator!= (const StockpileShape &b) const
+        {
+            return id != b.id || x1 != b.x1 || y1 != b.y1 || x2 != b.x2 || y2 != b.y2 ||
+                   z != b.z || extents_hash != b.extents_hash;
+        }
+    };
+}
+
+static int32_t Record::*const flag_pos[FLAG_LIST_COUNT] = {
+    &Record::melt_pos, &Record::dump_pos, &Record::forbid_pos
+};
+
+static std::vector<Record> records;
+static std::vector<int32_t> free_slots;
+static std::unordered_map<df::item*, int32_t> by_pointer;
+
+// IN_PLAY as of the last update, and the slot of each item in it
+static std::vector<df::item*> last_items;
+static std::vector<int32_t> last_slots;
+
+static std::vector<Bucket> by_type;
+static std::map<MaterialKey, Bucket> by_material;
+static std::unordered_map<int32_t, Bucket> by_container;
+static std::unordered_map<int32_t, Bucket> by_stockpile;
+static Bucket by_flag[FLAG_LIST_COUNT];
+
+// One cell per map block
+static std::vector<Bucket> by_cell;
+static uint32_t cell_x = 0, cell_y = 0, cell_z = 0;
+
+static std::vector<StockpileShape> stockpile_shapes;
+static std::unordered_map<df::coord, int32_t, CoordHash> stockpile_tiles;
+
+static uint32_t update_serial = 1, last_update = 0;
+static uint32_t diff_serial = 0;
+static Stats stats;
+
+/*
+ * Buckets
+ */
+
+static void bucket_add(Bucket &bucket, int32_t slot, int32_t Record::*pos)
+{
+    records[slot].*pos = int32_t(bucket.size());
+    bucket.push_back(slot);
+}
+
+static void bucket_remove(Bucket &bucket, int32_t slot, int32_t Record::*pos)
+{
+    int32_t idx = records[slot].*pos;
+    int32_t last = bucket.back();
+    bucket[idx] = last;
+    records[last].*pos = idx;
+    bucket.pop_back();
+    records[slot].*pos = -1;
+}
+
+template<class Map, class Key>
+static void bucket_remove(Map &map, const Key &key, int32_t slot, int32_t Record::*pos)
+{
+    auto it = map.find(key);
+    bucket_remove(it->second, slot, pos);
+    if (it->second.empty())
+        map.erase(it);
+}
+
+static MaterialKey material_key(const Record &r)
+{
+    return MaterialKey(r.type, r.mat_type, r.mat_index, r.subtype);
+}
+
+/*
+ * Location of an item
+ */
+
+static void locate(Record &r)
+{
+    df::item *item = r.item;
+
+    r.flags = item->flags.whole;
+    r.pos = item->pos;
+    r.ref_count = item->general_refs.size();
+
+    df::item *container = Items::getContainer(item);
+    r.container = container ? container->id : -1;
+
+    r.stockpile = r.cell = -1;
+    if (item->flags.bits.on_ground)
+    {
+        uint32_t x = r.pos.x >> 4, y = r.pos.y >> 4, z = r.pos.z;
+        if (r.pos.x >= 0 && r.pos.y >= 0 && r.pos.z >= 0 && x < cell_x && y < cell_y && z < cell_z)
+            r.cell = int32_t((z*cell_y + y)*cell_x + x);
+
+        auto it = stockpile_tiles.find(r.pos);
+        if (it != stockpile_tiles.end())
+            r.stockpile = it->second;
+    }
+
+    r.flag_lists = 0;
+    if (item->flags.bits.melt)
+        r.flag_lists |= 1 << MELT;
+    if (item->flags.bits.dump)
+        r.flag_lists |= 1 << DUMP;
+    if (item->flags.bits.forbid)
+        r.flag_lists |= 1 << FORBID;
+}
+
+static void place(int32_t slot)
+{
+    const Record &r = records[slot];
+
+    if (r.container >= 0)
+        bucket_add(by_container[r.container], slot, &Record::container_pos);
+    if (r.stockpile >= 0)
+        bucket_add(by_stockpile[r.stockpile], slot, &Record::stockpile_pos);
+    if (r.cell >= 0)
+        bucket_add(by_cell[r.cell], slot, &Record::cell_pos);
+
+    for (int i = 0; i < FLAG_LIST_COUNT; i++)
+    {
+        if (r.flag_lists & (1 << i))
+            bucket_add(by_flag[i], slot, flag_pos[i]);
+    }
+}
+
+static void unplace(int32_t slot)
+{
+    const Record &r = records[slot];
+
+    if (r.container >= 0)
+        bucket_remove(by_container, r.container, slot, &Record::container_pos);
+    if (r.stockpile >= 0)
+        bucket_remove(by_stockpile, r.stockpile, slot, &Record::stockpile_pos);
+    if (r.cell >= 0)
+        bucket_remove(by_cell[r.cell], slot, &Record::cell_pos);
+
+    for (int i = 0; i < FLAG_LIST_COUNT; i++)
+    {
+        if (r.flag_lists & (1 << i))
+            bucket_remove(by_flag[i], slot, flag_pos[i]);
+    }
+}
+
+/*
+ * Creation and destruction
+ */
+
+static int32_t add_item(df::item *item)
+{
+    int32_t slot;
+    if (!free_slots.empty())
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else
+    {
+        slot = int32_t(records.size());
+        records.push_back(Record());
+    }
+
+    Record &r = records[slot];
+    memset(&r, 0, sizeof(r));
+    r.item = item;
+    r.id = item->id;
+    r.live = true;
+    r.type = item->getType();
+    r.subtype = item->getSubtype();
+    r.mat_type = item->getActualMaterial();
+    r.mat_index = item->getActualMaterialIndex();
+    locate(r);
+
+    size_t type_idx = size_t(r.type + 1);
+    if (type_idx >= by_type.size())
+        by_type.resize(type_idx + 1);
+    bucket_add(by_type[type_idx], slot, &Record::type_pos);
+    bucket_add(by_material[material_key(r)], slot, &Record::material_pos);
+    place(slot);
+
+    by_pointer[item] = slot;
+    return slot;
+}
+
+static void remove_item(int32_t slot)
+{
+    Record &r = records[slot];
+
+    unplace(slot);
+    bucket_remove(by_type[size_t(r.type + 1)], slot, &Record::type_pos);
+    bucket_remove(by_material, material_key(r), slot, &Record::material_pos);
+
+    auto it = by_pointer.find(r.item);
+    if (it != by_pointer.end() && it->second == slot)
+        by_pointer.erase(it);
+
+    r.live = false;
+    r.item = NULL;
+    free_slots.push_back(slot);
+}
+
+// Reindexes the item if its flags, position or references changed.
+static int32_t refresh(int32_t slot, df::item *item, bool force)
+{
+    Record &r = records[slot];
+
+    // Destroyed, and a new item allocated at the same address
+    if (item->id != r.id)
+    {
+        remove_item(slot);
+        stats.changed++;
+        return add_item(item);
+    }
+
+    if (!force && item->flags.whole == r.flags && item->pos == r.pos &&
+        item->general_refs.size() == r.ref_count)
+        return slot;
+
+    unplace(slot);
+    locate(r);
+    place(slot);
+    stats.changed++;
+    return slot;
+}
+
+/*
+ * Map and stockpile layout
+ */
+
+static bool check_grid()
+{
+    uint32_t x = 0, y = 0, z = 0;
+    if (Maps::IsValid())
+        Maps::getSize(x, y, z);
+
+    if (x == cell_x && y == cell_y && z == cell_z)
+        return false;
+
+    ItemIndex::clear();
+    cell_x = x; cell_y = y; cell_z = z;
+    by_cell.resize(size_t(x) * y * z);
+    return true;
+}
+
+static bool check_stockpiles()
+{
+    std::vector<StockpileShape> shapes;
+    std::vector<df::building*> buildings;
+
+    auto &all = world->buildings.all;
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        df::building *bld = all[i];
+        if (bld->getType() != building_type::Stockpile)
+            continue;
+
+        StockpileShape shape;
+        shape.id = bld->id;
+        shape.x1 = bld->x1; shape.y1 = bld->y1;
+        shape.x2 = bld->x2; shape.y2 = bld->y2;
+        shape.z = bld->z;
+        shape.extents_hash = 0;
+        if (bld->room.extents)
+        {
+            for (int j = 0; j < bld->room.width * bld->room.height; j++)
+                shape.extents_hash = shape.extents_hash*31 + bld->room.extents[j];
+        }
+
+        shapes.push_back(shape);
+        buildings.push_back(bld);
+    }
+
+    bool same = (shapes.size() == stockpile_shapes.size());
+    for (size_t i = 0; same && i < shapes.size(); i++)
+        same = !(shapes[i] != stockpile_shapes[i]);
+    if (same)
+        return false;
+
+    stockpile_shapes.swap(shapes);
+    stockpile_tiles.clear();
+
+    for (size_t i = 0; i < buildings.size(); i++)
+    {
+        df::building *bld = buildings[i];
+        for (int32_t x = bld->x1; x <= bld->x2; x++)
+        {
+            for (int32_t y = bld->y1; y <= bld->y2; y++)
+            {
+                if (Buildings::containsTile(bld, df::coord2d(x, y)))
+                    stockpile_tiles[df::coord(x, y, bld->z)] = bld->id;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Updates
+ */
+
+static void diff_all(std::vector<df::item*> &items, bool force)
+{
+    diff_serial++;
+    stats.full_diffs++;
+
+    std::vector<int32_t> slots(items.size());
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        df::item *item = items[i];
+        auto it = by_pointer.find(item);
+        int32_t slot;
+
+        if (it != by_pointer.end())
+            slot = refresh(it->second, item, force);
+        else
+        {
+            slot = add_item(item);
+            stats.changed++;
+        }
+
+        records[slot].seen = diff_serial;
+        slots[i] = slot;
+    }
+
+    // Whatever was not found any more is gone
+    for (size_t i = 0; i < last_slots.size(); i++)
+    {
+        int32_t slot = last_slots[i];
+        if (records[slot].live && records[slot].seen != diff_serial)
+        {
+            remove_item(slot);
+            stats.changed++;
+        }
+    }
+
+    last_items = items;
+    last_slots.swap(slots);
+}
+
+void ItemIndex::update(bool force)
+{
+    if (!force && last_update == update_serial)
+        return;
+
+    if (!world)
+    {
+        clear();
+        return;
+    }
+
+    static Profiler::Probe *probe = Profiler::getProbe("itemindex/update");
+    Profiler::Scope scope(probe);
+    uint64_t start = Profiler::now();
+
+    stats.updates++;
+    stats.changed = 0;
+
+    check_grid();
+    bool relocate = check_stockpiles();
+    last_update = update_serial;
+
+    auto &items = world->items.other[items_other_id::IN_PLAY];
+
+    // Nothing created or destroyed: just look for changed items
+    if (items.size() == last_items.size() &&
+        (items.empty() || memcmp(&items[0], &last_items[0], items.size() * sizeof(df::item*)) == 0))
+    {
+        for (size_t i = 0; i < items.size(); i++)
+            last_slots[i] = refresh(last_slots[i], items[i], relocate);
+    }
+    else
+        diff_all(items, relocate);
+
+    stats.last_time = Profiler::now() - start;
+}
+
+void ItemIndex::clear()
+{
+    records.clear();
+    free_slots.clear();
+    by_pointer.clear();
+    last_items.clear();
+    last_slots.clear();
+
+    by_type.clear();
+    by_material.clear();
+    by_container.clear();
+    by_stockpile.clear();
+    for (int i = 0; i < FLAG_LIST_COUNT; i++)
+        by_flag[i].clear();
+
+    by_cell.clear();
+    cell_x = cell_y = cell_z = 0;
+
+    stockpile_shapes.clear();
+    stockpile_tiles.clear();
+
+    last_update = 0;
+}
+
+void ItemIndex::getStats(Stats *out)
+{
+    stats.items = records.size() - free_slots.size();
+    *out = stats;
+}
+
+void ItemIndex::onUpdate()
+{
+    update_serial++;
+}
+
+void ItemIndex::onStateChange(color_ostream &out, state_change_event event)
+{
+    switch (event)
+    {
+    case SC_WORLD_UNLOADED:
+    case SC_MAP_LOADED:
+    case SC_MAP_UNLOADED:
+        clear();
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Queries
+ */
+
+static void append(std::vector<df::item*> *out, const Bucket &bucket)
+{
+    for (size_t i = 0; i < bucket.size(); i++)
+        out->push_back(records[bucket[i]].item);
+}
+
+void ItemIndex::findByType(std::vector<df::item*> *out, df::item_type type, int16_t subtype)
+{
+    CHECK_NULL_POINTER(out);
+    update();
+
+    size_t type_idx = size_t(type + 1);
+    if (type_idx >= by_type.size())
+        return;
+
+    const Bucket &bucket = by_type[type_idx];
+    for (size_t i = 0; i < bucket.size(); i++)
+    {
+        const Record &r = records[bucket[i]];
+        if (subtype == -1 || r.subtype == subtype)
+            out->push_back(r.item);
+    }
+}
+
+void ItemIndex::findByMaterial(std::vector<df::item*> *out, df::item_type type, int16_t subtype,
+                               int16_t mat_type, int32_t mat_index)
+{
+    CHECK_NULL_POINTER(out);
+    update();
+
+    if (subtype != -1)
+    {
+        auto it = by_material.find(MaterialKey(type, mat_type, mat_index, subtype));
+        if (it != by_material.end())
+            append(out, it->second);
+        return;
+    }
+
+    int16_t any = std::numeric_limits<int16_t>::min();
+    auto it = by_material.lower_bound(MaterialKey(type, mat_type, mat_index, any));
+    for (; it != by_material.end(); ++it)
+    {
+        const MaterialKey &key = it->first;
+        if (key.type != type || key.mat_type != mat_type || key.mat_index != mat_index)
+            break;
+        append(out, it->second);
+    }
+}
+
+void ItemIndex::findFlagged(std::vector<df::item*> *out, FlagList list)
+{
+    CHECK_NULL_POINTER(out);
+    CHECK_INVALID_ARGUMENT(list >= 0 && list < FLAG_LIST_COUNT);
+    update();
+
+    append(out, by_flag[list]);
+}
+
+static void append_contents(std::vector<df::item*> *out, size_t begin)
+{
+    // Breadth-first over everything appended from begin on
+    for (size_t i = begin; i < out->size(); i++)
+    {
+        auto it = by_container.find((*out)[i]->id);
+        if (it != by_container.end())
+            append(out, it->second);
+    }
+}
+
+void ItemIndex::findInStockpile(std::vector<df::item*> *out, df::building *stockpile, bool with_contents)
+{
+    CHECK_NULL_POINTER(out);
+    CHECK_NULL_POINTER(stockpile);
+    update();
+
+    size_t begin = out->size();
+
+    auto it = by_stockpile.find(stockpile->id);
+    if (it != by_stockpile.end())
+        append(out, it->second);
+
+    if (with_contents)
+        append_contents(out, begin);
+}
+
+void ItemIndex::findInContainer(std::vector<df::item*> *out, df::item *container)
+{
+    CHECK_NULL_POINTER(out);
+    CHECK_NULL_POINTER(container);
+    update();
+
+    auto it = by_container.find(container->id);
+    if (it != by_container.end())
+        append(out, it->second);
+}
+
+void ItemIndex::findInBox(std::vector<df::item*> *out, df::coord min, df::coord max)
+{
+    CHECK_NULL_POINTER(out);
+    update();
+
+    if (!cell_x || !cell_y || !cell_z)
+        return;
+
+    int x1 = std::max<int>(min.x >> 4, 0), x2 = std::min<int>(max.x >> 4, cell_x-1);
+    int y1 = std::max<int>(min.y >> 4, 0), y2 = std::min<int>(max.y >> 4, cell_y-1);
+    int z1 = std::max<int>(min.z, 0), z2 = std::min<int>(max.z, cell_z-1);
+
+    for (int z = z1; z <= z2; z++)
+    {
+        for (int y = y1; y <= y2; y++)
+        {
+            for (int x = x1; x <= x2; x++)
+            {
+                const Bucket &bucket = by_cell[(z*cell_y + y)*cell_x + x];
+                for (size_t i = 0; i < bucket.size(); i++)
+                {
+                    const Record &r = records[bucket[i]];
+                    if (r.pos.x >= min.x && r.pos.x <= max.x &&
+                        r.pos.y >= min.y && r.pos.y <= max.y)
+                        out->push_back(r.item);
+                }
+            }
+        }
+    }
+}
@@ -40,6 +40,7 @@ using namespace std;
 #include "modules/Items.h"
 #include "modules/Units.h"
 #include "modules/MapCache.h"
+#include "modules/IdIndex.h"
 #include "ModuleFactory.h"
 #include "Core.h"
 #include "Error.h"
@@ -480,7 +481,7 @@ df::item * Items::findItemByID(int32_t id)
 {
     if (id < 0)
         return 0;
-    return df::item::find(id);
+    return IdIndex::findItem(id);
 }
 
 bool Items::copyItem(df::item * itembase, DFHack::dfh_item &item)
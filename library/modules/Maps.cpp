@@ -31,6 +31,8 @@ distribution.
 #include <set>
 #include <cstdlib>
 #include <iostream>
+#include <new>
+#include <algorithm>
 using namespace std;
 
 #include "modules/Maps.h"
@@ -42,6 +44,8 @@ using namespace std;
 #include "ModuleFactory.h"
 #include "Core.h"
 #include "MiscUtils.h"
+#include "WorkerPool.h"
+#include "tinythread.h"
 
 #include "modules/Buildings.h"
 
@@ -666,10 +670,11 @@ bool Maps::canStepBetween(df::coord pos1, df::coord pos2)
 
 MapExtras::Block::Block(MapCache *parent, DFCoord _bcoord) : parent(parent)
 {
-    dirty_designations = false;
+    dirty_designations.clear();
     dirty_tiles = false;
-    dirty_temperatures = false;
-    dirty_occupancies = false;
+    dirty_temperatures.clear();
+    dirty_occupancies.clear();
+    queued = false;
     valid = false;
     bcoord = _bcoord;
     block = Maps::getBlock(bcoord);
@@ -800,6 +805,7 @@ bool MapExtras::Block::setTiletypeAt(df::coord2d pos, df::tiletype tt, bool forc
     pos = pos & 15;
 
     dirty_tiles = true;
+    if (!queued) queue();
     tiles->raw_tiles[pos.x][pos.y] = tt;
     tiles->dirty_raw.setassignment(pos, true);
 
@@ -893,46 +899,193 @@ void MapExtras::Block::ParseBasemats(TileInfo *tiles, BasematInfo *bmats)
     }
 }
 
+void MapExtras::Block::queue()
+{
+    // The cache is shared by the workers of a parallel scan, so blocks
+    // changed during one are found by WriteAll checking all of them.
+    if (parent->scanning)
+        return;
+
+    queued = true;
+    parent->dirty_blocks.push_back(this);
+}
+
+// Copies the changed tiles, each run of adjacent ones in one go.
+template<class T>
+static void copy_dirty_tiles(T (&dst)[16][16], const T (&src)[16][16],
+                             const MapExtras::TileDirtyMask &mask)
+{
+    for (int x = 0; x < 16; x++)
+    {
+        unsigned row = mask.rows[x];
+        if (row == 0xFFFF)
+        {
+            memcpy(dst[x], src[x], sizeof(dst[x]));
+            continue;
+        }
+
+        int y = 0;
+        while (row)
+        {
+            for (; !(row & 1); row >>= 1) y++;
+            int start = y;
+            for (; row & 1; row >>= 1) y++;
+            memcpy(&dst[x][start], &src[x][start], (y-start)*sizeof(T));
+        }
+    }
+}
+
+static uint32_t get_undo_value(df::map_block *block, int field, int x, int y)
+{
+    using MapExtras::UndoJournal;
+
+    switch (field)
+    {
+    case UndoJournal::DESIGNATION:
+        return block->designation[x][y].whole;
+    case UndoJournal::OCCUPANCY:
+        return block->occupancy[x][y].whole;
+    case UndoJournal::TEMPERATURE:
+        return block->temperature_1[x][y] | (uint32_t(block->temperature_2[x][y]) << 16);
+    case UndoJournal::TILETYPE:
+        return uint32_t(block->tiletype[x][y]);
+    default:
+        return 0;
+    }
+}
+
+static void set_undo_value(df::map_block *block, int field, int x, int y, uint32_t value)
+{
+    using MapExtras::UndoJournal;
+
+    switch (field)
+    {
+    case UndoJournal::DESIGNATION:
+        block->designation[x][y].whole = value;
+        break;
+    case UndoJournal::OCCUPANCY:
+        block->occupancy[x][y].whole = value;
+        break;
+    case UndoJournal::TEMPERATURE:
+        block->temperature_1[x][y] = uint16_t(value);
+        block->temperature_2[x][y] = uint16_t(value >> 16);
+        break;
+    case UndoJournal::TILETYPE:
+        block->tiletype[x][y] = df::tiletype(value);
+        break;
+    }
+}
+
+static void record_undo(std::vector<MapExtras::UndoJournal::Entry> *out, df::map_block *block,
+                        int field, const MapExtras::TileDirtyMask &mask)
+{
+    for (int x = 0; x < 16; x++)
+    {
+        if (!mask.rows[x])
+            continue;
+        for (int y = 0; y < 16; y++)
+        {
+            if (!(mask.rows[x] & (1 << y)))
+                continue;
+
+            MapExtras::UndoJournal::Entry entry;
+            entry.pos = block->map_pos + df::coord(x,y,0);
+            entry.field = uint8_t(field);
+            entry.value = get_undo_value(block, field, x, y);
+            out->push_back(entry);
+        }
+    }
+}
+
 bool MapExtras::Block::Write ()
 {
     if(!valid) return false;
 
-    if(dirty_designations)
+    queued = false;
+
+    UndoJournal *journal = parent->journal;
+    std::vector<UndoJournal::Entry> undo;
+
+    if(!dirty_designations.empty())
     {
-        COPY(block->designation, designation);
+        if (journal)
+            record_undo(&undo, block, UndoJournal::DESIGNATION, dirty_designations);
+        copy_dirty_tiles(block->designation, designation, dirty_designations);
         block->flags.bits.designated = true;
-        dirty_designations = false;
+        dirty_designations.clear();
     }
     if(dirty_tiles && tiles)
     {
         dirty_tiles = false;
 
-        for (int x = 0; x < 16; x++)
+        TileDirtyMask mask;
+        mask.clear();
+        for (int y = 0; y < 16; y++)
         {
-            for (int y = 0; y < 16; y++)
-            {
+            if (!tiles->dirty_raw.bits[y])
+                continue;
+            for (int x = 0; x < 16; x++)
                 if (tiles->dirty_raw.getassignment(x,y))
-                    block->tiletype[x][y] = tiles->raw_tiles[x][y];
-            }
+                    mask.set(df::coord2d(x,y));
         }
 
+        if (journal)
+            record_undo(&undo, block, UndoJournal::TILETYPE, mask);
+        copy_dirty_tiles(block->tiletype, tiles->raw_tiles, mask);
+
         delete tiles; tiles = NULL;
         delete basemats; basemats = NULL;
     }
-    if(dirty_temperatures)
+    if(!dirty_temperatures.empty())
     {
-        COPY(block->temperature_1, temp1);
-        COPY(block->temperature_2, temp2);
-        dirty_temperatures = false;
+        if (journal)
+            record_undo(&undo, block, UndoJournal::TEMPERATURE, dirty_temperatures);
+        copy_dirty_tiles(block->temperature_1, temp1, dirty_temperatures);
+        copy_dirty_tiles(block->temperature_2, temp2, dirty_temperatures);
+        dirty_temperatures.clear();
     }
-    if(dirty_occupancies)
+    if(!dirty_occupancies.empty())
     {
-        COPY(block->occupancy, occupancy);
-        dirty_occupancies = false;
+        if (journal)
+            record_undo(&undo, block, UndoJournal::OCCUPANCY, dirty_occupancies);
+        copy_dirty_tiles(block->occupancy, occupancy, dirty_occupancies);
+        dirty_occupancies.clear();
     }
+
+    if (!undo.empty())
+        journal->append(undo);
     return true;
 }
 
+static tthread::mutex journal_mutex;
+
+void MapExtras::UndoJournal::append(const std::vector<Entry> &batch)
+{
+    tthread::lock_guard<tthread::mutex> lock(journal_mutex);
+    entries.insert(entries.end(), batch.begin(), batch.end());
+}
+
+size_t MapExtras::UndoJournal::undo()
+{
+    size_t count = 0;
+
+    for (size_t i = entries.size(); i > 0; i--)
+    {
+        const Entry &entry = entries[i-1];
+        df::map_block *block = Maps::getTileBlock(entry.pos);
+        if (!block)
+            continue;
+
+        set_undo_value(block, entry.field, entry.pos.x&15, entry.pos.y&15, entry.value);
+        if (entry.field == DESIGNATION)
+            block->flags.bits.designated = true;
+        count++;
+    }
+
+    entries.clear();
+    return count;
+}
+
 void MapExtras::BlockInfo::prepare(Block *mblock)
 {
     this->mblock = mblock;
@@ -1013,9 +1166,13 @@ t_matpair MapExtras::BlockInfo::getBaseMaterial(df::tiletype tt, df::coord2d pos
         break;
 
     case LAVA_STONE:
-        if (auto details = parent->region_details[mblock->biomeRegionAt(pos)])
-            rv.mat_index = details->lava_stone;
+    {
+        // find() rather than [], as blocks may be parsed from several threads
+        auto it = parent->region_details.find(mblock->biomeRegionAt(pos));
+        if (it != parent->region_details.end() && it->second)
+            rv.mat_index = it->second->lava_stone;
         break;
+    }
 
     case PLANT:
         rv.mat_type = MaterialInfo::PLANT_BASE;
@@ -1289,14 +1446,26 @@ bool MapExtras::Block::removeItemOnGround(df::item *item)
     return true;
 }
 
-MapExtras::MapCache::MapCache()
+MapExtras::MapCache::MapCache(BlockStorage storage) : storage(storage)
 {
     valid = 0;
+    dense_index = NULL;
+    chunk_used = 0;
+    scanning = false;
+    unlisted_writes = false;
+    journal = NULL;
     Maps::getSize(x_bmax, y_bmax, z_max);
     x_tmax = x_bmax*16; y_tmax = y_bmax*16;
     validgeo = Maps::ReadGeology(&layer_mats, &geoidx);
     valid = true;
 
+    if (storage == DENSE_BLOCKS && x_bmax && y_bmax && z_max)
+    {
+        size_t count = size_t(x_bmax)*y_bmax*z_max;
+        dense_index = new Block*[count];
+        memset(dense_index, 0, count*sizeof(Block*));
+    }
+
     if (auto data = df::global::world->world_data)
     {
         for (size_t i = 0; i < data->region_details.size(); i++)
@@ -1329,34 +1498,166 @@ MapExtras::MapCache::MapCache()
     }
 }
 
-MapExtras::Block *MapExtras::MapCache::BlockAt(DFCoord blockcoord)
+MapExtras::MapCache::~MapCache()
+{
+    trash();
+    delete[] dense_index;
+}
+
+// Blocks are a few kilobytes each; 64 of them per chunk keeps the
+// allocation count low without holding much memory for small caches.
+static const size_t BLOCKS_PER_CHUNK = 64;
+
+MapExtras::Block *MapExtras::MapCache::loadBlock(DFCoord blockcoord)
 {
     if(!valid)
         return 0;
+    if(unsigned(blockcoord.x) >= x_bmax ||
+       unsigned(blockcoord.y) >= y_bmax ||
+       unsigned(blockcoord.z) >= z_max)
+        return 0;
+
+    if (dense_index)
+    {
+        Block *&slot = dense_index[(blockcoord.z*y_bmax + blockcoord.y)*x_bmax + blockcoord.x];
+        if (slot)
+            return slot;
+
+        if (block_chunks.empty() || chunk_used == BLOCKS_PER_CHUNK)
+        {
+            block_chunks.push_back(::operator new(sizeof(Block)*BLOCKS_PER_CHUNK));
+            chunk_used = 0;
+        }
+        void *mem = (char*)block_chunks.back() + sizeof(Block)*chunk_used++;
+        slot = new (mem) Block(this, blockcoord);
+        block_list.push_back(slot);
+        return slot;
+    }
+
     std::map <DFCoord, Block*>::iterator iter = blocks.find(blockcoord);
     if(iter != blocks.end())
-    {
         return (*iter).second;
+
+    Block * nblo = new Block(this, blockcoord);
+    blocks[blockcoord] = nblo;
+    block_list.push_back(nblo);
+    return nblo;
+}
+
+MapExtras::Block *MapExtras::MapCache::findLoaded(DFCoord blockcoord)
+{
+    if (dense_index)
+        return dense_index[(blockcoord.z*y_bmax + blockcoord.y)*x_bmax + blockcoord.x];
+
+    std::map <DFCoord, Block*>::iterator iter = blocks.find(blockcoord);
+    return (iter != blocks.end()) ? iter->second : NULL;
+}
+
+struct MapExtras::MapCache::BlockScan
+{
+    MapCache *cache;
+    block_function fn;
+    void *data;
+    DFCoord origin;
+    size_t size_x, size_y;
+};
+
+void MapExtras::MapCache::scanBlock(void *data, size_t index, unsigned worker)
+{
+    BlockScan *scan = (BlockScan*)data;
+    DFCoord pos(scan->origin.x + index % scan->size_x,
+                scan->origin.y + (index / scan->size_x) % scan->size_y,
+                scan->origin.z + index / (scan->size_x * scan->size_y));
+
+    // Only reads the cache, so it is safe from any number of workers
+    if (Block *b = scan->cache->findLoaded(pos))
+    {
+        if (b->valid)
+            scan->fn(scan->data, b, worker);
+        return;
+    }
+
+    if (!Maps::getBlock(pos))
+        return;
+
+    Block temp(scan->cache, pos);
+    scan->fn(scan->data, &temp, worker);
+}
+
+void MapExtras::MapCache::parallelForEachBlock(block_function fn, void *data, DFCoord bmin, DFCoord bmax)
+{
+    if (!valid)
+        return;
+
+    int x1 = std::max<int>(bmin.x, 0), x2 = std::min<int>(bmax.x, x_bmax-1);
+    int y1 = std::max<int>(bmin.y, 0), y2 = std::min<int>(bmax.y, y_bmax-1);
+    int z1 = std::max<int>(bmin.z, 0), z2 = std::min<int>(bmax.z, z_max-1);
+    if (x1 > x2 || y1 > y2 || z1 > z2)
+        return;
+
+    BlockScan scan;
+    scan.cache = this;
+    scan.fn = fn;
+    scan.data = data;
+    scan.origin = DFCoord(x1, y1, z1);
+    scan.size_x = x2-x1+1;
+    scan.size_y = y2-y1+1;
+
+    scanning = true;
+    WorkerPool::run(scan.size_x * scan.size_y * (z2-z1+1), &MapCache::scanBlock, &scan);
+    scanning = false;
+
+    // The workers could not queue the cached blocks they changed
+    unlisted_writes = true;
+}
+
+bool MapExtras::MapCache::WriteAll()
+{
+    if (unlisted_writes)
+    {
+        for (size_t i = 0; i < block_list.size(); i++)
+            if (block_list[i]->isDirty())
+                block_list[i]->Write();
+        unlisted_writes = false;
     }
     else
     {
-        if(unsigned(blockcoord.x) < x_bmax &&
-           unsigned(blockcoord.y) < y_bmax &&
-           unsigned(blockcoord.z) < z_max)
-        {
-            Block * nblo = new Block(this, blockcoord);
-            blocks[blockcoord] = nblo;
-            return nblo;
-        }
-        return 0;
+        for (size_t i = 0; i < dirty_blocks.size(); i++)
+            dirty_blocks[i]->Write();
+    }
+
+    dirty_blocks.clear();
+    return true;
+}
+
+void MapExtras::MapCache::trash()
+{
+    if (dense_index)
+    {
+        for (size_t i = 0; i < block_list.size(); i++)
+            block_list[i]->~Block();
+        for (size_t i = 0; i < block_chunks.size(); i++)
+            ::operator delete(block_chunks[i]);
+        block_chunks.clear();
+        chunk_used = 0;
+        memset(dense_index, 0, size_t(x_bmax)*y_bmax*z_max*sizeof(Block*));
+    }
+    else
+    {
+        for (size_t i = 0; i < block_list.size(); i++)
+            delete block_list[i];
+        blocks.clear();
     }
+    block_list.clear();
+    dirty_blocks.clear();
+    unlisted_writes = false;
 }
 
 void MapExtras::MapCache::resetTags()
 {
-    for (auto it = blocks.begin(); it != blocks.end(); ++it)
+    for (size_t i = 0; i < block_list.size(); i++)
     {
-        delete[] it->second->tags;
-        it->second->tags = NULL;
+        delete[] block_list[i]->tags;
+        block_list[i]->tags = NULL;
     }
 }
@@ -0,0 +1,364 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#include "Internal.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+#include "modules/Snapshot.h"
+#include "modules/Maps.h"
+#include "modules/World.h"
+#include "Profiler.h"
+#include "WorkerPool.h"
+
+#include "DataDefs.h"
+#include "df/world.h"
+#include "df/map_block.h"
+#include "df/plant.h"
+#include "df/construction.h"
+#include "df/unit.h"
+#include "df/item.h"
+#include "df/block_square_event_mineralst.h"
+
+using namespace DFHack;
+using df::global::world;
+
+static uint32_t next_serial = 0;
+
+/*
+ * Block
+ */
+
+int16_t Snapshot::Block::layerMaterialAt(df::coord2d p) const
+{
+    // Same lookup as MapExtras::BlockInfo::SquashRocks
+    df::tile_designation des = DesignationAt(p);
+    uint8_t biome = des.bits.biome;
+    if (biome >= eBiomeCount)
+        return -1;
+
+    uint8_t idx = region_offset[biome];
+    if (idx >= owner->layer_mats.size())
+        return -1;
+
+    const std::vector<int16_t> &layers = owner->layer_mats[idx];
+    if (des.bits.geolayer_index >= layers.size())
+        return -1;
+    return layers[des.bits.geolayer_index];
+}
+
+int16_t Snapshot::Block::veinMaterialAt(df::coord2d p) const
+{
+    using namespace df::enums::tiletype_material;
+
+    if (tileMaterial(tiletypeAt(p)) != MINERAL)
+        return -1;
+
+    // Later veins override earlier ones
+    for (uint32_t i = vein_count; i > 0; i--)
+    {
+        const VeinData &vein = owner->veins[vein_begin + i - 1];
+        if (vein.getassignment(p))
+            return vein.inorganic_mat;
+    }
+    return -1;
+}
+
+bool Snapshot::Block::GetGlobalFeature(t_feature *out) const
+{
+    *out = global_feature;
+    return out->type != (df::feature_type)-1;
+}
+
+bool Snapshot::Block::GetLocalFeature(t_feature *out) const
+{
+    *out = local_feature;
+    return out->type != (df::feature_type)-1;
+}
+
+const Snapshot::PlantData &Snapshot::Block::getPlant(size_t i) const
+{
+    return owner->plants[plant_begin + i];
+}
+
+/*
+ * Snapshot
+ */
+
+Snapshot::Snapshot()
+{
+    clear();
+}
+
+Snapshot::~Snapshot()
+{
+}
+
+void Snapshot::clear()
+{
+    parts = 0;
+    serial = 0;
+    year = tick = 0;
+    capture_time = 0;
+
+    x_bmax = y_bmax = z_bmax = 0;
+    region_origin = df::coord();
+    block_index.clear();
+    blocks.clear();
+    veins.clear();
+    plants.clear();
+    constructions.clear();
+    layer_mats.clear();
+
+    units.clear();
+    items.clear();
+}
+
+size_t Snapshot::getMemoryUsage() const
+{
+    size_t size = sizeof(*this);
+    size += block_index.capacity() * sizeof(int32_t);
+    size += blocks.capacity() * sizeof(Block);
+    size += veins.capacity() * sizeof(VeinData);
+    size += plants.capacity() * sizeof(PlantData);
+    size += constructions.capacity() * sizeof(ConstructionData);
+    for (size_t i = 0; i < layer_mats.size(); i++)
+        size += layer_mats[i].capacity() * sizeof(int16_t);
+    size += units.capacity() * sizeof(UnitData);
+    size += items.capacity() * sizeof(ItemData);
+    return size;
+}
+
+void Snapshot::capture(unsigned parts)
+{
+    static Profiler::Probe *probe = Profiler::getProbe("snapshot/capture");
+    Profiler::Scope scope(probe);
+
+    uint64_t start = Profiler::now();
+
+    clear();
+    this->serial = ++next_serial;
+    this->parts = parts;
+
+    if (world)
+    {
+        year = World::ReadCurrentYear();
+        tick = World::ReadCurrentTick();
+    }
+
+    if ((parts & MAP) && Maps::IsValid())
+        captureMap();
+    if ((parts & UNITS) && world)
+        captureUnits();
+    if ((parts & ITEMS) && world)
+        captureItems();
+
+    capture_time = Profiler::now() - start;
+}
+
+void Snapshot::captureMap()
+{
+    Maps::getSize(x_bmax, y_bmax, z_bmax);
+    region_origin = df::coord(world->map.region_x, world->map.region_y, world->map.region_z);
+
+    std::vector<df::coord2d> geoidx;
+    if (!Maps::ReadGeology(&layer_mats, &geoidx))
+        layer_mats.clear();
+
+    auto &map_blocks = world->map.map_blocks;
+
+    block_index.assign(x_bmax * y_bmax * z_bmax, -1);
+    blocks.resize(map_blocks.size());
+
+    size_t count = 0;
+    for (size_t i = 0; i < map_blocks.size(); i++)
+    {
+        df::map_block *mb = map_blocks[i];
+        df::coord bpos(mb->map_pos.x >> 4, mb->map_pos.y >> 4, mb->map_pos.z);
+        if (uint32_t(bpos.x) >= x_bmax || uint32_t(bpos.y) >= y_bmax || uint32_t(bpos.z) >= z_bmax)
+            continue;
+
+        Block &b = blocks[count];
+        block_index[(bpos.z*y_bmax + bpos.y)*x_bmax + bpos.x] = int32_t(count++);
+
+        b.owner = this;
+        b.pos = bpos;
+        b.region_pos = mb->region_pos;
+        memcpy(b.region_offset, mb->region_offset, sizeof(b.region_offset));
+        memcpy(b.tiletype, mb->tiletype, sizeof(b.tiletype));
+        memcpy(b.designation, mb->designation, sizeof(b.designation));
+        memcpy(b.occupancy, mb->occupancy, sizeof(b.occupancy));
+
+        Maps::ReadFeatures(mb, &b.local_feature, &b.global_feature);
+        b.local_feature.origin = b.global_feature.origin = NULL;
+
+        std::vector<df::block_square_event_mineralst *> mb_veins;
+        Maps::SortBlockEvents(mb, &mb_veins);
+
+        b.vein_begin = uint32_t(veins.size());
+        b.vein_count = uint32_t(mb_veins.size());
+        for (size_t j = 0; j < mb_veins.size(); j++)
+        {
+            VeinData vein;
+            vein.inorganic_mat = mb_veins[j]->inorganic_mat;
+            for (int y = 0; y < 16; y++)
+            {
+                uint16_t row = 0;
+                for (int x = 0; x < 16; x++)
+                    if (mb_veins[j]->getassignment(x,y))
+                        row |= uint16_t(1 << x);
+                vein.tile_bitmask[y] = row;
+            }
+            veins.push_back(vein);
+        }
+
+        b.plant_begin = uint32_t(plants.size());
+        b.plant_count = uint32_t(mb->plants.size());
+        for (size_t j = 0; j < mb->plants.size(); j++)
+        {
+            df::plant *pp = mb->plants[j];
+            PlantData plant;
+            plant.pos = pp->pos;
+            plant.material = pp->material;
+            plant.is_shrub = pp->flags.bits.is_shrub;
+            plants.push_back(plant);
+        }
+    }
+    blocks.resize(count);
+
+    auto &cons = world->constructions;
+    constructions.resize(cons.size());
+    for (size_t i = 0; i < cons.size(); i++)
+    {
+        ConstructionData &con = constructions[i];
+        con.pos = cons[i]->pos;
+        con.mat_type = cons[i]->mat_type;
+        con.mat_index = cons[i]->mat_index;
+        con.original_tile = cons[i]->original_tile;
+    }
+}
+
+void Snapshot::captureUnits()
+{
+    auto &all = world->units.all;
+    units.resize(all.size());
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        df::unit *unit = all[i];
+        UnitData &data = units[i];
+        data.id = unit->id;
+        data.race = unit->race;
+        data.caste = unit->caste;
+        data.sex = unit->sex;
+        data.civ_id = unit->civ_id;
+        data.hist_figure_id = unit->hist_figure_id;
+        data.profession = unit->profession;
+        data.pos = unit->pos;
+        data.flags1 = unit->flags1;
+        data.flags2 = unit->flags2;
+        data.flags3 = unit->flags3;
+        data.birth_year = unit->relations.birth_year;
+        data.curse_year = unit->relations.curse_year;
+        data.death_id = unit->counters.death_id;
+        data.curse_add_tags1 = unit->curse.add_tags1;
+        data.curse_add_tags2 = unit->curse.add_tags2;
+    }
+}
+
+void Snapshot::captureItems()
+{
+    auto &all = world->items.all;
+    items.resize(all.size());
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        df::item *item = all[i];
+        ItemData &data = items[i];
+        data.id = item->id;
+        data.type = item->getType();
+        data.subtype = item->getSubtype();
+        data.mat_type = item->getMaterial();
+        data.mat_index = item->getMaterialIndex();
+        data.quality = item->getQuality();
+        data.stack_size = item->getStackSize();
+        data.pos = item->pos;
+        data.flags = item->flags;
+    }
+}
+
+/*
+ * Parallel scans
+ */
+
+struct Snapshot::BlockScan
+{
+    const Snapshot *snapshot;
+    block_function fn;
+    void *data;
+    df::coord bmin;
+    int32_t x_size, y_size;
+};
+
+void Snapshot::scanBlock(void *data, size_t index, unsigned worker)
+{
+    BlockScan *scan = (BlockScan*)data;
+
+    int32_t x = scan->bmin.x + int32_t(index % scan->x_size);
+    index /= scan->x_size;
+    int32_t y = scan->bmin.y + int32_t(index % scan->y_size);
+    int32_t z = scan->bmin.z + int32_t(index / scan->y_size);
+
+    if (const Block *block = scan->snapshot->getBlock(x, y, z))
+        scan->fn(scan->data, block, worker);
+}
+
+void Snapshot::parallelForEachBlock(block_function fn, void *data, df::coord bmin, df::coord bmax) const
+{
+    if (!hasMap())
+        return;
+
+    int x1 = std::max<int>(bmin.x, 0), x2 = std::min<int>(bmax.x, x_bmax-1);
+    int y1 = std::max<int>(bmin.y, 0), y2 = std::min<int>(bmax.y, y_bmax-1);
+    int z1 = std::max<int>(bmin.z, 0), z2 = std::min<int>(bmax.z, z_bmax-1);
+    if (x1 > x2 || y1 > y2 || z1 > z2)
+        return;
+
+    BlockScan scan;
+    scan.snapshot = this;
+    scan.fn = fn;
+    scan.data = data;
+    scan.bmin = df::coord(x1, y1, z1);
+    scan.x_size = x2-x1+1;
+    scan.y_size = y2-y1+1;
+
+    size_t count = size_t(scan.x_size) * scan.y_size * (z2-z1+1);
+    WorkerPool::run(count, &scanBlock, &scan);
+}
+
+void Snapshot::parallelForEachBlock(block_function fn, void *data) const
+{
+    parallelForEachBlock(fn, data, df::coord(0,0,0), df::coord(x_bmax-1, y_bmax-1, z_bmax-1));
+}
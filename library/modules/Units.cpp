@@ -43,6 +43,7 @@ using namespace std;
 #include "modules/Items.h"
 #include "modules/Materials.h"
 #include "modules/Translation.h"
+#include "modules/IdIndex.h"
 #include "ModuleFactory.h"
 #include "Core.h"
 #include "MiscUtils.h"
@@ -234,7 +235,7 @@ void Units::CopyCreature(df::unit * source, t_unit & furball)
 
 int32_t Units::FindIndexById(int32_t creature_id)
 {
-    return df::unit::binsearch_index(world->units.all, creature_id);
+    return IdIndex::findIndex(IdIndex::UNITS, creature_id);
 }
 /*
 bool Creatures::WriteLabors(const uint32_t index, uint8_t labors[NUM_CREATURE_LABORS])
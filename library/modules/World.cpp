@@ -54,8 +54,9 @@ using namespace df::enums;
 using df::global::world;
 
 static int next_persistent_id = 0;
-static std::multimap<std::string, int> persistent_index;
-typedef std::pair<std::string, int> T_persistent_item;
+// Keys of the fake figures, sorted for prefix queries
+static std::multimap<std::string, df::historical_figure*> persistent_index;
+typedef std::pair<std::string, df::historical_figure*> T_persistent_item;
 
 bool World::ReadPauseState()
 {
@@ -183,7 +184,7 @@ static bool BuildPersistentCache()
         if (!hfvec[i]->name.has_name || hfvec[i]->name.first_name.empty())
             continue;
 
-        persistent_index.insert(T_persistent_item(hfvec[i]->name.first_name, -hfvec[i]->id));
+        persistent_index.insert(T_persistent_item(hfvec[i]->name.first_name, hfvec[i]));
     }
 
     return true;
@@ -208,7 +209,7 @@ PersistentDataItem World::AddPersistentData(const std::string &key)
 
     hfvec.insert(hfvec.begin(), hfig);
 
-    persistent_index.insert(T_persistent_item(key, -hfig->id));
+    persistent_index.insert(T_persistent_item(key, hfig));
 
     return dataFromHFig(hfig);
 }
@@ -219,8 +220,8 @@ PersistentDataItem World::GetPersistentData(const std::string &key)
         return PersistentDataItem();
 
     auto it = persistent_index.find(key);
-    if (it != persistent_index.end())
-        return GetPersistentData(it->second);
+    if (it != persistent_index.end() && it->second->name.has_name)
+        return dataFromHFig(it->second);
 
     return PersistentDataItem();
 }
@@ -282,9 +283,8 @@ void World::GetPersistentData(std::vector<PersistentDataItem> *vec, const std::s
 
     for (auto it = eqrange.first; it != eqrange.second; ++it)
     {
-        auto hfig = df::historical_figure::find(-it->second);
-        if (hfig && hfig->name.has_name)
-            vec->push_back(dataFromHFig(hfig));
+        if (it->second->name.has_name)
+            vec->push_back(dataFromHFig(it->second));
     }
 }
 
@@ -304,7 +304,7 @@ bool World::DeletePersistentData(const PersistentDataItem &item)
     {
         auto it = it2; ++it2;
 
-        if (it->second != -id)
+        if (it->second->id != id)
             continue;
 
         persistent_index.erase(it);
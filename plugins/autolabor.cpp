@@ -41,6 +41,7 @@
 
 #include "modules/MapCache.h"
 #include "modules/Items.h"
+#include "modules/ItemIndex.h"
 
 using std::string;
 using std::endl;
@@ -1549,7 +1550,15 @@ static int stockcheck(color_ostream &out, vector <string> & parameters)
 
     }
 
-    std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
+    // we really only care about MEAT, FISH, FISH_RAW, PLANT, CHEESE, FOOD, and EGG
+    static const df::item_type food_types[] = {
+        item_type::MEAT, item_type::FISH, item_type::FISH_RAW, item_type::PLANT,
+        item_type::CHEESE, item_type::FOOD, item_type::EGG
+    };
+
+    std::vector<df::item*> items;
+    for (size_t i = 0; i < sizeof(food_types)/sizeof(food_types[0]); i++)
+        ItemIndex::findByType(&items, food_types[i]);
 
     // Precompute a bitmask with the bad flags
     df::item_flags bad_flags;
@@ -1568,17 +1577,7 @@ static int stockcheck(color_ostream &out, vector <string> & parameters)
         if (item->flags.whole & bad_flags.whole)
             continue;
 
-        // we really only care about MEAT, FISH, FISH_RAW, PLANT, CHEESE, FOOD, and EGG
-
         df::item_type typ = item->getType();
-        if (typ != item_type::MEAT &&
-            typ != item_type::FISH &&
-            typ != item_type::FISH_RAW &&
-            typ != item_type::PLANT &&
-            typ != item_type::CHEESE &&
-            typ != item_type::FOOD &&
-            typ != item_type::EGG)
-            continue;
 
         df::item *container = 0;
         df::unit *holder = 0;
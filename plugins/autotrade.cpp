@@ -8,6 +8,7 @@
 #include "df/viewscreen_dwarfmodest.h"
 #include "df/building_stockpilest.h"
 #include "modules/Items.h"
+#include "modules/ItemIndex.h"
 #include "df/building_tradedepotst.h"
 #include "df/general_ref_building_holderst.h"
 #include "df/job.h"
@@ -118,6 +119,12 @@ public:
         return this->sp == sp;
     }
 
+    // The items in the stockpile, including the contents of bins and barrels
+    void getItems(std::vector<df::item*> *items)
+    {
+        ItemIndex::findInStockpile(items, sp, true);
+    }
+
     void save()
     {
         config = DFHack::World::AddPersistentData("autotrade/stockpiles");
@@ -326,9 +333,6 @@ static void mark_all_in_stockpiles(vector<StockpileInfo> &stockpiles, bool annou
         return;
     }
 
-    std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
-
-
     // Precompute a bitmask with the bad flags
     df::item_flags bad_flags;
     bad_flags.whole = 0;
@@ -342,18 +346,19 @@ static void mark_all_in_stockpiles(vector<StockpileInfo> &stockpiles, bool annou
 
     size_t marked_count = 0;
     size_t error_count = 0;
-    for (size_t i = 0; i < items.size(); i++)
+    std::vector<df::item*> items;
+    for (auto it = stockpiles.begin(); it != stockpiles.end(); it++)
     {
-        df::item *item = items[i];
-        if (item->flags.whole & bad_flags.whole)
-            continue;
-
-        if (!is_valid_item(item))
-            continue;
+        items.clear();
+        it->getItems(&items);
 
-        for (auto it = stockpiles.begin(); it != stockpiles.end(); it++)
+        for (size_t i = 0; i < items.size(); i++)
         {
-            if (!it->inStockpile(item))
+            df::item *item = items[i];
+            if (item->flags.whole & bad_flags.whole)
+                continue;
+
+            if (!is_valid_item(item))
                 continue;
 
             // In case of container, check contained items for mandates
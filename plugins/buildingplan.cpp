@@ -21,6 +21,7 @@
 #include "modules/Buildings.h"
 #include "modules/Maps.h"
 #include "modules/Items.h"
+#include "modules/ItemIndex.h"
 
 #include "TileTypes.h"
 #include "df/job_item.h"
@@ -652,7 +653,6 @@ public:
         int size = item_types::last_item_value - item_types::first_item_value+1;
         for (size_t i = 1; i < size; i++)
         {
-            is_relevant_item_type[(df::item_type) (i-1)] = false;
             string item_name = toLower(item_types::key_table[i]);
             string item_name_clean;
             for (auto c = item_name.begin(); c != item_name.end(); c++)
@@ -683,7 +683,6 @@ public:
                     item_for_building_type[btype] = itype;
                     default_item_filters[btype] =  ItemFilter();
                     available_item_vectors[itype] = vector<df::item *>();
-                    is_relevant_item_type[itype] = true;
 
                     if (planmode_enabled.find(btype) == planmode_enabled.end())
                     {
@@ -825,7 +824,6 @@ private:
     map<df::building_type, df::item_type> item_for_building_type;
     map<df::building_type, ItemFilter> default_item_filters;
     map<df::item_type, vector<df::item *>> available_item_vectors;
-    map<df::item_type, bool> is_relevant_item_type; //Needed for fast check when looping over all items
     bool quickfort_mode;
 
     vector<PlannedBuilding> planned_buildings;
@@ -848,34 +846,39 @@ private:
         F(in_building); F(construction); F(artifact);
 #undef F
 
-        std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
+        std::vector<df::item*> items;
 
-        for (size_t i = 0; i < items.size(); i++)
+        // Only the item types used by buildings
+        for (auto iter = available_item_vectors.begin(); iter != available_item_vectors.end(); iter++)
         {
-            df::item *item = items[i];
+            df::item_type itype = iter->first;
 
-            if (item->flags.whole & bad_flags.whole)
-                continue;
+            items.clear();
+            ItemIndex::findByType(&items, itype);
 
-            df::item_type itype = item->getType();
-            if (!is_relevant_item_type[itype])
-                continue;
+            for (size_t i = 0; i < items.size(); i++)
+            {
+                df::item *item = items[i];
 
-            if (itype == item_type::BOX && item->isBag())
-                continue; //Skip bags
+                if (item->flags.whole & bad_flags.whole)
+                    continue;
 
-            if (item->flags.bits.artifact)
-                continue;
+                if (itype == item_type::BOX && item->isBag())
+                    continue; //Skip bags
 
-            if (item->flags.bits.in_job ||
-                item->isAssignedToStockpile() ||
-                item->flags.bits.owned ||
-                item->flags.bits.in_chest)
-            {
-                continue;
-            }
+                if (item->flags.bits.artifact)
+                    continue;
 
-            available_item_vectors[itype].push_back(item);
+                if (item->flags.bits.in_job ||
+                    item->isAssignedToStockpile() ||
+                    item->flags.bits.owned ||
+                    item->flags.bits.in_chest)
+                {
+                    continue;
+                }
+
+                iter->second.push_back(item);
+            }
         }
     }
 };
@@ -14,6 +14,7 @@
 #include "modules/World.h"
 #include "modules/Units.h"
 #include "modules/Burrows.h"
+#include "modules/IdIndex.h"
 #include "TileTypes.h"
 
 #include "DataDefs.h"
@@ -162,7 +163,7 @@ static void detect_digging(color_ostream &out)
 {
     for (auto it = diggers.begin(); it != diggers.end();)
     {
-        auto worker = df::unit::find(it->first);
+        auto worker = IdIndex::findUnit(it->first);
 
         if (!worker || !worker->job.current_job ||
             worker->job.current_job->id != it->second.id)
@@ -457,7 +458,7 @@ static void copyUnits(df::burrow *target, df::burrow *source, bool enable)
 
     for (size_t i = 0; i < source->units.size(); i++)
     {
-        auto unit = df::unit::find(source->units[i]);
+        auto unit = IdIndex::findUnit(source->units[i]);
 
         if (unit)
             Burrows::setAssignedUnit(target, unit, enable);
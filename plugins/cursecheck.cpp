@@ -31,6 +31,7 @@ using namespace std;
 #include "modules/Units.h"
 #include <modules/Translation.h>
 #include "modules/Gui.h"
+#include "modules/Snapshot.h"
 #include "MiscUtils.h"
 
 #include "df/unit.h"
@@ -124,38 +125,38 @@ void setUnitNickname(df::unit *unit, const std::string &nick)
     }
 }
 
-std::string determineCurse(df::unit * unit)
+std::string determineCurse(const Snapshot::UnitData &unit)
 {
     string cursetype = "unknown";
             
     // ghosts: ghostly, duh
     // as of DF 34.05 and higher vampire ghosts and the like should not be possible
     // if they get reintroduced later it will become necessary to watch 'ghostly' seperately
-    if(unit->flags3.bits.ghostly)
+    if(unit.flags3.bits.ghostly)
         cursetype = "ghost";
 
     // zombies: undead or hate life (according to ag), not bloodsuckers
-    if( (unit->curse.add_tags1.bits.OPPOSED_TO_LIFE || unit->curse.add_tags1.bits.NOT_LIVING)
-        && !unit->curse.add_tags1.bits.BLOODSUCKER )
+    if( (unit.curse_add_tags1.bits.OPPOSED_TO_LIFE || unit.curse_add_tags1.bits.NOT_LIVING)
+        && !unit.curse_add_tags1.bits.BLOODSUCKER )
         cursetype = "zombie";
 
     // necromancers: alive, don't eat, don't drink, don't age
-    if(!unit->curse.add_tags1.bits.NOT_LIVING 
-        && unit->curse.add_tags1.bits.NO_EAT 
-        && unit->curse.add_tags1.bits.NO_DRINK 
-        && unit->curse.add_tags2.bits.NO_AGING
+    if(!unit.curse_add_tags1.bits.NOT_LIVING 
+        && unit.curse_add_tags1.bits.NO_EAT 
+        && unit.curse_add_tags1.bits.NO_DRINK 
+        && unit.curse_add_tags2.bits.NO_AGING
         )
         cursetype = "necromancer";
 
     // werecreatures: alive, DO eat, DO drink, don't age
-    if(!unit->curse.add_tags1.bits.NOT_LIVING 
-        && !unit->curse.add_tags1.bits.NO_EAT 
-        && !unit->curse.add_tags1.bits.NO_DRINK 
-        && unit->curse.add_tags2.bits.NO_AGING )
+    if(!unit.curse_add_tags1.bits.NOT_LIVING 
+        && !unit.curse_add_tags1.bits.NO_EAT 
+        && !unit.curse_add_tags1.bits.NO_DRINK 
+        && unit.curse_add_tags2.bits.NO_AGING )
         cursetype = "werebeast";
 
     // vampires: bloodsucker (obvious enough)
-    if(unit->curse.add_tags1.bits.BLOODSUCKER)
+    if(unit.curse_add_tags1.bits.BLOODSUCKER)
         cursetype = "vampire";
 
     return cursetype;
@@ -163,9 +164,7 @@ std::string determineCurse(df::unit * unit)
 
 command_result cursecheck (color_ostream &out, vector <string> & parameters)
 {
-    CoreSuspender suspend;
     int32_t cursorX, cursorY, cursorZ;
-    Gui::getCursorCoords(cursorX,cursorY,cursorZ);
 
     bool giveDetails = false;
     bool giveNick = false;
@@ -204,6 +203,15 @@ command_result cursecheck (color_ostream &out, vector <string> & parameters)
         }
     }
 
+    // Units are filtered on a copy; the game is only stopped again
+    // to name the few that turn out to be cursed
+    Snapshot snap;
+    {
+        CoreSuspender suspend;
+        Gui::getCursorCoords(cursorX,cursorY,cursorZ);
+        snap.capture(Snapshot::UNITS);
+    }
+
     // check whole map if no cursor is active
     bool checkWholeMap = false;
     if(cursorX == -30000)
@@ -212,29 +220,45 @@ command_result cursecheck (color_ostream &out, vector <string> & parameters)
         checkWholeMap = true;
     }
 
-    for(size_t i = 0; i < world->units.all.size(); i++)
+    std::vector<std::pair<int32_t, string> > cursed;    // unit id, curse type
+    const std::vector<Snapshot::UnitData> &units = snap.getUnits();
+
+    for(size_t i = 0; i < units.size(); i++)
     {
-        df::unit * unit = world->units.all[i];
+        const Snapshot::UnitData &unit = units[i];
 
         // don't spam all completely dead creatures if not explicitly wanted
-        if(unit->flags1.bits.dead && ignoreDead)
+        if(unit.flags1.bits.dead && ignoreDead)
         {
             continue;
         }
 
         // bail out if we have a map cursor and creature is not at that specific position
-        if ( !checkWholeMap && (unit->pos.x != cursorX || unit->pos.y != cursorY || unit->pos.z != cursorZ) )
+        if ( !checkWholeMap && (unit.pos.x != cursorX || unit.pos.y != cursorY || unit.pos.z != cursorZ) )
         {
             continue;
         }
 
         // non-cursed creatures have curse_year == -1
-        if(unit->relations.curse_year != -1)
+        if(unit.curse_year != -1)
         {
             cursecount++;
+            cursed.push_back(std::make_pair(unit.id, determineCurse(unit)));
+        }
+    }
+
+    if ((giveNick || giveDetails) && !cursed.empty())
+    {
+        CoreSuspender suspend;
+
+        for(size_t i = 0; i < cursed.size(); i++)
+        {
+            df::unit * unit = df::unit::find(cursed[i].first);
+            if (!unit)
+                continue;
+
+            const string &cursetype = cursed[i].second;
 
-            string cursetype = determineCurse(unit);
-                      
             if(giveNick)
             {
                 setUnitNickname(unit, cursetype); //"CURSED");
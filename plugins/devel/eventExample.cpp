@@ -35,7 +35,7 @@ DFhackCExport command_result plugin_init(color_ostream &out, std::vector<PluginC
 
 command_result eventExample(color_ostream& out, vector<string>& parameters) {
     EventManager::EventHandler initiateHandler(jobInitiated, 10);
-    EventManager::EventHandler completeHandler(jobCompleted, 5);
+    EventManager::EventHandler completeHandler(jobCompleted, 5, EventManager::Backend::INCREMENTAL);
     EventManager::EventHandler timeHandler(timePassed, 1);
     EventManager::EventHandler deathHandler(unitDeath, 500);
     EventManager::EventHandler itemHandler(itemCreate, 1000);
@@ -0,0 +1,132 @@
+// Measures virtual_cast throughput, alone and from several threads at once
+
+#include "Core.h"
+#include "Console.h"
+#include "Export.h"
+#include "PluginManager.h"
+#include "DataDefs.h"
+#include "Profiler.h"
+#include "tinythread.h"
+
+#include "df/world.h"
+#include "df/item.h"
+
+#include <stdlib.h>
+
+using std::vector;
+using std::string;
+
+using namespace DFHack;
+
+using df::global::world;
+
+struct BenchThread
+{
+    const vector<df::item*> *items;
+    int passes;
+    size_t found;
+};
+
+static void bench_thread(void *arg)
+{
+    BenchThread *bench = (BenchThread*)arg;
+    size_t found = 0;
+
+    for (int pass = 0; pass < bench->passes; pass++)
+    {
+        const vector<df::item*> &items = *bench->items;
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            // df::item has subclasses, so this always goes through the vtable lookup
+            if (virtual_cast<df::item>(items[i]))
+                found++;
+        }
+    }
+
+    bench->found = found;
+}
+
+command_result df_vtable_bench (color_ostream &out, vector <string> & parameters)
+{
+    int max_threads = 4;
+    int passes = 20;
+    if (parameters.size() > 0)
+        max_threads = atoi(parameters[0].c_str());
+    if (parameters.size() > 1)
+        passes = atoi(parameters[1].c_str());
+    if (max_threads < 1 || passes < 1)
+        return CR_WRONG_USAGE;
+
+    // Items must not be destroyed while the threads look at them
+    CoreSuspender suspend;
+
+    if (!world || world->items.all.empty())
+    {
+        out.printerr("No items to cast.\n");
+        return CR_FAILURE;
+    }
+
+    vector<df::item*> items = world->items.all;
+
+    out.print("%d items, %d passes per thread\n", int(items.size()), passes);
+
+    // Powers of two, always finishing with exactly max_threads
+    vector<int> counts;
+    for (int count = 1; count < max_threads; count *= 2)
+        counts.push_back(count);
+    counts.push_back(max_threads);
+
+    for (size_t run = 0; run < counts.size(); run++)
+    {
+        int count = counts[run];
+        vector<BenchThread> args(count);
+        vector<tthread::thread*> threads;
+
+        uint64_t start = Profiler::now();
+
+        for (int i = 0; i < count; i++)
+        {
+            args[i].items = &items;
+            args[i].passes = passes;
+            args[i].found = 0;
+            threads.push_back(new tthread::thread(bench_thread, &args[i]));
+        }
+
+        size_t found = 0;
+        for (int i = 0; i < count; i++)
+        {
+            threads[i]->join();
+            delete threads[i];
+            found += args[i].found;
+        }
+
+        uint64_t elapsed = Profiler::now() - start;
+        double casts = double(items.size()) * passes * count;
+
+        out.print("%2d threads: %8.2f ms, %8.2f million casts/sec, %d per thread\n",
+                  count, elapsed / 1000.0,
+                  elapsed ? casts / elapsed : 0.0,
+                  int(found / count));
+    }
+
+    return CR_OK;
+}
+
+DFHACK_PLUGIN("vtable-bench");
+
+DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
+{
+    commands.push_back(PluginCommand("vtable-bench",
+                                     "Measure virtual_cast throughput across threads",
+                                     df_vtable_bench, false,
+                                     "  vtable-bench [threads] [passes]\n"
+                                     "    Casts every item to df::item in 1, 2, 4...threads at once,\n"
+                                     "    up to the given count (default 4), with passes (default 20)\n"
+                                     "    over the item vector per thread, and prints casts per second.\n"));
+    return CR_OK;
+}
+
+DFhackCExport command_result plugin_shutdown ( color_ostream &out )
+{
+    return CR_OK;
+}
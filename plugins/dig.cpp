@@ -1021,7 +1021,7 @@ command_result digv (color_ostream &out, vector <string> & parameters)
         con.printerr("I won't dig the borders. That would be cheating!\n");
         return CR_FAILURE;
     }
-    MapExtras::MapCache * MCache = new MapExtras::MapCache;
+    MapExtras::MapCache * MCache = new MapExtras::MapCache(MapExtras::DENSE_BLOCKS);
     df::tile_designation des = MCache->designationAt(xy);
     df::tiletype tt = MCache->tiletypeAt(xy);
     int16_t veinmat = MCache->veinMaterialAt(xy);
@@ -1205,7 +1205,7 @@ command_result digl (color_ostream &out, vector <string> & parameters)
         con.printerr("I won't dig the borders. That would be cheating!\n");
         return CR_FAILURE;
     }
-    MapExtras::MapCache * MCache = new MapExtras::MapCache;
+    MapExtras::MapCache * MCache = new MapExtras::MapCache(MapExtras::DENSE_BLOCKS);
     df::tile_designation des = MCache->designationAt(xy);
     df::tiletype tt = MCache->tiletypeAt(xy);
     int16_t veinmat = MCache->veinMaterialAt(xy);
@@ -1422,7 +1422,7 @@ command_result digtype (color_ostream &out, vector <string> & parameters)
         return CR_FAILURE;
     }
     DFHack::DFCoord xy ((uint32_t)cx,(uint32_t)cy,cz);
-    MapExtras::MapCache * mCache = new MapExtras::MapCache;
+    MapExtras::MapCache * mCache = new MapExtras::MapCache(MapExtras::DENSE_BLOCKS);
     df::tile_designation baseDes = mCache->designationAt(xy);
     df::tiletype tt = mCache->tiletypeAt(xy);
     int16_t veinmat = mCache->veinMaterialAt(xy);
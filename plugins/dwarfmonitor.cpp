@@ -15,6 +15,7 @@
 #include "modules/Translation.h"
 #include "modules/World.h"
 #include "modules/Maps.h"
+#include "modules/IdIndex.h"
 #include "df/activity_event.h"
 #include "df/activity_entry.h"
 
@@ -1013,6 +1014,14 @@ static bool is_at_leisure(df::unit *unit)
     return false;
 }
 
+// State of the stats pass in progress, which may span several frames
+static bool stats_pass_active = false;
+static bool stats_pass_paused = false;
+static size_t stats_cursor = 0;
+// Units to look at, as of the start of the pass
+static std::vector<int32_t> stats_units;
+static int pending_misery[] = { 0, 0, 0, 0, 0, 0, 0 };
+
 static void reset()
 {
     work_history.clear();
@@ -1021,111 +1030,143 @@ static void reset()
         misery[i] = 0;
 
     misery_upto_date = false;
+    stats_pass_active = false;
+    stats_units.clear();
 }
 
-static void update_dwarf_stats(bool is_paused)
+static void update_unit_stats(df::unit *unit, bool is_paused)
 {
-    if (monitor_misery)
-    {
-        for (int i = 0; i < 7; i++)
-            misery[i] = 0;
-    }
+    if (!Units::isCitizen(unit))
+        return;
 
-    for (auto iter = world->units.active.begin(); iter != world->units.active.end(); iter++)
+    if (DFHack::Units::isDead(unit))
     {
-        df::unit* unit = *iter;
-        if (!Units::isCitizen(unit))
-            continue;
-
-        if (DFHack::Units::isDead(unit))
-        {
-            auto it = work_history.find(unit);
-            if (it != work_history.end())
-                work_history.erase(it);
+        auto it = work_history.find(unit);
+        if (it != work_history.end())
+            work_history.erase(it);
 
-            continue;
-        }
+        return;
+    }
 
-        if (monitor_misery)
-        {
-            int happy = unit->status.happiness;
-            if (happy == 0)         // miserable
-                misery[0]++;
-            else if (happy <= 25)   // very unhappy
-                misery[1]++;
-            else if (happy <= 50)   // unhappy
-                misery[2]++;
-            else if (happy <= 75)   // fine
-                misery[3]++;
-            else if (happy <= 125)  // quite content
-                misery[4]++;
-            else if (happy <= 150)  // happy
-                misery[5]++;
-            else                    // ecstatic
-                misery[6]++;
-        }
+    if (monitor_misery)
+    {
+        int happy = unit->status.happiness;
+        if (happy == 0)         // miserable
+            pending_misery[0]++;
+        else if (happy <= 25)   // very unhappy
+            pending_misery[1]++;
+        else if (happy <= 50)   // unhappy
+            pending_misery[2]++;
+        else if (happy <= 75)   // fine
+            pending_misery[3]++;
+        else if (happy <= 125)  // quite content
+            pending_misery[4]++;
+        else if (happy <= 150)  // happy
+            pending_misery[5]++;
+        else                    // ecstatic
+            pending_misery[6]++;
+    }
 
-        if (!monitor_jobs || is_paused)
-            continue;
+    if (!monitor_jobs || is_paused)
+        return;
 
-        if (unit->profession == profession::BABY ||
-            unit->profession == profession::CHILD ||
-            unit->profession == profession::DRUNK)
-        {
-            continue;
-        }
+    if (unit->profession == profession::BABY ||
+        unit->profession == profession::CHILD ||
+        unit->profession == profession::DRUNK)
+    {
+        return;
+    }
 
-        if (ENUM_ATTR(profession, military, unit->profession))
-        {
-            add_work_history(unit, JOB_MILITARY);
-            continue;
-        }
+    if (ENUM_ATTR(profession, military, unit->profession))
+    {
+        add_work_history(unit, JOB_MILITARY);
+        return;
+    }
 
-        if (!unit->job.current_job)
-        {
-            add_work_history(unit, JOB_IDLE);
-            continue;
-        }
+    if (!unit->job.current_job)
+    {
+        add_work_history(unit, JOB_IDLE);
+        return;
+    }
 
-        if (is_at_leisure(unit))
-        {
-            add_work_history(unit, JOB_LEISURE);
-            continue;
-        }
-         
-        add_work_history(unit, unit->job.current_job->job_type);
+    if (is_at_leisure(unit))
+    {
+        add_work_history(unit, JOB_LEISURE);
+        return;
     }
+
+    add_work_history(unit, unit->job.current_job->job_type);
 }
 
-DFhackCExport command_result plugin_onupdate (color_ostream &out)
+static bool start_stats_pass()
 {
     if (!monitor_jobs && !monitor_misery)
-        return CR_OK;
-
-    if(!Maps::IsValid())
-        return CR_OK;
+        return false;
 
     static decltype(world->frame_counter) last_frame_count = 0;
-    
+
     bool is_paused = DFHack::World::ReadPauseState();
     if (is_paused)
     {
         if (monitor_misery && !misery_upto_date)
             misery_upto_date = true;
         else
-            return CR_OK;
+            return false;
     }
     else
     {
         if (world->frame_counter - last_frame_count < DELTA_TICKS)
-            return CR_OK;
+            return false;
 
         last_frame_count = world->frame_counter;
     }
 
-    update_dwarf_stats(is_paused);
+    for (int i = 0; i < 7; i++)
+        pending_misery[i] = 0;
+
+    stats_pass_active = true;
+    stats_pass_paused = is_paused;
+    stats_cursor = 0;
+
+    // The active list changes between slices, so walk a copy of the ids
+    auto &units = world->units.active;
+    stats_units.resize(units.size());
+    for (size_t i = 0; i < units.size(); i++)
+        stats_units[i] = units[i]->id;
+    return true;
+}
 
-    return CR_OK;
+// Runs as a plugin task: walks the unit list in budgeted slices, and
+// publishes the misery counts once the whole list has been seen.
+static bool update_dwarf_stats(color_ostream &out, TaskBudget &budget)
+{
+    if (!Maps::IsValid())
+    {
+        stats_pass_active = false;
+        return true;
+    }
+
+    if (!stats_pass_active && !start_stats_pass())
+        return true;
+
+    while (stats_cursor < stats_units.size())
+    {
+        // Units that went away since the pass started are skipped
+        if (df::unit *unit = IdIndex::findUnit(stats_units[stats_cursor++]))
+            update_unit_stats(unit, stats_pass_paused);
+
+        if ((stats_cursor & 31) == 0 && budget.expired())
+            return false;
+    }
+
+    if (monitor_misery)
+    {
+        for (int i = 0; i < 7; i++)
+            misery[i] = pending_misery[i];
+    }
+
+    stats_pass_active = false;
+    return true;
 }
 
 static color_value monitor_colors[] = 
@@ -1291,6 +1332,8 @@ DFhackCExport command_result plugin_init(color_ostream &out, std::vector <Plugin
         "  Show statistics summary\n\n"
         ));
 
+    Core::getInstance().getPluginManager()->addTask(plugin_self, "stats", update_dwarf_stats);
+
     return CR_OK;
 }
 
@@ -146,7 +146,7 @@ command_result filltraffic(color_ostream &out, std::vector<std::string> & params
     }
 
     DFCoord xy ((uint32_t)cx,(uint32_t)cy,cz);
-    MapExtras::MapCache MCache;
+    MapExtras::MapCache MCache(MapExtras::DENSE_BLOCKS);
 
     df::tile_designation des = MCache.designationAt(xy);
     df::tiletype tt = MCache.tiletypeAt(xy);
@@ -332,7 +332,7 @@ command_result setAllMatching(color_ostream &out, checkTile checkProc,
         return CR_FAILURE;
     }
 
-    MapExtras::MapCache MCache;
+    MapExtras::MapCache MCache(MapExtras::DENSE_BLOCKS);
 
     out.print("Setting traffic...\n");
 
@@ -39,8 +39,10 @@ command_result isoWorldRemote (color_ostream &out, std::vector <std::string> & p
 static command_result GetEmbarkTile(color_ostream &stream, const TileRequest *in, EmbarkTile *out);
 static command_result GetEmbarkInfo(color_ostream &stream, const MapRequest *in, MapReply *out);
 static command_result GetRawNames(color_ostream &stream, const MapRequest *in, RawNames *out);
+static command_result StreamEmbarkTiles(color_ostream &stream, const MapRequest *in, ServerStream<EmbarkTileList> *out);
 
-bool gather_embark_tile_layer(int EmbX, int EmbY, int EmbZ, EmbarkTileLayer * tile, MapExtras::MapCache * MP);
+struct EmbarkBlockSample;
+bool gather_embark_tile_layer(const EmbarkBlockSample *layer, const EmbarkBlockSample *upper, EmbarkTileLayer * tile);
 bool gather_embark_tile(int EmbX, int EmbY, EmbarkTile * tile, MapExtras::MapCache * MP);
 
 
@@ -70,6 +72,7 @@ DFhackCExport RPCService *plugin_rpcconnect(color_ostream &)
     svc->addFunction("GetEmbarkTile", GetEmbarkTile);
     svc->addFunction("GetEmbarkInfo", GetEmbarkInfo);
     svc->addFunction("GetRawNames", GetRawNames);
+    svc->addStreamFunction("StreamEmbarkTiles", StreamEmbarkTiles);
     return svc;
 }
 
@@ -175,33 +178,35 @@ static command_result GetEmbarkTile(color_ostream &stream, const TileRequest *in
     return CR_OK;
 }
 
-static command_result GetEmbarkInfo(color_ostream &stream, const MapRequest *in, MapReply *out)
-{
+//Whether the map isoworld asks about is the one currently loaded.
+static bool is_map_available(const MapRequest *in) {
     if(!Core::getInstance().isWorldLoaded()) {
-        out->set_available(false);
-        return CR_OK;
+        return false;
     }
     if(!Core::getInstance().isMapLoaded()) {
-        out->set_available(false);
-        return CR_OK;
+        return false;
     }
     if(!df::global::gamemode) {
-        out->set_available(false);
-        return CR_OK;
+        return false;
     }
     if((*df::global::gamemode != game_mode::ADVENTURE) && (*df::global::gamemode != game_mode::DWARF)) {
-        out->set_available(false);
-        return CR_OK;
+        return false;
     }
     if(!DFHack::Maps::IsValid()) {
-        out->set_available(false);
-        return CR_OK;
+        return false;
     }
     if(!in->has_save_folder()) { //probably should send the stuff anyway, but nah.
-        out->set_available(false);
-        return CR_OK;
+        return false;
     }
     if(!(in->save_folder() == df::global::world->cur_savegame.save_dir)) { //isoworld has a different map loaded, don't bother trying to load tiles for it, we don't have them.
+        return false;
+    }
+    return true;
+}
+
+static command_result GetEmbarkInfo(color_ostream &stream, const MapRequest *in, MapReply *out)
+{
+    if(!is_map_available(in)) {
         out->set_available(false);
         return CR_OK;
     }
@@ -215,10 +220,74 @@ static command_result GetEmbarkInfo(color_ostream &stream, const MapRequest *in,
     return CR_OK;
 }
 
+//Sends the whole map one embark tile at a time, so neither side ever holds all of it.
+//The game is only suspended while each tile is gathered, not while it is sent.
+static command_result StreamEmbarkTiles(color_ostream &stream, const MapRequest *in, ServerStream<EmbarkTileList> *out)
+{
+    int size_x, size_y;
+    {
+        CoreSuspender suspend;
+        if(!is_map_available(in))
+            return CR_OK;
+        size_x = df::global::world->map.x_count_block / 3;
+        size_y = df::global::world->map.y_count_block / 3;
+    }
+
+    EmbarkTileList part;
+    for(int y = 0; y < size_y; y++) {
+        for(int x = 0; x < size_x; x++) {
+            part.Clear();
+            {
+                CoreSuspender suspend;
+                //The map may have been unloaded since the last tile.
+                if(!DFHack::Maps::IsValid())
+                    return CR_FAILURE;
+                MapExtras::MapCache MC;
+                gather_embark_tile(x * 3, y * 3, part.add_tile(), &MC);
+                MC.trash();
+            }
+            if(!out->write(part))
+                return out->isCancelled() ? CR_OK : CR_LINK_FAILURE;
+        }
+    }
+    return CR_OK;
+}
+
 int coord_to_index_48(int x, int y) {
     return y*48+x;
 }
 
+//What gather_embark_tile_layer needs from one map block, read out in parallel beforehand.
+struct EmbarkBlockSample {
+    bool valid;
+    df::tiletype tiletype[16][16];
+    df::tile_designation designation[16][16];
+    DFHack::t_matpair material[16][16];
+
+    EmbarkBlockSample() : valid(false) {}
+};
+
+struct EmbarkSampler {
+    int EmbX, EmbY;
+    std::vector<EmbarkBlockSample> *samples;
+
+    void operator() (MapExtras::Block *b, unsigned worker) {
+        df::coord pos = b->getCoord();
+        if(!b->getRaw())
+            return;
+        EmbarkBlockSample &sample = (*samples)[(pos.z*3 + pos.y-EmbY)*3 + pos.x-EmbX];
+        for(int block_y=0; block_y<16; block_y++) {
+            for(int block_x=0; block_x<16; block_x++) {
+                df::coord2d block_coord(block_x, block_y);
+                sample.tiletype[block_x][block_y] = b->tiletypeAt(block_coord);
+                sample.designation[block_x][block_y] = b->DesignationAt(block_coord);
+                sample.material[block_x][block_y] = b->staticMaterialAt(block_coord);
+            }
+        }
+        sample.valid = true;
+    }
+};
+
 bool gather_embark_tile(int EmbX, int EmbY, EmbarkTile * tile, MapExtras::MapCache * MP) {
     tile->set_is_valid(false);
     tile->set_world_x(df::global::world->map.region_x + (EmbX/3)); 
@@ -226,11 +295,22 @@ bool gather_embark_tile(int EmbX, int EmbY, EmbarkTile * tile, MapExtras::MapCac
     tile->set_world_z(df::global::world->map.region_z + 1); //adding one because floors get shifted one downwards.
     tile->set_current_year(*df::global::cur_year);
     tile->set_current_season(*df::global::cur_season);
+
+    //Parsing the blocks is the expensive part, so do all of them at once on every core.
+    int z_count = MP->maxZ();
+    std::vector<EmbarkBlockSample> samples(z_count * 9);
+    EmbarkSampler sampler;
+    sampler.EmbX = EmbX;
+    sampler.EmbY = EmbY;
+    sampler.samples = &samples;
+    MP->parallelForEachBlock(sampler, DFCoord(EmbX, EmbY, 0), DFCoord(EmbX+2, EmbY+2, z_count-1));
+
     int num_valid_layers = 0;
-    for(int z = 0; z < MP->maxZ(); z++)
+    for(int z = 0; z < z_count; z++)
     {
         EmbarkTileLayer * tile_layer = tile->add_tile_layer();
-        num_valid_layers += gather_embark_tile_layer(EmbX, EmbY, z, tile_layer, MP);
+        const EmbarkBlockSample * upper = (z+1 < z_count) ? &samples[(z+1)*9] : NULL;
+        num_valid_layers += gather_embark_tile_layer(&samples[z*9], upper, tile_layer);
     }
     if(num_valid_layers > 0)
         tile->set_is_valid(true);
@@ -238,7 +318,7 @@ bool gather_embark_tile(int EmbX, int EmbY, EmbarkTile * tile, MapExtras::MapCac
 }
 
 
-bool gather_embark_tile_layer(int EmbX, int EmbY, int EmbZ, EmbarkTileLayer * tile, MapExtras::MapCache * MP)
+bool gather_embark_tile_layer(const EmbarkBlockSample *layer, const EmbarkBlockSample *upper, EmbarkTileLayer * tile)
 {
     for(int i = tile->mat_type_table_size(); i < 2304; i++) { //This is needed so we have a full array to work with, otherwise the size isn't updated correctly.
         tile->add_mat_type_table(AIR);
@@ -247,32 +327,23 @@ bool gather_embark_tile_layer(int EmbX, int EmbY, int EmbZ, EmbarkTileLayer * ti
     int num_valid_blocks = 0;
     for(int yy = 0; yy < 3; yy++) {
         for(int xx = 0; xx < 3; xx++) {
-            DFCoord current_coord, upper_coord; 
-            current_coord.x = EmbX+xx;
-            current_coord.y = EmbY+yy;
-            current_coord.z = EmbZ;
-            upper_coord = current_coord;
-            upper_coord.z += 1;
-            MapExtras::Block * b = MP->BlockAt(current_coord);
-            MapExtras::Block * b_upper = MP->BlockAt(upper_coord);
-            if(b && b->getRaw()) {
+            const EmbarkBlockSample * b = &layer[yy*3+xx];
+            const EmbarkBlockSample * b_upper = upper ? &upper[yy*3+xx] : NULL;
+            if(b->valid) {
                 for(int block_y=0; block_y<16; block_y++) {
                     for(int block_x=0; block_x<16; block_x++) {
-                        df::coord2d block_coord;
-                        block_coord.x = block_x;
-                        block_coord.y = block_y;
-                        df::tiletype tile_type = b->tiletypeAt(block_coord);
+                        df::tiletype tile_type = b->tiletype[block_x][block_y];
                         df::tiletype upper_tile = df::tiletype::Void;
-                        if(b_upper && b_upper->getRaw()) {
-                            upper_tile = b_upper->tiletypeAt(block_coord);
+                        if(b_upper && b_upper->valid) {
+                            upper_tile = b_upper->tiletype[block_x][block_y];
                         }
-                        df::tile_designation designation = b->DesignationAt(block_coord);
+                        df::tile_designation designation = b->designation[block_x][block_y];
                         DFHack::t_matpair actual_mat;
                         if(tileShapeBasic(tileShape(upper_tile)) == tiletype_shape_basic::Floor && (tileMaterial(tile_type) != tiletype_material::FROZEN_LIQUID) && (tileMaterial(tile_type) != tiletype_material::BROOK)) { //if the upper tile is a floor, use that material instead. Unless it's ice.
-                            actual_mat = b_upper->staticMaterialAt(block_coord);
+                            actual_mat = b_upper->material[block_x][block_y];
                         }
                         else {
-                            actual_mat = b->staticMaterialAt(block_coord);
+                            actual_mat = b->material[block_x][block_y];
                         }
                         if(((tileMaterial(tile_type) == tiletype_material::FROZEN_LIQUID) || (tileMaterial(tile_type) == tiletype_material::BROOK)) && (tileShapeBasic(tileShape(tile_type)) == tiletype_shape_basic::Floor)) {
                         tile_type = tiletype::OpenSpace;
@@ -326,31 +397,7 @@ bool gather_embark_tile_layer(int EmbX, int EmbY, int EmbZ, EmbarkTileLayer * ti
 }
 
 static command_result GetRawNames(color_ostream &stream, const MapRequest *in, RawNames *out){
-    if(!Core::getInstance().isWorldLoaded()) {
-        out->set_available(false);
-        return CR_OK;
-    }
-    if(!Core::getInstance().isMapLoaded()) {
-        out->set_available(false);
-        return CR_OK;
-    }
-    if(!df::global::gamemode) {
-        out->set_available(false);
-        return CR_OK;
-    }
-    if((*df::global::gamemode != game_mode::ADVENTURE) && (*df::global::gamemode != game_mode::DWARF)) {
-        out->set_available(false);
-        return CR_OK;
-    }
-    if(!DFHack::Maps::IsValid()) {
-        out->set_available(false);
-        return CR_OK;
-    }
-    if(!in->has_save_folder()) { //probably should send the stuff anyway, but nah.
-        out->set_available(false);
-        return CR_OK;
-    }
-    if(!(in->save_folder() == df::global::world->cur_savegame.save_dir)) { //isoworld has a different map loaded, don't bother trying to load tiles for it, we don't have them.
+    if(!is_map_available(in)) {
         out->set_available(false);
         return CR_OK;
     }
@@ -443,7 +443,7 @@ command_result df_liquids_execute(color_ostream &out, OperationMode &cur_mode, d
         return CR_FAILURE;
     }
 
-    MapCache mcache;
+    MapCache mcache(MapExtras::DENSE_BLOCKS);
     coord_vec all_tiles = brush->points(mcache,cursor);
 
     // Force the game to recompute its walkability cache
@@ -0,0 +1,457 @@
+// Remote map viewing by deltas: clients get only the blocks that changed since
+// the version they already have, instead of re-reading the whole map.
+
+#include "Core.h"
+#include <Console.h>
+#include <Export.h>
+#include <PluginManager.h>
+
+#include "DataDefs.h"
+#include "df/world.h"
+#include "df/map_block.h"
+
+#include "modules/Maps.h"
+#include "modules/MapCache.h"
+
+#include "Profiler.h"
+#include "WorkerPool.h"
+#include "RemoteServer.h"
+#include "tinythread.h"
+
+#include "mapdelta.pb.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+using namespace DFHack;
+using namespace df::enums;
+using namespace mapdelta;
+
+DFHACK_PLUGIN("mapdelta");
+
+static command_result mapdelta_cmd(color_ostream &out, std::vector <std::string> & parameters);
+
+static command_result GetMapDelta(color_ostream &stream, const DeltaRequest *in, MapDelta *out);
+static command_result StreamMapDeltas(color_ostream &stream, const DeltaRequest *in, ServerStream<MapDelta> *out);
+
+DFhackCExport command_result plugin_init (color_ostream &out, std::vector <PluginCommand> &commands)
+{
+    commands.push_back(PluginCommand(
+        "mapdelta", "Show the state of the map change tracker.",
+        mapdelta_cmd, false,
+        "  Remote map viewers call the GetMapDelta and StreamMapDeltas RPC\n"
+        "  functions of this plugin to receive only the map blocks that changed.\n"
+        "  This command prints how much of the map is tracked.\n"
+    ));
+    return CR_OK;
+}
+
+DFhackCExport RPCService *plugin_rpcconnect(color_ostream &)
+{
+    RPCService *svc = new RPCService();
+    svc->addFunction("GetMapDelta", GetMapDelta);
+    svc->addStreamFunction("StreamMapDeltas", StreamMapDeltas);
+    return svc;
+}
+
+/*
+ * Change tracking
+ *
+ * Every block remembers a hash and a change stamp for each part. Blocks are
+ * only rehashed when a client asks about them, at most once per
+ * MIN_SCAN_INTERVAL; a part whose hash differs gets the next version as
+ * its stamp. All of this is only touched with the core suspended.
+ */
+
+enum {
+    PART_TILETYPES,
+    PART_DESIGNATIONS,
+    PART_LIQUIDS,
+    PART_TEMPERATURE,
+    PART_COUNT
+};
+
+static const uint32_t ALL_PARTS = (1 << PART_COUNT) - 1;
+
+// Lets several clients share one scan
+static const uint64_t MIN_SCAN_INTERVAL = 50000; // microseconds
+
+// Blocks per part of a streamed delta
+static const int STREAM_PART_BLOCKS = 64;
+
+// Idle streams still send an empty delta this often, to notice a lost client
+static const uint64_t STREAM_HEARTBEAT = 2000000; // microseconds
+
+struct BlockState
+{
+    bool present;
+    uint64_t scanned;
+    uint64_t hash[PART_COUNT];
+    uint32_t stamp[PART_COUNT];
+};
+
+static uint32_t generation = 0;
+static uint32_t version = 0;
+static uint32_t x_bmax = 0, y_bmax = 0, z_bmax = 0;
+static std::vector<BlockState> blocks;
+
+static uint64_t scan_count = 0, scan_time = 0;
+
+static void reset_tracker()
+{
+    generation++;
+    version = 0;
+    x_bmax = y_bmax = z_bmax = 0;
+    blocks.clear();
+}
+
+DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_change_event event)
+{
+    switch (event) {
+    case SC_MAP_LOADED:
+    case SC_MAP_UNLOADED:
+        reset_tracker();
+        break;
+    default:
+        break;
+    }
+    return CR_OK;
+}
+
+DFhackCExport command_result plugin_shutdown (color_ostream &out)
+{
+    blocks.clear();
+    return CR_OK;
+}
+
+static bool update_size()
+{
+    if (!Maps::IsValid())
+        return false;
+
+    uint32_t x, y, z;
+    Maps::getSize(x, y, z);
+    if (x != x_bmax || y != y_bmax || z != z_bmax || blocks.empty())
+    {
+        reset_tracker();
+        x_bmax = x; y_bmax = y; z_bmax = z;
+        blocks.resize(size_t(x) * y * z);
+        memset(&blocks[0], 0, blocks.size() * sizeof(BlockState));
+    }
+    return true;
+}
+
+static inline size_t block_index(df::coord pos)
+{
+    return (size_t(pos.z) * y_bmax + pos.y) * x_bmax + pos.x;
+}
+
+static inline uint64_t mix(uint64_t hash, uint32_t value)
+{
+    return (hash ^ value) * 0x100000001b3ULL;
+}
+
+static inline uint32_t liquid_bits(df::tile_designation des)
+{
+    return des.bits.flow_size | (des.bits.liquid_type << 3);
+}
+
+static inline uint32_t designation_bits(df::tile_designation des)
+{
+    des.bits.flow_size = 0;
+    des.bits.liquid_type = tile_liquid::Water;
+    return des.whole;
+}
+
+struct BlockHasher
+{
+    uint32_t new_version;
+    uint64_t now;
+    WorkerPool::PerWorker<int> changed;
+
+    BlockHasher() : changed(0) {}
+
+    void operator() (MapExtras::Block *b, unsigned worker)
+    {
+        BlockState &state = blocks[block_index(b->getCoord())];
+        if (state.present && now - state.scanned < MIN_SCAN_INTERVAL)
+            return;
+
+        uint64_t hash[PART_COUNT];
+        for (int i = 0; i < PART_COUNT; i++)
+            hash[i] = 0xcbf29ce484222325ULL;
+
+        for (int y = 0; y < 16; y++)
+        {
+            for (int x = 0; x < 16; x++)
+            {
+                df::coord2d p(x, y);
+                df::tile_designation des = b->DesignationAt(p);
+                hash[PART_TILETYPES] = mix(hash[PART_TILETYPES], b->tiletypeAt(p));
+                hash[PART_DESIGNATIONS] = mix(hash[PART_DESIGNATIONS], designation_bits(des));
+                hash[PART_LIQUIDS] = mix(hash[PART_LIQUIDS], liquid_bits(des));
+                hash[PART_TEMPERATURE] = mix(hash[PART_TEMPERATURE], b->temperature1At(p));
+            }
+        }
+
+        for (int i = 0; i < PART_COUNT; i++)
+        {
+            if (!state.present || state.hash[i] != hash[i])
+            {
+                state.hash[i] = hash[i];
+                state.stamp[i] = new_version;
+                changed[worker] = 1;
+            }
+        }
+
+        state.present = true;
+        state.scanned = now;
+    }
+};
+
+// Brings the stamps of the blocks in the box up to date.
+static void scan_blocks(df::coord bmin, df::coord bmax)
+{
+    static Profiler::Probe *probe = Profiler::getProbe("mapdelta/scan");
+    Profiler::Scope scope(probe);
+
+    uint64_t start = Profiler::now();
+
+    MapExtras::MapCache MC;
+    BlockHasher hasher;
+    hasher.new_version = version+1;
+    hasher.now = start;
+    MC.parallelForEachBlock(hasher, bmin, bmax);
+
+    for (size_t i = 0; i < hasher.changed.size(); i++)
+    {
+        if (hasher.changed[i])
+        {
+            version++;
+            break;
+        }
+    }
+
+    scan_count++;
+    scan_time += Profiler::now() - start;
+}
+
+static void get_box(const DeltaRequest *in, df::coord *bmin, df::coord *bmax)
+{
+    *bmin = df::coord(std::max<int>(in->min_x(), 0),
+                      std::max<int>(in->min_y(), 0),
+                      std::max<int>(in->min_z(), 0));
+    *bmax = df::coord(in->has_max_x() ? std::min<int>(in->max_x(), x_bmax-1) : x_bmax-1,
+                      in->has_max_y() ? std::min<int>(in->max_y(), y_bmax-1) : y_bmax-1,
+                      in->has_max_z() ? std::min<int>(in->max_z(), z_bmax-1) : z_bmax-1);
+}
+
+static uint32_t changed_parts(const BlockState &state, uint32_t since, uint32_t parts)
+{
+    uint32_t mask = 0;
+    if (!state.present)
+        return 0;
+    for (int i = 0; i < PART_COUNT; i++)
+    {
+        if ((parts & (1 << i)) && state.stamp[i] > since)
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+static void fill_block(MapExtras::MapCache &MC, df::coord pos, uint32_t mask, BlockDelta *out)
+{
+    out->set_x(pos.x);
+    out->set_y(pos.y);
+    out->set_z(pos.z);
+
+    MapExtras::Block *b = MC.BlockAt(pos);
+    if (!b || !b->is_valid())
+        return;
+
+    for (int y = 0; y < 16; y++)
+    {
+        for (int x = 0; x < 16; x++)
+        {
+            df::coord2d p(x, y);
+            df::tile_designation des = b->DesignationAt(p);
+            if (mask & (1 << PART_TILETYPES))
+                out->add_tiletypes(b->tiletypeAt(p));
+            if (mask & (1 << PART_DESIGNATIONS))
+                out->add_designations(designation_bits(des));
+            if (mask & (1 << PART_LIQUIDS))
+                out->add_liquids(liquid_bits(des));
+            if (mask & (1 << PART_TEMPERATURE))
+                out->add_temperatures(b->temperature1At(p));
+        }
+    }
+}
+
+static void fill_header(const DeltaRequest *in, MapDelta *out)
+{
+    out->set_generation(generation);
+    out->set_version(version);
+    out->set_reset(in->generation() != generation);
+    out->set_size_x(x_bmax);
+    out->set_size_y(y_bmax);
+    out->set_size_z(z_bmax);
+}
+
+/*
+ * Delta walk over a box, resumable at any block
+ */
+
+struct DeltaWalk
+{
+    df::coord bmin, bmax;
+    uint32_t since, parts;
+    size_t cursor, count;
+
+    void init(const DeltaRequest *in, size_t cursor_)
+    {
+        get_box(in, &bmin, &bmax);
+        since = (in->generation() == generation) ? in->since_version() : 0;
+        parts = in->parts() & ALL_PARTS;
+        cursor = cursor_;
+        count = (bmin.x > bmax.x || bmin.y > bmax.y || bmin.z > bmax.z) ? 0 :
+            size_t(bmax.x-bmin.x+1) * (bmax.y-bmin.y+1) * (bmax.z-bmin.z+1);
+    }
+
+    // Adds up to max_blocks changed blocks; returns false once the walk is over.
+    bool next(MapExtras::MapCache &MC, MapDelta *out, size_t max_blocks)
+    {
+        int size_x = bmax.x-bmin.x+1, size_y = bmax.y-bmin.y+1;
+        size_t added = 0;
+
+        for (; cursor < count; cursor++)
+        {
+            if (added >= max_blocks)
+                return true;
+
+            df::coord pos(bmin.x + cursor % size_x,
+                          bmin.y + (cursor / size_x) % size_y,
+                          bmin.z + cursor / (size_x * size_y));
+
+            uint32_t mask = changed_parts(blocks[block_index(pos)], since, parts);
+            if (mask)
+            {
+                fill_block(MC, pos, mask, out->add_blocks());
+                added++;
+            }
+        }
+
+        return false;
+    }
+};
+
+static command_result GetMapDelta(color_ostream &stream, const DeltaRequest *in, MapDelta *out)
+{
+    if (!update_size())
+        return CR_NOT_FOUND;
+
+    DeltaWalk walk;
+    walk.init(in, in->cursor());
+    if (walk.count == 0)
+        return CR_WRONG_USAGE;
+
+    // Continuations walk the state the first reply saw, plus newer changes
+    if (in->cursor() == 0)
+        scan_blocks(walk.bmin, walk.bmax);
+
+    fill_header(in, out);
+
+    MapExtras::MapCache MC;
+    size_t max_blocks = std::max<uint32_t>(in->max_blocks(), 1);
+    if (walk.next(MC, out, max_blocks))
+        out->set_next_cursor(uint32_t(walk.cursor));
+    MC.trash();
+
+    return CR_OK;
+}
+
+// Keeps sending deltas until the client cancels the call. The core is
+// only suspended while looking for changes and copying the blocks.
+static command_result StreamMapDeltas(color_ostream &stream, const DeltaRequest *in, ServerStream<MapDelta> *out)
+{
+    DeltaRequest req = *in;
+    DeltaWalk walk;
+    MapDelta part;
+    uint64_t last_write = 0;
+
+    for (;;)
+    {
+        bool first = true, more = true;
+
+        while (more)
+        {
+            part.Clear();
+            {
+                CoreSuspender suspend;
+
+                if (!update_size())
+                    return CR_NOT_FOUND;
+
+                if (first)
+                {
+                    walk.init(&req, 0);
+                    scan_blocks(walk.bmin, walk.bmax);
+                    fill_header(&req, &part);
+                    req.set_generation(generation);
+                    req.set_since_version(version);
+                    first = false;
+                }
+                else if (req.generation() != generation)
+                {
+                    // Reloaded halfway through; start over with a reset
+                    break;
+                }
+                else
+                {
+                    part.set_generation(generation);
+                    part.set_version(req.since_version());
+                }
+
+                MapExtras::MapCache MC;
+                more = walk.next(MC, &part, STREAM_PART_BLOCKS);
+                MC.trash();
+            }
+
+            part.set_complete(!more);
+
+            // Nothing changed: only check now and then that the client is still there
+            if (!more && part.blocks_size() == 0 && !part.reset() &&
+                Profiler::now() - last_write < STREAM_HEARTBEAT)
+                break;
+
+            if (!out->write(part))
+                return out->isCancelled() ? CR_OK : CR_LINK_FAILURE;
+
+            last_write = Profiler::now();
+        }
+
+        uint32_t interval = std::max<uint32_t>(req.interval_ms(), 10);
+        tthread::this_thread::sleep_for(tthread::chrono::milliseconds(interval));
+    }
+}
+
+static command_result mapdelta_cmd(color_ostream &out, std::vector <std::string> & parameters)
+{
+    if (!parameters.empty())
+        return CR_WRONG_USAGE;
+
+    CoreSuspender suspend;
+
+    size_t tracked = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+        tracked += blocks[i].present;
+
+    out.print("Map generation %u, version %u.\n", generation, version);
+    out.print("Tracking %u of %u blocks, %u KB.\n",
+              unsigned(tracked), unsigned(blocks.size()),
+              unsigned(blocks.size() * sizeof(BlockState) / 1024));
+    if (scan_count)
+        out.print("%u scans, %.2f ms on average.\n",
+                  unsigned(scan_count), scan_time / 1000.0 / scan_count);
+    return CR_OK;
+}
@@ -2,10 +2,13 @@
 #include "Console.h"
 #include "Export.h"
 #include "PluginManager.h"
-#include "modules/MapCache.h"
+#include "modules/Maps.h"
+#include "modules/Snapshot.h"
+#include "WorkerPool.h"
 using namespace DFHack;
 
 #include <fstream>
+#include <algorithm>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/gzip_stream.h>
@@ -13,8 +16,6 @@ using namespace google::protobuf::io;
 
 #include "DataDefs.h"
 #include "df/world.h"
-#include "df/plant.h"
-#include "modules/Constructions.h"
 
 #include "proto/Map.pb.h"
 #include "proto/Block.pb.h"
@@ -22,8 +23,6 @@ using namespace google::protobuf::io;
 using namespace DFHack;
 using df::global::world;
 
-typedef std::vector<df::plant *> PlantList;
-
 command_result mapexport (color_ostream &out, std::vector <std::string> & parameters);
 
 DFHACK_PLUGIN("mapexport");
@@ -80,6 +79,132 @@ static dfproto::Tile::TileMaterialType toProto(df::tiletype_material mat)
     return dfproto::Tile::AIR;
 }
 
+typedef std::map<df::coord,std::pair<uint32_t,uint16_t> > ConstructionMaterials;
+
+/*
+ * Builds the serialized blocks of a range of z levels in parallel; they
+ * are written out in order afterwards.
+ */
+struct ExportScan
+{
+    bool showHidden;
+    const ConstructionMaterials *constructionMaterials;
+    uint32_t x_max, y_max, z_base;
+    std::vector<std::string> blocks;   // by offset from z_base; empty if skipped
+
+    void operator() (const Snapshot::Block *b, unsigned worker)
+    {
+        df::coord pos = b->getCoord();
+
+        DFHack::t_feature blockFeatureGlobal;
+        DFHack::t_feature blockFeatureLocal;
+
+        dfproto::Block protoblock;
+        protoblock.set_x(pos.x);
+        protoblock.set_y(pos.y);
+        protoblock.set_z(pos.z);
+
+        // Find features
+        b->GetGlobalFeature(&blockFeatureGlobal);
+        b->GetLocalFeature(&blockFeatureLocal);
+
+        // Iterate over all the tiles in the block
+        for(uint32_t y = 0; y < 16; y++)
+        {
+            for(uint32_t x = 0; x < 16; x++)
+            {
+                df::coord2d coord(x, y);
+                df::tile_designation des = b->DesignationAt(coord);
+                df::tile_occupancy occ = b->OccupancyAt(coord);
+
+                // Skip hidden tiles
+                if (!showHidden && des.bits.hidden)
+                {
+                    continue;
+                }
+
+                dfproto::Tile *prototile = protoblock.add_tile();
+                prototile->set_x(x);
+                prototile->set_y(y);
+
+                // Check for liquid
+                if (des.bits.flow_size)
+                {
+                    prototile->set_liquid_type((dfproto::Tile::LiquidType)des.bits.liquid_type);
+                    prototile->set_flow_size(des.bits.flow_size);
+                }
+
+                df::tiletype type = b->tiletypeAt(coord);
+                prototile->set_type((dfproto::Tile::TileType)tileShape(type));
+                prototile->set_tile_material(toProto(tileMaterial(type)));
+
+                df::coord map_pos = df::coord(pos.x*16+x,pos.y*16+y,pos.z);
+                
+                switch (tileMaterial(type))
+                {
+                case tiletype_material::SOIL:
+                case tiletype_material::STONE:
+                    prototile->set_material_type(0);
+                    prototile->set_material_index(b->layerMaterialAt(coord));
+                    break;
+                case tiletype_material::MINERAL:
+                    prototile->set_material_type(0);
+                    prototile->set_material_index(b->veinMaterialAt(coord));
+                    break;
+                case tiletype_material::FEATURE:
+                    if (blockFeatureLocal.type != -1 && des.bits.feature_local)
+                    {
+                        if (blockFeatureLocal.type == feature_type::deep_special_tube
+                                && blockFeatureLocal.main_material == 0) // stone
+                        {
+                            prototile->set_material_type(0);
+                            prototile->set_material_index(blockFeatureLocal.sub_material);
+                        }
+                        if (blockFeatureGlobal.type != -1 && des.bits.feature_global
+                                && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
+                                && blockFeatureGlobal.main_material == 0) // stone
+                        {
+                            prototile->set_material_type(0);
+                            prototile->set_material_index(blockFeatureGlobal.sub_material);
+                        }
+                    }
+                    break;
+                case tiletype_material::CONSTRUCTION:
+                {
+                    ConstructionMaterials::const_iterator it = constructionMaterials->find(map_pos);
+                    if (it != constructionMaterials->end())
+                    {
+                        prototile->set_material_index(it->second.first);
+                        prototile->set_material_type(it->second.second);
+                    }
+                    break;
+                }
+                default:
+                    break;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < b->getPlantCount(); i++)
+        {
+            const Snapshot::PlantData & plant = b->getPlant(i);
+            df::coord2d loc(plant.pos.x, plant.pos.y);
+            loc = loc % 16;
+            if (showHidden || !b->DesignationAt(loc).bits.hidden)
+            {
+                dfproto::Plant *protoplant = protoblock.add_plant();
+                protoplant->set_x(loc.x);
+                protoplant->set_y(loc.y);
+                protoplant->set_is_shrub(plant.is_shrub);
+                protoplant->set_material(plant.material);
+            }
+        }
+
+        size_t index = ((pos.z - z_base)*y_max + pos.y)*x_max + pos.x;
+        protoblock.SerializeToString(&blocks[index]);
+    }
+};
+
 command_result mapexport (color_ostream &out, std::vector <std::string> & parameters)
 {
     bool showHidden = false;
@@ -105,20 +230,42 @@ command_result mapexport (color_ostream &out, std::vector <std::string> & parame
         }
     }
 
-    CoreSuspender suspend;
-
     uint32_t x_max=0, y_max=0, z_max=0;
 
-    if (!Maps::IsValid())
+    if (parameters.size() < filenameParameter)
     {
-        out.printerr("Map is not available!\n");
+        out.printerr("Please supply a filename.\n");
         return CR_FAILURE;
     }
 
-    if (parameters.size() < filenameParameter)
+    // The game only waits for the copy; the export itself runs after it resumes
+    Snapshot snap;
+    dfproto::Map protomap;
     {
-        out.printerr("Please supply a filename.\n");
-        return CR_FAILURE;
+        CoreSuspender suspend;
+
+        if (!Maps::IsValid())
+        {
+            out.printerr("Map is not available!\n");
+            return CR_FAILURE;
+        }
+
+        snap.capture(Snapshot::MAP);
+
+        // The material dictionary comes from the raws, so copy it now too
+        for (size_t i = 0; i < world->raws.inorganics.size(); i++)
+        {
+            dfproto::Material *protomaterial = protomap.add_inorganic_material();
+            protomaterial->set_index(i);
+            protomaterial->set_name(world->raws.inorganics[i]->id);
+        }
+
+        for (size_t i = 0; i < world->raws.plants.all.size(); i++)
+        {
+            dfproto::Material *protomaterial = protomap.add_organic_material();
+            protomaterial->set_index(i);
+            protomaterial->set_name(world->raws.plants.all[i]->id);
+        }
     }
 
     std::string filename = parameters[filenameParameter-1];
@@ -137,183 +284,60 @@ command_result mapexport (color_ostream &out, std::vector <std::string> & parame
 
     coded_output->WriteLittleEndian32(0x50414DDF); //Write our file header
 
-    Maps::getSize(x_max, y_max, z_max);
-    MapExtras::MapCache map;
-    DFHack::Materials *mats = Core::getInstance().getMaterials();
+    snap.getSize(x_max, y_max, z_max);
 
     out << "Writing  map info..." << std::endl;
 
-    dfproto::Map protomap;
     protomap.set_x_size(x_max);
     protomap.set_y_size(y_max);
     protomap.set_z_size(z_max);
 
     out << "Writing material dictionary..." << std::endl;
-    
-    for (size_t i = 0; i < world->raws.inorganics.size(); i++)
-    {
-        dfproto::Material *protomaterial = protomap.add_inorganic_material();
-        protomaterial->set_index(i);
-        protomaterial->set_name(world->raws.inorganics[i]->id);
-    }
 
-    for (size_t i = 0; i < world->raws.plants.all.size(); i++)
+    ConstructionMaterials constructionMaterials;
+    const std::vector<Snapshot::ConstructionData> &constructions = snap.getConstructions();
+    for (size_t i = 0; i < constructions.size(); i++)
     {
-        dfproto::Material *protomaterial = protomap.add_organic_material();
-        protomaterial->set_index(i);
-        protomaterial->set_name(world->raws.plants.all[i]->id);
-    }
-
-    std::map<df::coord,std::pair<uint32_t,uint16_t> > constructionMaterials;
-    if (Constructions::isValid())
-    {
-        for (uint32_t i = 0; i < Constructions::getCount(); i++)
-        {
-            df::construction *construction = Constructions::getConstruction(i);
-            constructionMaterials[construction->pos] = std::make_pair(construction->mat_index, construction->mat_type);
-        }
+        const Snapshot::ConstructionData &construction = constructions[i];
+        constructionMaterials[construction.pos] = std::make_pair(construction.mat_index, construction.mat_type);
     }
         
     coded_output->WriteVarint32(protomap.ByteSize());
     protomap.SerializeToCodedStream(coded_output);
     
-    DFHack::t_feature blockFeatureGlobal;
-    DFHack::t_feature blockFeatureLocal;
-
     out.print("Writing map block information");
 
-    for(uint32_t z = 0; z < z_max; z++)
-    {
-        for(uint32_t b_y = 0; b_y < y_max; b_y++)
-        {
-            for(uint32_t b_x = 0; b_x < x_max; b_x++)
-            {
-                if (b_x == 0 && b_y == 0 && z % 10 == 0) out.print(".");
-                // Get the map block
-                df::coord2d blockCoord(b_x, b_y);
-                MapExtras::Block *b = map.BlockAt(DFHack::DFCoord(b_x, b_y, z));
-                if (!b || !b->is_valid())
-                {
-                    continue;
-                }
-
-                dfproto::Block protoblock;
-                protoblock.set_x(b_x);
-                protoblock.set_y(b_y);
-                protoblock.set_z(z);
+    ExportScan scan;
+    scan.showHidden = showHidden;
+    scan.constructionMaterials = &constructionMaterials;
+    scan.x_max = x_max;
+    scan.y_max = y_max;
 
-                // Find features
-                b->GetGlobalFeature(&blockFeatureGlobal);
-                b->GetLocalFeature(&blockFeatureLocal);
-
-                int global_z = df::global::world->map.region_z + z;
-
-                // Iterate over all the tiles in the block
-                for(uint32_t y = 0; y < 16; y++)
-                {
-                    for(uint32_t x = 0; x < 16; x++)
-                    {
-                        df::coord2d coord(x, y);
-                        df::tile_designation des = b->DesignationAt(coord);
-                        df::tile_occupancy occ = b->OccupancyAt(coord);
-
-                        // Skip hidden tiles
-                        if (!showHidden && des.bits.hidden)
-                        {
-                            continue;
-                        }
-
-                        dfproto::Tile *prototile = protoblock.add_tile();
-                        prototile->set_x(x);
-                        prototile->set_y(y);
-
-                        // Check for liquid
-                        if (des.bits.flow_size)
-                        {
-                            prototile->set_liquid_type((dfproto::Tile::LiquidType)des.bits.liquid_type);
-                            prototile->set_flow_size(des.bits.flow_size);
-                        }
-
-                        df::tiletype type = b->tiletypeAt(coord);
-                        prototile->set_type((dfproto::Tile::TileType)tileShape(type));
-                        prototile->set_tile_material(toProto(tileMaterial(type)));
+    // Scan a few z levels at a time on all cores, then write them in order
+    const uint32_t z_batch = 10;
+    for (uint32_t z = 0; z < z_max; z += z_batch)
+    {
+        uint32_t z_end = std::min(z + z_batch, z_max);
+        out.print(".");
 
-                        df::coord map_pos = df::coord(b_x*16+x,b_y*16+y,z);
-                        
-                        switch (tileMaterial(type))
-                        {
-                        case tiletype_material::SOIL:
-                        case tiletype_material::STONE:
-                            prototile->set_material_type(0);
-                            prototile->set_material_index(b->layerMaterialAt(coord));
-                            break;
-                        case tiletype_material::MINERAL:
-                            prototile->set_material_type(0);
-                            prototile->set_material_index(b->veinMaterialAt(coord));
-                            break;
-                        case tiletype_material::FEATURE:
-                            if (blockFeatureLocal.type != -1 && des.bits.feature_local)
-                            {
-                                if (blockFeatureLocal.type == feature_type::deep_special_tube
-                                        && blockFeatureLocal.main_material == 0) // stone
-                                {
-                                    prototile->set_material_type(0);
-                                    prototile->set_material_index(blockFeatureLocal.sub_material);
-                                }
-                                if (blockFeatureGlobal.type != -1 && des.bits.feature_global
-                                        && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
-                                        && blockFeatureGlobal.main_material == 0) // stone
-                                {
-                                    prototile->set_material_type(0);
-                                    prototile->set_material_index(blockFeatureGlobal.sub_material);
-                                }
-                            }
-                            break;
-                        case tiletype_material::CONSTRUCTION:
-                            if (constructionMaterials.find(map_pos) != constructionMaterials.end())
-                            {
-                                prototile->set_material_index(constructionMaterials[map_pos].first);
-                                prototile->set_material_type(constructionMaterials[map_pos].second);
-                            }
-                            break;
-                        default:
-                            break;
-                        }
-                    }
-                }
+        scan.z_base = z;
+        scan.blocks.clear();
+        scan.blocks.resize(x_max * y_max * (z_end - z));
+        snap.parallelForEachBlock(scan, DFCoord(0, 0, z), DFCoord(x_max-1, y_max-1, z_end-1));
 
-                if (b->getRaw())
-                {
-                    PlantList *plants = &b->getRaw()->plants;
-                    for (PlantList::const_iterator it = plants->begin(); it != plants->end(); it++)
-                    {
-                        const df::plant & plant = *(*it);
-                        df::coord2d loc(plant.pos.x, plant.pos.y);
-                        loc = loc % 16;
-                        if (showHidden || !b->DesignationAt(loc).bits.hidden)
-                        {
-                            dfproto::Plant *protoplant = protoblock.add_plant();
-                            protoplant->set_x(loc.x);
-                            protoplant->set_y(loc.y);
-                            protoplant->set_is_shrub(plant.flags.bits.is_shrub);
-                            protoplant->set_material(plant.material);
-                        }
-                    }
-                }
-                
-                coded_output->WriteVarint32(protoblock.ByteSize());
-                protoblock.SerializeToCodedStream(coded_output);
-            } // block x
-            // Clean uneeded memory
-            map.trash();
-        } // block y
-    } // z
+        for (size_t i = 0; i < scan.blocks.size(); i++)
+        {
+            if (scan.blocks[i].empty())
+                continue;
+            coded_output->WriteVarint32(scan.blocks[i].size());
+            coded_output->WriteString(scan.blocks[i]);
+        }
+    }
 
     delete coded_output;
     delete zip_output;
     delete raw_output;
 
-    mats->Finish();
     out.print("\nMap succesfully exported!\n");
     return CR_OK;
 }
@@ -17,9 +17,11 @@ using namespace std;
 #include "Console.h"
 #include "Export.h"
 #include "PluginManager.h"
-#include "modules/MapCache.h"
+#include "modules/Maps.h"
+#include "modules/Snapshot.h"
 
 #include "MiscUtils.h"
+#include "WorkerPool.h"
 
 #include "DataDefs.h"
 #include "df/world.h"
@@ -71,6 +73,15 @@ struct matdata
         }
         return count;
     }
+    void merge(const matdata &other)
+    {
+        count += other.count;
+        if (other.lower_z != invalid_z)
+        {
+            add(other.lower_z, 0);
+            add(other.upper_z, 0);
+        }
+    }
     unsigned int count;
     int lower_z;
     int upper_z;
@@ -96,8 +107,6 @@ struct shallower : public binary_function<_Tp, _Tp, bool>
 typedef std::map<int16_t, matdata> MatMap;
 typedef std::vector< pair<int16_t, matdata> > MatSorter;
 
-typedef std::vector<df::plant *> PlantList;
-
 #define TO_PTR_VEC(obj_vec, ptr_vec) \
     ptr_vec.clear(); \
     for (size_t i = 0; i < obj_vec.size(); i++) \
@@ -493,6 +502,196 @@ static command_result embark_prospector(color_ostream &out, df::viewscreen_choos
     return CR_OK;
 }
 
+struct ProspectData
+{
+    bool hasAquifer;
+    bool hasDemonTemple;
+    bool hasLair;
+    MatMap baseMats;
+    MatMap layerMats;
+    MatMap veinMats;
+    MatMap plantMats;
+    MatMap treeMats;
+
+    matdata liquidWater;
+    matdata liquidMagma;
+    matdata aquiferTiles;
+    matdata tubeTiles;
+
+    ProspectData() : hasAquifer(false), hasDemonTemple(false), hasLair(false) {}
+
+    static void merge(MatMap &to, const MatMap &from)
+    {
+        for (MatMap::const_iterator it = from.begin(); it != from.end(); ++it)
+            to[it->first].merge(it->second);
+    }
+
+    void merge(const ProspectData &other)
+    {
+        hasAquifer |= other.hasAquifer;
+        hasDemonTemple |= other.hasDemonTemple;
+        hasLair |= other.hasLair;
+        merge(baseMats, other.baseMats);
+        merge(layerMats, other.layerMats);
+        merge(veinMats, other.veinMats);
+        merge(plantMats, other.plantMats);
+        merge(treeMats, other.treeMats);
+        liquidWater.merge(other.liquidWater);
+        liquidMagma.merge(other.liquidMagma);
+        aquiferTiles.merge(other.aquiferTiles);
+        tubeTiles.merge(other.tubeTiles);
+    }
+};
+
+struct ProspectScan
+{
+    bool showHidden;
+    bool showPlants;
+    bool showSlade;
+    bool showTemple;
+    int region_z;
+
+    WorkerPool::PerWorker<ProspectData> results;
+
+    void operator() (const Snapshot::Block *b, unsigned worker)
+    {
+        ProspectData &data = results[worker];
+
+        DFHack::t_feature blockFeatureGlobal;
+        DFHack::t_feature blockFeatureLocal;
+
+        // Find features
+        b->GetGlobalFeature(&blockFeatureGlobal);
+        b->GetLocalFeature(&blockFeatureLocal);
+
+        int global_z = region_z + b->getCoord().z;
+
+        // Iterate over all the tiles in the block
+        for(uint32_t y = 0; y < 16; y++)
+        {
+            for(uint32_t x = 0; x < 16; x++)
+            {
+                df::coord2d coord(x, y);
+                df::tile_designation des = b->DesignationAt(coord);
+                df::tile_occupancy occ = b->OccupancyAt(coord);
+
+                // Skip hidden tiles
+                if (!showHidden && des.bits.hidden)
+                {
+                    continue;
+                }
+
+                // Check for aquifer
+                if (des.bits.water_table)
+                {
+                    data.hasAquifer = true;
+                    data.aquiferTiles.add(global_z);
+                }
+
+                // Check for lairs
+                if (occ.bits.monster_lair)
+                {
+                    data.hasLair = true;
+                }
+
+                // Check for liquid
+                if (des.bits.flow_size)
+                {
+                    if (des.bits.liquid_type == tile_liquid::Magma)
+                        data.liquidMagma.add(global_z);
+                    else
+                        data.liquidWater.add(global_z);
+                }
+
+                df::tiletype type = b->tiletypeAt(coord);
+                df::tiletype_shape tileshape = tileShape(type);
+                df::tiletype_material tilemat = tileMaterial(type);
+
+                // We only care about these types
+                switch (tileshape)
+                {
+                case tiletype_shape::WALL:
+                case tiletype_shape::FORTIFICATION:
+                    break;
+                case tiletype_shape::EMPTY:
+                    /* A heuristic: tubes inside adamantine have EMPTY:AIR tiles which
+                       still have feature_local set. Also check the unrevealed status,
+                       so as to exclude any holes mined by the player. */
+                    if (tilemat == tiletype_material::AIR &&
+                        des.bits.feature_local && des.bits.hidden &&
+                        blockFeatureLocal.type == feature_type::deep_special_tube)
+                    {
+                        data.tubeTiles.add(global_z);
+                    }
+                default:
+                    continue;
+                }
+
+                // Count the material type
+                data.baseMats[tilemat].add(global_z);
+
+                // Find the type of the tile
+                switch (tilemat)
+                {
+                case tiletype_material::SOIL:
+                case tiletype_material::STONE:
+                    data.layerMats[b->layerMaterialAt(coord)].add(global_z);
+                    break;
+                case tiletype_material::MINERAL:
+                    data.veinMats[b->veinMaterialAt(coord)].add(global_z);
+                    break;
+                case tiletype_material::FEATURE:
+                    if (blockFeatureLocal.type != -1 && des.bits.feature_local)
+                    {
+                        if (blockFeatureLocal.type == feature_type::deep_special_tube
+                                && blockFeatureLocal.main_material == 0) // stone
+                        {
+                            data.veinMats[blockFeatureLocal.sub_material].add(global_z);
+                        }
+                        else if (showTemple
+                                 && blockFeatureLocal.type == feature_type::deep_surface_portal)
+                        {
+                            data.hasDemonTemple = true;
+                        }
+                    }
+
+                    if (showSlade && blockFeatureGlobal.type != -1 && des.bits.feature_global
+                            && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
+                            && blockFeatureGlobal.main_material == 0) // stone
+                    {
+                        data.layerMats[blockFeatureGlobal.sub_material].add(global_z);
+                    }
+                    break;
+                case tiletype_material::LAVA_STONE:
+                    // TODO ?
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+
+        // Check plants this way, as the other way wasn't getting them all
+        // and we can check visibility more easily here
+        if (showPlants)
+        {
+            for (size_t i = 0; i < b->getPlantCount(); i++)
+            {
+                const Snapshot::PlantData & plant = b->getPlant(i);
+                df::coord2d loc(plant.pos.x, plant.pos.y);
+                loc = loc % 16;
+                if (showHidden || !b->DesignationAt(loc).bits.hidden)
+                {
+                    if(plant.is_shrub)
+                        data.plantMats[plant.material].add(global_z);
+                    else
+                        data.treeMats[plant.material].add(global_z);
+                }
+            }
+        }
+    }
+};
+
 command_result prospector (color_ostream &con, vector <string> & parameters)
 {
     bool showHidden = false;
@@ -520,198 +719,62 @@ command_result prospector (color_ostream &con, vector <string> & parameters)
             return CR_WRONG_USAGE;
     }
 
-    CoreSuspender suspend;
-
-    // Embark screen active: estimate using world geology data
-    if (VIRTUAL_CAST_VAR(screen, df::viewscreen_choose_start_sitest, Core::getTopViewscreen()))
-        return embark_prospector(con, screen, showHidden, showValue);
-
-    if (!Maps::IsValid())
+    // Only copy the map while the game is stopped; the scan runs after it resumes
+    Snapshot snap;
     {
-        con.printerr("Map is not available!\n");
-        return CR_FAILURE;
-    }
-
-    uint32_t x_max = 0, y_max = 0, z_max = 0;
-    Maps::getSize(x_max, y_max, z_max);
-    MapExtras::MapCache map;
-
-    DFHack::Materials *mats = Core::getInstance().getMaterials();
+        CoreSuspender suspend;
 
-    DFHack::t_feature blockFeatureGlobal;
-    DFHack::t_feature blockFeatureLocal;
+        // Embark screen active: estimate using world geology data
+        if (VIRTUAL_CAST_VAR(screen, df::viewscreen_choose_start_sitest, Core::getTopViewscreen()))
+            return embark_prospector(con, screen, showHidden, showValue);
 
-    bool hasAquifer = false;
-    bool hasDemonTemple = false;
-    bool hasLair = false;
-    MatMap baseMats;
-    MatMap layerMats;
-    MatMap veinMats;
-    MatMap plantMats;
-    MatMap treeMats;
-
-    matdata liquidWater;
-    matdata liquidMagma;
-    matdata aquiferTiles;
-    matdata tubeTiles;
-
-    uint32_t vegCount = 0;
-
-    for(uint32_t z = 0; z < z_max; z++)
-    {
-        for(uint32_t b_y = 0; b_y < y_max; b_y++)
+        if (!Maps::IsValid())
         {
-            for(uint32_t b_x = 0; b_x < x_max; b_x++)
-            {
-                // Get the map block
-                df::coord2d blockCoord(b_x, b_y);
-                MapExtras::Block *b = map.BlockAt(DFHack::DFCoord(b_x, b_y, z));
-                if (!b || !b->is_valid())
-                {
-                    continue;
-                }
-
-                // Find features
-                b->GetGlobalFeature(&blockFeatureGlobal);
-                b->GetLocalFeature(&blockFeatureLocal);
-
-                int global_z = world->map.region_z + z;
-
-                // Iterate over all the tiles in the block
-                for(uint32_t y = 0; y < 16; y++)
-                {
-                    for(uint32_t x = 0; x < 16; x++)
-                    {
-                        df::coord2d coord(x, y);
-                        df::tile_designation des = b->DesignationAt(coord);
-                        df::tile_occupancy occ = b->OccupancyAt(coord);
-
-                        // Skip hidden tiles
-                        if (!showHidden && des.bits.hidden)
-                        {
-                            continue;
-                        }
+            con.printerr("Map is not available!\n");
+            return CR_FAILURE;
+        }
 
-                        // Check for aquifer
-                        if (des.bits.water_table)
-                        {
-                            hasAquifer = true;
-                            aquiferTiles.add(global_z);
-                        }
+        snap.capture(Snapshot::MAP);
+    }
 
-                        // Check for lairs
-                        if (occ.bits.monster_lair)
-                        {
-                            hasLair = true;
-                        }
+    ProspectScan scan;
+    scan.showHidden = showHidden;
+    scan.showPlants = showPlants;
+    scan.showSlade = showSlade;
+    scan.showTemple = showTemple;
+    scan.region_z = snap.getRegionOrigin().z;
 
-                        // Check for liquid
-                        if (des.bits.flow_size)
-                        {
-                            if (des.bits.liquid_type == tile_liquid::Magma)
-                                liquidMagma.add(global_z);
-                            else
-                                liquidWater.add(global_z);
-                        }
+    // Blocks are scanned on several threads, each with its own totals
+    snap.parallelForEachBlock(scan);
 
-                        df::tiletype type = b->tiletypeAt(coord);
-                        df::tiletype_shape tileshape = tileShape(type);
-                        df::tiletype_material tilemat = tileMaterial(type);
+    ProspectData data;
+    for (size_t i = 0; i < scan.results.size(); i++)
+        data.merge(scan.results[i]);
 
-                        // We only care about these types
-                        switch (tileshape)
-                        {
-                        case tiletype_shape::WALL:
-                        case tiletype_shape::FORTIFICATION:
-                            break;
-                        case tiletype_shape::EMPTY:
-                            /* A heuristic: tubes inside adamantine have EMPTY:AIR tiles which
-                               still have feature_local set. Also check the unrevealed status,
-                               so as to exclude any holes mined by the player. */
-                            if (tilemat == tiletype_material::AIR &&
-                                des.bits.feature_local && des.bits.hidden &&
-                                blockFeatureLocal.type == feature_type::deep_special_tube)
-                            {
-                                tubeTiles.add(global_z);
-                            }
-                        default:
-                            continue;
-                        }
-
-                        // Count the material type
-                        baseMats[tilemat].add(global_z);
+    // The report looks up names and values in the raws
+    CoreSuspender suspend;
 
-                        // Find the type of the tile
-                        switch (tilemat)
-                        {
-                        case tiletype_material::SOIL:
-                        case tiletype_material::STONE:
-                            layerMats[b->layerMaterialAt(coord)].add(global_z);
-                            break;
-                        case tiletype_material::MINERAL:
-                            veinMats[b->veinMaterialAt(coord)].add(global_z);
-                            break;
-                        case tiletype_material::FEATURE:
-                            if (blockFeatureLocal.type != -1 && des.bits.feature_local)
-                            {
-                                if (blockFeatureLocal.type == feature_type::deep_special_tube
-                                        && blockFeatureLocal.main_material == 0) // stone
-                                {
-                                    veinMats[blockFeatureLocal.sub_material].add(global_z);
-                                }
-                                else if (showTemple
-                                         && blockFeatureLocal.type == feature_type::deep_surface_portal)
-                                {
-                                    hasDemonTemple = true;
-                                }
-                            }
-
-                            if (showSlade && blockFeatureGlobal.type != -1 && des.bits.feature_global
-                                    && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
-                                    && blockFeatureGlobal.main_material == 0) // stone
-                            {
-                                layerMats[blockFeatureGlobal.sub_material].add(global_z);
-                            }
-                            break;
-                        case tiletype_material::LAVA_STONE:
-                            // TODO ?
-                            break;
-                        default:
-                            break;
-                        }
-                    }
-                }
+    if (!Maps::IsValid())
+    {
+        con.printerr("Map was unloaded during the scan.\n");
+        return CR_FAILURE;
+    }
 
-                // Check plants this way, as the other way wasn't getting them all
-                // and we can check visibility more easily here
-                if (showPlants)
-                {
-                    auto block = Maps::getBlock(b_x,b_y,z);
-                    vector<df::plant *> *plants = block ? &block->plants : NULL;
-                    if(plants)
-                    {
-                        for (PlantList::const_iterator it = plants->begin(); it != plants->end(); it++)
-                        {
-                            const df::plant & plant = *(*it);
-                            df::coord2d loc(plant.pos.x, plant.pos.y);
-                            loc = loc % 16;
-                            if (showHidden || !b->DesignationAt(loc).bits.hidden)
-                            {
-                                if(plant.flags.bits.is_shrub)
-                                    plantMats[plant.material].add(global_z);
-                                else
-                                    treeMats[plant.material].add(global_z);
-                            }
-                        }
-                    }
-                }
-                // Block end
-            } // block x
+    DFHack::Materials *mats = Core::getInstance().getMaterials();
 
-            // Clean uneeded memory
-            map.trash();
-        } // block y
-    } // z
+    bool hasAquifer = data.hasAquifer;
+    bool hasDemonTemple = data.hasDemonTemple;
+    bool hasLair = data.hasLair;
+    MatMap &baseMats = data.baseMats;
+    MatMap &layerMats = data.layerMats;
+    MatMap &veinMats = data.veinMats;
+    MatMap &plantMats = data.plantMats;
+    MatMap &treeMats = data.treeMats;
+
+    matdata &liquidWater = data.liquidWater;
+    matdata &liquidMagma = data.liquidMagma;
+    matdata &aquiferTiles = data.aquiferTiles;
+    matdata &tubeTiles = data.tubeTiles;
 
     MatMap::const_iterator it;
 
@@ -10,6 +10,7 @@
 #include "modules/World.h"
 #include "modules/MapCache.h"
 #include "modules/Gui.h"
+#include "WorkerPool.h"
 #include "df/construction.h"
 #include "df/block_square_event_frozen_liquidst.h"
 using MapExtras::MapCache;
@@ -148,6 +149,32 @@ void revealAdventure(color_ostream &out)
     out.print("Local map revealed.\n");
 }
 
+struct RevealScan
+{
+    bool no_hell;
+    WorkerPool::PerWorker<vector<hideblock> > saved;
+
+    void operator() (size_t i, unsigned worker)
+    {
+        df::map_block *block = world->map.map_blocks[i];
+        // in 'no-hell'/'safe' mode, don't reveal blocks with hell and adamantine
+        if (no_hell && !isSafe(block->map_pos))
+            return;
+        hideblock hb;
+        hb.c = block->map_pos;
+        designations40d & designations = block->designation;
+        // for each tile in block
+        for (uint32_t x = 0; x < 16; x++) for (uint32_t y = 0; y < 16; y++)
+        {
+            // save hidden state of tile
+            hb.hiddens[x][y] = designations[x][y].bits.hidden;
+            // set to revealed
+            designations[x][y].bits.hidden = 0;
+        }
+        saved[worker].push_back(hb);
+    }
+};
+
 command_result reveal(color_ostream &out, vector<string> & params)
 {
     bool no_hell = true;
@@ -203,26 +230,15 @@ command_result reveal(color_ostream &out, vector<string> & params)
     }
 
     Maps::getSize(x_max,y_max,z_max);
+
+    // Every block is independent, so spread them over all cores
+    RevealScan scan;
+    scan.no_hell = no_hell;
+    WorkerPool::run(world->map.map_blocks.size(), scan);
+
     hidesaved.reserve(x_max * y_max * z_max);
-    for (size_t i = 0; i < world->map.map_blocks.size(); i++)
-    {
-        df::map_block *block = world->map.map_blocks[i];
-        // in 'no-hell'/'safe' mode, don't reveal blocks with hell and adamantine
-        if (no_hell && !isSafe(block->map_pos))
-            continue;
-        hideblock hb;
-        hb.c = block->map_pos;
-        designations40d & designations = block->designation;
-        // for each tile in block
-        for (uint32_t x = 0; x < 16; x++) for (uint32_t y = 0; y < 16; y++)
-        {
-            // save hidden state of tile
-            hb.hiddens[x][y] = designations[x][y].bits.hidden;
-            // set to revealed
-            designations[x][y].bits.hidden = 0;
-        }
-        hidesaved.push_back(hb);
-    }
+    for (size_t i = 0; i < scan.saved.size(); i++)
+        hidesaved.insert(hidesaved.end(), scan.saved[i].begin(), scan.saved[i].end());
     if(no_hell)
     {
         revealed = SAFE_REVEALED;
@@ -363,7 +379,7 @@ command_result revflood(color_ostream &out, vector<string> & params)
         return CR_FAILURE;
     }
     DFCoord xy ((uint32_t)cx,(uint32_t)cy,cz);
-    MapCache * MCache = new MapCache;
+    MapCache * MCache = new MapCache(MapExtras::DENSE_BLOCKS);
     df::tiletype tt = MCache->tiletypeAt(xy);
     if(isWallTerrain(tt))
     {
@@ -11,9 +11,12 @@
 #include <modules/Units.h>
 #include <modules/Job.h>
 #include <modules/Materials.h>
+#include <modules/EventManager.h>
 #include <LuaTools.h>
 #include <TileTypes.h>
+#include <Profiler.h>
 #include <vector>
+#include <algorithm>
 #include <cstdio>
 #include <stack>
 #include <string>
@@ -54,6 +57,8 @@
 #include "df/strain_type.h"
 #include "df/material.h"
 #include "df/flow_type.h"
+#include "df/map_block.h"
+#include "df/construction.h"
 
 #include "MiscUtils.h"
 
@@ -224,6 +229,34 @@ static bool apply_impact_damage(df::item *item, int minv, int maxv)
 
 static bool enable_plugin();
 
+// Lazily filled target statuses of the tiles within range, per z level
+struct TargetGrid {
+    static const uint8_t UNKNOWN = 0xFF;
+
+    df::coord2d origin;
+    int size;
+
+    // Levels whose tiles the cached statuses depend on
+    int z_min, z_max;
+    uint32_t version;
+
+    std::map<int, std::vector<uint8_t> > planes;
+
+    TargetGrid() : size(0), z_min(0), z_max(-1), version(0) {}
+
+    void clear() {
+        planes.clear();
+        z_min = 0; z_max = -1;
+    }
+
+    std::vector<uint8_t> &getPlane(int z) {
+        auto &plane = planes[z];
+        if (plane.empty())
+            plane.assign(size_t(size)*size, UNKNOWN);
+        return plane;
+    }
+};
+
 struct EngineInfo {
     int id;
     df::building_siegeenginest *bld;
@@ -246,6 +279,8 @@ struct EngineInfo {
     df::stockpile_links links;
     df::workshop_profile profile;
 
+    TargetGrid grid;
+
     bool hasTarget() { return is_range_valid(target); }
     bool onTarget(df::coord pos) { return is_in_range(target, pos); }
     df::coord getTargetSize() { return target.second - target.first; }
@@ -289,6 +324,10 @@ static EngineInfo *find_engine(df::building *bld, bool create = false)
     obj->hit_delay = obj->is_catapult ? 2 : -1;
     obj->fire_range = get_engine_range(ebld);
 
+    int max_range = obj->fire_range.second;
+    obj->grid.origin = df::coord2d(obj->center.x - max_range, obj->center.y - max_range);
+    obj->grid.size = 2*max_range + 1;
+
     obj->ammo_vector_id = job_item_vector_id::BOULDER;
     obj->ammo_item_type = item_type::BOULDER;
 
@@ -330,12 +369,15 @@ static EngineInfo *find_engine(df::coord pos)
  * Configuration management
  */
 
+static void reset_block_states();
+
 static void clear_engines()
 {
     for (auto it = engines.begin(); it != engines.end(); ++it)
         delete it->second;
     engines.clear();
     coord_engines.clear();
+    reset_block_states();
 }
 
 static void load_engines()
@@ -982,13 +1024,210 @@ static TargetTileStatus calcTileStatus(EngineInfo *engine, df::coord target)
     return status;
 }
 
+/*
+ * Target status cache
+ *
+ * The status of a tile only depends on the tile types along the paths to
+ * it, so every engine remembers the statuses it has computed within its
+ * range. The blocks those paths cross are hashed at most once per
+ * CHECK_INTERVAL, or on the next use after a construction or dig job
+ * finishes in them; a block whose hash differs gets a new stamp, and any
+ * grid filled before that stamp is dropped.
+ */
+
+static const uint64_t CHECK_INTERVAL = 500000; // microseconds
+
+struct BlockState {
+    bool present;
+    uint64_t scanned;
+    uint64_t hash;
+    uint32_t stamp;
+};
+
+static uint32_t map_version = 0;
+static uint32_t x_bmax = 0, y_bmax = 0, z_bmax = 0;
+static std::vector<BlockState> block_states;
+
+static void reset_block_states()
+{
+    map_version = 0;
+    x_bmax = y_bmax = z_bmax = 0;
+    block_states.clear();
+}
+
+static bool update_map_size()
+{
+    if (!Maps::IsValid())
+        return false;
+
+    uint32_t x, y, z;
+    Maps::getSize(x, y, z);
+    if (x != x_bmax || y != y_bmax || z != z_bmax || block_states.empty())
+    {
+        reset_block_states();
+        x_bmax = x; y_bmax = y; z_bmax = z;
+        block_states.resize(size_t(x) * y * z);
+        memset(&block_states[0], 0, block_states.size() * sizeof(BlockState));
+
+        for (auto it = engines.begin(); it != engines.end(); ++it)
+            it->second->grid.clear();
+    }
+    return true;
+}
+
+static BlockState *get_block_state(int x, int y, int z)
+{
+    if (x < 0 || y < 0 || z < 0 ||
+        uint32_t(x) >= x_bmax || uint32_t(y) >= y_bmax || uint32_t(z) >= z_bmax)
+        return NULL;
+    return &block_states[(size_t(z) * y_bmax + y) * x_bmax + x];
+}
+
+static void mark_block(df::coord pos)
+{
+    if (auto state = get_block_state(pos.x >> 4, pos.y >> 4, pos.z))
+        state->scanned = 0;
+}
+
+static uint64_t hash_block(df::map_block *block)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    if (block)
+    {
+        for (int x = 0; x < 16; x++)
+            for (int y = 0; y < 16; y++)
+                hash = (hash ^ uint32_t(block->tiletype[x][y])) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Rehashes the stale blocks in the box, and returns the newest stamp in it.
+static uint32_t scan_blocks(df::coord bmin, df::coord bmax)
+{
+    uint64_t now = Profiler::now();
+    uint32_t newest = 0;
+
+    int x1 = std::max<int>(bmin.x, 0), x2 = std::min<int>(bmax.x, x_bmax-1);
+    int y1 = std::max<int>(bmin.y, 0), y2 = std::min<int>(bmax.y, y_bmax-1);
+    int z1 = std::max<int>(bmin.z, 0), z2 = std::min<int>(bmax.z, z_bmax-1);
+
+    for (int z = z1; z <= z2; z++)
+    {
+        for (int y = y1; y <= y2; y++)
+        {
+            for (int x = x1; x <= x2; x++)
+            {
+                BlockState &state = *get_block_state(x, y, z);
+
+                if (!state.present || now - state.scanned >= CHECK_INTERVAL)
+                {
+                    uint64_t hash = hash_block(Maps::getBlock(x, y, z));
+                    if (state.present && state.hash != hash)
+                        state.stamp = ++map_version;
+
+                    state.present = true;
+                    state.hash = hash;
+                    state.scanned = now;
+                }
+
+                newest = std::max(newest, state.stamp);
+            }
+        }
+    }
+
+    return newest;
+}
+
+// Drops the grid if the map under it changed, and extends it to z1..z2.
+static void validate_grid(EngineInfo *engine, int z1, int z2)
+{
+    auto &grid = engine->grid;
+
+    // Paths to a level stay between it and the engine; allow for the zdelta fudge.
+    z1 = std::min<int>(z1, engine->center.z) - 1;
+    z2 = std::max<int>(z2, engine->center.z) + 1;
+    if (!grid.planes.empty())
+    {
+        z1 = std::min(z1, grid.z_min);
+        z2 = std::max(z2, grid.z_max);
+    }
+
+    if (!update_map_size())
+    {
+        grid.clear();
+        return;
+    }
+
+    df::coord bmin(grid.origin.x >> 4, grid.origin.y >> 4, z1);
+    df::coord bmax((grid.origin.x + grid.size - 1) >> 4,
+                   (grid.origin.y + grid.size - 1) >> 4, z2);
+
+    if (scan_blocks(bmin, bmax) > grid.version)
+        grid.clear();
+
+    grid.version = map_version;
+    grid.z_min = z1;
+    grid.z_max = z2;
+}
+
+// Needs a validate_grid covering target.z first.
+static TargetTileStatus getCachedStatus(EngineInfo *engine, std::vector<uint8_t> &plane, df::coord target)
+{
+    auto &grid = engine->grid;
+    int dx = target.x - grid.origin.x;
+    int dy = target.y - grid.origin.y;
+
+    if (dx < 0 || dy < 0 || dx >= grid.size || dy >= grid.size)
+        return calcTileStatus(engine, target);
+
+    uint8_t &cell = plane[dy*grid.size + dx];
+    if (cell == TargetGrid::UNKNOWN)
+        cell = uint8_t(calcTileStatus(engine, target));
+
+    return TargetTileStatus(cell);
+}
+
+static void onConstruction(color_ostream &out, void *ptr)
+{
+    auto con = (df::construction*)ptr;
+    mark_block(con->pos);
+}
+
+static void onJobCompleted(color_ostream &out, void *ptr)
+{
+    auto job = (df::job*)ptr;
+
+    switch (job->job_type)
+    {
+    case job_type::Dig:
+    case job_type::CarveUpwardStaircase:
+    case job_type::CarveDownwardStaircase:
+    case job_type::CarveUpDownStaircase:
+    case job_type::CarveRamp:
+    case job_type::DigChannel:
+    case job_type::FellTree:
+    case job_type::CarveFortification:
+    case job_type::RemoveStairs:
+        mark_block(job->pos);
+        // A channel also removes the floor above
+        if (job->job_type == job_type::DigChannel)
+            mark_block(job->pos + df::coord(0,0,1));
+        break;
+    default:
+        break;
+    }
+}
+
 static std::string getTileStatus(df::building_siegeenginest *bld, df::coord tile_pos)
 {
     auto engine = find_engine(bld, true);
     if (!engine)
         return "invalid";
 
-    return target_tile_type_names[calcTileStatus(engine, tile_pos)];
+    validate_grid(engine, tile_pos.z, tile_pos.z);
+    auto &plane = engine->grid.getPlane(tile_pos.z);
+
+    return target_tile_type_names[getCachedStatus(engine, plane, tile_pos)];
 }
 
 static void paintAimScreen(df::building_siegeenginest *bld, df::coord view, df::coord2d ltop, df::coord2d size)
@@ -996,6 +1235,9 @@ static void paintAimScreen(df::building_siegeenginest *bld, df::coord view, df::
     auto engine = find_engine(bld, true);
     CHECK_NULL_POINTER(engine);
 
+    validate_grid(engine, view.z, view.z);
+    auto &plane = engine->grid.getPlane(view.z);
+
     for (int x = 0; x < size.x; x++)
     {
         for (int y = 0; y < size.y; y++)
@@ -1010,7 +1252,7 @@ static void paintAimScreen(df::building_siegeenginest *bld, df::coord view, df::
 
             int color;
 
-            switch (calcTileStatus(engine, tile_pos))
+            switch (getCachedStatus(engine, plane, tile_pos))
             {
                 case TARGET_OK:
                     color = COLOR_GREEN;
@@ -1053,39 +1295,143 @@ static void paintAimScreen(df::building_siegeenginest *bld, df::coord view, df::
 
 static const float MAX_TIME = 1000000.0f;
 
-struct UnitPath {
-    df::unit *unit;
-    std::map<float, df::coord> path;
+static bool canTargetUnit(df::unit *unit);
+
+/*
+ * Predicted paths of the units, shared by all engines and rebuilt once
+ * per game tick. A track is a run of samples in flat arrays: the unit
+ * stays at (x,y,z)[i] until ends[i], and the last sample of a track
+ * lasts until MAX_TIME. Riders share the samples of their mount.
+ */
+struct UnitTracks {
+    struct Track {
+        df::unit *unit;
+        uint32_t begin, count;
+        bool targetable; // active and targetable, see load()
+        df::coord bbox_min, bbox_max;
+    };
 
     struct Hit {
-        UnitPath *path;
+        df::unit *unit;
         df::coord pos;
         int dist;
         float time, lmargin, rmargin;
     };
 
-    static std::map<df::unit*, UnitPath*> cache;
+    int32_t frame;
+    bool loaded;
+
+    std::vector<Track> tracks;
+    std::map<df::unit*, int> index;
+
+    std::vector<float> ends;
+    std::vector<int16_t> xs, ys, zs;
 
-    static UnitPath *get(df::unit *unit)
+    UnitTracks() : frame(-1), loaded(false) {}
+
+    void clear()
     {
-        auto &cv = cache[unit];
-        if (!cv) cv = new UnitPath(unit);
-        return cv;
-    };
+        loaded = false;
+        tracks.clear();
+        index.clear();
+        ends.clear();
+        xs.clear(); ys.clear(); zs.clear();
+    }
 
-    UnitPath(df::unit *unit) : unit(unit)
+    // Drops the tracks if the game advanced since they were built.
+    void expire()
     {
-        if (unit->flags1.bits.rider)
+        if (frame != world->frame_counter)
+        {
+            clear();
+            frame = world->frame_counter;
+        }
+    }
+
+    // Tracks every active unit, unless already done this tick.
+    void load()
+    {
+        expire();
+        if (loaded)
+            return;
+
+        loaded = true;
+
+        auto &active = world->units.active;
+        for (size_t i = 0; i < active.size(); i++)
         {
-            auto mount = df::unit::find(unit->relations.rider_mount_id);
+            int id = find(active[i]);
+            tracks[id].targetable = canTargetUnit(active[i]);
+        }
+    }
+
+    void push_sample(df::coord pos, float end)
+    {
+        xs.push_back(pos.x);
+        ys.push_back(pos.y);
+        zs.push_back(pos.z);
+        ends.push_back(end);
+    }
+
+    int get(df::unit *unit)
+    {
+        expire();
+        return find(unit);
+    }
+
+    int find(df::unit *unit)
+    {
+        auto it = index.find(unit);
+        if (it != index.end())
+            return it->second;
+
+        Track track;
+        track.unit = unit;
+        track.targetable = false;
+        track.begin = track.count = 0;
+
+        df::unit *mount = NULL;
+        if (unit->flags1.bits.rider)
+            mount = df::unit::find(unit->relations.rider_mount_id);
 
-            if (mount)
+        if (mount && mount != unit)
+        {
+            // Guard against a cycle while the mount is tracked
+            index[unit] = -1;
+            int mid = find(mount);
+            if (mid >= 0)
             {
-                path = get(mount)->path;
-                return;
+                track.begin = tracks[mid].begin;
+                track.count = tracks[mid].count;
             }
         }
 
+        if (track.count == 0)
+        {
+            track.begin = ends.size();
+            trace(unit);
+            track.count = ends.size() - track.begin;
+        }
+
+        track.bbox_min = track.bbox_max = df::coord(xs[track.begin], ys[track.begin], zs[track.begin]);
+        for (uint32_t i = track.begin+1; i < track.begin+track.count; i++)
+        {
+            track.bbox_min.x = std::min(track.bbox_min.x, xs[i]);
+            track.bbox_min.y = std::min(track.bbox_min.y, ys[i]);
+            track.bbox_min.z = std::min(track.bbox_min.z, zs[i]);
+            track.bbox_max.x = std::max(track.bbox_max.x, xs[i]);
+            track.bbox_max.y = std::max(track.bbox_max.y, ys[i]);
+            track.bbox_max.z = std::max(track.bbox_max.z, zs[i]);
+        }
+
+        int id = tracks.size();
+        tracks.push_back(track);
+        index[unit] = id;
+        return id;
+    }
+
+    void trace(df::unit *unit)
+    {
         df::coord pos = unit->pos;
         df::coord dest = unit->path.dest;
         auto &upath = unit->path.path;
@@ -1108,58 +1454,106 @@ struct UnitPath {
                 if (new_pos.x != pos.x && new_pos.y != pos.y)
                     delay *= 362.0/256.0;
 
-                path[time] = pos;
+                push_sample(pos, time);
                 pos = new_pos;
                 time += delay + 1;
             }
         }
 
-        path[MAX_TIME] = pos;
+        push_sample(pos, MAX_TIME);
     }
 
-    void get_margin(std::map<float,df::coord>::iterator &it, float time, float *lmargin, float *rmargin)
+    df::coord samplePos(uint32_t i) { return df::coord(xs[i], ys[i], zs[i]); }
+
+    void get_margin(const Track &track, uint32_t i, float time, float *lmargin, float *rmargin)
     {
-        auto it2 = it;
-        *lmargin = (it == path.begin()) ? MAX_TIME : time - (--it2)->first;
-        *rmargin = (it->first == MAX_TIME) ? MAX_TIME : it->first - time;
+        *lmargin = (i == track.begin) ? MAX_TIME : time - ends[i-1];
+        *rmargin = (ends[i] == MAX_TIME) ? MAX_TIME : ends[i] - time;
     }
 
-    df::coord posAtTime(float time, float *lmargin = NULL, float *rmargin = NULL)
+    df::coord posAtTime(int id, float time, float *lmargin = NULL, float *rmargin = NULL)
     {
         CHECK_INVALID_ARGUMENT(time < MAX_TIME);
 
-        auto it = path.upper_bound(time);
+        auto &track = tracks[id];
+        const float *base = &ends[0];
+        uint32_t i = std::upper_bound(base + track.begin, base + track.begin + track.count, time) - base;
+
         if (lmargin)
-            get_margin(it, time, lmargin, rmargin);
-        return it->second;
+            get_margin(track, i, time, lmargin, rmargin);
+        return samplePos(i);
     }
 
-    bool findHits(EngineInfo *engine, std::vector<Hit> *hit_points, float bias)
+    /*
+     * Collects the samples of every targetable unit that are in the target
+     * area and in range, and occupied when a shot fired now would land.
+     * Tracks are rejected by their bounding box first; the samples of the
+     * rest are tested in one branch-free pass over the flat arrays.
+     */
+    void findHits(EngineInfo *engine, std::vector<Hit> *hits, float bias)
     {
-        df::coord origin = engine->center;
+        if (!engine->hasTarget())
+            return;
+
+        const df::coord tmin = engine->target.first;
+        const df::coord tmax = engine->target.second;
+        const int cx = engine->center.x, cy = engine->center.y, cz = engine->center.z;
+        const int rmin = engine->fire_range.first, rmax = engine->fire_range.second;
+        const float tscale = float(engine->proj_speed+1);
+        const float toffset = engine->hit_delay + bias;
 
-        Hit info;
-        info.path = this;
+        std::vector<uint32_t> candidates;
 
-        for (auto it = path.begin(); it != path.end(); ++it)
+        for (size_t t = 0; t < tracks.size(); t++)
         {
-            info.pos = it->second;
-            info.dist = point_distance(origin - info.pos);
-            info.time = float(info.dist)*(engine->proj_speed+1) + engine->hit_delay + bias;
-            get_margin(it, info.time, &info.lmargin, &info.rmargin);
+            const Track &track = tracks[t];
 
-            if (info.lmargin > 0 && info.rmargin > 0)
+            if (!track.targetable ||
+                track.bbox_max.x < tmin.x || track.bbox_min.x > tmax.x ||
+                track.bbox_max.y < tmin.y || track.bbox_min.y > tmax.y ||
+                track.bbox_max.z < tmin.z || track.bbox_min.z > tmax.z)
+                continue;
+
+            candidates.resize(track.count);
+            size_t count = 0;
+
+            const int16_t *px = &xs[track.begin], *py = &ys[track.begin], *pz = &zs[track.begin];
+            const float *pend = &ends[track.begin];
+
+            for (uint32_t i = 0; i < track.count; i++)
             {
-                if (engine->onTarget(info.pos) && engine->isInRange(info.dist))
-                    hit_points->push_back(info);
+                int x = px[i], y = py[i], z = pz[i];
+                int dist = std::max(abs(x-cx), std::max(abs(y-cy), abs(z-cz)));
+                float time = dist*tscale + toffset;
+                float start = (i > 0) ? pend[i-1] : -MAX_TIME;
+
+                bool ok = (x >= tmin.x) & (x <= tmax.x) &
+                          (y >= tmin.y) & (y <= tmax.y) &
+                          (z >= tmin.z) & (z <= tmax.z) &
+                          (dist >= rmin) & (dist <= rmax) &
+                          (time > start) & (time < pend[i]);
+
+                candidates[count] = track.begin + i;
+                count += ok;
             }
-        }
 
-        return !hit_points->empty();
+            for (size_t j = 0; j < count; j++)
+            {
+                uint32_t i = candidates[j];
+
+                Hit info;
+                info.unit = track.unit;
+                info.pos = samplePos(i);
+                info.dist = point_distance(engine->center - info.pos);
+                info.time = float(info.dist)*tscale + toffset;
+                get_margin(track, i, info.time, &info.lmargin, &info.rmargin);
+                hits->push_back(info);
+            }
+        }
     }
 };
 
-std::map<df::unit*, UnitPath*> UnitPath::cache;
+static UnitTracks unit_tracks;
 
 static void push_margin(lua_State *L, float margin)
 {
@@ -1175,26 +1569,25 @@ static int traceUnitPath(lua_State *L)
 
     CHECK_NULL_POINTER(unit);
 
-    size_t idx = 1;
-    auto info = UnitPath::get(unit);
-    lua_createtable(L, info->path.size(), 0);
+    auto &track = unit_tracks.tracks[unit_tracks.get(unit)];
+    lua_createtable(L, track.count, 0);
 
-    float last_time = 0.0f;
-    for (auto it = info->path.begin(); it != info->path.end(); ++it)
+    for (uint32_t i = 0; i < track.count; i++)
     {
-        Lua::Push(L, it->second);
-        if (idx > 1)
+        uint32_t sample = track.begin + i;
+
+        Lua::Push(L, unit_tracks.samplePos(sample));
+        if (i > 0)
         {
-            lua_pushnumber(L, last_time);
+            lua_pushnumber(L, unit_tracks.ends[sample-1]);
             lua_setfield(L, -2, "from");
         }
-        if (idx < info->path.size())
+        if (i+1 < track.count)
         {
-            lua_pushnumber(L, it->first);
+            lua_pushnumber(L, unit_tracks.ends[sample]);
             lua_setfield(L, -2, "to");
         }
-        lua_rawseti(L, -2, idx++);
-        last_time = it->first;
+        lua_rawseti(L, -2, i+1);
     }
 
     return 1;
@@ -1208,9 +1601,9 @@ static int unitPosAtTime(lua_State *L)
     CHECK_NULL_POINTER(unit);
 
     float lmargin, rmargin;
-    auto info = UnitPath::get(unit);
+    int track = unit_tracks.get(unit);
 
-    Lua::Push(L, info->posAtTime(time, &lmargin, &rmargin));
+    Lua::Push(L, unit_tracks.posAtTime(track, time, &lmargin, &rmargin));
     push_margin(L, lmargin);
     push_margin(L, rmargin);
     return 3;
@@ -1229,19 +1622,26 @@ static bool canTargetUnit(df::unit *unit)
     return true;
 }
 
-static void proposeUnitHits(EngineInfo *engine, std::vector<UnitPath::Hit> *hits, float bias)
+static void proposeUnitHits(EngineInfo *engine, std::vector<UnitTracks::Hit> *hits, float bias)
 {
-    auto &active = world->units.active;
+    if (!engine->hasTarget())
+        return;
 
-    for (size_t i = 0; i < active.size(); i++)
-    {
-        auto unit = active[i];
+    unit_tracks.load();
+    unit_tracks.findHits(engine, hits, bias);
 
-        if (!canTargetUnit(unit))
-            continue;
+    // Drop the hits that no shot height can reach
+    validate_grid(engine, engine->target.first.z, engine->target.second.z);
 
-        UnitPath::get(unit)->findHits(engine, hits, bias);
+    size_t count = 0;
+    for (size_t i = 0; i < hits->size(); i++)
+    {
+        auto &hit = (*hits)[i];
+        auto &plane = engine->grid.getPlane(hit.pos.z);
+        if (getCachedStatus(engine, plane, hit.pos) != TARGET_BLOCKED)
+            (*hits)[count++] = hit;
     }
+    hits->resize(count);
 }
 
 static int proposeUnitHits(lua_State *L)
@@ -1252,7 +1652,7 @@ static int proposeUnitHits(lua_State *L)
     if (!engine->hasTarget())
         luaL_error(L, "target not set");
 
-    std::vector<UnitPath::Hit> hits;
+    std::vector<UnitTracks::Hit> hits;
     proposeUnitHits(engine, &hits, bias);
 
     lua_createtable(L, hits.size(), 0);
@@ -1261,7 +1661,7 @@ static int proposeUnitHits(lua_State *L)
     {
         auto &hit = hits[i];
         lua_createtable(L, 0, 6);
-        Lua::SetField(L, hit.path->unit, -1, "unit");
+        Lua::SetField(L, hit.unit, -1, "unit");
         Lua::SetField(L, hit.pos, -1, "pos");
         Lua::SetField(L, hit.dist, -1, "dist");
         Lua::SetField(L, hit.time, -1, "time");
@@ -1280,7 +1680,7 @@ static int computeNearbyWeight(lua_State *L)
     luaL_checktype(L, 3, LUA_TTABLE);
     const char *fname = luaL_optstring(L, 4, "nearby_weight");
 
-    std::vector<UnitPath*> units;
+    std::vector<int> units;
     std::vector<float> weights;
 
     lua_pushnil(L);
@@ -1294,7 +1694,7 @@ static int computeNearbyWeight(lua_State *L)
             unit = Lua::CheckDFObject<df::unit>(L, -2);
         if (!unit)
             continue;
-        units.push_back(UnitPath::get(unit));
+        units.push_back(unit_tracks.get(unit));
         weights.push_back(lua_tonumber(L, -1));
         lua_pop(L, 1);
     }
@@ -1317,7 +1717,7 @@ static int computeNearbyWeight(lua_State *L)
         if (lua_isnil(L, -1))
         {
             if (!unit) luaL_error(L, "either unit or pos is required");
-            pos = UnitPath::get(unit)->posAtTime(time);
+            pos = unit_tracks.posAtTime(unit_tracks.get(unit), time);
         }
         else
             Lua::CheckDFAssign(L, &pos, -1);
@@ -1326,10 +1726,10 @@ static int computeNearbyWeight(lua_State *L)
 
         for (size_t i = 0; i < units.size(); i++)
         {
-            if (units[i]->unit == unit)
+            if (unit_tracks.tracks[units[i]].unit == unit)
                 continue;
 
-            auto diff = units[i]->posAtTime(time) - pos;
+            auto diff = unit_tracks.posAtTime(units[i], time) - pos;
             float dist = 1 + sqrtf(diff.x*diff.x + diff.y*diff.y + diff.z*diff.z);
             sum += weights[i]/(dist*dist);
         }
@@ -1770,6 +2170,7 @@ static bool is_enabled = false;
 
 static void enable_hooks(bool enable)
 {
+    bool was_enabled = is_enabled;
     is_enabled = enable;
 
     INTERPOSE_HOOK(projectile_hook, checkMovement).apply(enable);
@@ -1779,6 +2180,23 @@ static void enable_hooks(bool enable)
     INTERPOSE_HOOK(building_hook, getStockpileLinks).apply(enable);
     INTERPOSE_HOOK(building_hook, updateAction).apply(enable);
 
+    EventManager::EventHandler construction(onConstruction, 10, EventManager::Backend::INCREMENTAL);
+    EventManager::EventHandler job_completed(onJobCompleted, 10, EventManager::Backend::INCREMENTAL);
+
+    if (enable != was_enabled)
+    {
+        if (enable)
+        {
+            EventManager::registerListener(EventManager::EventType::CONSTRUCTION, construction, plugin_self);
+            EventManager::registerListener(EventManager::EventType::JOB_COMPLETED, job_completed, plugin_self);
+        }
+        else
+        {
+            EventManager::unregister(EventManager::EventType::CONSTRUCTION, construction, plugin_self);
+            EventManager::unregister(EventManager::EventType::JOB_COMPLETED, job_completed, plugin_self);
+        }
+    }
+
     if (enable)
         load_engines();
     else
@@ -1800,13 +2218,8 @@ static bool enable_plugin()
 
 static void clear_caches(color_ostream &out)
 {
-    if (!UnitPath::cache.empty())
-    {
-        for (auto it = UnitPath::cache.begin(); it != UnitPath::cache.end(); ++it)
-            delete it->second;
-
-        UnitPath::cache.clear();
-    }
+    if (world)
+        unit_tracks.expire();
 }
 
 DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_change_event event)
@@ -1828,6 +2241,7 @@ DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_chan
         break;
     case SC_MAP_UNLOADED:
         enable_hooks(false);
+        unit_tracks.clear();
         break;
     default:
         break;
@@ -63,6 +63,17 @@ DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <Plug
     return CR_OK;
 }
 
+// Tiles overwritten by the last paint job
+static MapExtras::UndoJournal last_paint;
+
+DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_change_event event)
+{
+    // The journal refers to tiles of the map that was loaded
+    if (event == SC_MAP_UNLOADED)
+        last_paint.clear();
+    return CR_OK;
+}
+
 DFhackCExport command_result plugin_shutdown ( color_ostream &out )
 {
     tiletypes_hist.save("tiletypes.history");
@@ -83,6 +94,7 @@ void help( color_ostream & out, std::vector<std::string> &commands, int start, i
             << " block                 : set block brush" << std::endl
             << " column                : set column brush" << std::endl
             << " run / (empty)         : paint!" << std::endl
+            << " undo / u              : revert the last paint" << std::endl
             << std::endl
             << "Filter/paint options:" << std::endl
             << " Any: reset to default (no filter/paint)" << std::endl
@@ -638,6 +650,29 @@ bool processTileType(color_ostream & out, TileType &paint, std::vector<std::stri
     return found;
 }
 
+command_result executeUndo(color_ostream &out)
+{
+    CoreSuspender suspend;
+
+    if (last_paint.empty())
+    {
+        out.printerr("Nothing to undo.\n");
+        return CR_OK;
+    }
+    if (!Maps::IsValid())
+    {
+        out.printerr("Map is not available!\n");
+        last_paint.clear();
+        return CR_FAILURE;
+    }
+
+    df::global::world->reindex_pathfinding = true;
+
+    size_t count = last_paint.undo();
+    out.print("Restored %d tile changes.\n", int(count));
+    return CR_OK;
+}
+
 command_result executePaintJob(color_ostream &out)
 {
     if (paint.empty())
@@ -665,7 +700,9 @@ command_result executePaintJob(color_ostream &out)
     out.print("Cursor coords: (%d, %d, %d)\n", x, y, z);
 
     DFHack::DFCoord cursor(x,y,z);
-    MapExtras::MapCache map;
+    MapExtras::MapCache map(MapExtras::DENSE_BLOCKS);
+    last_paint.clear();
+    map.setJournal(&last_paint);
     coord_vec all_tiles = brush->points(map, cursor);
     out.print("working...\n");
 
@@ -782,7 +819,7 @@ command_result executePaintJob(color_ostream &out)
 
     if (map.WriteAll())
     {
-        out.print("OK\n");
+        out.print("OK, %d tile changes; 'undo' reverts them.\n", int(last_paint.size()));
         return CR_OK;
     }
     else
@@ -853,6 +890,10 @@ command_result processCommand(color_ostream &out, std::vector<std::string> &comm
     {
         executePaintJob(out);
     }
+    else if (command == "undo" || command == "u")
+    {
+        executeUndo(out);
+    }
 
     return CR_OK;
 }
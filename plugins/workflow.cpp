@@ -6,9 +6,11 @@
 
 #include "LuaTools.h"
 #include "DataFuncs.h"
+#include "Profiler.h"
 
 #include "modules/Materials.h"
 #include "modules/Items.h"
+#include "modules/ItemIndex.h"
 #include "modules/Gui.h"
 #include "modules/Job.h"
 #include "modules/World.h"
@@ -24,7 +26,6 @@
 #include "df/dfhack_material_category.h"
 #include "df/item.h"
 #include "df/item_quality.h"
-#include "df/items_other_id.h"
 #include "df/tool_uses.h"
 #include "df/general_ref.h"
 #include "df/general_ref_unit_workerst.h"
@@ -91,6 +92,8 @@ DFhackCExport command_result plugin_init (color_ostream &out, std::vector <Plugi
                 "    Delete a constraint.\n"
                 "  workflow unlimit-all\n"
                 "    Delete all constraints.\n"
+                "  workflow benchmark [passes]\n"
+                "    Time the item counting pass, and report items per second.\n"
                 "Function:\n"
                 "  - When the plugin is enabled, it protects all repeat jobs from removal.\n"
                 "    If they do disappear due to any cause, they are immediately re-added\n"
@@ -289,8 +292,6 @@ public:
 
 int ProtectedJob::cur_tick_idx = 0;
 
-typedef std::map<std::pair<int,int>, bool> TMaterialCache;
-
 static const size_t MAX_HISTORY_SIZE = 28;
 
 enum HistoryItem {
@@ -324,8 +325,6 @@ struct ItemConstraint {
     bool is_active, cant_resume_reported;
     int low_stock_reported;
 
-    TMaterialCache material_cache;
-
 public:
     ItemConstraint()
         : is_craft(false), min_quality(item_quality::Ordinary), is_local(false),
@@ -423,6 +422,9 @@ static std::vector<ItemConstraint*> constraints;
 static int meltable_count = 0;
 static bool melt_active = false;
 
+// Cleared whenever constraints are added or removed
+static bool matcher_valid = false;
+
 /******************************
  *       MISC FUNCTIONS       *
  ******************************/
@@ -486,6 +488,7 @@ static void cleanup_state(color_ostream &out)
     for (size_t i = 0; i < constraints.size(); i++)
         delete constraints[i];
     constraints.clear();
+    matcher_valid = false;
 }
 
 static void check_lost_jobs(color_ostream &out, int ticks);
@@ -830,6 +833,7 @@ static ItemConstraint *get_constraint(color_ostream &out, const std::string &str
     nct->history = World::GetPersistentData(history_key(nct->config), NULL);
 
     constraints.push_back(nct);
+    matcher_valid = false;
     return nct;
 }
 
@@ -838,6 +842,7 @@ static void delete_constraint(ItemConstraint *cv)
     int idx = linear_index(constraints, cv);
     if (idx >= 0)
         vector_erase_at(constraints, idx);
+    matcher_valid = false;
 
     World::DeletePersistentData(cv->config);
     World::DeletePersistentData(cv->history);
@@ -1112,6 +1117,143 @@ static bool isAssignedSquad(df::item *item)
     return binsearch_index(vec, &df::item::id, item->id) >= 0;
 }
 
+// Returns false for items that never count; sets is_invalid for
+// the ones that only count as in use.
+static bool checkCountableItem(df::item *item, bool *is_invalid)
+{
+    *is_invalid = false;
+
+    // don't count worn items
+    if (item->getWear() >= 1)
+        *is_invalid = true;
+
+    // Special handling
+    switch (item->getType()) {
+    case item_type::THREAD:
+        if (item->flags.bits.spider_web)
+            return false;
+        if (item->getTotalDimension() < 15000)
+            *is_invalid = true;
+        break;
+
+    case item_type::CLOTH:
+        if (item->getTotalDimension() < 10000)
+            *is_invalid = true;
+        break;
+
+    default:
+        break;
+    }
+
+    return true;
+}
+
+/*
+ * The constraint set compiled for counting: for every item type, the
+ * constraints that can match it, and one material-match bitmap shared
+ * by all of them, with a row per material and a bit per constraint.
+ */
+struct ConstraintMatcher {
+    struct Entry {
+        int16_t subtype;
+        int index;
+    };
+
+    std::vector<ItemConstraint*> list;
+    std::vector<std::vector<Entry> > by_type; // index is item type + 1
+    std::vector<df::item_type> types;         // with a non-empty list
+
+    size_t words;
+    std::vector<uint64_t> mat_bits;
+    std::map<std::pair<int16_t,int32_t>, size_t> mat_rows;
+
+    // Totals for the benchmark
+    size_t items_scanned;
+
+    ConstraintMatcher() : words(0), items_scanned(0) {}
+
+    void compile()
+    {
+        list = constraints;
+        by_type.clear();
+        types.clear();
+        mat_bits.clear();
+        mat_rows.clear();
+        words = (list.size() + 63) / 64;
+
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            ItemConstraint *cv = list[i];
+
+            if (cv->is_craft)
+            {
+                using namespace df::enums::job_type;
+
+                auto lst = ENUM_ATTR(job_type, possible_item, MakeCrafts);
+                for (size_t j = 0; j < lst.size; j++)
+                    addEntry(lst.items[j], -1, i);
+            }
+            else
+                addEntry(cv->item.type, cv->item.subtype, i);
+        }
+
+        matcher_valid = true;
+    }
+
+    void addEntry(df::item_type type, int16_t subtype, int index)
+    {
+        if (type < 0)
+            return;
+
+        size_t idx = size_t(type + 1);
+        if (idx >= by_type.size())
+            by_type.resize(idx + 1);
+        if (by_type[idx].empty())
+            types.push_back(type);
+
+        Entry entry = { subtype, index };
+        by_type[idx].push_back(entry);
+    }
+
+    // Bits of the constraints whose material spec accepts this material
+    const uint64_t *materialRow(int16_t mat_type, int32_t mat_index)
+    {
+        auto key = std::make_pair(mat_type, mat_index);
+        auto it = mat_rows.find(key);
+        if (it != mat_rows.end())
+            return &mat_bits[it->second];
+
+        size_t base = mat_bits.size();
+        mat_bits.resize(base + words, 0);
+        mat_rows[key] = base;
+
+        MaterialInfo mat(mat_type, mat_index);
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            ItemConstraint *cv = list[i];
+            if (mat.matches(cv->material) &&
+                (cv->mat_mask.whole == 0 || mat.matches(cv->mat_mask)))
+                mat_bits[base + i/64] |= uint64_t(1) << (i%64);
+        }
+
+        return &mat_bits[base];
+    }
+};
+
+static ConstraintMatcher matcher;
+
+static bool itemInUse(df::item *item)
+{
+    // Flag checks first, the ones walking references last
+    return item->flags.bits.owned ||
+           item->flags.bits.in_chest ||
+           item->isAssignedToStockpile() ||
+           isAssignedSquad(item) ||
+           isRouteVehicle(item) ||
+           itemInRealJob(item) ||
+           itemBusy(item);
+}
+
 static void map_job_items(color_ostream &out)
 {
     for (size_t i = 0; i < constraints.size(); i++)
@@ -1134,111 +1276,96 @@ static void map_job_items(color_ostream &out)
     F(in_building); F(construction); F(artifact);
 #undef F
 
-    bool dry_buckets = isOptionEnabled(CF_DRYBUCKETS);
+    std::vector<df::item*> items;
+
+    if (isOptionEnabled(CF_DRYBUCKETS))
+    {
+        ItemIndex::findByType(&items, item_type::BUCKET);
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            df::item *item = items[i];
+            if (!(item->flags.whole & bad_flags.whole) && !item->flags.bits.in_job)
+                dryBucket(item);
+        }
+    }
 
-    std::vector<df::item*> &items = world->items.other[items_other_id::IN_PLAY];
+    items.clear();
+    ItemIndex::findFlagged(&items, ItemIndex::MELT);
 
     for (size_t i = 0; i < items.size(); i++)
     {
         df::item *item = items[i];
-
         if (item->flags.whole & bad_flags.whole)
             continue;
+        if (!item->flags.bits.owned && !itemBusy(item))
+            meltable_count++;
+    }
 
-        df::item_type itype = item->getType();
-        int16_t isubtype = item->getSubtype();
-        int16_t imattype = item->getActualMaterial();
-        int32_t imatindex = item->getActualMaterialIndex();
+    if (!matcher_valid)
+        matcher.compile();
 
-        bool is_invalid = false;
+    // Each item is only tested against the constraints on its type
+    for (size_t t = 0; t < matcher.types.size(); t++)
+    {
+        df::item_type type = matcher.types[t];
+        const std::vector<ConstraintMatcher::Entry> &entries = matcher.by_type[type + 1];
 
-        // don't count worn items
-        if (item->getWear() >= 1)
-            is_invalid = true;
+        items.clear();
+        ItemIndex::findByType(&items, type);
+        matcher.items_scanned += items.size();
 
-        // Special handling
-        switch (itype) {
-        case item_type::BUCKET:
-            if (dry_buckets && !item->flags.bits.in_job)
-                dryBucket(item);
-            break;
+        for (size_t j = 0; j < items.size(); j++)
+        {
+            df::item *item = items[j];
 
-        case item_type::THREAD:
-            if (item->flags.bits.spider_web)
+            if (item->flags.whole & bad_flags.whole)
                 continue;
-            if (item->getTotalDimension() < 15000)
-                is_invalid = true;
-            break;
 
-        case item_type::CLOTH:
-            if (item->getTotalDimension() < 10000)
-                is_invalid = true;
-            break;
-
-        default:
-            break;
-        }
-
-        if (item->flags.bits.melt && !item->flags.bits.owned && !itemBusy(item))
-            meltable_count++;
+            bool is_invalid;
+            if (!checkCountableItem(item, &is_invalid))
+                continue;
 
-        // Match to constraints
-        TMaterialCache::key_type matkey(imattype, imatindex);
+            int16_t subtype = item->getSubtype();
+            int quality = item->getQuality();
+            bool foreign = item->flags.bits.foreign;
+            const uint64_t *mat_row = matcher.materialRow(item->getActualMaterial(),
+                                                          item->getActualMaterialIndex());
 
-        for (size_t i = 0; i < constraints.size(); i++)
-        {
-            ItemConstraint *cv = constraints[i];
+            // Looked up on the first match only
+            int in_use = -1;
+            int stack_size = 0;
 
-            if (cv->is_craft)
+            for (size_t k = 0; k < entries.size(); k++)
             {
-                if (!isCraftItem(itype))
+                const ConstraintMatcher::Entry &entry = entries[k];
+                if (entry.subtype != -1 && entry.subtype != subtype)
                     continue;
-            }
-            else
-            {
-                if (cv->item.type != itype ||
-                    (cv->item.subtype != -1 && cv->item.subtype != isubtype))
+                if (!(mat_row[entry.index/64] & (uint64_t(1) << (entry.index%64))))
                     continue;
-            }
 
-            if (cv->is_local && item->flags.bits.foreign)
-                continue;
-            if (item->getQuality() < cv->min_quality)
-                continue;
-
-            TMaterialCache::iterator it = cv->material_cache.find(matkey);
-
-            bool ok = true;
-            if (it != cv->material_cache.end())
-                ok = it->second;
-            else
-            {
-                MaterialInfo mat(imattype, imatindex);
-                ok = mat.matches(cv->material) &&
-                     (cv->mat_mask.whole == 0 || mat.matches(cv->mat_mask));
-                cv->material_cache[matkey] = ok;
-            }
+                ItemConstraint *cv = matcher.list[entry.index];
+                if (cv->is_local && foreign)
+                    continue;
+                if (quality < cv->min_quality)
+                    continue;
 
-            if (!ok)
-                continue;
+                if (in_use < 0)
+                {
+                    in_use = (is_invalid || itemInUse(item)) ? 1 : 0;
+                    stack_size = item->getStackSize();
+                }
 
-            if (is_invalid ||
-                item->flags.bits.owned ||
-                item->flags.bits.in_chest ||
-                item->isAssignedToStockpile() ||
-                isRouteVehicle(item) ||
-                itemInRealJob(item) ||
-                itemBusy(item) ||
-                isAssignedSquad(item))
-            {
-                is_invalid = true;
-                cv->item_inuse_count++;
-                cv->item_inuse_amount += item->getStackSize();
-            }
-            else
-            {
-                cv->item_count++;
-                cv->item_amount += item->getStackSize();
+                if (in_use)
+                {
+                    cv->item_inuse_count++;
+                    cv->item_inuse_amount += stack_size;
+                }
+                else
+                {
+                    cv->item_count++;
+                    cv->item_amount += stack_size;
+                }
             }
         }
     }
@@ -1905,6 +2032,33 @@ static command_result workflow_cmd(color_ostream &out, vector <string> & paramet
         out.print("Removed all constraints.\n");
         return CR_OK;
     }
+    else if (cmd == "benchmark")
+    {
+        int passes = (parameters.size() >= 2) ? atoi(parameters[1].c_str()) : 10;
+        if (passes <= 0 || parameters.size() > 2)
+            return CR_WRONG_USAGE;
+
+        // Keep the index update and matcher compilation out of the timing
+        ItemIndex::update();
+        matcher_valid = false;
+        map_job_items(out);
+
+        size_t scanned = matcher.items_scanned;
+        uint64_t start = Profiler::now();
+
+        for (int i = 0; i < passes; i++)
+            map_job_items(out);
+
+        uint64_t time = std::max<uint64_t>(Profiler::now() - start, 1);
+        scanned = matcher.items_scanned - scanned;
+
+        out.print("%d passes over %d constraints: %.2f ms per pass, %d items per pass, %.0f items/sec\n",
+                  passes, int(constraints.size()), time / 1000.0 / passes,
+                  int(scanned / passes), scanned * 1000000.0 / time);
+        out.print("Material bitmap: %d materials, %d bytes\n",
+                  int(matcher.mat_rows.size()), int(matcher.mat_bits.size() * sizeof(uint64_t)));
+        return CR_OK;
+    }
     else
         return CR_WRONG_USAGE;
 }
@@ -51,6 +51,7 @@ using namespace std;
 #include "modules/Materials.h"
 #include "modules/MapCache.h"
 #include "modules/Buildings.h"
+#include "modules/IdIndex.h"
 #include "modules/World.h"
 #include "modules/Screen.h"
 #include "MiscUtils.h"
@@ -680,13 +681,7 @@ bool isNaked(df::unit* unit)
 
 int getUnitIndexFromId(df::unit* unit_)
 {
-    for (size_t i=0; i < world->units.all.size(); i++)
-    {
-        df::unit* unit = world->units.all[i];
-        if(unit->id == unit_->id)
-            return i;
-    }
-    return -1;
+    return IdIndex::findIndex(IdIndex::UNITS, unit_->id);
 }
 
 // dump some unit info
@@ -860,31 +855,17 @@ bool isActive(df::building * building)
 
 int32_t findBuildingIndexById(int32_t id)
 {
-    for (size_t b = 0; b < world->buildings.all.size(); b++)
-    {
-        if(world->buildings.all.at(b)->id == id)
-            return b;
-    }
-    return -1;
+    return IdIndex::findIndex(IdIndex::BUILDINGS, id);
 }
 
 int32_t findUnitIndexById(int32_t id)
 {
-    for (size_t i = 0; i < world->units.all.size(); i++)
-    {
-        if(world->units.all.at(i)->id == id)
-            return i;
-    }
-    return -1;
+    return IdIndex::findIndex(IdIndex::UNITS, id);
 }
 
 df::unit* findUnitById(int32_t id)
 {
-    int32_t index = findUnitIndexById(id);
-    if(index != -1)
-        return world->units.all[index];
-    else
-        return NULL;
+    return IdIndex::findUnit(id);
 }
 
 // returns id of pen/pit at cursor position (-1 if nothing found)
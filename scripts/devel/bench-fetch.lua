@@ -0,0 +1,77 @@
+-- Compares reading fields one by one with df.fetch.
+-- Usage: devel/bench-fetch [units|items] [min-count]
+--
+-- Reads id, pos.x and a flag from every object in world.units.all or
+-- world.items.all, going over the vector until at least min-count
+-- (default 100000) objects were read, and prints objects per second.
+
+local args = {...}
+local kind = args[1] or 'items'
+local min_count = tonumber(args[2]) or 100000
+
+local vec, paths
+if kind == 'units' then
+    vec = df.global.world.units.all
+    paths = { 'id', 'pos.x', 'flags1.dead' }
+elseif kind == 'items' then
+    vec = df.global.world.items.all
+    paths = { 'id', 'pos.x', 'flags.forbid' }
+else
+    qerror('Unknown vector: '..kind)
+end
+
+local size = #vec
+if size == 0 then
+    qerror('The vector is empty.')
+end
+
+local passes = math.ceil(min_count / size)
+
+local function plain()
+    local ids, xs, flags = {}, {}, {}
+    for i = 0, size-1 do
+        local obj = vec[i]
+        ids[i+1] = obj.id
+        xs[i+1] = obj.pos.x
+        if kind == 'units' then
+            flags[i+1] = obj.flags1.dead
+        else
+            flags[i+1] = obj.flags.forbid
+        end
+    end
+    return ids, xs, flags
+end
+
+local function fetched()
+    return df.fetch(vec, paths)
+end
+
+local function run(fn)
+    local start = os.clock()
+    for i = 1, passes do
+        fn()
+    end
+    return os.clock() - start
+end
+
+-- Compile and cache the paths before timing
+local a1, a2, a3 = plain()
+local b1, b2, b3 = fetched()
+for i = 1, size do
+    if a1[i] ~= b1[i] or a2[i] ~= b2[i] or a3[i] ~= b3[i] then
+        qerror('Results differ at index '..(i-1))
+    end
+end
+
+local total = passes * size
+local t_plain = run(plain)
+local t_fetch = run(fetched)
+
+local function rate(t)
+    return math.floor(total / math.max(t, 1e-6))
+end
+
+print(string.format('%d objects (%d x %d), fields: %s', total, passes, size, table.concat(paths, ', ')))
+print(string.format('  field access: %8.3f s, %10d objects/sec', t_plain, rate(t_plain)))
+print(string.format('  df.fetch:     %8.3f s, %10d objects/sec', t_fetch, rate(t_fetch)))
+print(string.format('  speedup:      %8.1fx', t_plain / math.max(t_fetch, 1e-6)))
@@ -0,0 +1,33 @@
+-- Shows or fills the cache of compiled lua scripts.
+-- Usage: devel/script-cache [stats|reset|precompile|clear|rescan]
+--
+-- 'precompile' compiles every script in hack/scripts up front; putting it
+-- in dfhack.init moves the parse cost of later script runs to startup.
+-- 'reset' prints the stats and then clears the counters.
+-- 'rescan' makes the script index recheck hack/scripts right away.
+
+local internal = dfhack.internal
+local cmd = ... or 'stats'
+
+if cmd == 'precompile' then
+    local count, failed = internal.precompileScripts()
+    print(string.format('Compiled %d scripts.', count))
+    for name,err in pairs(failed) do
+        dfhack.printerr(name..': '..err)
+    end
+elseif cmd == 'clear' then
+    internal.clearScriptCache()
+elseif cmd == 'rescan' then
+    internal.rescanScripts()
+elseif cmd == 'stats' or cmd == 'reset' then
+    local stats = internal.getScriptCacheStats(cmd == 'reset')
+    print(string.format('%d scripts cached, %d bytes', stats.scripts, stats.bytes))
+    print(string.format('%d hits, %d misses', stats.hits, stats.misses))
+    print(string.format('%.2f ms spent compiling, %.2f ms saved by hits',
+                        stats.parse_ms, stats.saved_ms))
+    local index = internal.getScriptIndexStats()
+    print(string.format('Index: %d scripts in %d directories, %d rescans, %d help reads',
+                        index.scripts, index.dirs, index.rescans, index.help_reads))
+else
+    qerror('Usage: devel/script-cache [stats|reset|precompile|clear|rescan]')
+end
@@ -0,0 +1,29 @@
+-- Lists the places that use dfhack.timeout, by time spent in the callbacks.
+-- Usage: devel/timeout-stats [reset]
+--
+-- With 'reset', the counters are cleared after printing, so that the
+-- next run covers only the time in between.
+
+local args = {...}
+
+local stats = dfhack.timeout_stats(args[1] == 'reset')
+
+table.sort(stats, function(a,b)
+    if a.ms ~= b.ms then
+        return a.ms > b.ms
+    end
+    return a.scheduled > b.scheduled
+end)
+
+if #stats == 0 then
+    print('No timers were scheduled.')
+    return
+end
+
+print(string.format('%10s %8s %8s %8s %6s %10s  %s',
+                    'ms', 'max ms', 'fired', 'queued', 'active', 'cancelled', 'site'))
+for _,site in ipairs(stats) do
+    print(string.format('%10.2f %8.2f %8d %8d %6d %10d  %s',
+                        site.ms, site.max_ms, site.fired, site.scheduled,
+                        site.active, site.cancelled, site.site))
+end